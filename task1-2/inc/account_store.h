@@ -0,0 +1,136 @@
+#ifndef ACCOUNT_STORE_H_
+#define ACCOUNT_STORE_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "account_table.h"
+#include "protocol.h"
+
+class unknown_client_error : public std::runtime_error {
+public:
+  explicit unknown_client_error(const std::string &what_arg) : std::runtime_error(what_arg) {}
+};
+
+/*
+ * Receives every modification of an account_store. Transfers are reported
+ * while the locks of the involved accounts are still held, so records
+ * of transfers touching the same account come in the order they were applied.
+ */
+class account_journal {
+public:
+  virtual ~account_journal() {}
+  virtual void log_registration(t_client_id id) = 0;
+  virtual void log_transfer(t_client_id from, t_client_id to, t_balance amount) = 0;
+  virtual void log_transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) = 0;
+};
+
+/*
+ * Thread-safe storage of client balances.
+ * Balances live in a dense account_table, modifications are guarded by a
+ * fixed set of lock stripes. Every cache line of balances belongs to exactly
+ * one stripe, so writers holding different locks never share cache lines,
+ * and operations on accounts from different stripes run in parallel.
+ * Operations touching two accounts lock their stripes in the order of
+ * increasing stripe index, which rules out deadlocks.
+ *
+ * Reads take no locks and write nothing shared: every stripe is also a
+ * seqlock, whose sequence number is odd while a writer modifies balances
+ * of the stripe. A reader retries if the number was odd or has changed
+ * while it read the balance, so it never sees a transfer halfway through.
+ *
+ * Snapshots do not stop other operations. A snapshot starts by taking
+ * all locks for a moment, after that every page of balances which is
+ * about to be modified is copied first, unless it has already been
+ * written out.
+ */
+class account_store {
+public:
+  static const std::size_t DEFAULT_STRIPES = 64;
+
+  explicit account_store(std::size_t stripes = DEFAULT_STRIPES);
+
+  // Not thread-safe: should be set before the store is shared. Nullptr disables journaling.
+  void set_journal(account_journal *journal) { journal_ = journal; }
+
+  t_client_id register_new_client();
+  // Throws unknown_client_error if there is no such client. Never blocks writers.
+  t_balance get_amount(t_client_id id) const;
+  // Throws unknown_client_error if any of the clients does not exist.
+  void transfer(t_client_id from, t_client_id to, t_balance amount);
+  /*
+   * Applies all transfers at once under a single acquisition of every
+   * involved lock, or throws unknown_client_error and applies none
+   * if any of the clients does not exist.
+   */
+  void transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items);
+
+  // Clients are never removed, so once true this stays true.
+  bool exists(t_client_id id) const { return id < table_.size(); }
+  // Throws unknown_client_error if there is no such client.
+  void check_exists(t_client_id id) const;
+
+  std::size_t size() const { return table_.size(); }
+
+  // Fills an empty store, see account_table::adopt(). Not thread-safe.
+  void adopt(t_balance *balances, std::size_t count, std::shared_ptr<void> owner) {
+    table_.adopt(balances, count, std::move(owner));
+  }
+
+  typedef std::function<void(const t_balance *balances, std::size_t count)> snapshot_writer;
+  /*
+   * Passes balances of all accounts as of a single moment to `out` in order,
+   * in pieces of at most account_table::PAGE_SIZE. `at_cut` is called at that
+   * moment with all locks held, so it observes no transfer halfway through.
+   * Returns the number of accounts. Only one snapshot is taken at a time.
+   */
+  std::size_t write_snapshot(const std::function<void()> &at_cut, const snapshot_writer &out);
+
+private:
+  account_store(const account_store &) = delete;
+  account_store& operator=(const account_store &) = delete;
+
+  struct stripe {
+    std::mutex mutex;
+    std::atomic<std::uint64_t> sequence{0};  // Odd while the holder of the mutex modifies balances.
+    // Keeps locks of different stripes on different cache lines regardless of alignment.
+    char padding[2 * CACHE_LINE_SIZE - sizeof(std::mutex) - sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  struct snapshot_capture {
+    std::uint64_t epoch;
+    std::size_t size;
+    // Copies of pages made by writers before modifying them.
+    std::vector<std::unique_ptr<t_balance[]>> preimages;
+  };
+
+  std::size_t stripe_index(t_client_id id) const {
+    return (id / account_table::BALANCES_PER_CACHE_LINE) % stripes_count_;
+  }
+  // Locks a stripe, the time spent waiting for another thread is recorded in metrics.
+  std::unique_lock<std::mutex> lock_stripe(std::size_t index) const;
+  void lock_all();
+  void unlock_all();
+  // Bracket modifications of a stripe's balances, its lock should be held.
+  void begin_write(std::size_t index);
+  void end_write(std::size_t index);
+  // Returns true if the caller should capture the page, false if it has already been captured.
+  bool claim_page(t_client_id id, std::uint64_t epoch);
+  // Should be called under the account's lock before modifying it.
+  void preserve(snapshot_capture *capture, t_client_id id);
+
+  account_table table_;
+  account_journal *journal_;
+  std::size_t stripes_count_;
+  std::unique_ptr<stripe[]> stripes_;
+
+  std::mutex snapshot_mutex_;
+  std::uint64_t snapshot_epoch_;
+  std::atomic<snapshot_capture*> capture_;  // Changed with all locks held.
+};
+
+#endif  // ACCOUNT_STORE_H_
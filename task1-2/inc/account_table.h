@@ -0,0 +1,75 @@
+#ifndef ACCOUNT_TABLE_H_
+#define ACCOUNT_TABLE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include "protocol.h"
+
+const std::size_t CACHE_LINE_SIZE = 64;
+
+/*
+ * Dense table of balances indexed directly by client id, ids are 0..size()-1.
+ * Balances are stored in fixed-size cache-line-aligned chunks referenced
+ * from a fixed directory, so growing the table never moves existing
+ * balances: references obtained by concurrent readers stay valid.
+ * The table does not synchronize accesses to balances themselves.
+ *
+ * Chunks are further split into pages, each page has an epoch word
+ * which account_store uses for copy-on-write snapshots.
+ */
+class account_table {
+public:
+  static const std::size_t CHUNK_BITS = 16;
+  static const std::size_t CHUNK_SIZE = std::size_t(1) << CHUNK_BITS;
+  static const std::size_t MAX_CHUNKS = std::size_t(1) << 16;
+  static const std::size_t BALANCES_PER_CACHE_LINE = CACHE_LINE_SIZE / sizeof(t_balance);
+  static const std::size_t PAGE_BITS = 9;
+  static const std::size_t PAGE_SIZE = std::size_t(1) << PAGE_BITS;  // 4 KiB of balances.
+
+  account_table();
+  ~account_table();
+
+  // Adds a new zero balance and returns its id. Thread-safe.
+  t_client_id push_back();
+
+  /*
+   * Fills an empty table with `count` balances. Whole chunks are used in place,
+   * so `balances` should be writable and cache-line aligned, `owner` keeps
+   * the memory alive for the lifetime of the table. The rest is copied.
+   * Not thread-safe.
+   */
+  void adopt(t_balance *balances, std::size_t count, std::shared_ptr<void> owner);
+
+  // Thread-safe, all ids below the returned value are valid.
+  std::size_t size() const { return size_.load(std::memory_order_acquire); }
+
+  // Id should be valid.
+  t_balance& operator[](t_client_id id) {
+    return chunks_[id >> CHUNK_BITS].load(std::memory_order_relaxed)[id & (CHUNK_SIZE - 1)];
+  }
+  const t_balance& operator[](t_client_id id) const {
+    return chunks_[id >> CHUNK_BITS].load(std::memory_order_relaxed)[id & (CHUNK_SIZE - 1)];
+  }
+
+  // Id should be valid.
+  std::atomic<std::uint64_t>& page_epoch(t_client_id id) {
+    return page_epochs_[id >> CHUNK_BITS][(id & (CHUNK_SIZE - 1)) >> PAGE_BITS];
+  }
+
+private:
+  account_table(const account_table &) = delete;
+  account_table& operator=(const account_table &) = delete;
+
+  std::unique_ptr<std::atomic<t_balance*>[]> chunks_;
+  void allocate_chunk(std::size_t chunk);
+
+  std::unique_ptr<std::unique_ptr<char[]>[]> raw_chunks_;  // Owners of unaligned chunk memory.
+  std::unique_ptr<std::unique_ptr<std::atomic<std::uint64_t>[]>[]> page_epochs_;
+  std::shared_ptr<void> adopted_owner_;
+  std::atomic<std::size_t> size_;
+  std::mutex grow_mutex_;
+};
+
+#endif  // ACCOUNT_TABLE_H_
@@ -0,0 +1,107 @@
+#ifndef AU_STREAM_SOCKET_H_
+#define AU_STREAM_SOCKET_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "stream_socket.h"
+
+typedef uint16_t au_stream_port;
+
+/*
+ * Reliable byte stream over UDP, ports are UDP ports.
+ *
+ * Connections are set up with a SYN / SYN-ACK / ACK handshake, data is sent
+ * in segments within a sliding window limited by the receiver's buffer.
+ * Receivers acknowledge cumulatively and report out-of-order ranges with
+ * selective acknowledgements. Senders estimate RTT from echoed timestamps
+ * and detect losses by time (a segment is lost once a later one has been
+ * delivered) or by retransmission timeout.
+ * Congestion control is model-based: the window follows twice the measured
+ * delivery rate times the RTT instead of halving on every loss, so random
+ * losses do not collapse the throughput.
+ *
+ * Every bound UDP port is served by a background thread which handles
+ * all its connections, the blocking calls below only wait for it.
+ */
+
+namespace au_stream_detail {
+class endpoint;
+class connection;
+}
+
+class au_stream_connection_socket : public stream_socket {
+public:
+  /*
+   * Closes the connection gracefully: waits until everything sent is
+   * acknowledged by the other side, but not longer than a few seconds.
+   */
+  ~au_stream_connection_socket() override;
+
+  void send(const void *buf, size_t size) override;
+  void recv(void *buf, size_t size) override;
+  size_t recv_some(void *buf, size_t size) override;
+
+private:
+  friend class au_stream_client_socket;
+  friend class au_stream_server_socket;
+
+  au_stream_connection_socket(std::shared_ptr<au_stream_detail::endpoint> endpoint,
+                              std::shared_ptr<au_stream_detail::connection> connection);
+  au_stream_connection_socket(const au_stream_connection_socket &) = delete;
+  au_stream_connection_socket& operator=(const au_stream_connection_socket &) = delete;
+
+  std::shared_ptr<au_stream_detail::endpoint> endpoint_;
+  std::shared_ptr<au_stream_detail::connection> connection_;
+};
+
+class au_stream_client_socket : public stream_client_socket {
+public:
+  au_stream_client_socket(hostname host, au_stream_port client_port, au_stream_port server_port);
+  ~au_stream_client_socket() override;
+
+  // Closes the previous connection, if any.
+  void connect() override;
+  void send(const void *buf, size_t size) override;
+  void recv(void *buf, size_t size) override;
+  size_t recv_some(void *buf, size_t size) override;
+
+private:
+  std::string host_;
+  au_stream_port client_port_;
+  au_stream_port server_port_;
+  std::shared_ptr<au_stream_detail::endpoint> endpoint_;  // Bound on the first connect().
+  std::unique_ptr<au_stream_connection_socket> sock_;
+};
+
+class au_stream_server_socket : public stream_server_socket {
+public:
+  // Connections waiting for accept_one_client(), further SYNs are answered with RST.
+  static const std::size_t ACCEPT_BACKLOG = 128;
+
+  au_stream_server_socket(hostname host, au_stream_port port);
+  // Refuses new connections, accepted ones keep working.
+  ~au_stream_server_socket() override;
+
+  au_stream_connection_socket* accept_one_client() override;
+
+private:
+  std::shared_ptr<au_stream_detail::endpoint> endpoint_;
+};
+
+/*
+ * Emulation of a bad link for tests, in the spirit of netnsct.sh.
+ * Applies to packets sent by sockets created after the call: drops
+ * the given share of them and delays the rest by delay +- jitter,
+ * which also reorders them.
+ */
+struct au_stream_impairment {
+  double loss;
+  std::chrono::milliseconds delay;
+  std::chrono::milliseconds jitter;
+};
+void au_stream_set_impairment(const au_stream_impairment &impairment);
+
+#endif  // AU_STREAM_SOCKET_H_
@@ -0,0 +1,52 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Benchmarks are run by `bin/bench <name> [args...]`.
+ * Each one prints a header line and then one tab-separated line per measurement.
+ */
+int bench_account_store(int argc, char *argv[]);
+int bench_sequencer(int argc, char *argv[]);
+int bench_protocol_decode(int argc, char *argv[]);
+int bench_protocol_encode(int argc, char *argv[]);
+int bench_protocol_compact(int argc, char *argv[]);
+int bench_protocol_messages(int argc, char *argv[]);
+int bench_log(int argc, char *argv[]);
+int bench_write_ahead_log(int argc, char *argv[]);
+int bench_snapshot(int argc, char *argv[]);
+int bench_accept(int argc, char *argv[]);
+int bench_transport(int argc, char *argv[]);
+
+// Number of operator new calls made by the calling thread so far.
+std::uint64_t bench_allocations();
+
+class bench_timer {
+public:
+  bench_timer() : start_(std::chrono::steady_clock::now()) {}
+  double seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Fast deterministic PRNG for generating workloads.
+class xorshift {
+public:
+  explicit xorshift(std::uint64_t seed) : state_(seed * 0x9E3779B97F4A7C15ull + 1) {}
+  std::uint64_t operator()() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return state_;
+  }
+
+private:
+  std::uint64_t state_;
+};
+
+#endif  // BENCH_H_
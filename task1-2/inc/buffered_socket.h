@@ -0,0 +1,56 @@
+#ifndef BUFFERED_SOCKET_H_
+#define BUFFERED_SOCKET_H_
+
+#include <functional>
+#include <vector>
+#include "ring_buffer.h"
+#include "stream_socket.h"
+
+/*
+ * Buffering decorator for another stream_socket.
+ * Incoming data is read ahead in large chunks into a ring buffer and
+ * recv() is served from memory. Outgoing data is coalesced until flush()
+ * is called or the write buffer fills up. The optional flush hook runs
+ * right before any outgoing data is handed to the inner socket, e.g. to
+ * make what the data acknowledges durable first.
+ * The destructor does not flush, unflushed data is lost.
+ */
+class buffered_socket : public stream_socket {
+public:
+  static const std::size_t DEFAULT_CAPACITY = 64 * 1024;
+  typedef std::function<void()> flush_hook;
+
+  explicit buffered_socket(stream_socket &inner,
+                           std::size_t read_capacity = DEFAULT_CAPACITY,
+                           std::size_t write_capacity = DEFAULT_CAPACITY,
+                           flush_hook before_flush = flush_hook());
+
+  void send(const void *buf, size_t size) override;
+  // Coalesced like send(); too large data goes out in a single sendv() with the buffered one.
+  void sendv(const const_buffer *bufs, size_t count) override;
+  void recv(void *buf, size_t size) override;
+  size_t recv_some(void *buf, size_t size) override;
+
+  // Sends all buffered outgoing data.
+  void flush();
+
+  // Amount of incoming data which can be received without blocking.
+  std::size_t buffered_input() const { return read_buf_.size(); }
+  std::size_t buffered_output() const { return write_size_; }
+  // Copies buffered incoming data without consuming it, returns the amount copied.
+  std::size_t peek(void *buf, std::size_t size) const { return read_buf_.peek(0, buf, size); }
+
+private:
+  buffered_socket(const buffered_socket &) = delete;
+  buffered_socket& operator=(const buffered_socket &) = delete;
+
+  void fill();
+
+  stream_socket &inner_;
+  flush_hook before_flush_;
+  ring_buffer read_buf_;
+  std::vector<char> write_buf_;
+  std::size_t write_size_;
+};
+
+#endif  // BUFFERED_SOCKET_H_
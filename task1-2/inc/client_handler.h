@@ -0,0 +1,38 @@
+#ifndef CLIENT_HANDLER_H_
+#define CLIENT_HANDLER_H_
+
+#include <chrono>
+#include <memory>
+#include "account_store.h"
+#include "protocol.h"
+#include "replication.h"
+#include "transfer_sequencer.h"
+#include "write_ahead_log.h"
+
+/*
+ * Request handling of the server, shared by all its modes. The state it
+ * works with is global and is set up by the server before clients come.
+ */
+extern account_store accounts;
+extern std::unique_ptr<write_ahead_log> wal;
+// With --sequencer, all transfers are applied by its thread.
+extern std::unique_ptr<transfer_sequencer> sequencer;
+// With --replication-port, replicas are fed through it; with --replica-of, the store follows a primary.
+extern std::unique_ptr<replication_primary> primary;
+extern std::unique_ptr<replication_replica> replica;
+extern std::chrono::milliseconds max_staleness;
+
+/*
+ * Blocks until modifications made by the current thread are durable.
+ * Called before responses are sent, so that a client is never told
+ * about an operation which may be lost in a crash.
+ */
+void wait_durable();
+
+// Creates a handler for a connection, see epoll_server::handler_factory.
+std::unique_ptr<MessageVisitor> make_client_handler(stream_socket *sock);
+
+// Serves a connection on the calling thread until it is closed or a request fails.
+void process_client(std::unique_ptr<stream_socket> client);
+
+#endif  // CLIENT_HANDLER_H_
@@ -0,0 +1,59 @@
+#ifndef EPOLL_SERVER_H_
+#define EPOLL_SERVER_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "protocol.h"
+#include "tcp_socket.h"
+
+/*
+ * Event-driven server core: a fixed set of event loop threads, each
+ * multiplexing many non-blocking connections with epoll.
+ * Every connection has its own read and write buffers. Complete messages
+ * are decoded from the read buffer and passed to the connection's handler
+ * one at a time, the handler writes its responses into the write buffer.
+ * Available on Linux only.
+ */
+class epoll_server {
+public:
+  /*
+   * Creates a handler for a new connection. All responses should be sent
+   * to the given socket, which is valid for the lifetime of the handler.
+   */
+  typedef std::function<std::unique_ptr<MessageVisitor>(stream_socket*)> handler_factory;
+
+  /*
+   * Called by an event loop thread after it has handled a round of requests
+   * and before it starts sending their responses, e.g. to make their effects durable.
+   * If it throws, the connections which got requests in that round are closed.
+   */
+  typedef std::function<void()> flush_hook;
+
+  /*
+   * A connection with this much output not yet taken by the client is not
+   * read from and its buffered requests are not handled until the output
+   * drains, so a client which never reads cannot make the server buffer
+   * without limit.
+   */
+  static const std::size_t MAX_PENDING_OUTPUT = 1 << 20;
+
+  epoll_server(std::size_t threads, handler_factory factory, flush_hook before_flush = flush_hook());
+  ~epoll_server();  // Stops all event loops and closes all connections.
+
+  // Thread-safe.
+  void add_client(std::unique_ptr<tcp_connection_socket> client);
+
+private:
+  epoll_server(const epoll_server &) = delete;
+  epoll_server& operator=(const epoll_server &) = delete;
+
+  class event_loop;
+
+  handler_factory factory_;
+  std::vector<std::unique_ptr<event_loop>> loops_;
+  std::atomic<std::size_t> next_loop_;
+};
+
+#endif  // EPOLL_SERVER_H_
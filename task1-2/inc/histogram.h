@@ -0,0 +1,55 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Histogram of non-negative integer values with bounded relative error,
+ * in the spirit of HdrHistogram. Values below 2^precision_bits are
+ * counted exactly, larger ones fall into buckets which are 2^-(precision_bits-1)
+ * of their value wide, so the default 11 bits keep percentiles within 0.1%
+ * and take 256KB, while 4 bits keep them within 12.5% in 2.5KB.
+ * Values above MAX_VALUE are counted as MAX_VALUE.
+ * Recording is a couple of arithmetic operations, histograms of
+ * different threads are combined with merge(). Not thread-safe.
+ */
+class histogram {
+public:
+  static const int DEFAULT_PRECISION_BITS = 11;
+  static const std::uint64_t MAX_VALUE = (1ull << 40) - 1;
+
+  // Precision should be in [1, 16].
+  explicit histogram(int precision_bits = DEFAULT_PRECISION_BITS);
+
+  void record(std::uint64_t value) { record(value, 1); }
+  // Records the same value `count` times.
+  void record(std::uint64_t value, std::uint64_t count);
+  // Both histograms should have the same precision.
+  void merge(const histogram &other);
+  void clear();
+
+  std::uint64_t count() const { return count_; }
+  std::uint64_t min() const { return count_ ? min_ : 0; }
+  std::uint64_t max() const { return max_; }
+  double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0; }
+  /*
+   * The smallest value such that the given percentage (0..100) of recorded
+   * values are not larger, rounded up to the end of its bucket.
+   */
+  std::uint64_t percentile(double percent) const;
+
+private:
+  std::size_t index_of(std::uint64_t value) const;
+  // The largest value which falls into the same bucket.
+  std::uint64_t highest_equivalent(std::size_t index) const;
+
+  int precision_bits_;
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t count_;
+  std::uint64_t min_;
+  std::uint64_t max_;
+  std::uint64_t sum_;
+};
+
+#endif  // HISTOGRAM_H_
@@ -0,0 +1,49 @@
+#ifndef JOURNAL_RECORD_H_
+#define JOURNAL_RECORD_H_
+
+#include <cstdint>
+#include <vector>
+#include "account_store.h"
+
+/*
+ * Records of account_journal operations, as written to the write-ahead log
+ * and shipped to replicas. Layout, all integers are little-endian:
+ *   uint32 payload size, uint32 payload checksum, payload.
+ * Payload starts with the record type:
+ *   REGISTRATION: uint64 id
+ *   TRANSFER: uint64 from, uint64 to, int64 amount
+ *   TRANSFER_BATCH: uint64 from, uint32 count, count * (uint64 to, int64 amount)
+ */
+const std::size_t JOURNAL_RECORD_HEADER_SIZE = 8;
+const std::size_t JOURNAL_MAX_PAYLOAD_SIZE = 1 + 8 + 4 + BatchTransferRequest::MAX_ITEMS * 16;
+const std::size_t JOURNAL_REGISTRATION_RECORD_SIZE = JOURNAL_RECORD_HEADER_SIZE + 9;
+const std::size_t JOURNAL_TRANSFER_RECORD_SIZE = JOURNAL_RECORD_HEADER_SIZE + 25;
+
+inline std::size_t journal_batch_record_size(std::size_t items) {
+  return JOURNAL_RECORD_HEADER_SIZE + 13 + items * 16;
+}
+
+void put_little_endian(char *&out, std::uint64_t value, std::size_t bytes);
+std::uint64_t get_little_endian(const char *&in, std::size_t bytes);
+
+// Encode a whole record into a buffer of the size above and return the size.
+std::size_t journal_encode_registration(char *record, t_client_id id);
+std::size_t journal_encode_transfer(char *record, t_client_id from, t_client_id to, t_balance amount);
+std::size_t journal_encode_transfer_batch(char *record, t_client_id from,
+                                          const std::vector<BatchTransferRequest::Item> &items);
+
+/*
+ * Reads a record header, returns false if it cannot start a complete record.
+ * The payload is intact if journal_checksum() of it matches `checksum`.
+ */
+bool journal_decode_header(const char *header, std::size_t &payload_size, std::uint32_t &checksum);
+std::uint32_t journal_checksum(const char *data, std::size_t size);
+
+/*
+ * Applies a payload to the store, registering the clients it mentions if
+ * needed, so that registrations may be applied twice or out of order.
+ * Throws std::runtime_error if the payload is malformed.
+ */
+void journal_apply(account_store &store, const char *payload, std::size_t size);
+
+#endif  // JOURNAL_RECORD_H_
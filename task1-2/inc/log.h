@@ -0,0 +1,56 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdio.h>
+#include <atomic>
+
+/*
+ * Asynchronous logging.
+ * Every thread formats its records into its own lock-free ring buffer,
+ * a background thread collects them and writes them out in batches.
+ * Records are dropped (and counted) when a ring is full, logging threads
+ * never block. Records from one thread keep their order, records from
+ * different threads may interleave in any order.
+ *
+ * Use LOG(log_level::info, "format", args...): when the level is
+ * disabled, the arguments are not evaluated and the only cost is
+ * a single relaxed atomic load.
+ */
+enum class log_level : int {
+  off = 0,
+  error,
+  warning,
+  info,
+  debug,
+};
+
+namespace log_detail {
+extern std::atomic<int> verbosity;
+}
+
+inline bool log_enabled(log_level level) {
+  return static_cast<int>(level) <= log_detail::verbosity.load(std::memory_order_relaxed);
+}
+
+void log_set_level(log_level level);
+// Parses "off", "error", "warning", "info" or "debug", returns false on failure.
+bool log_parse_level(const char *name, log_level &level);
+// Redirects output, stdout by default. The file should outlive logging.
+void log_set_output(FILE *output);
+// Waits until everything logged so far by all threads is written out.
+void log_flush();
+
+void log_write(log_level level, const char *format, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+#define LOG(level, ...) \
+  do { \
+    if (log_enabled(level)) { \
+      log_write(level, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#endif  // LOG_H_
@@ -0,0 +1,331 @@
+#ifndef MESSAGE_SCHEMA_H_
+#define MESSAGE_SCHEMA_H_
+
+/*
+ * Compile-time description of protocol messages, see protocol.h.
+ * A fixed-size message lists its fields with PROTO_FIELD in a proto_layout,
+ * which generates its codecs for both encodings. All messages are listed in a proto_message_list,
+ * and proto_schema generates per-id tables, the storage for any message and
+ * the visitor interface from it. Everything is templates, so codecs are
+ * inlined into the table entries and into callers which know the message type.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+#include <type_traits>
+
+template<typename T>
+inline T proto_to_big_endian(T val) {
+  static_assert(std::is_unsigned<T>::value, "proto_to_big_endian works with unsigned types only");
+  #if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return val;
+  #elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  switch (sizeof(T)) {
+  case 1: return val;
+  case 2: return __builtin_bswap16(val);
+  case 4: return __builtin_bswap32(val);
+  case 8: return __builtin_bswap64(val);
+  }
+  #endif
+  T result = 0;
+  unsigned char *bytes = reinterpret_cast<unsigned char*>(&result);
+  for (std::size_t i = 0; i < sizeof(T); i++) {
+    bytes[i] = (val >> (8 * (sizeof(T) - 1 - i))) & 0xFF;
+  }
+  return result;
+}
+
+// Stores val at buf in big-endian as a single word.
+template<typename T>
+inline void proto_store(char *buf, T val_) {
+  typename std::make_unsigned<T>::type val = proto_to_big_endian<typename std::make_unsigned<T>::type>(val_);
+  memcpy(buf, &val, sizeof(val));
+}
+
+// Loads a big-endian value from buf as a single word.
+template<typename T>
+inline T proto_load(const char *buf) {
+  typename std::make_unsigned<T>::type val;
+  memcpy(&val, buf, sizeof(val));
+  return proto_to_big_endian(val);  // Byte swap is an involution.
+}
+
+// Throw protocol_error.
+[[noreturn]] void proto_throw_unknown_id(std::uint8_t id);
+[[noreturn]] void proto_throw_malformed(const char *what);
+[[noreturn]] void proto_throw_unexpected(std::uint8_t id);
+
+// How message payloads are put on the wire, a connection may switch with a handshake (see HelloMessage).
+enum class proto_encoding {
+  fixed,    // Integers as big-endian words of their full width.
+  compact,  // Integers as varints, zig-zag ones for signed types; the payload is prefixed with its length.
+};
+
+// The longest varint holding an integer of the given size.
+constexpr std::size_t proto_max_varint_size(std::size_t bytes) {
+  return (8 * bytes + 6) / 7;
+}
+
+// Varints are LEB128: 7 bits per byte, least significant first, the high bit is set on all bytes but the last.
+inline std::size_t proto_varint_size(std::uint64_t val) {
+  std::size_t size = 1;
+  for (; val >= 0x80; val >>= 7) {
+    size++;
+  }
+  return size;
+}
+
+// Returns the end of the stored varint.
+inline char* proto_store_varint(char *buf, std::uint64_t val) {
+  for (; val >= 0x80; val >>= 7) {
+    *buf++ = static_cast<char>(val | 0x80);
+  }
+  *buf++ = static_cast<char>(val);
+  return buf;
+}
+
+/*
+ * Loads a varint from [buf, end) into val and moves buf past it.
+ * Returns false if it is incomplete (buf is not moved then).
+ * Throws protocol_error if it is longer than 64 bits.
+ */
+inline bool proto_try_load_varint(const char *&buf, const char *end, std::uint64_t &val) {
+  const char *pos = buf;
+  val = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (pos == end) {
+      return false;
+    }
+    std::uint8_t byte = static_cast<std::uint8_t>(*pos++);
+    val |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      buf = pos;
+      return true;
+    }
+  }
+  proto_throw_malformed("Too long varint");
+}
+
+// Same, but throws protocol_error if the varint is incomplete.
+inline std::uint64_t proto_load_varint(const char *&buf, const char *end) {
+  std::uint64_t val;
+  if (!proto_try_load_varint(buf, end, val)) {
+    proto_throw_malformed("Truncated varint");
+  }
+  return val;
+}
+
+// Throws protocol_error unless a compact message was decoded exactly up to its end.
+inline void proto_check_compact_end(const char *buf, const char *end) {
+  if (buf != end) {
+    proto_throw_malformed("Trailing bytes in a compact message");
+  }
+}
+
+// Zig-zag keeps small negative values short: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+template<typename T>
+inline std::uint64_t proto_to_varint(T val) {
+  static_assert(std::is_integral<T>::value && sizeof(T) <= 8, "Varints hold integers of up to 64 bits");
+  if (std::is_signed<T>::value) {
+    std::int64_t v = val;
+    return (static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63);
+  }
+  return static_cast<std::uint64_t>(val);
+}
+
+// Throws protocol_error if the value does not fit into T.
+template<typename T>
+inline T proto_from_varint(std::uint64_t val) {
+  T result;
+  if (std::is_signed<T>::value) {
+    std::int64_t v = static_cast<std::int64_t>(val >> 1) ^ -static_cast<std::int64_t>(val & 1);
+    result = static_cast<T>(v);
+    if (static_cast<std::int64_t>(result) != v) {
+      proto_throw_malformed("Integer out of range");
+    }
+  } else {
+    result = static_cast<T>(val);
+    if (static_cast<std::uint64_t>(result) != val) {
+      proto_throw_malformed("Integer out of range");
+    }
+  }
+  return result;
+}
+
+// Integer field `Member` of message T.
+template<typename T, typename M, M T::*Member>
+struct proto_field {
+  static constexpr std::size_t SIZE = sizeof(M);
+  static constexpr std::size_t MAX_COMPACT_SIZE = proto_max_varint_size(sizeof(M));
+
+  static void encode(char *buf, const T &msg) { proto_store(buf, msg.*Member); }
+  static void decode(const char *buf, T &msg) { msg.*Member = proto_load<M>(buf); }
+
+  static std::size_t compact_size(const T &msg) { return proto_varint_size(proto_to_varint(msg.*Member)); }
+  static char* encode_compact(char *buf, const T &msg) { return proto_store_varint(buf, proto_to_varint(msg.*Member)); }
+  static void decode_compact(const char *&buf, const char *end, T &msg) {
+    msg.*Member = proto_from_varint<M>(proto_load_varint(buf, end));
+  }
+};
+
+#define PROTO_FIELD(T, member) proto_field<T, decltype(T::member), &T::member>
+
+// Fields stored back-to-back in the listed order.
+template<typename... Fields>
+struct proto_layout;
+
+template<>
+struct proto_layout<> {
+  static constexpr std::size_t SIZE = 0;
+  static constexpr std::size_t MAX_COMPACT_SIZE = 0;
+
+  template<typename T> static void encode(char *, const T &) {}
+  template<typename T> static void decode(const char *, T &) {}
+  template<typename T> static std::size_t compact_size(const T &) { return 0; }
+  template<typename T> static char* encode_compact(char *buf, const T &) { return buf; }
+  template<typename T> static void decode_compact(const char *&, const char *, T &) {}
+};
+
+template<typename Field, typename... Rest>
+struct proto_layout<Field, Rest...> {
+  static constexpr std::size_t SIZE = Field::SIZE + proto_layout<Rest...>::SIZE;
+  static constexpr std::size_t MAX_COMPACT_SIZE = Field::MAX_COMPACT_SIZE + proto_layout<Rest...>::MAX_COMPACT_SIZE;
+
+  template<typename T> static void encode(char *buf, const T &msg) {
+    Field::encode(buf, msg);
+    proto_layout<Rest...>::encode(buf + Field::SIZE, msg);
+  }
+  template<typename T> static void decode(const char *buf, T &msg) {
+    Field::decode(buf, msg);
+    proto_layout<Rest...>::decode(buf + Field::SIZE, msg);
+  }
+  template<typename T> static std::size_t compact_size(const T &msg) {
+    return Field::compact_size(msg) + proto_layout<Rest...>::compact_size(msg);
+  }
+  template<typename T> static char* encode_compact(char *buf, const T &msg) {
+    return proto_layout<Rest...>::encode_compact(Field::encode_compact(buf, msg), msg);
+  }
+  template<typename T> static void decode_compact(const char *&buf, const char *end, T &msg) {
+    Field::decode_compact(buf, end, msg);
+    proto_layout<Rest...>::decode_compact(buf, end, msg);
+  }
+};
+
+template<typename... Messages>
+struct proto_message_list {};
+
+template<std::uint8_t Id, typename... Messages>
+struct proto_ids_from : std::true_type {};
+
+template<std::uint8_t Id, typename Message, typename... Rest>
+struct proto_ids_from<Id, Message, Rest...>
+    : std::integral_constant<bool, Message::ID == Id && proto_ids_from<Id + 1, Rest...>::value> {};
+
+constexpr std::size_t proto_max_size(std::size_t a, std::size_t b) {
+  return a > b ? a : b;
+}
+
+template<typename... Messages>
+struct proto_max_fixed_size : std::integral_constant<std::size_t, 0> {};
+
+template<typename Message, typename... Rest>
+struct proto_max_fixed_size<Message, Rest...>
+    : std::integral_constant<std::size_t, proto_max_size(Message::fixed_size(), proto_max_fixed_size<Rest...>::value)> {};
+
+template<typename... Messages>
+struct proto_max_fixed_compact_size : std::integral_constant<std::size_t, 0> {};
+
+template<typename Message, typename... Rest>
+struct proto_max_fixed_compact_size<Message, Rest...>
+    : std::integral_constant<std::size_t, proto_max_size(Message::fixed_compact_size(),
+                                                         proto_max_fixed_compact_size<Rest...>::value)> {};
+
+// Interface with a pure virtual accept(const T&) for every message type T.
+template<typename... Messages>
+struct proto_visitor;
+
+template<typename Message>
+struct proto_visitor<Message> {
+  virtual ~proto_visitor() {}
+  virtual void accept(const Message&) = 0;
+};
+
+template<typename Message, typename... Rest>
+struct proto_visitor<Message, Rest...> : proto_visitor<Rest...> {
+  using proto_visitor<Rest...>::accept;
+  virtual void accept(const Message&) = 0;
+};
+
+// Visitor whose accept(const T&) throws protocol_error for every message type T, handlers override the ones they expect.
+template<typename Visitor, typename... Messages>
+struct proto_default_visitor;
+
+template<typename Visitor>
+struct proto_default_visitor<Visitor> : Visitor {};
+
+template<typename Visitor, typename Message, typename... Rest>
+struct proto_default_visitor<Visitor, Message, Rest...> : proto_default_visitor<Visitor, Rest...> {
+  using proto_default_visitor<Visitor, Rest...>::accept;
+  void accept(const Message&) override { proto_throw_unexpected(Message::ID); }
+};
+
+/*
+ * Everything generated from the list of messages. Their ids should be
+ * 1, 2, ... in the order of the list, so that an id indexes the tables.
+ * Every message type T provides:
+ *   T::ID;
+ *   constexpr T::header_size(): bytes after the id which tell the size of the rest;
+ *   T::payload_size(header): the size of everything after the id, validated;
+ *   constexpr T::fixed_size(): the part of that which does not depend on contents;
+ *   constexpr T::fixed_compact_size(): an upper bound of the same in the compact encoding;
+ *   constexpr T::max_compact_size(): the largest valid compact payload.
+ */
+template<typename List>
+struct proto_schema;
+
+template<typename... Messages>
+struct proto_schema<proto_message_list<Messages...>> {
+  static_assert(proto_ids_from<1, Messages...>::value, "Message ids should be 1, 2, ... in the order of the list");
+
+  // Compact payloads of that size have a single byte of length.
+  static_assert(proto_max_fixed_compact_size<Messages...>::value < 0x80, "Fixed parts of compact messages should be short");
+
+  static constexpr std::size_t COUNT = sizeof...(Messages);
+  // The largest message which does not depend on contents in either encoding, including the id byte.
+  static constexpr std::size_t MAX_FIXED_SIZE = proto_max_size(1 + proto_max_fixed_size<Messages...>::value,
+                                                               2 + proto_max_fixed_compact_size<Messages...>::value);
+
+  typedef typename std::aligned_union<0, Messages...>::type storage;
+  typedef proto_visitor<Messages...> visitor;
+  // Throwing accept() overrides of Visitor, which derives from visitor.
+  template<typename Visitor> using default_visitor = proto_default_visitor<Visitor, Messages...>;
+
+  /*
+   * Calls Op::call<T>(args...) for the message type T with the given id
+   * through a table of Op::call instances. Throws protocol_error for unknown ids.
+   */
+  template<typename Op, typename R, typename... Args>
+  static R dispatch(std::uint8_t id, Args... args) {
+    static R (*const table[])(Args...) = {&Op::template call<Messages>...};
+    if (id == 0 || id > COUNT) {
+      proto_throw_unknown_id(id);
+    }
+    return table[id - 1](args...);
+  }
+};
+
+template<typename T, typename M, M T::*Member>
+constexpr std::size_t proto_field<T, M, Member>::SIZE;
+template<typename T, typename M, M T::*Member>
+constexpr std::size_t proto_field<T, M, Member>::MAX_COMPACT_SIZE;
+template<typename Field, typename... Rest>
+constexpr std::size_t proto_layout<Field, Rest...>::SIZE;
+template<typename Field, typename... Rest>
+constexpr std::size_t proto_layout<Field, Rest...>::MAX_COMPACT_SIZE;
+template<typename... Messages>
+constexpr std::size_t proto_schema<proto_message_list<Messages...>>::COUNT;
+template<typename... Messages>
+constexpr std::size_t proto_schema<proto_message_list<Messages...>>::MAX_FIXED_SIZE;
+
+#endif  // MESSAGE_SCHEMA_H_
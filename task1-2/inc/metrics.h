@@ -0,0 +1,71 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include "histogram.h"
+
+/*
+ * Process-wide instrumentation.
+ * Every thread records into its own block of counters and latency
+ * buckets, which only that thread writes, so recording takes no locks
+ * and no atomic read-modify-write instructions. metrics_collect() sums
+ * the blocks of all threads, including the ones which have exited.
+ *
+ * Latencies are kept with 12.5% precision, see histogram(4).
+ */
+enum class metric_counter : int {
+  connections_opened = 0,
+  connections_closed,
+  bytes_received,
+  bytes_sent,
+  lock_waits,  // Lock acquisitions which had to wait for another thread.
+  COUNT,
+};
+
+// Requests are told apart by message id.
+const std::size_t METRICS_MAX_MESSAGE_ID = 15;
+const int METRICS_PRECISION_BITS = 4;
+
+void metrics_add(metric_counter counter, std::uint64_t value = 1);
+void metrics_record_request(std::uint8_t message_id, std::uint64_t service_ns, bool failed);
+void metrics_record_lock_wait(std::uint64_t wait_ns);
+
+struct metrics_snapshot {
+  struct request_stats {
+    request_stats() : service_ns(METRICS_PRECISION_BITS), errors(0) {}
+    histogram service_ns;
+    std::uint64_t errors;
+  };
+
+  metrics_snapshot() : lock_wait_ns(METRICS_PRECISION_BITS) {}
+
+  std::uint64_t counters[static_cast<int>(metric_counter::COUNT)];
+  request_stats requests[METRICS_MAX_MESSAGE_ID + 1];
+  histogram lock_wait_ns;
+
+  std::uint64_t operator[](metric_counter counter) const { return counters[static_cast<int>(counter)]; }
+};
+
+metrics_snapshot metrics_collect();
+
+// Records the time until destruction as the service time of a request.
+class request_timer {
+public:
+  explicit request_timer(std::uint8_t message_id)
+      : message_id_(message_id), start_(std::chrono::steady_clock::now()) {}
+  ~request_timer() {
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start_;
+    metrics_record_request(message_id_, elapsed.count(), std::uncaught_exception());
+  }
+
+private:
+  request_timer(const request_timer &) = delete;
+  request_timer& operator=(const request_timer &) = delete;
+
+  std::uint8_t message_id_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#endif  // METRICS_H_
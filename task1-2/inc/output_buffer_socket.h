@@ -0,0 +1,24 @@
+#ifndef OUTPUT_BUFFER_SOCKET_H_
+#define OUTPUT_BUFFER_SOCKET_H_
+
+#include <stdexcept>
+#include <string>
+#include "stream_socket.h"
+
+// Appends everything sent to a string, e.g. to the write buffer of an event-driven connection.
+class output_buffer_socket : public stream_socket {
+public:
+  explicit output_buffer_socket(std::string *out) : out_(out) {}
+
+  void send(const void *buf, size_t size) override {
+    out_->append(static_cast<const char*>(buf), size);
+  }
+  void recv(void *, size_t) override {
+    throw std::logic_error("output_buffer_socket does not support recv()");
+  }
+
+private:
+  std::string *out_;
+};
+
+#endif  // OUTPUT_BUFFER_SOCKET_H_
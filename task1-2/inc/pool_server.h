@@ -0,0 +1,44 @@
+#ifndef POOL_SERVER_H_
+#define POOL_SERVER_H_
+
+#include <memory>
+#include "epoll_server.h"
+#include "tcp_socket.h"
+
+/*
+ * Server core which executes requests on a bounded thread_pool.
+ * A single poller thread waits for all connections with epoll. Connections
+ * are polled one-shot: once a connection is ready, a task serving it is
+ * submitted to the pool, and the connection is not polled again until the
+ * task has read, handled and flushed what was there. So every connection
+ * is served by at most one task at a time and its requests keep their
+ * order, while different connections run in parallel on at most
+ * `workers` threads.
+ * Handlers and hooks have the same meaning as in epoll_server.
+ * Available on Linux only.
+ */
+class pool_server {
+public:
+  pool_server(std::size_t workers, epoll_server::handler_factory factory,
+              epoll_server::flush_hook before_flush = epoll_server::flush_hook());
+  ~pool_server();  // Calls shutdown().
+
+  // Thread-safe. Clients added after shutdown() has started are closed at once.
+  void add_client(std::unique_ptr<tcp_connection_socket> client);
+  /*
+   * Graceful shutdown: stops polling, finishes all requests which are
+   * being handled, flushes their responses as far as possible without
+   * blocking, joins all threads and closes all connections.
+   * Thread-safe, later calls do nothing.
+   */
+  void shutdown();
+
+private:
+  pool_server(const pool_server &) = delete;
+  pool_server& operator=(const pool_server &) = delete;
+
+  class impl;
+  std::unique_ptr<impl> impl_;
+};
+
+#endif  // POOL_SERVER_H_
@@ -1,11 +1,17 @@
 #ifndef PROTOCOL_H_
 #define PROTOCOL_H_
 
+#include <assert.h>
 #include <stdint.h>
 #include <iostream>
 #include <memory>
+#include <new>
+#include <sstream>
 #include <exception>
 #include <string>
+#include <type_traits>
+#include <vector>
+#include "message_schema.h"
 #include "stream_socket.h"
 
 class protocol_error : public std::runtime_error {
@@ -16,94 +22,500 @@ public:
 typedef std::uint64_t t_client_id;
 typedef std::int64_t t_balance;
 
-class MessageVisitor;
+struct MessageVisitor;
 
 struct AbstractMessage {
   virtual ~AbstractMessage() {};
   virtual void serialize(std::ostream &os) const = 0;
   virtual void deserialize(std::istream &is) = 0;
+  // Encodes the message into exactly serialized_size() bytes at buf.
+  virtual void encode(char *buf) const = 0;
+  // Decodes the message from buf, which holds its whole payload (see proto_message_size).
+  virtual void decode(const char *buf) = 0;
   virtual std::uint8_t id() const = 0;
   virtual std::size_t serialized_size() const = 0;
   virtual void visit(MessageVisitor&) const = 0;
+
+  // Same for proto_encoding::compact: encodes the payload into exactly compact_size() bytes at buf.
+  virtual std::size_t compact_size() const = 0;
+  virtual void encode_compact(char *buf) const = 0;
+  // Decodes the message from exactly size bytes. Throws protocol_error if they are malformed.
+  virtual void decode_compact(const char *buf, std::size_t size) = 0;
+
+  /*
+   * Trailing bytes of the encoding which the message already keeps in
+   * contiguous memory (e.g. a string), so that proto_send can pass them
+   * to sendv() instead of copying them. encode_head() encodes everything
+   * before them. By default there are none.
+   */
+  virtual const_buffer payload() const { return const_buffer{nullptr, 0}; }
+  virtual void encode_head(char *buf) const { encode(buf); }
 };
 
-struct RegistrationMessage : public AbstractMessage {
+/*
+ * Base of all messages, see message_schema.h. Messages are final, so
+ * calls on a message of a known type are not virtual and may be inlined.
+ */
+template<typename Derived, std::uint8_t Id>
+struct ProtoMessage : public AbstractMessage {
+  static constexpr std::uint8_t ID = Id;
+
+  // Stream codecs are built on top of encode() and decode().
   void serialize(std::ostream &os) const override;
   void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+  std::uint8_t id() const override { return Id; }
+  void visit(MessageVisitor &v) const override;
 };
 
-struct LoginMessage : public AbstractMessage {
+// Message with a fixed layout: Derived lists its fields in `layout`.
+template<typename Derived, std::uint8_t Id>
+struct FixedMessage : public ProtoMessage<Derived, Id> {
+  static constexpr std::size_t header_size() { return 0; }
+  static constexpr std::size_t fixed_size() { return Derived::layout::SIZE; }
+  static constexpr std::size_t fixed_compact_size() { return Derived::layout::MAX_COMPACT_SIZE; }
+  static constexpr std::size_t max_compact_size() { return Derived::layout::MAX_COMPACT_SIZE; }
+  static std::size_t payload_size(const char *) { return Derived::layout::SIZE; }
+
+  void encode(char *buf) const override { Derived::layout::encode(buf, derived()); }
+  void decode(const char *buf) override { Derived::layout::decode(buf, static_cast<Derived&>(*this)); }
+  std::size_t serialized_size() const override { return Derived::layout::SIZE; }
+
+  std::size_t compact_size() const override { return Derived::layout::compact_size(derived()); }
+  void encode_compact(char *buf) const override { Derived::layout::encode_compact(buf, derived()); }
+  void decode_compact(const char *buf, std::size_t size) override {
+    const char *end = buf + size;
+    Derived::layout::decode_compact(buf, end, static_cast<Derived&>(*this));
+    proto_check_compact_end(buf, end);
+  }
+
+private:
+  const Derived& derived() const { return static_cast<const Derived&>(*this); }
+};
+
+/*
+ * Variable-length message: HEADER_SIZE bytes with the number of items,
+ * followed by up to Derived::MAX_ITEMS items of Derived::ITEM_SIZE bytes.
+ * In the compact encoding the number is a varint and an item takes
+ * from 1 to Derived::MAX_COMPACT_ITEM_SIZE bytes.
+ * Derived implements the codecs.
+ */
+template<typename Derived, std::uint8_t Id>
+struct VariableMessage : public ProtoMessage<Derived, Id> {
+  static constexpr std::size_t HEADER_SIZE = sizeof(std::uint32_t);
+
+  static constexpr std::size_t header_size() { return HEADER_SIZE; }
+  static constexpr std::size_t fixed_size() { return HEADER_SIZE; }
+  static constexpr std::size_t fixed_compact_size() { return proto_max_varint_size(HEADER_SIZE); }
+  static constexpr std::size_t max_compact_size() {
+    return fixed_compact_size() + Derived::MAX_ITEMS * Derived::MAX_COMPACT_ITEM_SIZE;
+  }
+  static std::size_t payload_size(const char *header) { return HEADER_SIZE + items_count(header) * Derived::ITEM_SIZE; }
+
+  // Throws protocol_error if there are too many items.
+  static std::uint32_t check_items_count(std::uint64_t count);
+  static std::uint32_t items_count(const char *header) { return check_items_count(proto_load<std::uint32_t>(header)); }
+  /*
+   * Loads the number of items of a compact message and moves buf past it.
+   * Throws protocol_error if there are too many items or they cannot fit before end.
+   */
+  static std::uint32_t load_compact_items_count(const char *&buf, const char *end);
+};
+
+struct RegistrationMessage final : public FixedMessage<RegistrationMessage, 1> {
+  typedef proto_layout<> layout;
+};
+
+struct LoginMessage final : public FixedMessage<LoginMessage, 2> {
   t_client_id client_id;
 
-  void serialize(std::ostream &os) const override;
-  void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+  typedef proto_layout<PROTO_FIELD(LoginMessage, client_id)> layout;
 };
 
-struct RegistrationResponse : public AbstractMessage {
+struct RegistrationResponse final : public FixedMessage<RegistrationResponse, 3> {
   t_client_id client_id;
-  
-  void serialize(std::ostream &os) const override;
-  void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+
+  typedef proto_layout<PROTO_FIELD(RegistrationResponse, client_id)> layout;
 };
 
-struct BalanceInquiryRequest : public AbstractMessage {
-  void serialize(std::ostream &os) const override;
-  void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+struct BalanceInquiryRequest final : public FixedMessage<BalanceInquiryRequest, 4> {
+  typedef proto_layout<> layout;
 };
 
-struct BalanceInquiryResponse : public AbstractMessage {
+struct BalanceInquiryResponse final : public FixedMessage<BalanceInquiryResponse, 5> {
   t_balance balance;
 
-  void serialize(std::ostream &os) const override;
-  void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+  typedef proto_layout<PROTO_FIELD(BalanceInquiryResponse, balance)> layout;
 };
 
-struct TransferRequest : public AbstractMessage {
+struct TransferRequest final : public FixedMessage<TransferRequest, 6> {
   t_client_id transfer_to;
   t_balance amount;
 
-  void serialize(std::ostream &os) const override;
-  void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+  typedef proto_layout<PROTO_FIELD(TransferRequest, transfer_to), PROTO_FIELD(TransferRequest, amount)> layout;
 };
 
-struct OperationSucceeded : public AbstractMessage {
-  void serialize(std::ostream &os) const override;
-  void deserialize(std::istream &is) override;
-  std::uint8_t id() const override;
-  std::size_t serialized_size() const override;
-  void visit(MessageVisitor&) const override;
+struct OperationSucceeded final : public FixedMessage<OperationSucceeded, 7> {
+  typedef proto_layout<> layout;
+};
+
+/*
+ * Variable-length message: up to MAX_ITEMS transfers from the current
+ * client which should be applied all together or not at all.
+ */
+struct BatchTransferRequest final : public VariableMessage<BatchTransferRequest, 8> {
+  struct Item {
+    t_client_id transfer_to;
+    t_balance amount;
+  };
+  typedef proto_layout<PROTO_FIELD(Item, transfer_to), PROTO_FIELD(Item, amount)> item_layout;
+
+  static constexpr std::size_t ITEM_SIZE = item_layout::SIZE;
+  static constexpr std::size_t MAX_COMPACT_ITEM_SIZE = item_layout::MAX_COMPACT_SIZE;
+  static constexpr std::size_t MAX_ITEMS = 65536;
+
+  std::vector<Item> items;
+
+  void encode(char *buf) const override;
+  void decode(const char *buf) override;
+  std::size_t serialized_size() const override { return HEADER_SIZE + items.size() * ITEM_SIZE; }
+  std::size_t compact_size() const override;
+  void encode_compact(char *buf) const override;
+  void decode_compact(const char *buf, std::size_t size) override;
+};
+
+/*
+ * Variable-length message: status of every item of BatchTransferRequest.
+ * Either all statuses are OK, or no transfers were applied.
+ */
+struct BatchTransferResponse final : public VariableMessage<BatchTransferResponse, 9> {
+  static constexpr std::size_t ITEM_SIZE = sizeof(std::uint8_t);
+  static constexpr std::size_t MAX_COMPACT_ITEM_SIZE = ITEM_SIZE;
+  static constexpr std::size_t MAX_ITEMS = BatchTransferRequest::MAX_ITEMS;
+
+  enum Status : std::uint8_t {
+    OK = 0,
+    UNKNOWN_CLIENT = 1,
+    NOT_APPLIED = 2,  // The item is fine, but another one is not.
+  };
+  std::vector<Status> statuses;
+
+  void encode(char *buf) const override;
+  void decode(const char *buf) override;
+  std::size_t serialized_size() const override { return HEADER_SIZE + statuses.size() * ITEM_SIZE; }
+  std::size_t compact_size() const override;
+  void encode_compact(char *buf) const override;
+  void decode_compact(const char *buf, std::size_t size) override;
 };
 
-struct MessageVisitor {
-  virtual ~MessageVisitor() {};
-  virtual void accept(const RegistrationMessage&) = 0;
-  virtual void accept(const LoginMessage&) = 0;
-  virtual void accept(const RegistrationResponse&) = 0;
-  virtual void accept(const BalanceInquiryRequest&) = 0;
-  virtual void accept(const BalanceInquiryResponse&) = 0;
-  virtual void accept(const TransferRequest&) = 0;
-  virtual void accept(const OperationSucceeded&) = 0;
+// Asks the server for its metrics.
+struct StatsRequest final : public FixedMessage<StatsRequest, 10> {
+  typedef proto_layout<> layout;
 };
 
-std::unique_ptr<AbstractMessage> proto_recv(stream_socket &sock);
-void proto_send(stream_socket &sock, const AbstractMessage &msg);
+/*
+ * Variable-length message: server metrics as text of up to MAX_TEXT_SIZE
+ * bytes, one "name value" pair per line. Items are characters.
+ */
+struct StatsResponse final : public VariableMessage<StatsResponse, 11> {
+  static constexpr std::size_t ITEM_SIZE = 1;
+  static constexpr std::size_t MAX_COMPACT_ITEM_SIZE = ITEM_SIZE;
+  static constexpr std::size_t MAX_TEXT_SIZE = 1 << 20;
+  static constexpr std::size_t MAX_ITEMS = MAX_TEXT_SIZE;
+  std::string text;
+
+  void encode(char *buf) const override;
+  void decode(const char *buf) override;
+  std::size_t serialized_size() const override { return HEADER_SIZE + text.size(); }
+  const_buffer payload() const override { return const_buffer{text.data(), text.size()}; }  // The text.
+  void encode_head(char *buf) const override;
+  std::size_t compact_size() const override;
+  void encode_compact(char *buf) const override;
+  void decode_compact(const char *buf, std::size_t size) override;
+};
+
+const std::uint32_t PROTO_VERSION = 1;
+// Bits of HelloMessage::capabilities.
+const std::uint32_t PROTO_CAP_COMPACT = 1;  // proto_encoding::compact
+
+/*
+ * Optional first message of a client: the protocol version and the
+ * capabilities it supports. Clients which skip it get the version 1
+ * protocol with proto_encoding::fixed, so older ones keep working.
+ * HelloMessage and HelloResponse are always in the fixed encoding,
+ * both sides switch to the agreed one after HelloResponse.
+ */
+struct HelloMessage final : public FixedMessage<HelloMessage, 12> {
+  std::uint32_t version;
+  std::uint32_t capabilities;
+
+  typedef proto_layout<PROTO_FIELD(HelloMessage, version), PROTO_FIELD(HelloMessage, capabilities)> layout;
+};
+
+// The server's version and the requested capabilities which it supports.
+struct HelloResponse final : public FixedMessage<HelloResponse, 13> {
+  std::uint32_t version;
+  std::uint32_t capabilities;
+
+  typedef proto_layout<PROTO_FIELD(HelloResponse, version), PROTO_FIELD(HelloResponse, capabilities)> layout;
+};
+
+// The encoding which sides with the agreed capabilities use.
+inline proto_encoding proto_agreed_encoding(std::uint32_t capabilities) {
+  return (capabilities & PROTO_CAP_COMPACT) ? proto_encoding::compact : proto_encoding::fixed;
+}
+
+// All messages, in the order of their ids. A new message type is added here.
+typedef proto_message_list<
+    RegistrationMessage,
+    LoginMessage,
+    RegistrationResponse,
+    BalanceInquiryRequest,
+    BalanceInquiryResponse,
+    TransferRequest,
+    OperationSucceeded,
+    BatchTransferRequest,
+    BatchTransferResponse,
+    StatsRequest,
+    StatsResponse,
+    HelloMessage,
+    HelloResponse> ProtocolMessages;
+
+typedef proto_schema<ProtocolMessages> ProtocolSchema;
+
+// Has a pure virtual accept(const T&) for every message type T.
+struct MessageVisitor : public ProtocolSchema::visitor {
+  // Encoding of the messages which the visitor expects next, it may change after HelloMessage.
+  virtual proto_encoding encoding() const { return proto_encoding::fixed; }
+};
+
+// MessageVisitor which throws protocol_error for every message, handlers override accept() for the ones they expect.
+typedef ProtocolSchema::default_visitor<MessageVisitor> DefaultMessageVisitor;
+
+template<typename Derived, std::uint8_t Id>
+constexpr std::uint8_t ProtoMessage<Derived, Id>::ID;
+
+template<typename Derived, std::uint8_t Id>
+void ProtoMessage<Derived, Id>::visit(MessageVisitor &v) const {
+  v.accept(static_cast<const Derived&>(*this));
+}
+
+template<typename Derived, std::uint8_t Id>
+void ProtoMessage<Derived, Id>::serialize(std::ostream &os) const {
+  std::vector<char> buf(serialized_size());
+  encode(buf.data());
+  if (!os.write(buf.data(), buf.size())) {
+    throw protocol_error("Unable to write to the stream");
+  }
+}
+
+template<typename Derived, std::uint8_t Id>
+void ProtoMessage<Derived, Id>::deserialize(std::istream &is) {
+  std::vector<char> buf(Derived::header_size());
+  if (!is.read(buf.data(), buf.size())) {
+    throw protocol_error("Unexpected EOF");
+  }
+  buf.resize(Derived::payload_size(buf.data()));
+  if (!is.read(buf.data() + Derived::header_size(), buf.size() - Derived::header_size())) {
+    throw protocol_error("Unexpected EOF");
+  }
+  decode(buf.data());
+}
+
+template<typename Derived, std::uint8_t Id>
+constexpr std::size_t VariableMessage<Derived, Id>::HEADER_SIZE;
+
+template<typename Derived, std::uint8_t Id>
+std::uint32_t VariableMessage<Derived, Id>::check_items_count(std::uint64_t count) {
+  if (count > Derived::MAX_ITEMS) {
+    std::stringstream err_msg;
+    err_msg << "Too many items in a message with id " << static_cast<int>(Id) << ": " << count;
+    throw protocol_error(err_msg.str());
+  }
+  return static_cast<std::uint32_t>(count);
+}
+
+template<typename Derived, std::uint8_t Id>
+std::uint32_t VariableMessage<Derived, Id>::load_compact_items_count(const char *&buf, const char *end) {
+  std::uint32_t count = check_items_count(proto_load_varint(buf, end));
+  if (count > static_cast<std::size_t>(end - buf)) {  // Every item takes at least a byte.
+    proto_throw_malformed("Truncated compact message");
+  }
+  return count;
+}
+
+/*
+ * Upper bound on the full size of any fixed-size message on the wire in
+ * either encoding, including the id byte. Variable-length messages may be larger.
+ */
+constexpr std::size_t MAX_MESSAGE_SIZE = ProtocolSchema::MAX_FIXED_SIZE;
+
+/*
+ * Returns the full size on the wire (including the id byte) of the message
+ * starting at buf, or 0 if more than size bytes are needed to tell it.
+ * Throws protocol_error for unknown ids and oversized messages.
+ * In the fixed encoding the id is followed by the payload, in the compact
+ * one by a varint with the payload size and the payload.
+ */
+std::size_t proto_message_size(const void *buf, std::size_t size, proto_encoding encoding = proto_encoding::fixed);
+
+// Full size of msg on the wire, including the id byte.
+template<typename Message>
+std::size_t proto_encoded_size(const Message &msg, proto_encoding encoding = proto_encoding::fixed) {
+  if (encoding == proto_encoding::compact) {
+    std::size_t payload_size = msg.compact_size();
+    return 1 + proto_varint_size(payload_size) + payload_size;
+  }
+  return 1 + msg.serialized_size();
+}
+
+// Returns msg as T, or nullptr if it has another type. Cheaper than dynamic_cast.
+template<typename T>
+const T* proto_get_if(const AbstractMessage &msg) {
+  return msg.id() == T::ID ? static_cast<const T*>(&msg) : nullptr;
+}
+
+/*
+ * Holds a message of any type in place, without heap allocations
+ * (except for items of variable-length messages). Operations on the
+ * message go through per-id tables instead of virtual calls.
+ */
+class AnyMessage {
+public:
+  AnyMessage() : msg_(nullptr), id_(0) {}
+  ~AnyMessage() { reset(); }
+
+  template<typename T> T& emplace() {
+    reset();
+    T *msg = new (&storage_) T();
+    msg_ = msg;
+    id_ = T::ID;
+    return *msg;
+  }
+  // Constructs a default message with the given id. Throws protocol_error for unknown ids.
+  AbstractMessage& emplace(std::uint8_t id);
+  void reset() {
+    if (msg_) {
+      ProtocolSchema::dispatch<destroy_op, void, AbstractMessage*>(id_, msg_);
+      msg_ = nullptr;
+      id_ = 0;
+    }
+  }
+
+  bool empty() const { return msg_ == nullptr; }
+  std::uint8_t id() const { return id_; }
+  AbstractMessage& get() { assert(msg_); return *msg_; }
+  const AbstractMessage& get() const { assert(msg_); return *msg_; }
+  // Returns nullptr if the message has another type.
+  template<typename T> const T* get_if() const {
+    return id_ == T::ID ? static_cast<const T*>(msg_) : nullptr;
+  }
+  // Calls f(const T&) with the message as its actual type T.
+  template<typename F> void apply(F &&f) const {
+    assert(msg_);
+    ProtocolSchema::dispatch<apply_op<F>, void, const AbstractMessage*, F&>(id_, msg_, f);
+  }
+  void visit(MessageVisitor &v) const { apply(accept_op{v}); }
+
+private:
+  AnyMessage(const AnyMessage &) = delete;
+  AnyMessage& operator=(const AnyMessage &) = delete;
+
+  struct destroy_op {
+    template<typename T> static void call(AbstractMessage *msg) { static_cast<T*>(msg)->~T(); }
+  };
+  template<typename F> struct apply_op {
+    template<typename T> static void call(const AbstractMessage *msg, F &f) { f(static_cast<const T&>(*msg)); }
+  };
+  struct accept_op {
+    MessageVisitor &v;
+    template<typename T> void operator()(const T &msg) const { v.accept(msg); }
+  };
+
+  ProtocolSchema::storage storage_;
+  AbstractMessage *msg_;
+  std::uint8_t id_;
+};
+
+/*
+ * Decodes a single message from the beginning of buf into msg.
+ * Returns the number of bytes consumed or 0 if buf contains only
+ * a part of the message (msg is left empty then).
+ * Throws protocol_error for unknown message ids.
+ */
+std::size_t proto_decode(const void *buf, std::size_t size, AnyMessage &msg, proto_encoding encoding = proto_encoding::fixed);
+
+// Receives a single message into msg without heap allocations.
+void proto_recv(stream_socket &sock, AnyMessage &msg, proto_encoding encoding = proto_encoding::fixed);
+std::unique_ptr<AbstractMessage> proto_recv(stream_socket &sock, proto_encoding encoding = proto_encoding::fixed);
+/*
+ * Encodes msg together with its id byte into buf, which should have room
+ * for at least proto_encoded_size(msg, encoding) bytes (MAX_MESSAGE_SIZE
+ * is enough for fixed-size messages).
+ * Returns the number of bytes written.
+ */
+template<typename Message>
+std::size_t proto_encode(char *buf, const Message &msg, proto_encoding encoding = proto_encoding::fixed) {
+  buf[0] = static_cast<char>(msg.id());
+  if (encoding == proto_encoding::compact) {
+    std::size_t payload_size = msg.compact_size();
+    char *payload = proto_store_varint(buf + 1, payload_size);
+    msg.encode_compact(payload);
+    return payload - buf + payload_size;
+  }
+  msg.encode(buf + 1);
+  return 1 + msg.serialized_size();
+}
+
+/*
+ * Encodes messages back-to-back into a single fixed-size buffer,
+ * so that they can be sent with a single send().
+ * Messages larger than Capacity can never be added.
+ */
+template<std::size_t Capacity = 4096>
+class MessageBatch {
+public:
+  static_assert(Capacity >= MAX_MESSAGE_SIZE, "MessageBatch is too small for a single message");
+
+  MessageBatch() : size_(0) {}
+
+  // Returns false if there is no room left for msg.
+  template<typename Message>
+  bool add(const Message &msg, proto_encoding encoding = proto_encoding::fixed) {
+    if (Capacity - size_ < proto_encoded_size(msg, encoding)) {
+      return false;
+    }
+    size_ += proto_encode(buf_ + size_, msg, encoding);
+    return true;
+  }
+  // Sends all messages added so far and clears the batch.
+  void send(stream_socket &sock) {
+    sock.send(buf_, size_);
+    size_ = 0;
+  }
+
+  const char* data() const { return buf_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() { size_ = 0; }
+
+private:
+  char buf_[Capacity];
+  std::size_t size_;
+};
+
+// proto_send for messages which do not fit into MAX_MESSAGE_SIZE or have a payload().
+void proto_send_large(stream_socket &sock, const AbstractMessage &msg, proto_encoding encoding = proto_encoding::fixed);
+
+template<typename Message>
+void proto_send(stream_socket &sock, const Message &msg, proto_encoding encoding = proto_encoding::fixed) {
+  std::size_t size = proto_encoded_size(msg, encoding);
+  if (size > MAX_MESSAGE_SIZE || msg.payload().size > 0) {
+    proto_send_large(sock, msg, encoding);
+    return;
+  }
+  char buf[MAX_MESSAGE_SIZE];
+  proto_encode(buf, msg, encoding);
+  sock.send(buf, size);
+}
 
 #endif  // PROTOCOL_H_
@@ -0,0 +1,142 @@
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "account_store.h"
+#include "stream_socket.h"
+#include "tcp_socket.h"
+
+class buffered_socket;
+
+/*
+ * Log shipping from a primary server to read replicas.
+ *
+ * A replica connects to the primary's replication port and receives
+ * a snapshot of all balances taken at a cut (see account_store::write_snapshot),
+ * then every journal record made after the cut in the order the journal
+ * saw it, so transfers on the same account are applied in the primary's order.
+ * Heartbeats tell the replica how far along the primary is.
+ *
+ * Stream layout, all integers are little-endian. After the 8-byte
+ * REPLICATION_MAGIC, frames start with a uint8 kind:
+ *   SNAPSHOT_PAGE: uint32 count, count * int64 balance
+ *   SNAPSHOT_END: uint64 position of the cut
+ *   RECORD: a journal record, see journal_record.h
+ *   HEARTBEAT: uint64 position
+ * Positions count journal records made by the primary since it started.
+ */
+const char REPLICATION_MAGIC[] = "AUREPL01";
+
+/*
+ * Journal decorator which forwards every record to the next journal (e.g.
+ * the write-ahead log) and queues it for every replica. Each replica is
+ * served by a thread of its own, a replica which falls more than
+ * MAX_BACKLOG bytes behind or takes no data for SEND_TIMEOUT is
+ * disconnected and should reconnect. Snapshots for replicas are copied
+ * into memory and sent after they are taken, so a slow replica does not
+ * hold up other snapshots.
+ */
+class replication_primary : public account_journal {
+public:
+  static const std::size_t MAX_BACKLOG = 64 << 20;
+  static const std::chrono::milliseconds HEARTBEAT_INTERVAL;
+  static const std::chrono::milliseconds SEND_TIMEOUT;
+
+  // `next` may be null. Should be set as the store's journal.
+  replication_primary(account_store &store, account_journal *next);
+  // Disconnects all replicas.
+  ~replication_primary();
+
+  // Thread-safe. Starts streaming to a connected replica.
+  void add_replica(std::unique_ptr<tcp_connection_socket> sock);
+
+  void log_registration(t_client_id id) override;
+  void log_transfer(t_client_id from, t_client_id to, t_balance amount) override;
+  void log_transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) override;
+
+  std::size_t replicas() const;
+  std::uint64_t position() const;
+
+private:
+  replication_primary(const replication_primary &) = delete;
+  replication_primary& operator=(const replication_primary &) = delete;
+
+  struct replica {
+    std::unique_ptr<tcp_connection_socket> sock;
+    std::string pending;     // Frames not yet handed to the thread.
+    bool subscribed = false; // Gets records, i.e. its snapshot is taken.
+    bool dropped = false;    // Fell behind or the primary is closing.
+    bool finished = false;
+    std::condition_variable cv;
+    std::thread thread;
+  };
+
+  void publish(const char *record, std::size_t size);
+  void serve(replica &r);
+  void send_snapshot(replica &r);
+  // Sends in pieces with a deadline each, stops early once the replica is dropped.
+  void send_frames(replica &r, const char *data, std::size_t size);
+  // Joins threads of disconnected replicas. Should be called with mutex_ held.
+  void reap();
+
+  account_store &store_;
+  account_journal *next_;
+  mutable std::mutex mutex_;
+  std::list<replica> replicas_;
+  std::uint64_t position_;
+  bool stopping_;
+};
+
+/*
+ * Follows a primary: loads its snapshot into an empty store and then
+ * applies the stream on a thread of its own. Nothing else should modify
+ * the store, reads are safe at any time.
+ *
+ * The replica is as fresh as the primary was when the last heartbeat
+ * was sent, so staleness() is the time since one was received plus the
+ * network delay. It grows without bound once the primary is lost;
+ * such a replica keeps its data but should be restarted to follow again,
+ * see wait_lost().
+ */
+class replication_replica {
+public:
+  // Connects and receives the snapshot. Throws std::runtime_error and socket errors on failure.
+  replication_replica(account_store &store, std::unique_ptr<stream_client_socket> primary);
+  // Blocks until the primary closes the connection.
+  ~replication_replica();
+
+  bool connected() const { return connected_; }
+  // Blocks until the stream from the primary ends.
+  void wait_lost();
+  // Records of the primary applied so far.
+  std::uint64_t position() const { return position_; }
+  std::chrono::milliseconds staleness() const;
+
+private:
+  replication_replica(const replication_replica &) = delete;
+  replication_replica& operator=(const replication_replica &) = delete;
+
+  void receive_snapshot();
+  void run();
+  void heard_from_primary();
+
+  account_store &store_;
+  std::unique_ptr<stream_client_socket> primary_;
+  std::unique_ptr<buffered_socket> in_;
+  std::mutex lost_mutex_;
+  std::condition_variable lost_;
+  std::atomic<bool> connected_;  // Cleared under lost_mutex_.
+  std::atomic<std::uint64_t> position_;
+  std::atomic<std::chrono::steady_clock::rep> last_heartbeat_;
+  std::thread thread_;
+};
+
+#endif  // REPLICATION_H_
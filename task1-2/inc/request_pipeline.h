@@ -0,0 +1,64 @@
+#ifndef REQUEST_PIPELINE_H_
+#define REQUEST_PIPELINE_H_
+
+#include <deque>
+#include <functional>
+#include <typeinfo>
+#include "buffered_socket.h"
+#include "protocol.h"
+
+/*
+ * Client side of request pipelining: requests are sent without waiting
+ * for responses, the server answers them in order, and responses are
+ * matched with their requests by position.
+ * At most max_outstanding requests are in flight, so that neither side
+ * blocks on a full socket buffer while the other one is not reading.
+ */
+class request_pipeline {
+public:
+  typedef std::function<void(const AbstractMessage&)> response_handler;
+
+  static const std::size_t DEFAULT_MAX_OUTSTANDING = 1024;
+
+  explicit request_pipeline(buffered_socket &sock, std::size_t max_outstanding = DEFAULT_MAX_OUTSTANDING);
+
+  // Queues msg for sending, on_response is called once its response arrives.
+  void send(const AbstractMessage &msg, response_handler on_response);
+  // Sends queued requests without waiting for responses.
+  void flush() { sock_.flush(); }
+  // Receives a single response, returns false if nothing is outstanding.
+  bool receive_one();
+  // Sends all queued requests and waits for all responses.
+  void drain();
+
+  std::size_t outstanding() const { return handlers_.size(); }
+  /*
+   * Switches both directions to another encoding, e.g. after HelloResponse.
+   * Throws std::logic_error if there are outstanding requests.
+   */
+  void set_encoding(proto_encoding encoding);
+
+private:
+  request_pipeline(const request_pipeline &) = delete;
+  request_pipeline& operator=(const request_pipeline &) = delete;
+
+  buffered_socket &sock_;
+  std::size_t max_outstanding_;
+  std::deque<response_handler> handlers_;
+  AnyMessage response_;
+  proto_encoding encoding_;
+};
+
+// Wraps a handler expecting a specific response type, throws std::bad_cast on other types.
+template<typename T>
+request_pipeline::response_handler expect_response(std::function<void(const T&)> on_response) {
+  return [on_response](const AbstractMessage &msg) {
+    const T *response = proto_get_if<T>(msg);
+    if (!response) {
+      throw std::bad_cast();
+    }
+    on_response(*response);
+  };
+}
+
+#endif  // REQUEST_PIPELINE_H_
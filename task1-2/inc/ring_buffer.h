@@ -0,0 +1,59 @@
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/*
+ * Fixed-capacity byte FIFO over a circular buffer.
+ * Data can be copied in and out, or accessed in place through contiguous
+ * regions: write_region()/commit() and read_region()/consume().
+ * Not thread-safe.
+ */
+class ring_buffer {
+public:
+  explicit ring_buffer(std::size_t capacity);
+  /*
+   * Allocates `initial` bytes, possibly none, and doubles the allocation
+   * whenever written data does not fit, up to `capacity`. Suits buffers
+   * which are large at most but rarely hold much.
+   */
+  ring_buffer(std::size_t capacity, std::size_t initial);
+
+  std::size_t capacity() const { return capacity_; }
+  std::size_t allocated() const { return allocated_; }
+  std::size_t size() const { return size_; }
+  std::size_t free_space() const { return capacity_ - size_; }
+  bool empty() const { return size_ == 0; }
+  bool full() const { return size_ == capacity_; }
+  void clear() { head_ = size_ = 0; }
+
+  // Copies as much data as fits, returns the amount copied.
+  std::size_t write(const void *buf, std::size_t size);
+  // Copies and removes at most size bytes, returns the amount copied.
+  std::size_t read(void *buf, std::size_t size);
+  // Copies at most size bytes starting at offset without removing them.
+  std::size_t peek(std::size_t offset, void *buf, std::size_t size) const;
+
+  // The largest contiguous free region right after the data, allocates more if there is none.
+  std::pair<char*, std::size_t> write_region();
+  // Appends n bytes which were written to write_region().
+  void commit(std::size_t n);
+  // The largest contiguous region of data starting from the beginning.
+  std::pair<const char*, std::size_t> read_region() const;
+  // Removes n bytes from the beginning.
+  void consume(std::size_t n);
+
+private:
+  // Makes room for `size` bytes of data in the allocation, as far as the capacity allows.
+  void reserve(std::size_t size);
+
+  std::unique_ptr<char[]> data_;
+  std::size_t capacity_;
+  std::size_t allocated_;
+  std::size_t head_;
+  std::size_t size_;
+};
+
+#endif  // RING_BUFFER_H_
@@ -0,0 +1,34 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <cstdint>
+#include <string>
+#include "account_store.h"
+#include "write_ahead_log.h"
+
+/*
+ * Snapshot file format, version 1:
+ *   64-byte header: "AUSNAPSH", uint32 version, uint32 header size,
+ *   uint64 number of accounts, uint64 write-ahead log position, zero padding;
+ *   balances of all accounts as int64, indexed by client id.
+ * All integers are little-endian. Balances start at a cache-line-aligned
+ * offset, so the mapped file is used by the account table in place and
+ * loading does not depend on the number of accounts.
+ */
+const std::uint32_t SNAPSHOT_VERSION = 1;
+
+/*
+ * Writes a snapshot of the store without stopping it. The file is replaced
+ * atomically, a crash leaves the previous snapshot intact. If the log is
+ * given, its position at the moment of the snapshot is recorded and made
+ * durable first. Returns that position. Throws std::runtime_error on failure.
+ */
+std::uint64_t save_snapshot(account_store &store, const std::string &path, write_ahead_log *wal);
+
+/*
+ * Loads a snapshot into an empty store and returns the position in the
+ * write-ahead log to replay from. Throws std::runtime_error on failure.
+ */
+std::uint64_t load_snapshot(account_store &store, const std::string &path);
+
+#endif  // SNAPSHOT_H_
@@ -0,0 +1,49 @@
+#ifndef SOCKET_UTIL_H_
+#define SOCKET_UTIL_H_
+
+/*
+ * Platform glue and error reporting shared by socket implementations.
+ * Not a part of the public interface.
+ */
+
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#include <winsock2.h>
+// INVALID_SOCKET is already defined
+// SOCKET_ERROR is already defined
+#else
+typedef int SOCKET;
+static const int INVALID_SOCKET = -1;
+static const int SOCKET_ERROR = -1;
+#define closesocket close
+#endif
+
+#ifdef _WIN32
+class WSAStartupper {
+public:
+  WSAStartupper();
+  // We do not call WSACleanup() because of troubles with order of global ctors/dtors.
+private:
+  WSAStartupper(WSAStartupper &&) = delete;
+  WSAStartupper(const WSAStartupper&) = delete;
+  WSAStartupper& operator=(WSAStartupper) = delete;
+};
+#endif
+
+std::string get_socket_error(int code);
+// Describes the last socket error of the calling thread.
+std::string get_socket_error();
+
+template<typename T>
+void ensure_or_throw_impl(bool condition, const char *errname, const char *funname, const char *file, int line, const char *cond) {
+  if (!condition) {
+    std::stringstream msg;
+    msg << errname << " in " << funname << "() at " << file << ":" << line << ": condition " << cond << " failed: " << get_socket_error();
+    throw T(msg.str());
+  }
+}
+#define ensure_or_throw(cond, error) ensure_or_throw_impl<error>(cond, #error, __FUNCTION__, __FILE__, __LINE__, #cond)
+
+#endif  // SOCKET_UTIL_H_
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <cstddef>
 #include <exception>
 #include <stdexcept>
@@ -7,8 +8,25 @@
 
 /*
  * All the functions in the interface are blocking.
+ * TCP sockets also have variants which give up at a deadline, see tcp_socket.h.
  */
 
+// Point in time after which an operation fails with socket_timeout_error.
+typedef std::chrono::steady_clock::time_point socket_deadline;
+
+// Memory spans for vectored I/O, like iovec.
+struct const_buffer
+{
+    const void *data;
+    size_t size;
+};
+
+struct mutable_buffer
+{
+    void *data;
+    size_t size;
+};
+
 struct stream_socket
 {
     /*
@@ -31,6 +49,35 @@ struct stream_socket
      * - locking required;
      */
     virtual void recv(void *buf, size_t size) = 0;
+    /*
+     * Reads at least one and at most size bytes of data into buf
+     * (unless size is zero) and returns the amount read, or throws.
+     * Waits only until some data is available, so it can be used
+     * to read ahead. The default implementation reads exactly one byte.
+     * The same threading and exception rules as for recv apply.
+     */
+    virtual size_t recv_some(void *buf, size_t size) {
+        if (size == 0)
+            return 0;
+        recv(buf, 1);
+        return 1;
+    }
+    /*
+     * Vectored send and recv: work as if the buffers were a single
+     * contiguous one, so that e.g. a header and a payload stored apart
+     * can be sent without copying them together. Implementations may
+     * transfer all of them with a single system call, the default ones
+     * call send/recv for every buffer.
+     * The same threading and exception rules as for send/recv apply.
+     */
+    virtual void sendv(const const_buffer *bufs, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            send(bufs[i].data, bufs[i].size);
+    }
+    virtual void recvv(const mutable_buffer *bufs, size_t count) {
+        for (size_t i = 0; i < count; i++)
+            recv(bufs[i].data, bufs[i].size);
+    }
     virtual ~stream_socket() {};
 };
 
@@ -79,3 +126,9 @@ class socket_eof_error : public socket_io_error {
 public:
   explicit socket_eof_error(const std::string &what_arg) : socket_io_error(what_arg) {}
 };
+
+// The operation has not completed by its deadline. Part of the data may have been transferred.
+class socket_timeout_error : public socket_io_error {
+public:
+  explicit socket_timeout_error(const std::string &what_arg) : socket_io_error(what_arg) {}
+};
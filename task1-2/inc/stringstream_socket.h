@@ -0,0 +1,35 @@
+#ifndef STRINGSTREAM_SOCKET_H_
+#define STRINGSTREAM_SOCKET_H_
+
+#include <sstream>
+#include "stream_socket.h"
+
+/*
+ * In-memory socket: everything sent is appended to a stringstream
+ * and can be received back. Used by tests and benchmarks.
+ */
+class stringstream_socket : public stream_socket {
+public:
+  void send(const void *buf, size_t size) override {
+    if (!data_.write(reinterpret_cast<const char*>(buf), size)) {
+      throw socket_io_error("Unable to write to stringstream_socket");
+    }
+  }
+  void recv(void *buf, size_t size) override {
+    if (!data_.read(reinterpret_cast<char*>(buf), size)) {
+      throw socket_eof_error("No more data in stringstream_socket");
+    }
+  }
+  const std::stringstream& data() const {
+    return data_;
+  }
+  void clear() {
+    data_.str("");
+    data_.clear();
+  }
+
+private:
+  std::stringstream data_;
+};
+
+#endif  // STRINGSTREAM_SOCKET_H_
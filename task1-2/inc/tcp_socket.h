@@ -24,6 +24,32 @@ public:
   void send(const void *buf, size_t size) override;
   void recv(void *buf, size_t size) override;
 
+  // Performs a single recv() call, see stream_socket::recv_some.
+  size_t recv_some(void *buf, size_t size) override;
+  // Gather and scatter with sendmsg()/recvmsg(), a call per up to 64 buffers unless they are transferred partially.
+  void sendv(const const_buffer *bufs, size_t count) override;
+  void recvv(const mutable_buffer *bufs, size_t count) override;
+
+  /*
+   * Deadline variants of the calls above: they throw socket_timeout_error
+   * once the deadline passes. Transfers go on without blocking and wait
+   * with poll() only when the socket is not ready.
+   */
+  void send(const void *buf, size_t size, socket_deadline deadline);
+  void recv(void *buf, size_t size, socket_deadline deadline);
+  size_t recv_some(void *buf, size_t size, socket_deadline deadline);
+
+  /*
+   * Helpers for event-driven servers. In non-blocking mode send/recv above
+   * should not be used, use send_some/recv_some instead. They transfer as
+   * much data as possible without blocking and return the number of bytes
+   * transferred (0 if the operation would block).
+   * recv_some throws socket_eof_error if the socket was gracefully closed.
+   */
+  void set_nonblocking(bool nonblocking);
+  size_t send_some(const void *buf, size_t size);
+  SOCKET native_handle() const { return sock_; }
+
 private:
   tcp_connection_socket(const tcp_connection_socket &) = delete;
 
@@ -36,8 +62,17 @@ public:
   ~tcp_client_socket() override {};
 
   void connect() override;
+  // Throws socket_timeout_error if the connection is not established by the deadline.
+  void connect(socket_deadline deadline);
   void send(const void *buf, size_t size) override { sock_.send(buf, size); }
   void recv(void *buf, size_t size) override { sock_.recv(buf, size); }
+  size_t recv_some(void *buf, size_t size) override { return sock_.recv_some(buf, size); }
+  void sendv(const const_buffer *bufs, size_t count) override { sock_.sendv(bufs, count); }
+  void recvv(const mutable_buffer *bufs, size_t count) override { sock_.recvv(bufs, count); }
+
+  // For waiting on many connections at once, e.g. with poll().
+  SOCKET native_handle() const { return sock_.native_handle(); }
+  tcp_connection_socket& connection() { return sock_; }
 
 private:
   std::string host_;
@@ -47,12 +82,19 @@ private:
 
 class tcp_server_socket : public stream_server_socket {
 public:
-  tcp_server_socket(hostname host, tcp_port port);
+  /*
+   * With reuse_port, several sockets may listen on the same address at once
+   * (SO_REUSEPORT, Linux 3.9+ and BSDs): the kernel spreads incoming
+   * connections between them, so each can be served by its own thread.
+   */
+  tcp_server_socket(hostname host, tcp_port port, bool reuse_port = false);
   tcp_server_socket(tcp_server_socket &&other);
   tcp_server_socket& operator=(tcp_server_socket other);
   ~tcp_server_socket() override;
 
-  stream_socket* accept_one_client() override;
+  tcp_connection_socket* accept_one_client() override;
+  // Throws socket_timeout_error if no client connects by the deadline.
+  tcp_connection_socket* accept_one_client(socket_deadline deadline);
 
 private:
   tcp_server_socket(const tcp_server_socket &) = delete;
@@ -60,6 +102,26 @@ private:
   SOCKET sock_;
 };
 
+/*
+ * Gives every call on a connection its own deadline, `timeout` after the
+ * call starts, so that code written against stream_socket (e.g. on top of
+ * buffered_socket) does not wait for a stalled peer forever.
+ */
+class deadline_socket : public stream_socket {
+public:
+  deadline_socket(tcp_connection_socket &sock, std::chrono::milliseconds timeout) : sock_(sock), timeout_(timeout) {}
+
+  void send(const void *buf, size_t size) override { sock_.send(buf, size, deadline()); }
+  void recv(void *buf, size_t size) override { sock_.recv(buf, size, deadline()); }
+  size_t recv_some(void *buf, size_t size) override { return sock_.recv_some(buf, size, deadline()); }
+
+private:
+  socket_deadline deadline() const { return std::chrono::steady_clock::now() + timeout_; }
+
+  tcp_connection_socket &sock_;
+  std::chrono::milliseconds timeout_;
+};
+
 typedef const char* hostname;
 
 #endif  // TCP_SOCKET_H_
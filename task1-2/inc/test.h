@@ -2,5 +2,17 @@
 #define TEST_H_
 
 void test_protocol();
+void test_account_store();
+void test_buffered_socket();
+void test_log();
+void test_write_ahead_log();
+void test_snapshot();
+void test_histogram();
+void test_metrics();
+void test_thread_pool();
+void test_transfer_sequencer();
+void test_replication();
+void test_client_handler();
+void test_servers();
 
 #endif  // TEST_H_
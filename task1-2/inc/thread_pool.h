@@ -0,0 +1,66 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads executing submitted tasks.
+ * Every worker has its own deque of tasks. Tasks submitted by a worker go
+ * to the back of its own deque and are taken from there (the freshest,
+ * cache-warm ones first), other tasks are spread round-robin. An idle
+ * worker steals from the front of the other deques, so a burst submitted
+ * to one worker is soon shared by all of them.
+ * Tasks may run in any order and in parallel; a task should not throw.
+ */
+class thread_pool {
+public:
+  typedef std::function<void()> task;
+
+  explicit thread_pool(std::size_t threads);
+  ~thread_pool();  // Calls shutdown().
+
+  // Thread-safe. Throws std::logic_error after shutdown() has started.
+  void submit(task t);
+  /*
+   * Stops accepting tasks, waits until all submitted tasks are finished
+   * (including ones they submit meanwhile) and joins the workers.
+   * Should not be called from a task.
+   */
+  void shutdown();
+
+  std::size_t size() const { return workers_.size(); }
+
+private:
+  thread_pool(const thread_pool &) = delete;
+  thread_pool& operator=(const thread_pool &) = delete;
+
+  struct worker {
+    std::mutex mutex;
+    std::deque<task> tasks;
+    std::thread thread;
+  };
+
+  void run(std::size_t index);
+  bool take(std::size_t index, task &t);
+
+  std::vector<std::unique_ptr<worker>> workers_;
+  std::atomic<std::size_t> next_;
+  std::atomic<std::size_t> queued_;  // Tasks in the deques, counted before they are pushed.
+  std::atomic<std::size_t> active_;  // Tasks taken from the deques but not finished yet.
+  std::atomic<std::size_t> sleepers_;
+  std::atomic<bool> stopping_;
+
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+  std::mutex shutdown_mutex_;
+};
+
+#endif  // THREAD_POOL_H_
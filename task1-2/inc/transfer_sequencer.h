@@ -0,0 +1,98 @@
+#ifndef TRANSFER_SEQUENCER_H_
+#define TRANSFER_SEQUENCER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "account_store.h"
+
+/*
+ * Applies transfers to an account_store from a single thread, in the order
+ * they were published (disruptor-style), so that threads paying into the
+ * same hot accounts never fight for their locks. This also puts all
+ * transfers into a total order, which the journal sees as is.
+ *
+ * Callers claim a slot of a ring with one atomic increment, fill it and
+ * mark it published; the sequencer thread applies published slots in
+ * sequence order and completes the caller's ticket, which the caller
+ * waits for. Waiting first yields a few times and then sleeps, so idle
+ * threads do not burn a core.
+ *
+ * Being the only writer, the sequencer takes store locks which no other
+ * writer contends for; they still order it with snapshots.
+ * Batches should go through the sequencer as well then.
+ */
+class transfer_sequencer {
+public:
+  static const std::size_t DEFAULT_CAPACITY = 4096;
+
+  // Capacity is rounded up to a power of two.
+  explicit transfer_sequencer(account_store &store, std::size_t capacity = DEFAULT_CAPACITY);
+  // Applies everything published and stops the thread. No calls should be in progress.
+  ~transfer_sequencer();
+
+  /*
+   * Thread-safe, block until the transfer is applied.
+   * Throw unknown_client_error like the same methods of account_store.
+   */
+  void transfer(t_client_id from, t_client_id to, t_balance amount);
+  void transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items);
+
+  // Number of operations applied so far, i.e. the position in the total order.
+  std::uint64_t applied() const { return applied_.value.load(std::memory_order_acquire); }
+
+private:
+  transfer_sequencer(const transfer_sequencer &) = delete;
+  transfer_sequencer& operator=(const transfer_sequencer &) = delete;
+
+  // Lives on the caller's stack until the sequencer completes it.
+  struct ticket {
+    std::atomic<bool> done{false};
+    std::exception_ptr error;
+  };
+
+  struct slot {
+    std::atomic<std::uint64_t> published{0};  // Sequence number + 1 once the slot is filled.
+    t_client_id from;
+    t_client_id to;
+    t_balance amount;
+    const std::vector<BatchTransferRequest::Item> *items;  // Non-null for batches.
+    ticket *result;
+  };
+
+  struct padded_counter {
+    std::atomic<std::uint64_t> value{0};
+    // Keeps counters written by different threads on different cache lines regardless of alignment.
+    char padding[2 * CACHE_LINE_SIZE - sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  void publish(t_client_id from, t_client_id to, t_balance amount, const std::vector<BatchTransferRequest::Item> *items);
+  void run();
+  void apply(slot &s);
+  // Returns whether slot `sequence` is published, waiting for it if the sequencer is not stopping.
+  bool wait_published(std::uint64_t sequence);
+
+  account_store &store_;
+  std::size_t mask_;
+  std::unique_ptr<slot[]> slots_;
+
+  padded_counter next_;      // The next sequence number to claim.
+  padded_counter applied_;   // All sequence numbers below have been applied.
+  std::atomic<bool> stopping_;
+
+  // Sleeping callers and the sleeping sequencer thread are woken through these.
+  std::mutex sleep_mutex_;
+  std::condition_variable done_cv_;
+  std::condition_variable published_cv_;
+  std::atomic<std::size_t> sleeping_callers_;
+  std::atomic<bool> sequencer_sleeping_;
+
+  std::thread thread_;
+};
+
+#endif  // TRANSFER_SEQUENCER_H_
@@ -0,0 +1,111 @@
+#ifndef URING_H_
+#define URING_H_
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls, so that
+ * liburing is not needed. Entries are queued with get_sqe() and handed
+ * to the kernel all at once by submit_and_wait(): a single system call
+ * per round, however many operations and connections it covers.
+ * Not thread-safe, a ring belongs to a single thread.
+ * Errors are reported with std::runtime_error.
+ */
+class uring {
+public:
+  explicit uring(unsigned entries);
+  ~uring();
+
+  // Returns a zeroed entry to fill. Submits the queue first if it is full.
+  io_uring_sqe* get_sqe();
+  // Number of entries which can be queued before the queue is submitted.
+  unsigned space() const { return sq_entries_ - sq_queued_; }
+  // Submits all queued entries and waits until `wait_nr` completions are available.
+  void submit_and_wait(unsigned wait_nr);
+
+  // Calls f(const io_uring_cqe&) for every available completion, returns their number.
+  template<typename F>
+  unsigned drain(F f) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned n = 0;
+    for (; head != tail; head++, n++) {
+      f(cqes_[head & *cq_mask_]);
+      // Released one by one, as f may submit and the kernel needs room for new completions.
+      __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    }
+    return n;
+  }
+
+  int fd() const { return fd_; }
+
+  /*
+   * Whether the kernel supports everything uring_server needs: rings of
+   * provided buffers and multishot receive (Linux 6.0+). Probed once by
+   * actually receiving from a socket pair, as io_uring may also be
+   * disabled by sysctl or seccomp.
+   */
+  static bool supported();
+
+private:
+  uring(const uring &) = delete;
+  uring& operator=(const uring &) = delete;
+
+  int fd_;
+  void *ring_;
+  std::size_t ring_size_;
+  io_uring_sqe *sqes_;
+  std::size_t sqes_size_;
+
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  unsigned sq_entries_;
+  unsigned sq_queued_;  // Entries filled but not submitted yet.
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  io_uring_cqe *cqes_;
+};
+
+/*
+ * Buffers registered with a ring, which the kernel picks from for
+ * operations with IOSQE_BUFFER_SELECT in `group` (e.g. multishot receive),
+ * so memory is committed only to connections which actually have data.
+ * A picked buffer is identified by the completion flags and belongs to
+ * the caller until it is recycled.
+ */
+class uring_buffer_ring {
+public:
+  uring_buffer_ring(uring &ring, std::uint16_t group, unsigned count, std::size_t buffer_size);
+  ~uring_buffer_ring();
+
+  std::uint16_t group() const { return group_; }
+  std::size_t buffer_size() const { return buffer_size_; }
+  // The buffer picked for a completion, which should have IORING_CQE_F_BUFFER set.
+  static unsigned buffer_id(const io_uring_cqe &cqe) { return cqe.flags >> IORING_CQE_BUFFER_SHIFT; }
+  const char* buffer(unsigned id) const { return data_ + id * buffer_size_; }
+  // Gives the buffer back to the kernel.
+  void recycle(unsigned id);
+
+private:
+  uring_buffer_ring(const uring_buffer_ring &) = delete;
+  uring_buffer_ring& operator=(const uring_buffer_ring &) = delete;
+
+  uring &ring_;
+  std::uint16_t group_;
+  unsigned count_;
+  std::size_t buffer_size_;
+  io_uring_buf_ring *bufs_;
+  std::size_t bufs_size_;
+  char *data_;
+  std::uint16_t tail_;
+};
+
+#endif  // __linux__
+
+#endif  // URING_H_
@@ -0,0 +1,42 @@
+#ifndef URING_SERVER_H_
+#define URING_SERVER_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "epoll_server.h"
+#include "tcp_socket.h"
+
+/*
+ * Server core with the same contract as epoll_server, built on io_uring:
+ * every event loop thread owns a ring. Connections are read by multishot
+ * receives into a ring of registered buffers, so they are never re-armed
+ * and hold no read memory while idle. Responses of a round go out as
+ * chains of linked sends, and all operations of the round, for all
+ * connections of the loop, are submitted with a single system call.
+ * Available on Linux 6.0+ only, see supported().
+ */
+class uring_server {
+public:
+  uring_server(std::size_t threads, epoll_server::handler_factory factory,
+               epoll_server::flush_hook before_flush = epoll_server::flush_hook());
+  ~uring_server();  // Stops all event loops and closes all connections.
+
+  // Thread-safe.
+  void add_client(std::unique_ptr<tcp_connection_socket> client);
+
+  // Whether io_uring is usable in this process, otherwise the constructor throws.
+  static bool supported();
+
+private:
+  uring_server(const uring_server &) = delete;
+  uring_server& operator=(const uring_server &) = delete;
+
+  class event_loop;
+
+  epoll_server::handler_factory factory_;
+  std::vector<std::unique_ptr<event_loop>> loops_;
+  std::atomic<std::size_t> next_loop_;
+};
+
+#endif  // URING_SERVER_H_
@@ -0,0 +1,79 @@
+#ifndef WRITE_AHEAD_LOG_H_
+#define WRITE_AHEAD_LOG_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "account_store.h"
+
+/*
+ * Append-only write-ahead log of registrations and transfers with group commit.
+ * Appending only copies a record into the current in-memory batch.
+ * A background thread writes out and fdatasync()s whole batches: it starts
+ * a batch once something is appended and waits for batch_interval or until
+ * batch_size records are pending, whichever comes first, so operations
+ * of many clients share a single disk flush.
+ *
+ * Positions in the log are byte offsets from the beginning of the file.
+ * Every record carries its length and checksum, a partially written
+ * record at the end of the file (after a crash) is ignored by replay().
+ */
+class write_ahead_log : public account_journal {
+public:
+  static const std::size_t DEFAULT_BATCH_SIZE = 1024;
+
+  // Opens or creates the log for appending. Throws std::runtime_error on failure.
+  write_ahead_log(const std::string &path, std::chrono::microseconds batch_interval,
+                  std::size_t batch_size = DEFAULT_BATCH_SIZE);
+  // Writes out everything appended so far.
+  ~write_ahead_log();
+
+  /*
+   * Applies all complete records starting at the given position to the store
+   * and cuts off an incomplete tail. Should be called before anything is
+   * appended and before the log is set as the store's journal.
+   */
+  void replay(account_store &store, std::uint64_t from = 0);
+
+  void log_registration(t_client_id id) override;
+  void log_transfer(t_client_id from, t_client_id to, t_balance amount) override;
+  void log_transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) override;
+
+  // Position right after the last appended record.
+  std::uint64_t appended() const;
+  // Everything before this position is on disk.
+  std::uint64_t durable() const;
+  // Blocks until everything before the position is on disk. Throws std::runtime_error on I/O errors.
+  void wait_durable(std::uint64_t position);
+  // Blocks until everything appended before the call is on disk.
+  void sync() { wait_durable(appended()); }
+
+private:
+  write_ahead_log(const write_ahead_log &) = delete;
+  write_ahead_log& operator=(const write_ahead_log &) = delete;
+
+  void append(const char *record, std::size_t size);
+  void run();
+
+  std::string path_;
+  int fd_;
+  std::chrono::microseconds batch_interval_;
+  std::size_t batch_size_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;     // Something is appended or the log is closing.
+  std::condition_variable durable_cv_;  // durable_ has advanced or writing has failed.
+  std::string pending_;                 // Records not yet handed to the writer.
+  std::size_t pending_records_;
+  std::uint64_t appended_;
+  std::uint64_t durable_;
+  std::string error_;                   // Non-empty once writing has failed.
+  bool stopping_;
+  std::thread writer_;
+};
+
+#endif  // WRITE_AHEAD_LOG_H_
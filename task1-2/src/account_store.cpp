@@ -0,0 +1,247 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "account_store.h"
+#include "metrics.h"
+
+namespace {
+
+// Balances are read without locks, so they are accessed as relaxed atomics.
+t_balance load_balance(const t_balance &balance) {
+  #ifdef __GNUC__
+  return __atomic_load_n(&balance, __ATOMIC_RELAXED);
+  #else
+  return *static_cast<const volatile t_balance*>(&balance);
+  #endif
+}
+
+void add_to_balance(t_balance &balance, t_balance amount) {
+  #ifdef __GNUC__
+  __atomic_store_n(&balance, load_balance(balance) + amount, __ATOMIC_RELAXED);
+  #else
+  *static_cast<volatile t_balance*>(&balance) = load_balance(balance) + amount;
+  #endif
+}
+
+}  // namespace
+
+account_store::account_store(std::size_t stripes) : journal_(nullptr), stripes_count_(stripes), snapshot_epoch_(0), capture_(nullptr) {
+  if (stripes == 0) {
+    throw std::invalid_argument("account_store needs at least one lock stripe");
+  }
+  stripes_.reset(new stripe[stripes]);
+}
+
+void account_store::check_exists(t_client_id id) const {
+  if (!exists(id)) {
+    std::stringstream msg;
+    msg << "Unknown client: " << id;
+    throw unknown_client_error(msg.str());
+  }
+}
+
+std::unique_lock<std::mutex> account_store::lock_stripe(std::size_t index) const {
+  std::unique_lock<std::mutex> lock(stripes_[index].mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    lock.lock();
+    std::chrono::nanoseconds waited = std::chrono::steady_clock::now() - start;
+    metrics_record_lock_wait(waited.count());
+  }
+  return lock;
+}
+
+t_client_id account_store::register_new_client() {
+  t_client_id id = table_.push_back();
+  if (journal_) {
+    journal_->log_registration(id);
+  }
+  return id;
+}
+
+t_balance account_store::get_amount(t_client_id id) const {
+  check_exists(id);
+  const std::atomic<std::uint64_t> &sequence = stripes_[stripe_index(id)].sequence;
+  for (;;) {
+    std::uint64_t before = sequence.load(std::memory_order_acquire);
+    if (before % 2 == 0) {
+      t_balance amount = load_balance(table_[id]);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence.load(std::memory_order_relaxed) == before) {
+        return amount;
+      }
+    }
+    // A write takes nanoseconds, unless the writer has been preempted in the middle of it.
+    std::this_thread::yield();
+  }
+}
+
+void account_store::begin_write(std::size_t index) {
+  std::atomic<std::uint64_t> &sequence = stripes_[index].sequence;
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  // Balances are not modified before readers may see the odd number.
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void account_store::end_write(std::size_t index) {
+  std::atomic<std::uint64_t> &sequence = stripes_[index].sequence;
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void account_store::transfer(t_client_id from, t_client_id to, t_balance amount) {
+  check_exists(from);
+  check_exists(to);
+  std::size_t from_index = stripe_index(from);
+  std::size_t to_index = stripe_index(to);
+
+  std::unique_lock<std::mutex> first_lock = lock_stripe(std::min(from_index, to_index));
+  std::unique_lock<std::mutex> second_lock;
+  if (from_index != to_index) {
+    second_lock = lock_stripe(std::max(from_index, to_index));
+  }
+
+  // The snapshot pointer only changes with all locks held, the stripe lock orders the load.
+  if (snapshot_capture *capture = capture_.load(std::memory_order_relaxed)) {
+    preserve(capture, from);
+    preserve(capture, to);
+  }
+  begin_write(from_index);
+  if (from_index != to_index) {
+    begin_write(to_index);
+  }
+  add_to_balance(table_[from], -amount);
+  add_to_balance(table_[to], amount);
+  if (from_index != to_index) {
+    end_write(to_index);
+  }
+  end_write(from_index);
+  if (journal_) {
+    journal_->log_transfer(from, to, amount);
+  }
+}
+
+void account_store::transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) {
+  check_exists(from);
+  std::vector<std::size_t> indices(1, stripe_index(from));
+  for (const auto &item : items) {
+    check_exists(item.transfer_to);
+    indices.push_back(stripe_index(item.transfer_to));
+  }
+  std::sort(indices.begin(), indices.end());
+  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+  std::vector<std::unique_lock<std::mutex>> locks;
+  locks.reserve(indices.size());
+  for (std::size_t index : indices) {
+    locks.push_back(lock_stripe(index));
+  }
+
+  if (snapshot_capture *capture = capture_.load(std::memory_order_relaxed)) {
+    preserve(capture, from);
+    for (const auto &item : items) {
+      preserve(capture, item.transfer_to);
+    }
+  }
+  for (std::size_t index : indices) {
+    begin_write(index);
+  }
+  for (const auto &item : items) {
+    add_to_balance(table_[from], -item.amount);
+    add_to_balance(table_[item.transfer_to], item.amount);
+  }
+  for (std::size_t index : indices) {
+    end_write(index);
+  }
+  if (journal_) {
+    journal_->log_transfer_batch(from, items);
+  }
+}
+
+void account_store::lock_all() {
+  for (std::size_t i = 0; i < stripes_count_; i++) {
+    stripes_[i].mutex.lock();
+  }
+}
+
+void account_store::unlock_all() {
+  for (std::size_t i = stripes_count_; i-- > 0;) {
+    stripes_[i].mutex.unlock();
+  }
+}
+
+/*
+ * The epoch word of a page is 2 * epoch of the latest snapshot which has
+ * captured the page, plus one while the page is being captured.
+ */
+bool account_store::claim_page(t_client_id id, std::uint64_t epoch) {
+  std::atomic<std::uint64_t> &state = table_.page_epoch(id);
+  for (;;) {
+    std::uint64_t current = state.load(std::memory_order_acquire);
+    if (current == 2 * epoch) {
+      return false;
+    }
+    if (current == 2 * epoch + 1) {
+      std::this_thread::yield();
+    } else if (state.compare_exchange_weak(current, 2 * epoch + 1, std::memory_order_acquire)) {
+      return true;
+    }
+  }
+}
+
+void account_store::preserve(snapshot_capture *capture, t_client_id id) {
+  if (id >= capture->size || !claim_page(id, capture->epoch)) {
+    return;
+  }
+  t_client_id first = id & ~(account_table::PAGE_SIZE - 1);
+  std::size_t count = std::min(account_table::PAGE_SIZE, capture->size - first);
+  std::unique_ptr<t_balance[]> copy(new t_balance[count]);
+  memcpy(copy.get(), &table_[first], count * sizeof(t_balance));
+  capture->preimages[first / account_table::PAGE_SIZE] = std::move(copy);
+  table_.page_epoch(id).store(2 * capture->epoch, std::memory_order_release);
+}
+
+std::size_t account_store::write_snapshot(const std::function<void()> &at_cut, const snapshot_writer &out) {
+  std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex_);
+  snapshot_capture capture;
+  capture.epoch = ++snapshot_epoch_;
+
+  lock_all();
+  try {
+    at_cut();
+  } catch (...) {
+    unlock_all();
+    throw;
+  }
+  // Read after at_cut(), so that accounts registered before it are included.
+  capture.size = table_.size();
+  capture.preimages.resize((capture.size + account_table::PAGE_SIZE - 1) / account_table::PAGE_SIZE);
+  capture_.store(&capture, std::memory_order_relaxed);
+  unlock_all();
+
+  struct finish_capture {
+    ~finish_capture() {
+      store->lock_all();
+      store->capture_.store(nullptr, std::memory_order_relaxed);
+      store->unlock_all();
+    }
+    account_store *store;
+  } finish = {this};
+
+  t_balance page[account_table::PAGE_SIZE];
+  for (t_client_id first = 0; first < capture.size; first += account_table::PAGE_SIZE) {
+    std::size_t count = std::min(account_table::PAGE_SIZE, capture.size - first);
+    if (claim_page(first, capture.epoch)) {
+      memcpy(page, &table_[first], count * sizeof(t_balance));
+      table_.page_epoch(first).store(2 * capture.epoch, std::memory_order_release);
+      out(page, count);
+    } else {
+      std::unique_ptr<t_balance[]> &preimage = capture.preimages[first / account_table::PAGE_SIZE];
+      out(preimage.get(), count);
+      preimage.reset();
+    }
+  }
+  return capture.size;
+}
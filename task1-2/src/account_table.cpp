@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdexcept>
+#include "account_table.h"
+
+const std::size_t account_table::PAGE_SIZE;
+
+account_table::account_table()
+    : chunks_(new std::atomic<t_balance*>[MAX_CHUNKS]),
+      raw_chunks_(new std::unique_ptr<char[]>[MAX_CHUNKS]),
+      page_epochs_(new std::unique_ptr<std::atomic<std::uint64_t>[]>[MAX_CHUNKS]),
+      size_(0) {
+  for (std::size_t i = 0; i < MAX_CHUNKS; i++) {
+    chunks_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+account_table::~account_table() {}
+
+void account_table::allocate_chunk(std::size_t chunk) {
+  raw_chunks_[chunk].reset(new char[CHUNK_SIZE * sizeof(t_balance) + CACHE_LINE_SIZE]());
+  uintptr_t raw = reinterpret_cast<uintptr_t>(raw_chunks_[chunk].get());
+  uintptr_t aligned = (raw + CACHE_LINE_SIZE - 1) & ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1);
+  page_epochs_[chunk].reset(new std::atomic<std::uint64_t>[CHUNK_SIZE / PAGE_SIZE]());
+  chunks_[chunk].store(reinterpret_cast<t_balance*>(aligned), std::memory_order_relaxed);
+}
+
+t_client_id account_table::push_back() {
+  std::lock_guard<std::mutex> lock(grow_mutex_);
+  std::size_t id = size_.load(std::memory_order_relaxed);
+  std::size_t chunk = id >> CHUNK_BITS;
+  if (chunk >= MAX_CHUNKS) {
+    throw std::length_error("Too many accounts");
+  }
+  if (!chunks_[chunk].load(std::memory_order_relaxed)) {
+    allocate_chunk(chunk);
+  }
+  // Publishes the chunk pointer together with the new size.
+  size_.store(id + 1, std::memory_order_release);
+  return id;
+}
+
+void account_table::adopt(t_balance *balances, std::size_t count, std::shared_ptr<void> owner) {
+  std::lock_guard<std::mutex> lock(grow_mutex_);
+  if (size_.load(std::memory_order_relaxed) != 0) {
+    throw std::logic_error("Only an empty account_table can adopt balances");
+  }
+  if (count > MAX_CHUNKS * CHUNK_SIZE) {
+    throw std::length_error("Too many accounts");
+  }
+  if (reinterpret_cast<uintptr_t>(balances) % CACHE_LINE_SIZE != 0) {
+    throw std::invalid_argument("Adopted balances should be cache-line aligned");
+  }
+
+  std::size_t full_chunks = count >> CHUNK_BITS;
+  for (std::size_t chunk = 0; chunk < full_chunks; chunk++) {
+    page_epochs_[chunk].reset(new std::atomic<std::uint64_t>[CHUNK_SIZE / PAGE_SIZE]());
+    chunks_[chunk].store(balances + (chunk << CHUNK_BITS), std::memory_order_relaxed);
+  }
+  if (std::size_t rest = count & (CHUNK_SIZE - 1)) {
+    // A partial chunk has to be extended by push_back(), so it is copied.
+    allocate_chunk(full_chunks);
+    memcpy(chunks_[full_chunks].load(std::memory_order_relaxed), balances + (full_chunks << CHUNK_BITS),
+           rest * sizeof(t_balance));
+  }
+  adopted_owner_ = std::move(owner);
+  size_.store(count, std::memory_order_release);
+}
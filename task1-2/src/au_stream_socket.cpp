@@ -0,0 +1,1307 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "au_stream_socket.h"
+#include "log.h"
+#include "ring_buffer.h"
+#include "socket_util.h"
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define poll WSAPoll
+typedef int socklen_t;
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+namespace au_stream_detail {
+
+typedef std::chrono::steady_clock clock;
+typedef clock::time_point time_point;
+typedef std::chrono::microseconds duration;
+
+const time_point NEVER = time_point::max();
+
+/*
+ * Packet layout, all integers are big-endian:
+ *   uint8 flags, uint8 number of SACK blocks, uint16 reserved, uint32 connection id,
+ *   uint64 sequence number of the first payload byte, uint64 cumulative acknowledgement,
+ *   uint32 receive window, uint32 timestamp, uint32 echoed timestamp,
+ *   SACK blocks as pairs of uint64 [start, end), payload.
+ * Sequence numbers are stream offsets starting from zero, FIN takes one
+ * number after the last byte. Only pure acknowledgements carry SACK blocks.
+ */
+enum packet_flags : std::uint8_t {
+  FLAG_SYN = 1,
+  FLAG_ACK = 2,
+  FLAG_FIN = 4,
+  FLAG_RST = 8,
+  FLAG_PROBE = 16,  // Asks for an immediate acknowledgement.
+};
+
+const std::size_t HEADER_SIZE = 36;
+const std::size_t MSS = 1400;  // Keeps packets within a 1500-byte MTU.
+const std::size_t MAX_SACK_BLOCKS = 32;
+const std::size_t RECV_PACKET_BUFFER = 65536;
+
+// Upper limits, the buffers are allocated as data comes, see ring_buffer.
+const std::size_t SEND_BUFFER_SIZE = 8 << 20;
+const std::size_t RECV_BUFFER_SIZE = 8 << 20;
+const int UDP_BUFFER_SIZE = 4 << 20;
+
+const std::uint64_t INITIAL_CWND = 10 * MSS;
+const std::uint64_t MIN_CWND = 16 * MSS;
+const double STARTUP_GAIN = 2.89;
+const double CWND_GAIN = 2;
+const int BW_FILTER_ROUNDS = 10;
+
+const duration INITIAL_RTO = std::chrono::seconds(1);
+const duration MIN_RTO = std::chrono::milliseconds(200);
+const duration MAX_RTO = std::chrono::seconds(10);
+const duration MIN_RTT_WINDOW = std::chrono::seconds(10);
+const duration DELAYED_ACK = std::chrono::milliseconds(10);
+const duration MAX_TICK = std::chrono::milliseconds(20);
+const duration LINGER = std::chrono::seconds(10);
+const int MAX_RETRIES = 12;
+const int MAX_SYN_RETRIES = 8;
+
+void put(char *&out, std::uint64_t value, std::size_t bytes) {
+  for (std::size_t i = bytes; i-- > 0;) {
+    *out++ = static_cast<char>(value >> (8 * i));
+  }
+}
+
+std::uint64_t get(const char *&in, std::size_t bytes) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < bytes; i++) {
+    value = (value << 8) | static_cast<unsigned char>(*in++);
+  }
+  return value;
+}
+
+struct packet_header {
+  std::uint8_t flags;
+  std::uint32_t conn_id;
+  std::uint64_t seq;
+  std::uint64_t ack;
+  std::uint32_t window;
+  std::uint32_t timestamp;
+  std::uint32_t timestamp_echo;
+};
+
+struct sack_block {
+  std::uint64_t start;
+  std::uint64_t end;
+};
+
+double seconds(duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+std::mutex impairment_mutex;
+au_stream_impairment current_impairment = {0, std::chrono::milliseconds(0), std::chrono::milliseconds(0)};
+
+class endpoint;
+
+class connection {
+public:
+  enum state_t { SYN_SENT, SYN_RECEIVED, ESTABLISHED, CLOSED };
+
+  connection(endpoint &ep, const sockaddr_in &peer, std::uint32_t id, state_t state);
+
+  // Everything below is called with the endpoint mutex held.
+  // Sends SYN, for connections initiated locally.
+  void open(time_point now);
+  void on_packet(const packet_header &h, const sack_block *sacks, std::size_t sack_count,
+                 const char *payload, std::size_t size, time_point now);
+  void on_timer(time_point now);
+  time_point next_timer() const;
+
+  // Both return the number of bytes transferred, possibly zero.
+  std::size_t app_send(const char *buf, std::size_t size, time_point now);
+  std::size_t app_recv(char *buf, std::size_t size, time_point now);
+  void app_close(time_point now);
+  // Sends RST unless the connection has been closed gracefully.
+  void abort(time_point now);
+
+  bool established() const { return state_ == ESTABLISHED; }
+  bool failed() const { return state_ == CLOSED; }
+  bool eof() const { return eof_ && recv_buf_.empty(); }
+  bool close_finished() const;
+  const std::string& error() const { return error_; }
+  const sockaddr_in& peer() const { return peer_; }
+  std::uint32_t id() const { return id_; }
+
+private:
+  // Segments leave the map once acknowledged either cumulatively or selectively.
+  struct segment;
+  typedef std::map<std::uint64_t, segment> segment_map;
+
+  struct segment {
+    std::uint32_t size;  // Payload size, plus one for FIN.
+    bool fin;
+    bool lost;  // Waits for retransmission in lost_, otherwise in flight.
+    std::list<std::uint64_t>::iterator in_flight;  // Position in in_flight_ unless lost.
+    int transmissions;
+    time_point sent_time;
+    // Delivery rate sampling state at the moment of sending.
+    std::uint64_t delivered;
+    time_point delivered_time;
+    bool app_limited;
+  };
+
+  void fail(const std::string &error);
+  void send_packet(std::uint8_t flags, std::uint64_t seq, const char *payload, std::size_t size,
+                   const std::vector<sack_block> &sacks, time_point now);
+  void send_syn(time_point now);
+  void send_ack(time_point now, bool probe = false);
+  void send_segment(segment_map::iterator it, time_point now);
+  void mark_lost(segment_map::iterator it);
+  void forget(segment_map::iterator it);
+  void transmit(time_point now);
+  void process_ack(const packet_header &h, const sack_block *sacks, std::size_t sack_count, time_point now);
+  void process_data(const packet_header &h, const char *payload, std::size_t size, time_point now);
+  void store_out_of_order(std::uint64_t seq, const char *payload, std::size_t size);
+  void on_delivered(const segment &seg, time_point now, segment &latest);
+  void on_rtt_sample(duration rtt, time_point now);
+  void update_model(std::uint64_t newly_delivered, const segment *latest, time_point now);
+  void detect_losses();
+  duration probe_timeout() const;
+  void send_tail_probe(time_point now);
+  double max_bw() const;
+  std::uint32_t timestamp(time_point now) const;
+  std::uint32_t advertised_window() const;
+
+  endpoint &ep_;
+  sockaddr_in peer_;
+  std::uint32_t id_;
+  state_t state_;
+  std::string error_;
+  int retries_;
+
+  // Sender. send_buf_ holds the bytes starting from snd_una_.
+  ring_buffer send_buf_;
+  std::uint64_t snd_una_;
+  std::uint64_t snd_nxt_;
+  bool fin_queued_;
+  bool fin_sent_;
+  bool fin_acked_;
+  std::uint64_t fin_seq_;
+  segment_map segments_;                  // Sent and not acknowledged.
+  std::list<std::uint64_t> in_flight_;    // Segments in flight in the order of sending.
+  std::set<std::uint64_t> lost_;          // Segments to retransmit.
+  std::uint64_t pipe_;                    // Bytes in flight.
+  std::uint64_t peer_window_;
+  time_point rto_deadline_;
+  time_point tail_probe_deadline_;  // Retransmits the last segment if no acknowledgements come.
+  int tail_probes_;
+  time_point probe_deadline_;       // Asks for the window when the peer's buffer is full.
+
+  // RTT estimation.
+  bool have_rtt_;
+  duration srtt_;
+  duration rttvar_;
+  duration rto_;
+  duration min_rtt_;
+  time_point min_rtt_stamp_;
+
+  // Delivery rate model and loss detection.
+  std::uint64_t cwnd_;
+  std::uint64_t delivered_;
+  time_point delivered_time_;
+  std::uint64_t round_count_;
+  std::uint64_t next_round_delivered_;
+  double bw_rounds_[BW_FILTER_ROUNDS];
+  bool filled_pipe_;
+  double full_bw_;
+  int full_bw_count_;
+  time_point rack_time_;  // Latest send time of a delivered segment.
+
+  // Receiver. recv_buf_ holds in-order bytes not yet read by the application.
+  ring_buffer recv_buf_;
+  std::uint64_t rcv_nxt_;
+  std::map<std::uint64_t, std::string> out_of_order_;  // Disjoint, non-adjacent ranges.
+  std::deque<std::uint64_t> recent_;  // Latest out-of-order segments, reported first.
+  bool fin_received_;
+  std::uint64_t peer_fin_seq_;
+  bool eof_;
+  std::uint32_t ts_recent_;
+  int unacked_segments_;
+  time_point ack_deadline_;
+  std::uint64_t last_advertised_window_;
+};
+
+class endpoint {
+public:
+  endpoint(const sockaddr_in &local, bool listening);
+  ~endpoint();
+
+  std::mutex mutex;
+  // Notified whenever connections change state, wakes up application threads.
+  std::condition_variable changed;
+
+  // The methods below are called with the mutex held.
+  std::shared_ptr<connection> open(const sockaddr_in &peer, time_point now);
+  std::shared_ptr<connection> pop_accepted();
+  void stop_listening(time_point now);
+  void remove(const std::shared_ptr<connection> &conn);
+  void send_packet(const sockaddr_in &to, const char *data, std::size_t size, time_point now);
+  std::uint32_t timestamp(time_point now) const;
+
+private:
+  typedef std::pair<std::uint64_t, std::uint32_t> key;  // Address and port, connection id.
+
+  struct delayed_packet {
+    sockaddr_in to;
+    std::string data;
+  };
+
+  static key make_key(const sockaddr_in &addr, std::uint32_t id) {
+    return key((static_cast<std::uint64_t>(ntohl(addr.sin_addr.s_addr)) << 16) | ntohs(addr.sin_port), id);
+  }
+
+  void run();
+  void dispatch(const sockaddr_in &from, const char *data, std::size_t size, time_point now);
+  void send_now(const sockaddr_in &to, const char *data, std::size_t size);
+  void send_rst(const sockaddr_in &to, std::uint32_t id, time_point now);
+  bool accept_queue_has_room();
+
+  SOCKET sock_;
+  bool listening_;
+  time_point epoch_;
+  std::mt19937 rng_;
+  au_stream_impairment impairment_;
+  std::multimap<time_point, delayed_packet> delayed_;
+  std::map<key, std::shared_ptr<connection>> connections_;
+  std::deque<std::shared_ptr<connection>> accept_queue_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+};
+
+connection::connection(endpoint &ep, const sockaddr_in &peer, std::uint32_t id, state_t state)
+    : ep_(ep), peer_(peer), id_(id), state_(state), retries_(0),
+      send_buf_(SEND_BUFFER_SIZE, 0), snd_una_(0), snd_nxt_(0),
+      fin_queued_(false), fin_sent_(false), fin_acked_(false), fin_seq_(0),
+      pipe_(0), peer_window_(MSS), rto_deadline_(NEVER), tail_probe_deadline_(NEVER), tail_probes_(0),
+      probe_deadline_(NEVER),
+      have_rtt_(false), srtt_(0), rttvar_(0), rto_(INITIAL_RTO), min_rtt_(0),
+      cwnd_(INITIAL_CWND), delivered_(0), round_count_(0), next_round_delivered_(0),
+      filled_pipe_(false), full_bw_(0), full_bw_count_(0),
+      recv_buf_(RECV_BUFFER_SIZE, 0), rcv_nxt_(0), fin_received_(false), peer_fin_seq_(0), eof_(false),
+      ts_recent_(0), unacked_segments_(0), ack_deadline_(NEVER), last_advertised_window_(0) {
+  std::fill(bw_rounds_, bw_rounds_ + BW_FILTER_ROUNDS, 0.0);
+}
+
+std::uint32_t connection::timestamp(time_point now) const {
+  return ep_.timestamp(now);
+}
+
+std::uint32_t connection::advertised_window() const {
+  return static_cast<std::uint32_t>(std::min<std::uint64_t>(recv_buf_.free_space(), UINT32_MAX));
+}
+
+void connection::fail(const std::string &error) {
+  if (state_ == CLOSED) {
+    return;
+  }
+  LOG(log_level::debug, "au_stream connection %08x failed: %s", id_, error.c_str());
+  state_ = CLOSED;
+  error_ = error;
+  segments_.clear();
+  in_flight_.clear();
+  lost_.clear();
+  pipe_ = 0;
+  rto_deadline_ = tail_probe_deadline_ = probe_deadline_ = ack_deadline_ = NEVER;
+}
+
+void connection::open(time_point now) {
+  send_syn(now);
+  rto_deadline_ = now + rto_;
+}
+
+void connection::send_packet(std::uint8_t flags, std::uint64_t seq, const char *payload, std::size_t size,
+                             const std::vector<sack_block> &sacks, time_point now) {
+  char packet[HEADER_SIZE + MAX_SACK_BLOCKS * 16 + MSS];
+  assert(sacks.size() <= MAX_SACK_BLOCKS && size <= MSS);
+  char *out = packet;
+  put(out, flags, 1);
+  put(out, sacks.size(), 1);
+  put(out, 0, 2);
+  put(out, id_, 4);
+  put(out, seq, 8);
+  put(out, rcv_nxt_, 8);
+  std::uint32_t window = advertised_window();
+  put(out, window, 4);
+  put(out, timestamp(now), 4);
+  put(out, ts_recent_, 4);
+  for (const auto &block : sacks) {
+    put(out, block.start, 8);
+    put(out, block.end, 8);
+  }
+  if (size > 0) {
+    memcpy(out, payload, size);
+    out += size;
+  }
+  ep_.send_packet(peer_, packet, out - packet, now);
+
+  if (flags & FLAG_ACK) {
+    last_advertised_window_ = window;
+    unacked_segments_ = 0;
+    ack_deadline_ = NEVER;
+  }
+}
+
+void connection::send_syn(time_point now) {
+  std::uint8_t flags = state_ == SYN_SENT ? FLAG_SYN : (FLAG_SYN | FLAG_ACK);
+  send_packet(flags, 0, nullptr, 0, std::vector<sack_block>(), now);
+}
+
+/*
+ * There may be more out-of-order ranges than fit into a packet. Ranges
+ * of the latest segments go first so that every range is reported several
+ * times, the rest of space is taken by the ranges closest to rcv_nxt_.
+ */
+void connection::send_ack(time_point now, bool probe) {
+  std::vector<sack_block> sacks;
+  auto add = [&](std::uint64_t start, std::uint64_t end) {
+    for (const auto &block : sacks) {
+      if (block.start == start) {
+        return;
+      }
+    }
+    sacks.push_back({start, end});
+  };
+  for (std::size_t i = recent_.size(); i-- > 0 && sacks.size() < MAX_SACK_BLOCKS;) {
+    auto it = out_of_order_.upper_bound(recent_[i]);
+    if (it != out_of_order_.begin()) {
+      --it;
+      if (it->first + it->second.size() > recent_[i]) {
+        add(it->first, it->first + it->second.size());
+      }
+    }
+  }
+  for (auto it = out_of_order_.begin(); it != out_of_order_.end() && sacks.size() < MAX_SACK_BLOCKS; ++it) {
+    add(it->first, it->first + it->second.size());
+  }
+  send_packet(FLAG_ACK | (probe ? FLAG_PROBE : 0), snd_nxt_, nullptr, 0, sacks, now);
+}
+
+// Sends a new segment, retransmits a lost one or resends one in flight.
+void connection::send_segment(segment_map::iterator it, time_point now) {
+  std::uint64_t seq = it->first;
+  segment &seg = it->second;
+  char payload[MSS];
+  std::size_t size = seg.size - (seg.fin ? 1 : 0);
+  std::size_t copied = send_buf_.peek(seq - snd_una_, payload, size);
+  assert(copied == size);
+  (void)copied;
+
+  if (seg.transmissions > 0) {
+    if (seg.lost) {
+      lost_.erase(seq);
+    } else {
+      in_flight_.erase(seg.in_flight);
+      pipe_ -= seg.size;
+    }
+  }
+  seg.transmissions++;
+  seg.sent_time = now;
+  seg.delivered = delivered_;
+  seg.delivered_time = delivered_time_;
+  seg.lost = false;
+  seg.in_flight = in_flight_.insert(in_flight_.end(), seq);
+  pipe_ += seg.size;
+  send_packet(FLAG_ACK | (seg.fin ? FLAG_FIN : 0), seq, payload, size, std::vector<sack_block>(), now);
+}
+
+void connection::mark_lost(segment_map::iterator it) {
+  segment &seg = it->second;
+  assert(!seg.lost);
+  in_flight_.erase(seg.in_flight);
+  pipe_ -= seg.size;
+  seg.lost = true;
+  lost_.insert(it->first);
+}
+
+void connection::forget(segment_map::iterator it) {
+  segment &seg = it->second;
+  if (seg.lost) {
+    lost_.erase(it->first);
+  } else {
+    in_flight_.erase(seg.in_flight);
+    pipe_ -= seg.size;
+  }
+  segments_.erase(it);
+}
+
+void connection::transmit(time_point now) {
+  if (state_ != ESTABLISHED) {
+    return;
+  }
+  if (delivered_time_ == time_point()) {
+    delivered_time_ = now;
+  }
+  // Retransmissions go first.
+  while (!lost_.empty() && pipe_ < cwnd_) {
+    send_segment(segments_.find(*lost_.begin()), now);
+  }
+
+  std::uint64_t window_end = snd_una_ + peer_window_;
+  bool window_limited = false;
+  while (pipe_ < cwnd_) {
+    std::uint64_t buffered_end = snd_una_ + send_buf_.size();
+    segment seg = segment();
+    if (snd_nxt_ < buffered_end) {
+      std::uint64_t size = std::min<std::uint64_t>(MSS, buffered_end - snd_nxt_);
+      if (snd_nxt_ + size > window_end) {
+        window_limited = true;
+        break;
+      }
+      seg.size = size;
+    } else if (fin_queued_ && !fin_sent_) {
+      seg.size = 1;
+      seg.fin = true;
+      fin_sent_ = true;
+    } else {
+      break;
+    }
+    // Delivery rate samples are limited by the application once the sender runs out of data.
+    seg.app_limited = snd_nxt_ + seg.size >= buffered_end && pipe_ + seg.size < cwnd_;
+    auto it = segments_.insert(std::make_pair(snd_nxt_, seg)).first;
+    snd_nxt_ += seg.size;
+    send_segment(it, now);
+  }
+
+  if (!segments_.empty() && rto_deadline_ == NEVER) {
+    rto_deadline_ = now + rto_;
+  }
+  if (!segments_.empty() && tail_probe_deadline_ == NEVER) {
+    tail_probe_deadline_ = now + probe_timeout();
+  }
+  if (window_limited && segments_.empty() && probe_deadline_ == NEVER) {
+    probe_deadline_ = now + rto_;
+  }
+}
+
+void connection::on_packet(const packet_header &h, const sack_block *sacks, std::size_t sack_count,
+                           const char *payload, std::size_t size, time_point now) {
+  if (h.flags & FLAG_RST) {
+    fail(state_ == SYN_SENT ? "Connection refused" : "Connection reset by peer");
+    return;
+  }
+  if (state_ == CLOSED) {
+    return;
+  }
+  if (state_ == SYN_SENT) {
+    if ((h.flags & (FLAG_SYN | FLAG_ACK)) == (FLAG_SYN | FLAG_ACK)) {
+      state_ = ESTABLISHED;
+      retries_ = 0;
+      rto_deadline_ = NEVER;
+      peer_window_ = h.window;
+      ts_recent_ = h.timestamp;
+      if (h.timestamp_echo) {
+        on_rtt_sample(std::chrono::microseconds(timestamp(now) - h.timestamp_echo), now);
+      }
+      send_ack(now);
+      transmit(now);
+    }
+    return;
+  }
+  if (h.flags & FLAG_SYN) {
+    // Either our SYN-ACK or our acknowledgement of the peer's SYN-ACK was lost.
+    if (state_ == SYN_RECEIVED) {
+      ts_recent_ = h.timestamp;
+      peer_window_ = h.window;
+      send_syn(now);
+      if (rto_deadline_ == NEVER) {
+        rto_deadline_ = now + rto_;
+      }
+    } else if (h.flags & FLAG_ACK) {
+      send_ack(now);
+    }
+    return;
+  }
+  if (!(h.flags & FLAG_ACK)) {
+    return;
+  }
+  if (state_ == SYN_RECEIVED) {
+    state_ = ESTABLISHED;
+    retries_ = 0;
+    rto_deadline_ = NEVER;
+    if (h.timestamp_echo) {
+      on_rtt_sample(std::chrono::microseconds(timestamp(now) - h.timestamp_echo), now);
+    }
+  }
+
+  ts_recent_ = h.timestamp;
+  process_ack(h, sacks, sack_count, now);
+  if (state_ == CLOSED) {
+    return;
+  }
+  if (size > 0 || (h.flags & FLAG_FIN)) {
+    process_data(h, payload, size, now);
+  } else if (h.flags & FLAG_PROBE) {
+    send_ack(now);
+  }
+  transmit(now);
+}
+
+// Remembers in latest the delivered segment which was sent last.
+void connection::on_delivered(const segment &seg, time_point now, segment &latest) {
+  delivered_ += seg.size;
+  delivered_time_ = now;
+  // A retransmitted segment acknowledged within an RTT was most likely delivered by an earlier transmission.
+  bool ambiguous = seg.transmissions > 1 && have_rtt_ && now - seg.sent_time < min_rtt_;
+  if (!ambiguous) {
+    rack_time_ = std::max(rack_time_, seg.sent_time);
+    if (latest.transmissions == 0 || seg.sent_time > latest.sent_time) {
+      latest = seg;
+    }
+  }
+}
+
+void connection::process_ack(const packet_header &h, const sack_block *sacks, std::size_t sack_count, time_point now) {
+  if (h.ack > snd_nxt_ || h.ack < snd_una_) {
+    return;  // Acknowledges something never sent, or is reordered behind newer acknowledgements.
+  }
+  peer_window_ = h.window;
+  std::uint64_t newly_delivered = 0;
+  segment latest = segment();
+
+  for (std::size_t i = 0; i < sack_count; i++) {
+    auto it = segments_.lower_bound(sacks[i].start);
+    while (it != segments_.end() && it->first + it->second.size <= sacks[i].end) {
+      newly_delivered += it->second.size;
+      on_delivered(it->second, now, latest);
+      forget(it++);
+    }
+  }
+
+  if (h.ack > snd_una_) {
+    while (!segments_.empty() && segments_.begin()->first + segments_.begin()->second.size <= h.ack) {
+      newly_delivered += segments_.begin()->second.size;
+      on_delivered(segments_.begin()->second, now, latest);
+      forget(segments_.begin());
+    }
+    std::uint64_t data_acked = std::min<std::uint64_t>(h.ack, snd_una_ + send_buf_.size()) - snd_una_;
+    send_buf_.consume(data_acked);
+    if (fin_sent_ && h.ack > fin_seq_) {
+      fin_acked_ = true;
+    }
+    snd_una_ = h.ack;
+    probe_deadline_ = NEVER;
+  }
+
+  if (newly_delivered == 0) {
+    return;
+  }
+  retries_ = 0;
+  if (h.timestamp_echo) {
+    on_rtt_sample(std::chrono::microseconds(timestamp(now) - h.timestamp_echo), now);
+  }
+  update_model(newly_delivered, latest.transmissions > 0 ? &latest : nullptr, now);
+  detect_losses();
+  rto_deadline_ = segments_.empty() ? NEVER : now + rto_;
+  tail_probes_ = 0;
+  tail_probe_deadline_ = segments_.empty() ? NEVER : now + probe_timeout();
+}
+
+duration connection::probe_timeout() const {
+  if (!have_rtt_) {
+    return rto_;
+  }
+  return std::max(srtt_ * 3 / 2, srtt_ + 2 * rttvar_) + std::chrono::milliseconds(1);
+}
+
+/*
+ * When the last segments in flight or their acknowledgements are lost,
+ * nothing triggers loss detection until the retransmission timeout.
+ * A tail probe retransmits earlier, without resetting the window:
+ * segments which should have been acknowledged by now are considered lost,
+ * or the last segment is resent to make the receiver report what is missing.
+ */
+void connection::send_tail_probe(time_point now) {
+  if (!lost_.empty()) {
+    return;  // Waits for the window.
+  }
+  duration timeout = probe_timeout();
+  while (!in_flight_.empty()) {
+    auto it = segments_.find(in_flight_.front());
+    if (it->second.sent_time + timeout > now) {
+      break;
+    }
+    mark_lost(it);
+  }
+  if (!lost_.empty()) {
+    transmit(now);
+  } else if (!segments_.empty()) {
+    send_segment(std::prev(segments_.end()), now);
+  }
+}
+
+void connection::on_rtt_sample(duration rtt, time_point now) {
+  if (rtt <= duration::zero() || rtt > MAX_RTO) {
+    return;  // Timestamp wrapped around or is garbage.
+  }
+  if (!have_rtt_) {
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+    have_rtt_ = true;
+  } else {
+    duration delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+    rttvar_ = (3 * rttvar_ + delta) / 4;
+    srtt_ = (7 * srtt_ + rtt) / 8;
+  }
+  rto_ = std::min(MAX_RTO, std::max(MIN_RTO, srtt_ + 4 * rttvar_));
+  if (min_rtt_ == duration::zero() || rtt <= min_rtt_ || now - min_rtt_stamp_ > MIN_RTT_WINDOW) {
+    min_rtt_ = rtt;
+    min_rtt_stamp_ = now;
+  }
+}
+
+double connection::max_bw() const {
+  return *std::max_element(bw_rounds_, bw_rounds_ + BW_FILTER_ROUNDS);
+}
+
+/*
+ * Keeps the windowed maximum of the delivery rate over the last rounds
+ * (a round is one RTT worth of deliveries), leaves the startup phase
+ * once the rate stops growing, and sets the congestion window to
+ * a multiple of the estimated bandwidth-delay product.
+ */
+void connection::update_model(std::uint64_t newly_delivered, const segment *latest, time_point now) {
+  if (latest) {
+    bool round_start = latest->delivered >= next_round_delivered_;
+    if (round_start) {
+      next_round_delivered_ = delivered_;
+      round_count_++;
+      bw_rounds_[round_count_ % BW_FILTER_ROUNDS] = 0;
+    }
+    duration interval = std::chrono::duration_cast<duration>(now - latest->delivered_time);
+    if (interval > duration::zero()) {
+      double rate = (delivered_ - latest->delivered) / seconds(interval);
+      if (!latest->app_limited || rate > max_bw()) {
+        double &slot = bw_rounds_[round_count_ % BW_FILTER_ROUNDS];
+        slot = std::max(slot, rate);
+      }
+    }
+    if (round_start && !filled_pipe_ && !latest->app_limited) {
+      if (max_bw() >= full_bw_ * 1.25) {
+        full_bw_ = max_bw();
+        full_bw_count_ = 0;
+      } else if (++full_bw_count_ >= 3) {
+        filled_pipe_ = true;
+      }
+    }
+  }
+
+  double bdp = have_rtt_ ? max_bw() * seconds(srtt_) : 0;
+  std::uint64_t target = static_cast<std::uint64_t>((filled_pipe_ ? CWND_GAIN : STARTUP_GAIN) * bdp);
+  if (!filled_pipe_ || cwnd_ + newly_delivered <= target) {
+    cwnd_ += newly_delivered;
+  } else {
+    cwnd_ = target;
+  }
+  cwnd_ = std::min<std::uint64_t>(std::max(cwnd_, MIN_CWND), SEND_BUFFER_SIZE + MSS);
+}
+
+// A segment is lost if one sent noticeably later has been delivered, the margin tolerates reordering.
+void connection::detect_losses() {
+  duration reordering_window = std::max<duration>(min_rtt_ / 4, std::chrono::milliseconds(1));
+  while (!in_flight_.empty()) {
+    auto it = segments_.find(in_flight_.front());
+    if (it->second.sent_time + reordering_window >= rack_time_) {
+      break;
+    }
+    mark_lost(it);
+  }
+}
+
+// Merges the segment into out_of_order_ so that every range is a single SACK block.
+void connection::store_out_of_order(std::uint64_t seq, const char *payload, std::size_t size) {
+  std::uint64_t end = seq + size;
+  recent_.push_back(seq);
+  if (recent_.size() > MAX_SACK_BLOCKS) {
+    recent_.pop_front();
+  }
+
+  auto it = out_of_order_.upper_bound(seq);
+  if (it != out_of_order_.begin() && std::prev(it)->first + std::prev(it)->second.size() >= seq) {
+    --it;
+    std::uint64_t range_end = it->first + it->second.size();
+    if (range_end >= end) {
+      return;
+    }
+    it->second.append(payload + (range_end - seq), end - range_end);
+  } else {
+    it = out_of_order_.insert(it, std::make_pair(seq, std::string(payload, size)));
+  }
+
+  std::uint64_t range_end = it->first + it->second.size();
+  auto next = std::next(it);
+  while (next != out_of_order_.end() && next->first <= range_end) {
+    std::uint64_t next_end = next->first + next->second.size();
+    if (next_end > range_end) {
+      it->second.append(next->second, range_end - next->first, std::string::npos);
+      range_end = next_end;
+    }
+    next = out_of_order_.erase(next);
+  }
+}
+
+void connection::process_data(const packet_header &h, const char *payload, std::size_t size, time_point now) {
+  bool immediate = false;
+  if (h.flags & FLAG_FIN) {
+    fin_received_ = true;
+    peer_fin_seq_ = h.seq + size;
+  }
+  std::uint64_t end = h.seq + size;
+  if (size > 0) {
+    if (end <= rcv_nxt_) {
+      immediate = true;  // Duplicate, our acknowledgement was probably lost.
+    } else if (h.seq > rcv_nxt_) {
+      if (end - rcv_nxt_ <= recv_buf_.free_space()) {
+        store_out_of_order(h.seq, payload, size);
+      }
+      immediate = true;
+    } else if (end - rcv_nxt_ <= recv_buf_.free_space()) {
+      std::size_t skip = rcv_nxt_ - h.seq;
+      recv_buf_.write(payload + skip, size - skip);
+      rcv_nxt_ = end;
+      if (!out_of_order_.empty() && out_of_order_.begin()->first <= rcv_nxt_) {
+        const std::string &data = out_of_order_.begin()->second;
+        std::uint64_t data_end = out_of_order_.begin()->first + data.size();
+        if (data_end > rcv_nxt_) {
+          std::size_t offset = data.size() - (data_end - rcv_nxt_);
+          std::size_t written = recv_buf_.write(data.data() + offset, data.size() - offset);
+          assert(written == data.size() - offset);
+          (void)written;
+          rcv_nxt_ = data_end;
+        }
+        out_of_order_.erase(out_of_order_.begin());
+        immediate = true;  // A hole is filled, let the sender know at once.
+      }
+    } else {
+      immediate = true;  // No space, the sender will retransmit.
+    }
+  }
+  if (fin_received_ && !eof_ && rcv_nxt_ == peer_fin_seq_) {
+    rcv_nxt_++;
+    eof_ = true;
+    immediate = true;
+  } else if ((h.flags & FLAG_FIN) && size == 0) {
+    immediate = true;
+  }
+
+  if (immediate || ++unacked_segments_ >= 2) {
+    send_ack(now);
+  } else if (ack_deadline_ == NEVER) {
+    ack_deadline_ = now + DELAYED_ACK;
+  }
+}
+
+void connection::on_timer(time_point now) {
+  if (state_ == CLOSED) {
+    return;
+  }
+  if (ack_deadline_ <= now) {
+    send_ack(now);
+  }
+  if (rto_deadline_ <= now) {
+    if (state_ == SYN_SENT || state_ == SYN_RECEIVED) {
+      if (++retries_ > MAX_SYN_RETRIES) {
+        fail("Connection timed out");
+        return;
+      }
+      rto_ = std::min(MAX_RTO, 2 * rto_);
+      send_syn(now);
+      rto_deadline_ = now + rto_;
+    } else if (!segments_.empty()) {
+      if (++retries_ > MAX_RETRIES) {
+        fail("Connection timed out");
+        return;
+      }
+      // Everything in flight is considered lost, the model is kept.
+      while (!in_flight_.empty()) {
+        mark_lost(segments_.find(in_flight_.front()));
+      }
+      rto_ = std::min(MAX_RTO, 2 * rto_);
+      cwnd_ = MIN_CWND;
+      rto_deadline_ = tail_probe_deadline_ = NEVER;
+      transmit(now);
+      rto_deadline_ = now + rto_;
+    } else {
+      rto_deadline_ = NEVER;
+    }
+  }
+  if (tail_probe_deadline_ <= now) {
+    if (!segments_.empty() && state_ == ESTABLISHED) {
+      send_tail_probe(now);
+      tail_probes_++;
+      tail_probe_deadline_ = now + probe_timeout() * (1 << std::min(tail_probes_, 6));
+      rto_deadline_ = std::max(rto_deadline_, now + rto_);
+    } else {
+      tail_probe_deadline_ = NEVER;
+    }
+  }
+  if (probe_deadline_ <= now) {
+    if (segments_.empty() && snd_nxt_ < snd_una_ + send_buf_.size()) {
+      send_ack(now, true);
+      probe_deadline_ = now + rto_;
+    } else {
+      probe_deadline_ = NEVER;
+    }
+  }
+}
+
+time_point connection::next_timer() const {
+  return std::min(std::min(ack_deadline_, rto_deadline_), std::min(tail_probe_deadline_, probe_deadline_));
+}
+
+std::size_t connection::app_send(const char *buf, std::size_t size, time_point now) {
+  // Buffering twice the window keeps it full without holding much more than is in flight.
+  std::size_t limit = std::min<std::uint64_t>(SEND_BUFFER_SIZE, 2 * cwnd_);
+  if (send_buf_.size() >= limit) {
+    return 0;
+  }
+  std::size_t written = send_buf_.write(buf, std::min(size, limit - send_buf_.size()));
+  transmit(now);
+  return written;
+}
+
+std::size_t connection::app_recv(char *buf, std::size_t size, time_point now) {
+  std::size_t read = recv_buf_.read(buf, size);
+  // Tells the sender about the space as soon as a noticeable amount is freed.
+  if (read > 0 && state_ == ESTABLISHED && !eof_ &&
+      recv_buf_.free_space() >= last_advertised_window_ + RECV_BUFFER_SIZE / 4) {
+    send_ack(now);
+  }
+  return read;
+}
+
+void connection::app_close(time_point now) {
+  if (state_ != ESTABLISHED) {
+    abort(now);
+    return;
+  }
+  if (!fin_queued_) {
+    fin_queued_ = true;
+    fin_seq_ = snd_una_ + send_buf_.size();
+    transmit(now);
+  }
+}
+
+bool connection::close_finished() const {
+  bool all_acked = fin_sent_ && snd_una_ >= fin_seq_;
+  // When the peer has closed too, the acknowledgement of our FIN is not worth waiting for.
+  return state_ == CLOSED || fin_acked_ || (fin_received_ && all_acked);
+}
+
+void connection::abort(time_point now) {
+  if (state_ != CLOSED && !fin_acked_) {
+    send_packet(FLAG_RST, snd_nxt_, nullptr, 0, std::vector<sack_block>(), now);
+  }
+  fail("Connection closed");
+}
+
+endpoint::endpoint(const sockaddr_in &local, bool listening)
+    : listening_(listening), epoch_(clock::now()), rng_(std::random_device()()), stopping_(false) {
+  #ifdef _WIN32
+  static WSAStartupper wsa_startupper_;
+  #endif
+  {
+    std::lock_guard<std::mutex> lock(impairment_mutex);
+    impairment_ = current_impairment;
+  }
+
+  sock_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_error);
+  try {
+    // Bigger kernel buffers absorb bursts of a whole window, best effort.
+    int buffer_size = UDP_BUFFER_SIZE;
+    setsockopt(sock_, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<char*>(&buffer_size), sizeof buffer_size);
+    setsockopt(sock_, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<char*>(&buffer_size), sizeof buffer_size);
+    #ifdef _WIN32
+    u_long mode = 1;
+    ensure_or_throw(ioctlsocket(sock_, FIONBIO, &mode) == 0, socket_error);
+    #else
+    int flags = fcntl(sock_, F_GETFL, 0);
+    ensure_or_throw(flags != -1 && fcntl(sock_, F_SETFL, flags | O_NONBLOCK) == 0, socket_error);
+    #endif
+    ensure_or_throw(bind(sock_, reinterpret_cast<const sockaddr*>(&local), sizeof local) == 0, socket_error);
+    thread_ = std::thread(&endpoint::run, this);
+  } catch (...) {
+    closesocket(sock_);
+    throw;
+  }
+}
+
+endpoint::~endpoint() {
+  stopping_ = true;
+  thread_.join();
+  closesocket(sock_);
+}
+
+std::uint32_t endpoint::timestamp(time_point now) const {
+  std::uint32_t result = static_cast<std::uint32_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(now - epoch_).count());
+  return result ? result : 1;  // Zero means "no timestamp".
+}
+
+std::shared_ptr<connection> endpoint::open(const sockaddr_in &peer, time_point now) {
+  std::uint32_t id;
+  do {
+    id = rng_();
+  } while (connections_.count(make_key(peer, id)));
+  std::shared_ptr<connection> conn(new connection(*this, peer, id, connection::SYN_SENT));
+  connections_[make_key(peer, id)] = conn;
+  conn->open(now);
+  return conn;
+}
+
+std::shared_ptr<connection> endpoint::pop_accepted() {
+  if (accept_queue_.empty()) {
+    return nullptr;
+  }
+  std::shared_ptr<connection> conn = accept_queue_.front();
+  accept_queue_.pop_front();
+  return conn;
+}
+
+void endpoint::stop_listening(time_point now) {
+  listening_ = false;
+  for (const auto &conn : accept_queue_) {
+    conn->abort(now);
+    connections_.erase(make_key(conn->peer(), conn->id()));
+  }
+  accept_queue_.clear();
+}
+
+// Makes room by forgetting connections which have failed before being accepted.
+bool endpoint::accept_queue_has_room() {
+  if (accept_queue_.size() < au_stream_server_socket::ACCEPT_BACKLOG) {
+    return true;
+  }
+  for (auto it = accept_queue_.begin(); it != accept_queue_.end();) {
+    if ((*it)->failed()) {
+      connections_.erase(make_key((*it)->peer(), (*it)->id()));
+      it = accept_queue_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return accept_queue_.size() < au_stream_server_socket::ACCEPT_BACKLOG;
+}
+
+void endpoint::remove(const std::shared_ptr<connection> &conn) {
+  connections_.erase(make_key(conn->peer(), conn->id()));
+}
+
+void endpoint::send_now(const sockaddr_in &to, const char *data, std::size_t size) {
+  // Losing a datagram is not an error for an unreliable transport, retransmissions take care of it.
+  if (sendto(sock_, data, size, 0, reinterpret_cast<const sockaddr*>(&to), sizeof to) == SOCKET_ERROR) {
+    LOG(log_level::debug, "au_stream: sendto failed: %s", get_socket_error().c_str());
+  }
+}
+
+void endpoint::send_packet(const sockaddr_in &to, const char *data, std::size_t size, time_point now) {
+  if (impairment_.loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < impairment_.loss) {
+    return;
+  }
+  duration delay = impairment_.delay;
+  if (impairment_.jitter.count() > 0) {
+    std::uniform_int_distribution<long long> jitter(-impairment_.jitter.count() * 1000, impairment_.jitter.count() * 1000);
+    delay += duration(jitter(rng_));
+  }
+  if (delay <= duration::zero()) {
+    send_now(to, data, size);
+    return;
+  }
+  delayed_packet packet;
+  packet.to = to;
+  packet.data.assign(data, size);
+  delayed_.insert(std::make_pair(now + delay, std::move(packet)));
+}
+
+void endpoint::send_rst(const sockaddr_in &to, std::uint32_t id, time_point now) {
+  char packet[HEADER_SIZE] = {};
+  char *out = packet;
+  put(out, FLAG_RST, 1);
+  out += 3;
+  put(out, id, 4);
+  send_packet(to, packet, sizeof packet, now);
+}
+
+void endpoint::dispatch(const sockaddr_in &from, const char *data, std::size_t size, time_point now) {
+  if (size < HEADER_SIZE) {
+    return;
+  }
+  const char *in = data;
+  packet_header h;
+  h.flags = get(in, 1);
+  std::size_t sack_count = get(in, 1);
+  get(in, 2);
+  h.conn_id = get(in, 4);
+  h.seq = get(in, 8);
+  h.ack = get(in, 8);
+  h.window = get(in, 4);
+  h.timestamp = get(in, 4);
+  h.timestamp_echo = get(in, 4);
+  if (sack_count > MAX_SACK_BLOCKS || size < HEADER_SIZE + sack_count * 16) {
+    return;
+  }
+  sack_block sacks[MAX_SACK_BLOCKS];
+  for (std::size_t i = 0; i < sack_count; i++) {
+    sacks[i].start = get(in, 8);
+    sacks[i].end = get(in, 8);
+  }
+  std::size_t payload_size = size - (in - data);
+  if (payload_size > MSS) {
+    return;
+  }
+
+  auto it = connections_.find(make_key(from, h.conn_id));
+  if (it != connections_.end()) {
+    it->second->on_packet(h, sacks, sack_count, in, payload_size, now);
+  } else if (listening_ && h.flags == FLAG_SYN) {
+    if (!accept_queue_has_room()) {
+      send_rst(from, h.conn_id, now);  // Refused at once, like by a TCP listener with a full backlog.
+      return;
+    }
+    std::shared_ptr<connection> conn(new connection(*this, from, h.conn_id, connection::SYN_RECEIVED));
+    connections_[make_key(from, h.conn_id)] = conn;
+    accept_queue_.push_back(conn);
+    conn->on_packet(h, sacks, 0, nullptr, 0, now);
+  } else if (!(h.flags & FLAG_RST)) {
+    send_rst(from, h.conn_id, now);
+  }
+}
+
+void endpoint::run() {
+  std::vector<char> buf(RECV_PACKET_BUFFER);
+  while (!stopping_) {
+    int timeout_ms;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      time_point now = clock::now();
+      time_point next = now + MAX_TICK;
+      for (const auto &it : connections_) {
+        next = std::min(next, it.second->next_timer());
+      }
+      if (!delayed_.empty()) {
+        next = std::min(next, delayed_.begin()->first);
+      }
+      timeout_ms = next <= now ? 0 : std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1;
+    }
+
+    pollfd pfd;
+    pfd.fd = sock_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    poll(&pfd, 1, timeout_ms);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    time_point now = clock::now();
+    for (;;) {
+      sockaddr_in from;
+      socklen_t from_len = sizeof from;
+      int received = recvfrom(sock_, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+      if (received == SOCKET_ERROR) {
+        break;  // Nothing more to read, or an ICMP error about an earlier datagram.
+      }
+      if (from.sin_family == AF_INET) {
+        dispatch(from, buf.data(), received, now);
+      }
+    }
+    for (const auto &it : connections_) {
+      it.second->on_timer(now);
+    }
+    while (!delayed_.empty() && delayed_.begin()->first <= now) {
+      const delayed_packet &packet = delayed_.begin()->second;
+      send_now(packet.to, packet.data.data(), packet.data.size());
+      delayed_.erase(delayed_.begin());
+    }
+    changed.notify_all();
+  }
+}
+
+sockaddr_in resolve(hostname host, au_stream_port port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
+  addrinfo *addrs = nullptr;
+  int result = getaddrinfo(host, std::to_string(port).c_str(), &hints, &addrs);
+  if (result != 0 || addrs == nullptr) {
+    std::stringstream msg;
+    msg << "Unable to resolve host '" << host << "': "
+        << (result != 0 ? get_socket_error(result) : "no matching host found");
+    throw host_resolve_error(msg.str());
+  }
+  sockaddr_in addr;
+  memcpy(&addr, addrs->ai_addr, sizeof addr);
+  freeaddrinfo(addrs);
+  return addr;
+}
+
+}  // namespace au_stream_detail
+
+using namespace au_stream_detail;
+
+void au_stream_set_impairment(const au_stream_impairment &impairment) {
+  std::lock_guard<std::mutex> lock(impairment_mutex);
+  current_impairment = impairment;
+}
+
+au_stream_connection_socket::au_stream_connection_socket(std::shared_ptr<endpoint> endpoint,
+                                                         std::shared_ptr<connection> connection)
+    : endpoint_(std::move(endpoint)), connection_(std::move(connection)) {}
+
+au_stream_connection_socket::~au_stream_connection_socket() {
+  std::unique_lock<std::mutex> lock(endpoint_->mutex);
+  time_point deadline = clock::now() + LINGER;
+  connection_->app_close(clock::now());
+  while (!connection_->close_finished() && clock::now() < deadline) {
+    endpoint_->changed.wait_until(lock, deadline);
+  }
+  if (!connection_->close_finished()) {
+    connection_->abort(clock::now());
+  }
+  endpoint_->remove(connection_);
+}
+
+void au_stream_connection_socket::send(const void *buf, size_t size) {
+  const char *data = static_cast<const char*>(buf);
+  std::unique_lock<std::mutex> lock(endpoint_->mutex);
+  while (size > 0) {
+    if (connection_->failed()) {
+      throw socket_io_error(connection_->error());
+    }
+    std::size_t sent = connection_->app_send(data, size, clock::now());
+    data += sent;
+    size -= sent;
+    if (size > 0) {
+      endpoint_->changed.wait(lock);
+    }
+  }
+}
+
+void au_stream_connection_socket::recv(void *buf, size_t size) {
+  char *data = static_cast<char*>(buf);
+  while (size > 0) {
+    std::size_t received = recv_some(data, size);
+    data += received;
+    size -= received;
+  }
+}
+
+size_t au_stream_connection_socket::recv_some(void *buf, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  std::unique_lock<std::mutex> lock(endpoint_->mutex);
+  for (;;) {
+    std::size_t received = connection_->app_recv(static_cast<char*>(buf), size, clock::now());
+    if (received > 0) {
+      return received;
+    }
+    if (connection_->eof()) {
+      throw socket_eof_error("Socket was gracefully closed");
+    }
+    if (connection_->failed()) {
+      throw socket_io_error(connection_->error());
+    }
+    endpoint_->changed.wait(lock);
+  }
+}
+
+au_stream_client_socket::au_stream_client_socket(hostname host, au_stream_port client_port, au_stream_port server_port)
+    : host_(host), client_port_(client_port), server_port_(server_port) {}
+
+au_stream_client_socket::~au_stream_client_socket() {
+  sock_.reset();  // Closes the connection while the endpoint is still alive.
+}
+
+void au_stream_client_socket::connect() {
+  sock_.reset();
+  sockaddr_in server = resolve(host_.c_str(), server_port_);
+  if (!endpoint_) {
+    sockaddr_in local;
+    memset(&local, 0, sizeof local);
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(client_port_);
+    endpoint_ = std::make_shared<endpoint>(local, false);
+  }
+
+  std::unique_lock<std::mutex> lock(endpoint_->mutex);
+  std::shared_ptr<connection> conn = endpoint_->open(server, clock::now());
+  while (!conn->established() && !conn->failed()) {
+    endpoint_->changed.wait(lock);
+  }
+  if (conn->failed()) {
+    endpoint_->remove(conn);
+    std::stringstream msg;
+    msg << "Unable to connect to " << host_ << ":" << server_port_ << ": " << conn->error();
+    throw socket_error(msg.str());
+  }
+  sock_.reset(new au_stream_connection_socket(endpoint_, conn));
+}
+
+void au_stream_client_socket::send(const void *buf, size_t size) {
+  if (!sock_) {
+    throw socket_uninitialized("au_stream_client_socket is not connected");
+  }
+  sock_->send(buf, size);
+}
+
+void au_stream_client_socket::recv(void *buf, size_t size) {
+  if (!sock_) {
+    throw socket_uninitialized("au_stream_client_socket is not connected");
+  }
+  sock_->recv(buf, size);
+}
+
+size_t au_stream_client_socket::recv_some(void *buf, size_t size) {
+  if (!sock_) {
+    throw socket_uninitialized("au_stream_client_socket is not connected");
+  }
+  return sock_->recv_some(buf, size);
+}
+
+au_stream_server_socket::au_stream_server_socket(hostname host, au_stream_port port)
+    : endpoint_(std::make_shared<endpoint>(resolve(host, port), true)) {}
+
+au_stream_server_socket::~au_stream_server_socket() {
+  std::lock_guard<std::mutex> lock(endpoint_->mutex);
+  endpoint_->stop_listening(clock::now());
+}
+
+au_stream_connection_socket* au_stream_server_socket::accept_one_client() {
+  std::unique_lock<std::mutex> lock(endpoint_->mutex);
+  for (;;) {
+    if (std::shared_ptr<connection> conn = endpoint_->pop_accepted()) {
+      return new au_stream_connection_socket(endpoint_, conn);
+    }
+    endpoint_->changed.wait(lock);
+  }
+}
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include "bench.h"
+
+// Every heap allocation of the benchmark binary is counted, see bench_allocations().
+static thread_local std::uint64_t allocations = 0;
+
+void* operator new(std::size_t size) {
+  allocations++;
+  if (void *p = malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+std::uint64_t bench_allocations() {
+  return allocations;
+}
+
+struct benchmark {
+  const char *name;
+  const char *description;
+  int (*run)(int argc, char *argv[]);
+};
+
+static const benchmark benchmarks[] = {
+  {"account_store", "[threads] [accounts] - contended balance reads and transfers", bench_account_store},
+  {"sequencer", "[threads] [accounts] [zipf_s] - transfers between Zipf-distributed accounts under locks and on the sequencer", bench_sequencer},
+  {"protocol_decode", "[messages] [rounds] - message decoding paths", bench_protocol_decode},
+  {"protocol_encode", "[messages] [rounds] - message encoding paths", bench_protocol_encode},
+  {"protocol_compact", "[messages] [rounds] - size and speed of the fixed and the compact encodings", bench_protocol_compact},
+  {"protocol_messages", "[messages] [rounds] [port] - encoding, decoding and sockets for every message type", bench_protocol_messages},
+  {"log", "[threads] [rounds] - cost of a logging call", bench_log},
+  {"write_ahead_log", "[threads] [ops] [path] - durable transfers per second by group commit window", bench_write_ahead_log},
+  {"snapshot", "[accounts] [path] - snapshot saving and startup time", bench_snapshot},
+  {"accept", "[max_acceptors] [connections] [port] - accepted connections per second by SO_REUSEPORT listeners", bench_accept},
+  {"transport", "[connections] [seconds] [port] - pipelined requests per second by server backend (blocking, epoll, io_uring)", bench_transport},
+};
+
+static void usage() {
+  std::cout << "Usage: bench <name> [args...]\nAvailable benchmarks:\n";
+  for (const auto &b : benchmarks) {
+    std::cout << "  " << b.name << " " << b.description << "\n";
+  }
+  std::cout.flush();
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  for (const auto &b : benchmarks) {
+    if (strcmp(argv[1], b.name) == 0) {
+      try {
+        return b.run(argc - 2, argv + 2);
+      } catch (const std::exception &e) {
+        std::cout << "Exception caught: " << e.what() << std::endl;
+        return 1;
+      }
+    }
+  }
+  usage();
+  return 1;
+}
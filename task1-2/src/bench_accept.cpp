@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "bench.h"
+#include "tcp_socket.h"
+
+namespace {
+
+const char *const HOST = "127.0.0.1";
+const unsigned CONNECTORS = 4;
+
+/*
+ * Connects `connections` times in total from CONNECTORS threads. The server
+ * closes every connection right after accepting it, clients wait for that,
+ * so TIME_WAIT sockets pile up on the server side and ephemeral ports
+ * are not exhausted.
+ * Acceptors stay blocked in accept() until the benchmark exits, that is why
+ * every round listens on its own port.
+ */
+double run(unsigned acceptors, int connections, tcp_port port) {
+  std::vector<std::unique_ptr<tcp_server_socket>> listeners;
+  for (unsigned i = 0; i < acceptors; i++) {
+    listeners.emplace_back(new tcp_server_socket(HOST, port, acceptors > 1));
+  }
+  for (auto &listener : listeners) {
+    std::thread([](tcp_server_socket *server) {
+      try {
+        for (;;) {
+          delete server->accept_one_client();
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Acceptor failed: " << e.what() << std::endl;
+        exit(1);
+      }
+    }, listener.release()).detach();
+  }
+
+  std::atomic<int> next(0);
+  std::vector<std::thread> threads;
+  bench_timer timer;
+  for (unsigned t = 0; t < CONNECTORS; t++) {
+    threads.emplace_back([&next, connections, port] {
+      char c;
+      while (next++ < connections) {
+        tcp_client_socket client(HOST, port);
+        client.connect();
+        try {
+          client.recv(&c, 1);
+        } catch (const socket_eof_error&) {
+        }
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  return connections / timer.seconds();
+}
+
+}  // namespace
+
+int bench_accept(int argc, char *argv[]) {
+  unsigned max_acceptors = argc > 0 ? atoi(argv[0]) : std::max(1u, std::thread::hardware_concurrency());
+  int connections = argc > 1 ? atoi(argv[1]) : 10000;
+  tcp_port port = argc > 2 ? atoi(argv[2]) : 40031;
+  if (max_acceptors == 0 || connections <= 0) {
+    throw std::invalid_argument("acceptors and connections should be positive");
+  }
+
+  std::cout << "acceptors\tconnections_per_sec" << std::endl;
+  for (unsigned acceptors = 1; ; acceptors = std::min(2 * acceptors, max_acceptors)) {
+    std::cout << acceptors << "\t" << run(acceptors, connections, port++) << std::endl;
+    if (acceptors == max_acceptors) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "account_store.h"
+#include "bench.h"
+#include "transfer_sequencer.h"
+
+namespace {
+
+// The original server storage: one std::map behind one mutex.
+class global_mutex_store {
+public:
+  t_client_id register_new_client() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    t_client_id id = balances_.size();
+    balances_[id] = 0;
+    return id;
+  }
+
+  t_balance get_amount(t_client_id id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = balances_.find(id);
+    if (it == balances_.end()) {
+      throw std::runtime_error("Requested balance for an unknown client");
+    }
+    return it->second;
+  }
+
+  void transfer(t_client_id from, t_client_id to, t_balance amount) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it_from = balances_.find(from);
+    auto it_to = balances_.find(to);
+    if (it_from == balances_.end() || it_to == balances_.end()) {
+      throw std::runtime_error("Requested transfer for an unknown client");
+    }
+    it_from->second -= amount;
+    it_to->second += amount;
+  }
+
+private:
+  std::mutex mutex_;
+  std::map<t_client_id, t_balance> balances_;
+};
+
+const int OPS_PER_THREAD = 1000000;
+const int TRANSFER_PERCENT = 20;
+
+template<typename Store>
+double run(Store &store, unsigned threads_count, std::uint64_t accounts) {
+  for (std::uint64_t i = 0; i < accounts; i++) {
+    store.register_new_client();
+  }
+
+  std::vector<std::thread> threads;
+  bench_timer timer;
+  for (unsigned t = 0; t < threads_count; t++) {
+    threads.emplace_back([&store, t, accounts] {
+      xorshift rng(t);
+      t_balance sink = 0;
+      for (int i = 0; i < OPS_PER_THREAD; i++) {
+        std::uint64_t r = rng();
+        t_client_id a = r % accounts;
+        if ((r >> 32) % 100 < TRANSFER_PERCENT) {
+          store.transfer(a, (r >> 16) % accounts, 1);
+        } else {
+          sink += store.get_amount(a);
+        }
+      }
+      volatile t_balance keep = sink;
+      (void)keep;
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  return OPS_PER_THREAD * static_cast<double>(threads_count) / timer.seconds();
+}
+
+}  // namespace
+
+int bench_account_store(int argc, char *argv[]) {
+  unsigned max_threads = argc > 0 ? atoi(argv[0]) : std::thread::hardware_concurrency();
+  std::uint64_t accounts = argc > 1 ? atoll(argv[1]) : 100000;
+  if (max_threads == 0 || accounts == 0) {
+    throw std::invalid_argument("threads and accounts should be positive");
+  }
+
+  std::cout << "store\tthreads\taccounts\tops_per_sec" << std::endl;
+  for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    {
+      global_mutex_store store;
+      std::cout << "global_mutex\t" << threads << "\t" << accounts << "\t" << run(store, threads, accounts) << std::endl;
+    }
+    {
+      account_store store;
+      std::cout << "account_store\t" << threads << "\t" << accounts << "\t" << run(store, threads, accounts) << std::endl;
+    }
+    if (threads == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
+
+namespace {
+
+const int ZIPF_OPS_PER_THREAD = 200000;
+
+// Draws ids 0..n-1 with probability proportional to 1 / (id + 1)^s, so that the lowest ids are hot.
+class zipf_generator {
+public:
+  zipf_generator(std::uint64_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for (std::uint64_t i = 0; i < n; i++) {
+      sum += 1 / std::pow(i + 1, s);
+      cdf_[i] = sum;
+    }
+    for (auto &p : cdf_) {
+      p /= sum;
+    }
+  }
+
+  t_client_id operator()(xorshift &rng) const {
+    double u = (rng() >> 11) / 9007199254740992.0;  // Uniform in [0, 1) with 53 bits.
+    return std::min<std::size_t>(std::upper_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin(), cdf_.size() - 1);
+  }
+
+private:
+  std::vector<double> cdf_;
+};
+
+// Every thread makes transfers between accounts drawn from the distribution.
+template<typename Transfer>
+double run_zipf(const zipf_generator &zipf, unsigned threads_count, Transfer transfer) {
+  std::vector<std::thread> threads;
+  bench_timer timer;
+  for (unsigned t = 0; t < threads_count; t++) {
+    threads.emplace_back([&zipf, &transfer, t] {
+      xorshift rng(t);
+      for (int i = 0; i < ZIPF_OPS_PER_THREAD; i++) {
+        transfer(zipf(rng), zipf(rng), 1);
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  return ZIPF_OPS_PER_THREAD * static_cast<double>(threads_count) / timer.seconds();
+}
+
+}  // namespace
+
+int bench_sequencer(int argc, char *argv[]) {
+  unsigned max_threads = argc > 0 ? atoi(argv[0]) : std::max(4u, std::thread::hardware_concurrency());
+  std::uint64_t accounts = argc > 1 ? atoll(argv[1]) : 100000;
+  double s = argc > 2 ? atof(argv[2]) : 0.99;
+  if (max_threads == 0 || accounts == 0 || s < 0) {
+    throw std::invalid_argument("threads and accounts should be positive, s should be non-negative");
+  }
+  zipf_generator zipf(accounts, s);
+
+  std::cout << "path\tthreads\taccounts\tzipf_s\ttransfers_per_sec" << std::endl;
+  for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    account_store store;
+    for (std::uint64_t i = 0; i < accounts; i++) {
+      store.register_new_client();
+    }
+    double locked = run_zipf(zipf, threads, [&store](t_client_id from, t_client_id to, t_balance amount) {
+      store.transfer(from, to, amount);
+    });
+    std::cout << "mutex\t" << threads << "\t" << accounts << "\t" << s << "\t" << locked << std::endl;
+
+    transfer_sequencer sequencer(store);
+    double sequenced = run_zipf(zipf, threads, [&sequencer](t_client_id from, t_client_id to, t_balance amount) {
+      sequencer.transfer(from, to, amount);
+    });
+    std::cout << "sequencer\t" << threads << "\t" << accounts << "\t" << s << "\t" << sequenced << std::endl;
+    if (threads == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "bench.h"
+#include "log.h"
+
+namespace {
+
+// Fits into a ring, so records are timed without being dropped.
+const int RECORDS_PER_ROUND = 512;
+
+// Returns nanoseconds per record, only the calls themselves are timed.
+template<typename F>
+double run(unsigned threads_count, int rounds, F before_round) {
+  std::vector<std::thread> threads;
+  std::vector<double> seconds(threads_count);
+  std::mutex round_mutex;
+  for (unsigned t = 0; t < threads_count; t++) {
+    threads.emplace_back([&, t] {
+      for (int round = 0; round < rounds; round++) {
+        {
+          std::lock_guard<std::mutex> lock(round_mutex);
+          before_round();
+        }
+        bench_timer timer;
+        for (int i = 0; i < RECORDS_PER_ROUND; i++) {
+          LOG(log_level::info, "Received TransferRequest(to=%d, amount=%d)", i, round);
+        }
+        seconds[t] += timer.seconds();
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  double total = 0;
+  for (double s : seconds) {
+    total += s;
+  }
+  return total * 1e9 / (static_cast<double>(threads_count) * rounds * RECORDS_PER_ROUND);
+}
+
+double run_cout(unsigned threads_count, int rounds) {
+  std::vector<std::thread> threads;
+  std::vector<double> seconds(threads_count);
+  for (unsigned t = 0; t < threads_count; t++) {
+    threads.emplace_back([&, t] {
+      bench_timer timer;
+      for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < RECORDS_PER_ROUND; i++) {
+          std::cout << "Received TransferRequest("
+                    << "to=" << i << ", "
+                    << "amount=" << round << ")" << std::endl;
+        }
+      }
+      seconds[t] = timer.seconds();
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  double total = 0;
+  for (double s : seconds) {
+    total += s;
+  }
+  return total * 1e9 / (static_cast<double>(threads_count) * rounds * RECORDS_PER_ROUND);
+}
+
+}  // namespace
+
+int bench_log(int argc, char *argv[]) {
+  unsigned max_threads = argc > 0 ? atoi(argv[0]) : std::thread::hardware_concurrency();
+  int rounds = argc > 1 ? atoi(argv[1]) : 200;
+  if (max_threads == 0 || rounds <= 0) {
+    throw std::invalid_argument("threads and rounds should be positive");
+  }
+
+  // Both std::cout and the log write to /dev/null, so only the calling side is measured.
+  std::ofstream null_stream("/dev/null");
+  FILE *null_file = fopen("/dev/null", "w");
+  if (!null_stream || !null_file) {
+    throw std::runtime_error("Unable to open /dev/null");
+  }
+  std::streambuf *cout_buf = std::cout.rdbuf();
+  log_set_output(null_file);
+
+  std::cout << "sink\tthreads\tns_per_record" << std::endl;
+  for (unsigned threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+    std::cout.rdbuf(null_stream.rdbuf());
+    double cout_ns = run_cout(threads, rounds);
+    std::cout.rdbuf(cout_buf);
+    std::cout << "cout_endl\t" << threads << "\t" << cout_ns << std::endl;
+
+    log_set_level(log_level::info);
+    std::cout << "log_enabled\t" << threads << "\t" << run(threads, rounds, log_flush) << std::endl;
+    log_set_level(log_level::off);
+    std::cout << "log_disabled\t" << threads << "\t" << run(threads, rounds, [] {}) << std::endl;
+    if (threads == max_threads) {
+      break;
+    }
+  }
+
+  log_set_level(log_level::info);
+  log_set_output(stdout);
+  fclose(null_file);
+  return 0;
+}
@@ -0,0 +1,484 @@
+#include <stdlib.h>
+#include <string.h>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "bench.h"
+#include "protocol.h"
+#include "stringstream_socket.h"
+#include "tcp_socket.h"
+
+namespace {
+
+class memory_socket : public stream_socket {
+public:
+  void send(const void *buf, size_t size) override {
+    data_.append(static_cast<const char*>(buf), size);
+  }
+  void recv(void *buf, size_t size) override {
+    if (size > data_.size() - pos_) {
+      throw socket_eof_error("No more data in memory_socket");
+    }
+    memcpy(buf, data_.data() + pos_, size);
+    pos_ += size;
+  }
+  const std::string& data() const { return data_; }
+  void rewind() { pos_ = 0; }
+  void clear() { data_.clear(); pos_ = 0; }
+
+private:
+  std::string data_;
+  std::size_t pos_ = 0;
+};
+
+// The original decoding path: heap message, payload vector and a stringstream around it.
+// Supports fixed-size messages only, like the original.
+std::unique_ptr<AbstractMessage> legacy_proto_recv(stream_socket &sock) {
+  std::uint8_t id;
+  sock.recv(&id, 1);
+
+  std::unique_ptr<AbstractMessage> msg;
+  switch (id) {
+  case RegistrationMessage::ID: msg.reset(new RegistrationMessage); break;
+  case LoginMessage::ID: msg.reset(new LoginMessage); break;
+  case RegistrationResponse::ID: msg.reset(new RegistrationResponse); break;
+  case BalanceInquiryRequest::ID: msg.reset(new BalanceInquiryRequest); break;
+  case BalanceInquiryResponse::ID: msg.reset(new BalanceInquiryResponse); break;
+  case TransferRequest::ID: msg.reset(new TransferRequest); break;
+  case OperationSucceeded::ID: msg.reset(new OperationSucceeded); break;
+  default: throw protocol_error("Unknown message id");
+  }
+  std::vector<char> data(msg->serialized_size());
+  sock.recv(data.data(), data.size());
+
+  std::stringstream data_stream;
+  data_stream.rdbuf()->pubsetbuf(data.data(), data.size());
+  msg->deserialize(data_stream);
+  return msg;
+}
+
+// The original encoding path: a fresh stringstream written byte by byte and copied out.
+template<typename T>
+void legacy_write(std::ostream &os, const T& val_) {
+  typename std::make_unsigned<T>::type val = val_;
+  for (int i = static_cast<int>(sizeof(val)) - 1; i >= 0; i--) {
+    std::uint8_t byte = (val >> (8 * i)) & 0xFF;
+    os.write(reinterpret_cast<char*>(&byte), 1);
+  }
+}
+
+void legacy_proto_send(stream_socket &sock, const AbstractMessage &msg) {
+  std::stringstream data_stream;
+  legacy_write(data_stream, msg.id());
+  msg.serialize(data_stream);
+  const auto &data = data_stream.str();
+  sock.send(data.data(), data.size());
+}
+
+// Counts decoded messages of each type so that the decoding cannot be optimized away.
+struct counting_visitor : MessageVisitor {
+  std::uint64_t sum = 0;
+  void accept(const RegistrationMessage&) override { sum += 1; }
+  void accept(const LoginMessage &m) override { sum += m.client_id; }
+  void accept(const RegistrationResponse &m) override { sum += m.client_id; }
+  void accept(const BalanceInquiryRequest&) override { sum += 4; }
+  void accept(const BalanceInquiryResponse &m) override { sum += m.balance; }
+  void accept(const TransferRequest &m) override { sum += m.transfer_to + m.amount; }
+  void accept(const OperationSucceeded&) override { sum += 7; }
+  void accept(const BatchTransferRequest &m) override { sum += m.items.size(); }
+  void accept(const BatchTransferResponse &m) override { sum += m.statuses.size(); }
+  void accept(const StatsRequest&) override { sum += 10; }
+  void accept(const StatsResponse &m) override { sum += m.text.size(); }
+  void accept(const HelloMessage &m) override { sum += m.capabilities; }
+  void accept(const HelloResponse &m) override { sum += m.capabilities; }
+};
+
+// Calls counting_visitor directly, for AnyMessage::apply.
+struct counting_functor {
+  counting_visitor &v;
+  template<typename T> void operator()(const T &msg) const { v.counting_visitor::accept(msg); }
+};
+
+void fill(memory_socket &sock, std::size_t messages) {
+  xorshift rng(1);
+  for (std::size_t i = 0; i < messages; i++) {
+    switch (i % 4) {
+    case 0: {
+      TransferRequest msg;
+      msg.transfer_to = rng() % 1000000;
+      msg.amount = rng() % 1000;
+      proto_send(sock, msg);
+      break;
+    }
+    case 1: proto_send(sock, BalanceInquiryRequest()); break;
+    case 2: {
+      BalanceInquiryResponse msg;
+      msg.balance = rng() % 1000000;
+      proto_send(sock, msg);
+      break;
+    }
+    case 3: proto_send(sock, OperationSucceeded()); break;
+    }
+  }
+}
+
+std::vector<std::unique_ptr<AbstractMessage>> make_messages(std::size_t messages) {
+  memory_socket sock;
+  fill(sock, messages);
+  std::vector<std::unique_ptr<AbstractMessage>> result;
+  for (std::size_t i = 0; i < messages; i++) {
+    result.push_back(proto_recv(sock));
+  }
+  return result;
+}
+
+template<typename F>
+void measure(const char *path, std::size_t messages, int rounds, F decode_all) {
+  counting_visitor v;
+  bench_timer timer;
+  for (int r = 0; r < rounds; r++) {
+    decode_all(v);
+  }
+  double seconds = timer.seconds();
+  std::cout << path << "\t" << messages * rounds / seconds << "\t" << v.sum << std::endl;
+}
+
+}  // namespace
+
+int bench_protocol_decode(int argc, char *argv[]) {
+  std::size_t messages = argc > 0 ? atoll(argv[0]) : 100000;
+  int rounds = argc > 1 ? atoi(argv[1]) : 20;
+  if (messages == 0 || rounds <= 0) {
+    throw std::invalid_argument("messages and rounds should be positive");
+  }
+
+  memory_socket sock;
+  fill(sock, messages);
+  const std::string &data = sock.data();
+
+  std::cout << "path\tmessages_per_sec\tchecksum" << std::endl;
+  measure("legacy_proto_recv", messages, rounds, [&](counting_visitor &v) {
+    sock.rewind();
+    for (std::size_t i = 0; i < messages; i++) {
+      legacy_proto_recv(sock)->visit(v);
+    }
+  });
+  measure("proto_recv", messages, rounds, [&](counting_visitor &v) {
+    sock.rewind();
+    for (std::size_t i = 0; i < messages; i++) {
+      proto_recv(sock)->visit(v);
+    }
+  });
+  measure("proto_recv_any", messages, rounds, [&](counting_visitor &v) {
+    sock.rewind();
+    AnyMessage msg;
+    for (std::size_t i = 0; i < messages; i++) {
+      proto_recv(sock, msg);
+      msg.visit(v);
+    }
+  });
+  measure("proto_decode", messages, rounds, [&](counting_visitor &v) {
+    AnyMessage msg;
+    std::size_t pos = 0;
+    while (std::size_t size = proto_decode(data.data() + pos, data.size() - pos, msg)) {
+      msg.visit(v);
+      pos += size;
+    }
+  });
+  measure("proto_decode_apply", messages, rounds, [&](counting_visitor &v) {
+    AnyMessage msg;
+    std::size_t pos = 0;
+    while (std::size_t size = proto_decode(data.data() + pos, data.size() - pos, msg)) {
+      msg.apply(counting_functor{v});
+      pos += size;
+    }
+  });
+  return 0;
+}
+
+int bench_protocol_encode(int argc, char *argv[]) {
+  std::size_t messages = argc > 0 ? atoll(argv[0]) : 100000;
+  int rounds = argc > 1 ? atoi(argv[1]) : 20;
+  if (messages == 0 || rounds <= 0) {
+    throw std::invalid_argument("messages and rounds should be positive");
+  }
+
+  auto msgs = make_messages(messages);
+  memory_socket sock;
+
+  std::cout << "path\tmessages_per_sec\tbytes" << std::endl;
+  auto measure_encode = [&](const char *path, std::function<void()> encode_all) {
+    bench_timer timer;
+    std::size_t bytes = 0;
+    for (int r = 0; r < rounds; r++) {
+      sock.clear();
+      encode_all();
+      bytes += sock.data().size();
+    }
+    double seconds = timer.seconds();
+    std::cout << path << "\t" << messages * rounds / seconds << "\t" << bytes << std::endl;
+  };
+  measure_encode("legacy_proto_send", [&] {
+    for (const auto &msg : msgs) {
+      legacy_proto_send(sock, *msg);
+    }
+  });
+  measure_encode("proto_send", [&] {
+    for (const auto &msg : msgs) {
+      proto_send(sock, *msg);
+    }
+  });
+  measure_encode("message_batch", [&] {
+    MessageBatch<> batch;
+    for (const auto &msg : msgs) {
+      if (!batch.add(*msg)) {
+        batch.send(sock);
+        batch.add(*msg);
+      }
+    }
+    batch.send(sock);
+  });
+  return 0;
+}
+
+/*
+ * The same mix of messages in the fixed and in the compact encoding:
+ * bytes on the wire per message and encoding/decoding rates of a buffer.
+ */
+int bench_protocol_compact(int argc, char *argv[]) {
+  std::size_t messages = argc > 0 ? atoll(argv[0]) : 100000;
+  int rounds = argc > 1 ? atoi(argv[1]) : 20;
+  if (messages == 0 || rounds <= 0) {
+    throw std::invalid_argument("messages and rounds should be positive");
+  }
+
+  auto msgs = make_messages(messages);
+
+  std::cout << "encoding\tbytes_per_message\tencode_per_sec\tdecode_per_sec\tchecksum" << std::endl;
+  auto measure_encoding = [&](const char *name, proto_encoding encoding) {
+    std::vector<char> buf;
+    for (const auto &msg : msgs) {
+      buf.resize(buf.size() + proto_encoded_size(*msg, encoding));
+    }
+
+    bench_timer encode_timer;
+    for (int r = 0; r < rounds; r++) {
+      char *pos = buf.data();
+      for (const auto &msg : msgs) {
+        pos += proto_encode(pos, *msg, encoding);
+      }
+    }
+    double encode_seconds = encode_timer.seconds();
+
+    counting_visitor v;
+    bench_timer decode_timer;
+    for (int r = 0; r < rounds; r++) {
+      AnyMessage msg;
+      std::size_t pos = 0;
+      while (std::size_t size = proto_decode(buf.data() + pos, buf.size() - pos, msg, encoding)) {
+        msg.apply(counting_functor{v});
+        pos += size;
+      }
+    }
+    double decode_seconds = decode_timer.seconds();
+
+    std::cout << name << "\t" << static_cast<double>(buf.size()) / messages << "\t"
+              << messages * rounds / encode_seconds << "\t" << messages * rounds / decode_seconds << "\t"
+              << v.sum << std::endl;
+  };
+  measure_encoding("fixed", proto_encoding::fixed);
+  measure_encoding("compact", proto_encoding::compact);
+  return 0;
+}
+
+namespace {
+
+const std::size_t SAMPLE_BATCH_ITEMS = 16;
+
+template<typename T> void fill_sample(T&, xorshift&) {
+}
+
+template<> void fill_sample<LoginMessage>(LoginMessage &msg, xorshift &rng) {
+  msg.client_id = rng() % 1000000;
+}
+
+template<> void fill_sample<RegistrationResponse>(RegistrationResponse &msg, xorshift &rng) {
+  msg.client_id = rng() % 1000000;
+}
+
+template<> void fill_sample<BalanceInquiryResponse>(BalanceInquiryResponse &msg, xorshift &rng) {
+  msg.balance = rng() % 1000000;
+}
+
+template<> void fill_sample<TransferRequest>(TransferRequest &msg, xorshift &rng) {
+  msg.transfer_to = rng() % 1000000;
+  msg.amount = rng() % 1000;
+}
+
+template<> void fill_sample<BatchTransferRequest>(BatchTransferRequest &msg, xorshift &rng) {
+  for (std::size_t i = 0; i < SAMPLE_BATCH_ITEMS; i++) {
+    BatchTransferRequest::Item item;
+    item.transfer_to = rng() % 1000000;
+    item.amount = rng() % 1000;
+    msg.items.push_back(item);
+  }
+}
+
+template<> void fill_sample<BatchTransferResponse>(BatchTransferResponse &msg, xorshift&) {
+  msg.statuses.assign(SAMPLE_BATCH_ITEMS, BatchTransferResponse::OK);
+}
+
+template<> void fill_sample<StatsResponse>(StatsResponse &msg, xorshift &rng) {
+  for (std::size_t i = 0; i < SAMPLE_BATCH_ITEMS; i++) {
+    msg.text += "metric_" + std::to_string(i) + " " + std::to_string(rng() % 1000000) + "\n";
+  }
+}
+
+template<> void fill_sample<HelloMessage>(HelloMessage &msg, xorshift &rng) {
+  msg.version = PROTO_VERSION;
+  msg.capabilities = rng() & PROTO_CAP_COMPACT;
+}
+
+template<> void fill_sample<HelloResponse>(HelloResponse &msg, xorshift &rng) {
+  msg.version = PROTO_VERSION;
+  msg.capabilities = rng() & PROTO_CAP_COMPACT;
+}
+
+struct tcp_pair {
+  std::unique_ptr<tcp_client_socket> client;
+  std::unique_ptr<stream_socket> server;
+};
+
+class message_bench {
+public:
+  message_bench(std::size_t messages, int rounds, tcp_pair &tcp)
+      : messages_(messages), rounds_(rounds), tcp_(tcp) {}
+
+  template<typename T> void run(const char *name);
+
+private:
+  template<typename F> void measure(const char *name, const char *path, std::size_t bytes, F run_all);
+
+  std::size_t messages_;
+  int rounds_;
+  tcp_pair &tcp_;
+  counting_visitor v_;
+};
+
+// Allocations are counted on the calling thread only, run_all adds the ones made by its helper threads.
+template<typename F>
+void message_bench::measure(const char *name, const char *path, std::size_t bytes, F run_all) {
+  std::uint64_t other_allocations = 0;
+  std::uint64_t start_allocations = bench_allocations();
+  bench_timer timer;
+  for (int r = 0; r < rounds_; r++) {
+    run_all(other_allocations);
+  }
+  double seconds = timer.seconds();
+  std::uint64_t allocations = bench_allocations() - start_allocations + other_allocations;
+  double total = static_cast<double>(messages_) * rounds_;
+  std::cout << name << "\t" << path << "\t" << total / seconds << "\t" << seconds * 1e9 / total << "\t"
+            << allocations / total << "\t" << bytes << std::endl;
+}
+
+template<typename T>
+void message_bench::run(const char *name) {
+  xorshift rng(T::ID);
+  T msg;
+  fill_sample(msg, rng);
+  const std::size_t size = 1 + msg.serialized_size();
+  std::vector<char> buf(size * messages_);
+
+  measure(name, "encode", size, [&](std::uint64_t&) {
+    for (std::size_t i = 0; i < messages_; i++) {
+      proto_encode(buf.data() + i * size, msg);
+    }
+  });
+  measure(name, "decode", size, [&](std::uint64_t&) {
+    AnyMessage out;
+    std::size_t pos = 0;
+    while (std::size_t consumed = proto_decode(buf.data() + pos, buf.size() - pos, out)) {
+      out.visit(v_);
+      pos += consumed;
+    }
+  });
+
+  stringstream_socket sstream;
+  measure(name, "stringstream_socket", size, [&](std::uint64_t&) {
+    sstream.clear();
+    for (std::size_t i = 0; i < messages_; i++) {
+      proto_send(sstream, msg);
+    }
+    for (std::size_t i = 0; i < messages_; i++) {
+      proto_recv(sstream)->visit(v_);
+    }
+  });
+
+  // The sender has to run in parallel, otherwise it blocks once the socket buffers are full.
+  measure(name, "tcp_loopback", size, [&](std::uint64_t &other_allocations) {
+    std::exception_ptr error;
+    std::thread sender([&] {
+      std::uint64_t start_allocations = bench_allocations();
+      try {
+        for (std::size_t i = 0; i < messages_; i++) {
+          proto_send(*tcp_.client, msg);
+        }
+      } catch (...) {
+        error = std::current_exception();
+        tcp_.client.reset();  // Lets the receiver fail instead of waiting forever.
+      }
+      other_allocations += bench_allocations() - start_allocations;
+    });
+    try {
+      for (std::size_t i = 0; i < messages_; i++) {
+        proto_recv(*tcp_.server)->visit(v_);
+      }
+    } catch (...) {
+      sender.join();
+      throw;
+    }
+    sender.join();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  });
+}
+
+}  // namespace
+
+int bench_protocol_messages(int argc, char *argv[]) {
+  std::size_t messages = argc > 0 ? atoll(argv[0]) : 100000;
+  int rounds = argc > 1 ? atoi(argv[1]) : 5;
+  tcp_port port = argc > 2 ? atoi(argv[2]) : 40021;
+  if (messages == 0 || rounds <= 0) {
+    throw std::invalid_argument("messages and rounds should be positive");
+  }
+
+  tcp_pair tcp;
+  tcp_server_socket server("127.0.0.1", port);
+  tcp.client.reset(new tcp_client_socket("127.0.0.1", port));
+  tcp.client->connect();
+  tcp.server.reset(server.accept_one_client());
+
+  message_bench b(messages, rounds, tcp);
+  std::cout << "message\tpath\tmessages_per_sec\tns_per_message\tallocs_per_message\tbytes_per_message" << std::endl;
+  b.run<RegistrationMessage>("RegistrationMessage");
+  b.run<LoginMessage>("LoginMessage");
+  b.run<RegistrationResponse>("RegistrationResponse");
+  b.run<BalanceInquiryRequest>("BalanceInquiryRequest");
+  b.run<BalanceInquiryResponse>("BalanceInquiryResponse");
+  b.run<TransferRequest>("TransferRequest");
+  b.run<OperationSucceeded>("OperationSucceeded");
+  b.run<BatchTransferRequest>("BatchTransferRequest");
+  b.run<BatchTransferResponse>("BatchTransferResponse");
+  b.run<StatsRequest>("StatsRequest");
+  b.run<StatsResponse>("StatsResponse");
+  b.run<HelloMessage>("HelloMessage");
+  b.run<HelloResponse>("HelloResponse");
+  return 0;
+}
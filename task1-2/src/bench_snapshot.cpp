@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "account_store.h"
+#include "bench.h"
+#include "snapshot.h"
+
+namespace {
+
+// Transfers per second in a background thread while `action` runs.
+template<typename F>
+double transfers_during(account_store &store, F action) {
+  std::atomic<bool> stop(false);
+  std::uint64_t done = 0;
+  std::thread th([&] {
+    xorshift rng(1);
+    std::uint64_t accounts = store.size();
+    for (; !stop; done++) {
+      std::uint64_t r = rng();
+      store.transfer(r % accounts, (r >> 32) % accounts, 1);
+    }
+  });
+  bench_timer timer;
+  action();
+  stop = true;
+  th.join();
+  return done / timer.seconds();
+}
+
+}  // namespace
+
+int bench_snapshot(int argc, char *argv[]) {
+  std::uint64_t accounts = argc > 0 ? atoll(argv[0]) : 10000000;
+  // Should be on the disk under test, not on tmpfs.
+  std::string path = argc > 1 ? argv[1] : "bench_snapshot.tmp";
+  if (accounts == 0) {
+    throw std::invalid_argument("accounts should be positive");
+  }
+
+  account_store store;
+  for (std::uint64_t i = 0; i < accounts; i++) {
+    store.register_new_client();
+  }
+
+  double idle_tps = transfers_during(store, [] { std::this_thread::sleep_for(std::chrono::milliseconds(500)); });
+  double save_seconds = 0;
+  double saving_tps = transfers_during(store, [&] {
+    bench_timer timer;
+    save_snapshot(store, path, nullptr);
+    save_seconds = timer.seconds();
+  });
+
+  // What a restarting server does before it can serve the first request.
+  bench_timer timer;
+  account_store loaded;
+  load_snapshot(loaded, path);
+  t_balance first = loaded.get_amount(accounts - 1);
+  double first_request_seconds = timer.seconds();
+  (void)first;
+  remove(path.c_str());
+
+  std::cout << "accounts\tsave_seconds\ttransfers_per_sec_idle\ttransfers_per_sec_saving\tfirst_request_seconds" << std::endl;
+  std::cout << accounts << "\t" << save_seconds << "\t" << idle_tps << "\t" << saving_tps << "\t"
+            << first_request_seconds << std::endl;
+  return 0;
+}
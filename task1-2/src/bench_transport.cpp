@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "bench.h"
+#include "buffered_socket.h"
+#include "epoll_server.h"
+#include "log.h"
+#include "protocol.h"
+#include "tcp_socket.h"
+#include "uring_server.h"
+
+namespace {
+
+const char *const HOST = "127.0.0.1";
+const unsigned CLIENT_THREADS = 2;
+const unsigned SERVER_THREADS = 2;
+const int DEPTH = 8;  // Requests in flight per connection.
+
+// Answers balance inquiries with a constant, so that only the transport is measured.
+struct balance_handler : DefaultMessageVisitor {
+  explicit balance_handler(stream_socket *sock) : sock_(sock) {}
+
+  void accept(const BalanceInquiryRequest&) override {
+    BalanceInquiryResponse response;
+    response.balance = 42;
+    proto_send(*sock_, response);
+  }
+
+private:
+  stream_socket *sock_;
+};
+
+// The threads mode of the server: blocking sends and receives, one thread per connection.
+void serve_blocking(std::unique_ptr<tcp_connection_socket> client) {
+  buffered_socket sock(*client);
+  balance_handler handler(&sock);
+  AnyMessage msg;
+  try {
+    for (;;) {
+      proto_recv(sock, msg);
+      msg.visit(handler);
+      char header[16];
+      std::size_t size = proto_message_size(header, sock.peek(header, sizeof header));
+      if (size == 0 || sock.buffered_input() < size) {
+        sock.flush();
+      }
+    }
+  } catch (const socket_error&) {
+  }
+}
+
+/*
+ * CLIENT_THREADS threads keep DEPTH requests in flight on each of their
+ * connections: a round sends a batch to every connection, then reads all the answers.
+ */
+double measure(tcp_port port, int connections, double seconds, const std::function<void(std::unique_ptr<tcp_connection_socket>)> &serve) {
+  tcp_server_socket listener(HOST, port);
+  std::thread acceptor([&] {
+    for (int i = 0; i < connections; i++) {
+      serve(std::unique_ptr<tcp_connection_socket>(listener.accept_one_client()));
+    }
+  });
+  std::vector<std::vector<std::unique_ptr<tcp_client_socket>>> clients(CLIENT_THREADS);
+  for (int i = 0; i < connections; i++) {
+    std::unique_ptr<tcp_client_socket> client(new tcp_client_socket(HOST, port));
+    client->connect();
+    clients[i % CLIENT_THREADS].push_back(std::move(client));
+  }
+  acceptor.join();
+
+  MessageBatch<> batch;
+  for (int i = 0; i < DEPTH; i++) {
+    batch.add(BalanceInquiryRequest());
+  }
+  const std::size_t response_size = DEPTH * (1 + BalanceInquiryResponse::fixed_size());
+
+  std::atomic<bool> stop(false);
+  std::atomic<std::uint64_t> requests(0);
+  std::vector<std::thread> threads;
+  bench_timer timer;
+  for (unsigned t = 0; t < CLIENT_THREADS; t++) {
+    threads.emplace_back([&, t] {
+      auto &own = clients[t];
+      std::vector<char> responses(response_size);
+      std::uint64_t done = 0;
+      while (!stop) {
+        for (auto &client : own) {
+          client->send(batch.data(), batch.size());
+        }
+        for (auto &client : own) {
+          client->recv(responses.data(), responses.size());
+        }
+        done += DEPTH * own.size();
+      }
+      requests += done;
+    });
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  stop = true;
+  for (auto &th : threads) {
+    th.join();
+  }
+  return requests / timer.seconds();
+}
+
+}  // namespace
+
+int bench_transport(int argc, char *argv[]) {
+  int connections = argc > 0 ? atoi(argv[0]) : 64;
+  double seconds = argc > 1 ? atof(argv[1]) : 3;
+  tcp_port port = argc > 2 ? atoi(argv[2]) : 40041;
+  if (connections <= 0 || seconds <= 0) {
+    throw std::invalid_argument("connections and seconds should be positive");
+  }
+  log_set_level(log_level::error);  // Servers warn about every client which disconnects.
+  auto factory = [](stream_socket *sock) {
+    return std::unique_ptr<MessageVisitor>(new balance_handler(sock));
+  };
+
+  std::cout << "backend\tconnections\trequests_per_sec" << std::endl;
+  // Blocking server threads exit once the clients disconnect.
+  std::cout << "blocking\t" << connections << "\t"
+            << measure(port++, connections, seconds, [](std::unique_ptr<tcp_connection_socket> client) {
+                 std::thread(serve_blocking, std::move(client)).detach();
+               }) << std::endl;
+  {
+    epoll_server server(SERVER_THREADS, factory);
+    std::cout << "epoll\t" << connections << "\t"
+              << measure(port++, connections, seconds, [&server](std::unique_ptr<tcp_connection_socket> client) {
+                   server.add_client(std::move(client));
+                 }) << std::endl;
+  }
+  if (!uring_server::supported()) {
+    std::cerr << "io_uring is not available, skipping it" << std::endl;
+    return 0;
+  }
+  {
+    uring_server server(SERVER_THREADS, factory);
+    std::cout << "uring\t" << connections << "\t"
+              << measure(port++, connections, seconds, [&server](std::unique_ptr<tcp_connection_socket> client) {
+                   server.add_client(std::move(client));
+                 }) << std::endl;
+  }
+  return 0;
+}
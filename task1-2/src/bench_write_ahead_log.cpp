@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "account_store.h"
+#include "bench.h"
+#include "write_ahead_log.h"
+
+namespace {
+
+const std::size_t ACCOUNTS = 1000;
+
+// Every thread acts as a client which waits for each transfer to become durable.
+double run(const std::string &path, std::chrono::microseconds window, unsigned threads_count, int ops) {
+  remove(path.c_str());
+  account_store store;
+  write_ahead_log wal(path, window);
+  store.set_journal(&wal);
+  for (std::size_t i = 0; i < ACCOUNTS; i++) {
+    store.register_new_client();
+  }
+  wal.sync();
+
+  std::vector<std::thread> threads;
+  bench_timer timer;
+  for (unsigned t = 0; t < threads_count; t++) {
+    threads.emplace_back([&store, &wal, t, ops] {
+      xorshift rng(t);
+      for (int i = 0; i < ops; i++) {
+        std::uint64_t r = rng();
+        store.transfer(r % ACCOUNTS, (r >> 32) % ACCOUNTS, 1);
+        wal.sync();
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  double result = ops * static_cast<double>(threads_count) / timer.seconds();
+  remove(path.c_str());
+  return result;
+}
+
+}  // namespace
+
+int bench_write_ahead_log(int argc, char *argv[]) {
+  unsigned threads = argc > 0 ? atoi(argv[0]) : 32;
+  int ops = argc > 1 ? atoi(argv[1]) : 200;
+  // Should be on the disk under test, not on tmpfs.
+  std::string path = argc > 2 ? argv[2] : "bench_wal.tmp";
+  if (threads == 0 || ops <= 0) {
+    throw std::invalid_argument("threads and operations should be positive");
+  }
+
+  const long windows_us[] = {0, 100, 250, 500, 1000, 2000, 5000};
+  std::cout << "window_us\tthreads\tdurable_transfers_per_sec" << std::endl;
+  for (long window : windows_us) {
+    std::cout << window << "\t" << threads << "\t"
+              << run(path, std::chrono::microseconds(window), threads, ops) << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include <string.h>
+#include <algorithm>
+#include "buffered_socket.h"
+
+buffered_socket::buffered_socket(stream_socket &inner, std::size_t read_capacity, std::size_t write_capacity,
+                                 flush_hook before_flush)
+    : inner_(inner), before_flush_(before_flush), read_buf_(read_capacity), write_buf_(write_capacity),
+      write_size_(0) {}
+
+void buffered_socket::send(const void *buf, size_t size) {
+  const_buffer b = {buf, size};
+  sendv(&b, 1);
+}
+
+void buffered_socket::sendv(const const_buffer *bufs, size_t count) {
+  std::size_t total = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    total += bufs[i].size;
+  }
+  if (write_buf_.size() - write_size_ < total && total < write_buf_.size()) {
+    flush();
+  }
+  if (total < write_buf_.size()) {
+    for (std::size_t i = 0; i < count; i++) {
+      memcpy(write_buf_.data() + write_size_, bufs[i].data, bufs[i].size);
+      write_size_ += bufs[i].size;
+    }
+    return;
+  }
+
+  // Too large to be coalesced: sent straight from the caller's memory right after the buffered data.
+  const std::size_t MAX_JOINED = 8;
+  if (write_size_ == 0 || count >= MAX_JOINED) {
+    flush();
+    if (before_flush_) {
+      before_flush_();
+    }
+    inner_.sendv(bufs, count);
+    return;
+  }
+  if (before_flush_) {
+    before_flush_();
+  }
+  const_buffer joined[MAX_JOINED];
+  joined[0] = const_buffer{write_buf_.data(), write_size_};
+  std::copy(bufs, bufs + count, joined + 1);
+  write_size_ = 0;
+  inner_.sendv(joined, count + 1);
+}
+
+void buffered_socket::flush() {
+  if (write_size_ == 0) {
+    return;
+  }
+  if (before_flush_) {
+    before_flush_();
+  }
+  std::size_t size = write_size_;
+  write_size_ = 0;
+  inner_.send(write_buf_.data(), size);
+}
+
+void buffered_socket::fill() {
+  auto region = read_buf_.write_region();
+  read_buf_.commit(inner_.recv_some(region.first, region.second));
+}
+
+void buffered_socket::recv(void *buf, size_t size) {
+  char *dst = static_cast<char*>(buf);
+  while (size > 0) {
+    if (read_buf_.empty()) {
+      if (size >= read_buf_.capacity()) {
+        inner_.recv(dst, size);  // Too large to be buffered.
+        return;
+      }
+      fill();
+    }
+    std::size_t n = read_buf_.read(dst, size);
+    dst += n;
+    size -= n;
+  }
+}
+
+size_t buffered_socket::recv_some(void *buf, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  if (read_buf_.empty()) {
+    fill();
+  }
+  return read_buf_.read(buf, size);
+}
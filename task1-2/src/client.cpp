@@ -1,70 +1,131 @@
 #include <assert.h>
+#include <chrono>
 #include <iostream>
 #include <limits>
 #include <string>
+#include "buffered_socket.h"
 #include "protocol.h"
+#include "request_pipeline.h"
 #include "tcp_socket.h"
 
+// The server is considered dead if it does not answer for that long.
+const std::chrono::seconds CONNECT_TIMEOUT(10);
+const std::chrono::seconds RESPONSE_TIMEOUT(30);
+
 void help() {
   std::cout << "Available commands:\n"
             << "  register - register as a new client\n"
             << "  login <id> - login as an existing client\n"
             << "  balance - request current balance\n"
-            << "  transfer <id> <amount> - transfer <amount> to another client <id>" << std::endl;
+            << "  transfer <id> <amount> - transfer <amount> to another client <id>\n"
+            << "  batch <n> <id1> <amount1> ... <idn> <amountn> - make n transfers at once, either all or none\n"
+            << "  stats - print server metrics" << std::endl;
 }
 
-void wait_confirmation(stream_client_socket &sock) {
-  std::cout << "Waiting for confirmation..." << std::endl;
-  auto response = proto_recv(sock);
-  dynamic_cast<OperationSucceeded&>(*response);
+void confirm() {
   std::cout << "Confirmed." << std::endl;
 }
 
-void do_register(stream_client_socket &sock) {
-  proto_send(sock, RegistrationMessage());
-  auto msg_ptr = proto_recv(sock);
-  auto &msg = dynamic_cast<RegistrationResponse&>(*msg_ptr);
-  std::cout << "Your client id is " << msg.client_id << "." << std::endl;
+void do_register(request_pipeline &pipeline) {
+  pipeline.send(RegistrationMessage(), expect_response<RegistrationResponse>([](const RegistrationResponse &msg) {
+    std::cout << "Your client id is " << msg.client_id << "." << std::endl;
+  }));
 }
 
-void do_login(stream_client_socket &sock) {
+void do_login(request_pipeline &pipeline) {
   LoginMessage msg;
   assert(std::cin >> msg.client_id);
-  proto_send(sock, msg);
-  wait_confirmation(sock);
+  pipeline.send(msg, expect_response<OperationSucceeded>([](const OperationSucceeded&) { confirm(); }));
 }
 
-void do_balance(stream_client_socket &sock) {
-  proto_send(sock, BalanceInquiryRequest());
-  auto msg_ptr = proto_recv(sock);
-  auto &msg = dynamic_cast<BalanceInquiryResponse&>(*msg_ptr);
-  std::cout << "Your balance is " << msg.balance << "." << std::endl;
+void do_balance(request_pipeline &pipeline) {
+  pipeline.send(BalanceInquiryRequest(), expect_response<BalanceInquiryResponse>([](const BalanceInquiryResponse &msg) {
+    std::cout << "Your balance is " << msg.balance << "." << std::endl;
+  }));
 }
 
-void do_transfer(stream_client_socket &sock) {
+void do_transfer(request_pipeline &pipeline) {
   TransferRequest msg;
   assert(std::cin >> msg.transfer_to);
   assert(std::cin >> msg.amount);
-  proto_send(sock, msg);
-  wait_confirmation(sock);
+  pipeline.send(msg, expect_response<OperationSucceeded>([](const OperationSucceeded&) { confirm(); }));
+}
+
+void do_batch(request_pipeline &pipeline) {
+  std::size_t n;
+  assert(std::cin >> n);
+  BatchTransferRequest msg;
+  msg.items.resize(n);
+  for (auto &item : msg.items) {
+    assert(std::cin >> item.transfer_to);
+    assert(std::cin >> item.amount);
+  }
+  pipeline.send(msg, expect_response<BatchTransferResponse>([](const BatchTransferResponse &resp) {
+    bool applied = true;
+    for (std::size_t i = 0; i < resp.statuses.size(); i++) {
+      if (resp.statuses[i] == BatchTransferResponse::UNKNOWN_CLIENT) {
+        std::cout << "Transfer #" << i + 1 << ": unknown client." << std::endl;
+      }
+      applied = applied && resp.statuses[i] == BatchTransferResponse::OK;
+    }
+    std::cout << (applied ? "All transfers confirmed." : "No transfers were made.") << std::endl;
+  }));
+}
+
+void do_stats(request_pipeline &pipeline) {
+  pipeline.send(StatsRequest(), expect_response<StatsResponse>([](const StatsResponse &resp) {
+    std::cout << resp.text << std::flush;
+  }));
+}
+
+// Agrees on the compact encoding with the server, stays with the fixed one if it declines.
+void negotiate_compact(request_pipeline &pipeline) {
+  HelloMessage hello;
+  hello.version = PROTO_VERSION;
+  hello.capabilities = PROTO_CAP_COMPACT;
+  std::uint32_t capabilities = 0;
+  pipeline.send(hello, expect_response<HelloResponse>([&](const HelloResponse &resp) {
+    capabilities = resp.capabilities;
+  }));
+  pipeline.drain();
+  pipeline.set_encoding(proto_agreed_encoding(capabilities));
+  std::cout << "Using " << (capabilities & PROTO_CAP_COMPACT ? "compact" : "fixed") << " encoding." << std::endl;
 }
 
-void work(stream_client_socket &sock) {
+/*
+ * Commands which are already available in the input (e.g. when it is
+ * piped from a file) are pipelined: their requests are sent without
+ * waiting for responses, which are printed once the input runs dry.
+ */
+void work(request_pipeline &pipeline) {
   for (;;) {
-    std::cout << ">>> ";
+    if (std::cin.rdbuf()->in_avail() <= 0) {
+      if (pipeline.outstanding() > 0) {
+        std::cout << "Waiting for " << pipeline.outstanding() << " response(s)..." << std::endl;
+      }
+      pipeline.drain();
+      std::cout << ">>> " << std::flush;
+    }
 
     std::string command;
-    std::cin >> command;
+    if (!(std::cin >> command)) {
+      pipeline.drain();
+      break;
+    }
     if (command == "help") {
       help();
     } else if (command == "register") {
-      do_register(sock);
+      do_register(pipeline);
     } else if (command == "login") {
-      do_login(sock);
+      do_login(pipeline);
     } else if (command == "balance") {
-      do_balance(sock);
+      do_balance(pipeline);
     } else if (command == "transfer") {
-      do_transfer(sock);
+      do_transfer(pipeline);
+    } else if (command == "batch") {
+      do_batch(pipeline);
+    } else if (command == "stats") {
+      do_stats(pipeline);
     } else {
       std::cout << "Unknown command, type 'help' to get help." << std::endl;
     }
@@ -75,21 +136,36 @@ void work(stream_client_socket &sock) {
 int main(int argc, char* argv[]) {
   std::string host = "127.0.0.1";
   int port = 40001;
+  bool compact = false;
 
-  if (argc > 1) {
-    host = argv[1];
-  }
-  if (argc > 2) {
-    port = atoi(argv[2]);
+  int positional = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--compact") {
+      compact = true;
+    } else if (positional++ == 0) {
+      host = arg;
+    } else {
+      port = atoi(arg.c_str());
+    }
   }
 
+  // Lets work() see whether more commands are already available.
+  std::ios::sync_with_stdio(false);
+
   try {
     std::cout << "Trying to connect on " << host << ":" << port << "..." << std::endl;
     tcp_client_socket sock(host.c_str(), port);
-    sock.connect();
+    sock.connect(std::chrono::steady_clock::now() + CONNECT_TIMEOUT);
     std::cout << "Connected." << std::endl;
 
-    work(sock);
+    deadline_socket timed(sock.connection(), RESPONSE_TIMEOUT);
+    buffered_socket buffered(timed);
+    request_pipeline pipeline(buffered);
+    if (compact) {
+      negotiate_compact(pipeline);
+    }
+    work(pipeline);
   } catch (const std::exception &e) {
     std::cout << "Exception caught: " << e.what() << std::endl;
     return 1;
@@ -0,0 +1,274 @@
+#include <inttypes.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include "buffered_socket.h"
+#include "client_handler.h"
+#include "log.h"
+#include "metrics.h"
+
+account_store accounts;
+std::unique_ptr<write_ahead_log> wal;
+std::unique_ptr<transfer_sequencer> sequencer;
+std::unique_ptr<replication_primary> primary;
+std::unique_ptr<replication_replica> replica;
+std::chrono::milliseconds max_staleness(1000);
+
+namespace {
+
+// Whether the current thread has modified accounts since it last waited for the log.
+thread_local bool wal_pending = false;
+
+const char* message_name(std::uint8_t id) {
+  switch (id) {
+  case RegistrationMessage::ID: return "RegistrationMessage";
+  case LoginMessage::ID: return "LoginMessage";
+  case BalanceInquiryRequest::ID: return "BalanceInquiryRequest";
+  case TransferRequest::ID: return "TransferRequest";
+  case BatchTransferRequest::ID: return "BatchTransferRequest";
+  case StatsRequest::ID: return "StatsRequest";
+  case HelloMessage::ID: return "HelloMessage";
+  default: return nullptr;
+  }
+}
+
+std::string format_stats(const metrics_snapshot &m) {
+  std::stringstream out;
+  out << "accounts " << accounts.size() << "\n"
+      << "connections_active " << m[metric_counter::connections_opened] - m[metric_counter::connections_closed] << "\n"
+      << "connections_opened " << m[metric_counter::connections_opened] << "\n"
+      << "bytes_received " << m[metric_counter::bytes_received] << "\n"
+      << "bytes_sent " << m[metric_counter::bytes_sent] << "\n"
+      << "lock_waits " << m[metric_counter::lock_waits] << "\n";
+  if (primary) {
+    out << "replication_replicas " << primary->replicas() << "\n"
+        << "replication_position " << primary->position() << "\n";
+  }
+  if (replica) {
+    out << "replication_connected " << replica->connected() << "\n"
+        << "replication_position " << replica->position() << "\n"
+        << "replication_staleness_ms " << replica->staleness().count() << "\n";
+  }
+  auto percentiles = [&](const std::string &prefix, const histogram &h) {
+    out << prefix << "p50_ns " << h.percentile(50) << "\n"
+        << prefix << "p90_ns " << h.percentile(90) << "\n"
+        << prefix << "p99_ns " << h.percentile(99) << "\n"
+        << prefix << "p99.9_ns " << h.percentile(99.9) << "\n"
+        << prefix << "max_ns " << h.max() << "\n";
+  };
+  percentiles("lock_wait_", m.lock_wait_ns);
+  for (std::size_t id = 0; id <= METRICS_MAX_MESSAGE_ID; id++) {
+    const metrics_snapshot::request_stats &r = m.requests[id];
+    const char *name = message_name(id);
+    if (!name || r.service_ns.count() == 0) {
+      continue;
+    }
+    std::string prefix = std::string("requests.") + name + ".";
+    out << prefix << "count " << r.service_ns.count() << "\n"
+        << prefix << "errors " << r.errors << "\n";
+    percentiles(prefix + "service_", r.service_ns);
+  }
+  return out.str();
+}
+
+/*
+ * Every request is recorded in metrics with its service time, from the
+ * moment it is decoded until its response is buffered. Requests which
+ * throw are counted as errors, the connection is closed then.
+ * A replica refuses modifications, and reads while it is staler than
+ * max_staleness, so that the client goes to another server.
+ */
+class ClientHandler : public DefaultMessageVisitor {
+public:
+  ClientHandler(stream_socket *sock)
+      : sock_(sock), client_id_(-1), encoding_(proto_encoding::fixed), handshake_over_(false) {
+    metrics_add(metric_counter::connections_opened);
+  }
+  ~ClientHandler() {
+    metrics_add(metric_counter::connections_closed);
+  }
+
+  void accept(const RegistrationMessage&) {
+    request_timer timer(RegistrationMessage::ID);
+    handshake_over_ = true;
+    LOG(log_level::debug, "Received RegistrationMessage()");
+    check_writable();
+    client_id_ = accounts.register_new_client();
+    wal_pending = true;
+
+    RegistrationResponse resp;
+    resp.client_id = client_id_;
+    proto_send(*sock_, resp, encoding_);
+  }
+
+  void accept(const LoginMessage &m) {
+    request_timer timer(LoginMessage::ID);
+    handshake_over_ = true;
+    LOG(log_level::debug, "Received LoginMessage(client_id=%" PRIu64 ")", m.client_id);
+    check_fresh();
+    client_id_ = m.client_id;
+    accounts.get_amount(client_id_);  // Check that client exists.
+    proto_send(*sock_, OperationSucceeded(), encoding_);
+  }
+
+  void accept(const BalanceInquiryRequest&) {
+    request_timer timer(BalanceInquiryRequest::ID);
+    handshake_over_ = true;
+    LOG(log_level::debug, "Received BalanceInquiryRequest()");
+    check_fresh();
+
+    BalanceInquiryResponse resp;
+    resp.balance = accounts.get_amount(client_id_);
+    proto_send(*sock_, resp, encoding_);
+  }
+
+  void accept(const TransferRequest &m) {
+    request_timer timer(TransferRequest::ID);
+    handshake_over_ = true;
+    LOG(log_level::debug, "Received TransferRequest(to=%" PRIu64 ", amount=%" PRId64 ")", m.transfer_to, m.amount);
+    check_writable();
+    if (sequencer) {
+      sequencer->transfer(client_id_, m.transfer_to, m.amount);
+    } else {
+      accounts.transfer(client_id_, m.transfer_to, m.amount);
+    }
+    wal_pending = true;
+    proto_send(*sock_, OperationSucceeded(), encoding_);
+  }
+
+  void accept(const BatchTransferRequest &m) {
+    request_timer timer(BatchTransferRequest::ID);
+    handshake_over_ = true;
+    LOG(log_level::debug, "Received BatchTransferRequest(items=%zu)", m.items.size());
+    check_writable();
+    accounts.check_exists(client_id_);  // A sender which is not logged in fails the connection, as for TransferRequest.
+    BatchTransferResponse resp;
+    resp.statuses.resize(m.items.size(), BatchTransferResponse::OK);
+    bool valid = true;
+    for (std::size_t i = 0; i < m.items.size(); i++) {
+      if (!accounts.exists(m.items[i].transfer_to)) {
+        resp.statuses[i] = BatchTransferResponse::UNKNOWN_CLIENT;
+        valid = false;
+      }
+    }
+    if (valid) {
+      if (sequencer) {
+        sequencer->transfer_batch(client_id_, m.items);
+      } else {
+        accounts.transfer_batch(client_id_, m.items);
+      }
+      wal_pending = true;
+    } else {
+      for (auto &status : resp.statuses) {
+        if (status == BatchTransferResponse::OK) {
+          status = BatchTransferResponse::NOT_APPLIED;
+        }
+      }
+    }
+    proto_send(*sock_, resp, encoding_);
+  }
+
+  void accept(const StatsRequest&) {
+    request_timer timer(StatsRequest::ID);
+    handshake_over_ = true;
+    LOG(log_level::debug, "Received StatsRequest()");
+    StatsResponse resp;
+    resp.text = format_stats(metrics_collect());
+    proto_send(*sock_, resp, encoding_);
+  }
+
+  /*
+   * Only the first message may be a Hello, so the encoding can not change
+   * under requests already in flight. The response is in the fixed
+   * encoding, the agreed one is used after it.
+   */
+  void accept(const HelloMessage &m) {
+    request_timer timer(HelloMessage::ID);
+    LOG(log_level::debug, "Received HelloMessage(version=%" PRIu32 ", capabilities=%" PRIu32 ")", m.version, m.capabilities);
+    if (handshake_over_) {
+      throw std::runtime_error("HelloMessage should be the first message");
+    }
+    handshake_over_ = true;
+    HelloResponse resp;
+    resp.version = PROTO_VERSION;
+    resp.capabilities = m.capabilities & PROTO_CAP_COMPACT;
+    proto_send(*sock_, resp);
+    encoding_ = proto_agreed_encoding(resp.capabilities);
+  }
+
+  proto_encoding encoding() const override { return encoding_; }
+
+private:
+  void check_writable() {
+    if (replica) {
+      throw std::runtime_error("This server is a read-only replica");
+    }
+  }
+
+  void check_fresh() {
+    if (replica && replica->staleness() > max_staleness) {
+      throw std::runtime_error("The replica is too stale");
+    }
+  }
+
+  stream_socket *sock_;
+  std::uint64_t client_id_;
+  proto_encoding encoding_;
+  bool handshake_over_;  // HelloMessage is not accepted anymore.
+};
+
+// Whether a complete request can be received without blocking. A malformed one is left to proto_recv() to report.
+bool has_buffered_request(const buffered_socket &sock, proto_encoding encoding) {
+  char header[16];
+  std::size_t size;
+  try {
+    size = proto_message_size(header, sock.peek(header, sizeof header), encoding);
+  } catch (const protocol_error &) {
+    return false;
+  }
+  return size > 0 && sock.buffered_input() >= size;
+}
+
+}  // namespace
+
+void wait_durable() {
+  if (wal && wal_pending) {
+    wal->sync();
+    wal_pending = false;
+  }
+}
+
+std::unique_ptr<MessageVisitor> make_client_handler(stream_socket *sock) {
+  return std::unique_ptr<MessageVisitor>(new ClientHandler(sock));
+}
+
+/*
+ * Requests are pipelined: all requests which have already arrived are
+ * processed before the accumulated responses are flushed in a single write.
+ * With the write-ahead log, the whole group also shares one wait for the disk,
+ * which the socket makes before any responses leave, also when its buffer fills.
+ * If a request fails, the responses to the ones before it are still sent
+ * (once durable) before the connection is closed.
+ */
+void process_client(std::unique_ptr<stream_socket> client) {
+  buffered_socket sock(*client, buffered_socket::DEFAULT_CAPACITY, buffered_socket::DEFAULT_CAPACITY, wait_durable);
+  ClientHandler handler(&sock);
+  AnyMessage msg;
+  for (;;) {
+    try {
+      proto_recv(sock, msg, handler.encoding());
+      msg.visit(handler);
+      if (!has_buffered_request(sock, handler.encoding())) {
+        sock.flush();
+      }
+    } catch (const std::exception &e) {
+      LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+      try {
+        sock.flush();
+      } catch (const std::exception &) {
+        // Responses which cannot be made durable or sent are dropped with the connection.
+      }
+      break;
+    }
+  }
+}
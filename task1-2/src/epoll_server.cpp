@@ -0,0 +1,263 @@
+#include "epoll_server.h"
+#include "log.h"
+#include "output_buffer_socket.h"
+
+#ifdef __linux__
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void ensure_errno(bool condition, const char *what) {
+  if (!condition) {
+    throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+  }
+}
+
+struct connection {
+  connection(std::unique_ptr<tcp_connection_socket> s)
+      : sock(std::move(s)), out_pos(0), out_sock(&out), events(EPOLLIN), throttled(false), closing(false) {}
+
+  std::unique_ptr<tcp_connection_socket> sock;
+  std::string in;
+  std::string out;
+  std::size_t out_pos;
+  output_buffer_socket out_sock;
+  std::unique_ptr<MessageVisitor> handler;
+  std::uint32_t events;  // Requested epoll events.
+  bool throttled;        // Requests are left in `in` because of pending output.
+  bool closing;          // A request has failed, closed once the output before it is flushed.
+};
+
+}  // namespace
+
+class epoll_server::event_loop {
+public:
+  explicit event_loop(const flush_hook &before_flush) : before_flush_(before_flush), stopping_(false) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    ensure_errno(epoll_fd_ != -1, "epoll_create1");
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ensure_errno(wake_fd_ != -1, "eventfd");
+    epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    ensure_errno(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == 0, "epoll_ctl");
+    thread_ = std::thread(&event_loop::run, this);
+  }
+
+  ~event_loop() {
+    stopping_ = true;
+    std::uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof one);
+    assert(written == sizeof one);
+    (void)written;
+    thread_.join();
+    connections_.clear();
+    close(wake_fd_);
+    close(epoll_fd_);
+  }
+
+  void add_client(std::unique_ptr<connection> conn) {
+    conn->sock->set_nonblocking(true);
+    connection *c = conn.get();
+    {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      connections_[c] = std::move(conn);
+    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, c->sock->native_handle(), &ev) != 0) {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      connections_.erase(c);
+      ensure_errno(false, "epoll_ctl");
+    }
+  }
+
+private:
+  static const int MAX_EVENTS = 256;
+  static const std::size_t READ_CHUNK = 64 * 1024;
+
+  void run() {
+    epoll_event events[MAX_EVENTS];
+    std::unique_ptr<char[]> read_buf(new char[READ_CHUNK]);
+    std::vector<connection*> ready;
+    while (!stopping_) {
+      int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        LOG(log_level::error, "epoll_wait failed: %s", strerror(errno));
+        return;
+      }
+      ready.clear();
+      for (int i = 0; i < n; i++) {
+        connection *c = static_cast<connection*>(events[i].data.ptr);
+        if (c == nullptr) {
+          continue;  // Woken up by the destructor.
+        }
+        try {
+          if (events[i].events & EPOLLOUT) {
+            send_pending(*c);
+          }
+          if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            std::size_t got = c->sock->recv_some(read_buf.get(), READ_CHUNK);
+            c->in.append(read_buf.get(), got);
+          }
+          handle_requests(*c);
+          ready.push_back(c);
+        } catch (const std::exception &e) {
+          LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+          close_connection(c);
+        }
+      }
+
+      if (before_flush_ && !ready.empty()) {
+        try {
+          before_flush_();
+        } catch (const std::exception &e) {
+          LOG(log_level::error, "Exception caught before sending responses: %s", e.what());
+          for (connection *c : ready) {
+            close_connection(c);
+          }
+          continue;
+        }
+      }
+      for (connection *c : ready) {
+        try {
+          flush(*c);
+        } catch (const std::exception &e) {
+          LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+          close_connection(c);
+        }
+      }
+    }
+  }
+
+  /*
+   * Handles complete requests from the read buffer until the output is over
+   * MAX_PENDING_OUTPUT. If a request fails, the responses to the ones before
+   * it are still flushed, see flush().
+   */
+  void handle_requests(connection &c) {
+    std::size_t pos = 0;
+    AnyMessage msg;
+    c.throttled = false;
+    try {
+      while (std::size_t size = proto_decode(c.in.data() + pos, c.in.size() - pos, msg, c.handler->encoding())) {
+        msg.visit(*c.handler);
+        pos += size;
+        if (c.out.size() - c.out_pos >= MAX_PENDING_OUTPUT) {
+          c.throttled = true;
+          break;
+        }
+      }
+    } catch (const std::exception &e) {
+      LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+      c.closing = true;
+    }
+    c.in.erase(0, pos);
+  }
+
+  // Sends as much output as the socket takes, which was made durable in an earlier round.
+  void send_pending(connection &c) {
+    if (c.out_pos < c.out.size()) {
+      c.out_pos += c.sock->send_some(c.out.data() + c.out_pos, c.out.size() - c.out_pos);
+    }
+    if (c.out_pos == c.out.size()) {
+      c.out.clear();
+      c.out_pos = 0;
+    }
+  }
+
+  /*
+   * Reading stops while the output is over MAX_PENDING_OUTPUT. A throttled
+   * connection waits for EPOLLOUT even with all its output sent, as its
+   * buffered requests are handled on that event.
+   */
+  void flush(connection &c) {
+    send_pending(c);
+    if (c.closing) {
+      close_connection(&c);  // What the socket has not taken is dropped.
+      return;
+    }
+    std::size_t pending = c.out.size() - c.out_pos;
+    std::uint32_t events = 0;
+    if (pending < MAX_PENDING_OUTPUT) {
+      events |= EPOLLIN;
+    }
+    if (pending > 0 || c.throttled) {
+      events |= EPOLLOUT;
+    }
+    if (events != c.events) {
+      epoll_event ev;
+      memset(&ev, 0, sizeof ev);
+      ev.events = events;
+      ev.data.ptr = &c;
+      ensure_errno(epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.sock->native_handle(), &ev) == 0, "epoll_ctl");
+      c.events = events;
+    }
+  }
+
+  void close_connection(connection *c) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->sock->native_handle(), nullptr);
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connections_.erase(c);
+  }
+
+  flush_hook before_flush_;
+  int epoll_fd_;
+  int wake_fd_;
+  std::atomic<bool> stopping_;
+  std::mutex connections_mutex_;
+  std::map<connection*, std::unique_ptr<connection>> connections_;
+  std::thread thread_;
+};
+
+epoll_server::epoll_server(std::size_t threads, handler_factory factory, flush_hook before_flush)
+    : factory_(factory), next_loop_(0) {
+  if (threads == 0) {
+    throw std::invalid_argument("epoll_server needs at least one event loop");
+  }
+  for (std::size_t i = 0; i < threads; i++) {
+    loops_.emplace_back(new event_loop(before_flush));
+  }
+}
+
+epoll_server::~epoll_server() {}
+
+void epoll_server::add_client(std::unique_ptr<tcp_connection_socket> client) {
+  std::unique_ptr<connection> conn(new connection(std::move(client)));
+  conn->handler = factory_(&conn->out_sock);
+  loops_[next_loop_++ % loops_.size()]->add_client(std::move(conn));
+}
+
+#else  // __linux__
+
+#include <stdexcept>
+
+class epoll_server::event_loop {};
+
+epoll_server::epoll_server(std::size_t, handler_factory, flush_hook) : next_loop_(0) {
+  throw std::runtime_error("epoll_server is available on Linux only");
+}
+
+epoll_server::~epoll_server() {}
+
+void epoll_server::add_client(std::unique_ptr<tcp_connection_socket>) {}
+
+#endif  // __linux__
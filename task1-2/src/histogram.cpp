@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include "histogram.h"
+
+namespace {
+
+int highest_bit(std::uint64_t value) {
+  int bit = 0;
+  while (value >>= 1) {
+    bit++;
+  }
+  return bit;
+}
+
+}  // namespace
+
+const int histogram::DEFAULT_PRECISION_BITS;
+const std::uint64_t histogram::MAX_VALUE;
+
+histogram::histogram(int precision_bits)
+    : precision_bits_(precision_bits), count_(0),
+      min_(std::numeric_limits<std::uint64_t>::max()), max_(0), sum_(0) {
+  if (precision_bits < 1 || precision_bits > 16) {
+    throw std::invalid_argument("histogram precision should be in [1, 16] bits");
+  }
+  counts_.resize(index_of(MAX_VALUE) + 1);
+}
+
+/*
+ * Values below EXACT = 2^precision_bits map to themselves. A larger value
+ * is shifted right until it is in [HALF, EXACT), each shift selects
+ * a bucket of HALF slots.
+ */
+std::size_t histogram::index_of(std::uint64_t value) const {
+  const std::uint64_t EXACT = 1ull << precision_bits_;
+  const std::uint64_t HALF = EXACT / 2;
+  if (value < EXACT) {
+    return value;
+  }
+  int shift = highest_bit(value) - (precision_bits_ - 1);
+  return EXACT + (shift - 1) * HALF + ((value >> shift) - HALF);
+}
+
+std::uint64_t histogram::highest_equivalent(std::size_t index) const {
+  const std::uint64_t EXACT = 1ull << precision_bits_;
+  const std::uint64_t HALF = EXACT / 2;
+  if (index < EXACT) {
+    return index;
+  }
+  std::size_t shift = (index - EXACT) / HALF + 1;
+  std::uint64_t base = (index - EXACT) % HALF + HALF;
+  return ((base + 1) << shift) - 1;
+}
+
+void histogram::record(std::uint64_t value, std::uint64_t count) {
+  if (count == 0) {
+    return;
+  }
+  value = std::min(value, MAX_VALUE);
+  counts_[index_of(value)] += count;
+  count_ += count;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+  sum_ += value * count;
+}
+
+void histogram::merge(const histogram &other) {
+  if (other.precision_bits_ != precision_bits_) {
+    throw std::invalid_argument("Unable to merge histograms of different precision");
+  }
+  for (std::size_t i = 0; i < counts_.size(); i++) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+  sum_ += other.sum_;
+}
+
+void histogram::clear() {
+  std::fill(counts_.begin(), counts_.end(), 0);
+  count_ = 0;
+  min_ = std::numeric_limits<std::uint64_t>::max();
+  max_ = 0;
+  sum_ = 0;
+}
+
+std::uint64_t histogram::percentile(double percent) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  percent = std::min(std::max(percent, 0.0), 100.0);
+  // The epsilon keeps e.g. 99.9% of 1000 values at rank 999 despite rounding errors.
+  std::uint64_t rank = static_cast<std::uint64_t>(std::ceil(percent / 100 * count_ - 1e-9));
+  rank = std::max<std::uint64_t>(rank, 1);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < counts_.size(); i++) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(highest_equivalent(i), max_);
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,125 @@
+#include <stdexcept>
+#include "journal_record.h"
+
+namespace {
+
+enum record_type : std::uint8_t {
+  REGISTRATION = 1,
+  TRANSFER = 2,
+  TRANSFER_BATCH = 3,
+};
+
+// Fills in the header of a record whose payload ends at `end`.
+std::size_t finish_record(char *record, const char *end) {
+  std::size_t payload_size = end - record - JOURNAL_RECORD_HEADER_SIZE;
+  char *header = record;
+  put_little_endian(header, payload_size, 4);
+  put_little_endian(header, journal_checksum(record + JOURNAL_RECORD_HEADER_SIZE, payload_size), 4);
+  return end - record;
+}
+
+void ensure_client(account_store &store, t_client_id id) {
+  while (!store.exists(id)) {
+    store.register_new_client();
+  }
+}
+
+}  // namespace
+
+void put_little_endian(char *&out, std::uint64_t value, std::size_t bytes) {
+  for (std::size_t i = 0; i < bytes; i++) {
+    *out++ = static_cast<char>(value >> (8 * i));
+  }
+}
+
+std::uint64_t get_little_endian(const char *&in, std::size_t bytes) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < bytes; i++) {
+    value |= static_cast<std::uint64_t>(static_cast<unsigned char>(*in++)) << (8 * i);
+  }
+  return value;
+}
+
+std::size_t journal_encode_registration(char *record, t_client_id id) {
+  char *out = record + JOURNAL_RECORD_HEADER_SIZE;
+  put_little_endian(out, REGISTRATION, 1);
+  put_little_endian(out, id, 8);
+  return finish_record(record, out);
+}
+
+std::size_t journal_encode_transfer(char *record, t_client_id from, t_client_id to, t_balance amount) {
+  char *out = record + JOURNAL_RECORD_HEADER_SIZE;
+  put_little_endian(out, TRANSFER, 1);
+  put_little_endian(out, from, 8);
+  put_little_endian(out, to, 8);
+  put_little_endian(out, amount, 8);
+  return finish_record(record, out);
+}
+
+std::size_t journal_encode_transfer_batch(char *record, t_client_id from,
+                                          const std::vector<BatchTransferRequest::Item> &items) {
+  char *out = record + JOURNAL_RECORD_HEADER_SIZE;
+  put_little_endian(out, TRANSFER_BATCH, 1);
+  put_little_endian(out, from, 8);
+  put_little_endian(out, items.size(), 4);
+  for (const auto &item : items) {
+    put_little_endian(out, item.transfer_to, 8);
+    put_little_endian(out, item.amount, 8);
+  }
+  return finish_record(record, out);
+}
+
+bool journal_decode_header(const char *header, std::size_t &payload_size, std::uint32_t &checksum) {
+  payload_size = get_little_endian(header, 4);
+  checksum = get_little_endian(header, 4);
+  return payload_size > 0 && payload_size <= JOURNAL_MAX_PAYLOAD_SIZE;
+}
+
+// FNV-1a, good enough to tell a torn write from a complete record.
+std::uint32_t journal_checksum(const char *data, std::size_t size) {
+  std::uint32_t hash = 2166136261u;
+  for (std::size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void journal_apply(account_store &store, const char *payload, std::size_t size) {
+  const char *in = payload;
+  const char *end = payload + size;
+  auto need = [&](std::size_t bytes) {
+    if (static_cast<std::size_t>(end - in) < bytes) {
+      throw std::runtime_error("Corrupted journal record");
+    }
+  };
+  need(1);
+  std::uint8_t type = get_little_endian(in, 1);
+  if (type == REGISTRATION) {
+    need(8);
+    ensure_client(store, get_little_endian(in, 8));
+  } else if (type == TRANSFER) {
+    need(24);
+    t_client_id from = get_little_endian(in, 8);
+    t_client_id to = get_little_endian(in, 8);
+    t_balance amount = get_little_endian(in, 8);
+    ensure_client(store, from);
+    ensure_client(store, to);
+    store.transfer(from, to, amount);
+  } else if (type == TRANSFER_BATCH) {
+    need(12);
+    t_client_id from = get_little_endian(in, 8);
+    std::size_t count = get_little_endian(in, 4);
+    need(count * 16);
+    std::vector<BatchTransferRequest::Item> items(count);
+    ensure_client(store, from);
+    for (auto &item : items) {
+      item.transfer_to = get_little_endian(in, 8);
+      item.amount = get_little_endian(in, 8);
+      ensure_client(store, item.transfer_to);
+    }
+    store.transfer_batch(from, items);
+  } else {
+    throw std::runtime_error("Unknown journal record type");
+  }
+}
@@ -0,0 +1,555 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "histogram.h"
+#include "protocol.h"
+#include "tcp_socket.h"
+#ifdef _WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+/*
+ * Load generator: keeps many connections to the server busy with a mix
+ * of requests and reports throughput and latency percentiles per request type.
+ *
+ * Connections are split between worker threads, each thread waits for
+ * responses on all its connections with poll(). In closed-loop mode every
+ * connection keeps --depth requests in flight and sends a new one as soon
+ * as a response arrives. With --rate the requests are sent on a fixed
+ * schedule regardless of responses, and latency is measured from the
+ * scheduled time, so a stalled server is not hidden by the generator
+ * slowing down along with it.
+ */
+
+namespace {
+
+typedef std::chrono::steady_clock clock;
+
+enum op_type { OP_REGISTER, OP_LOGIN, OP_BALANCE, OP_TRANSFER, OP_COUNT };
+const char *const OP_NAMES[OP_COUNT] = {"register", "login", "balance", "transfer"};
+
+// Keeps the unread responses well below socket buffer sizes, so that the server never blocks on writing.
+const std::size_t MAX_IN_FLIGHT = 256;
+const std::size_t READ_BUFFER_SIZE = 16 * 1024;
+const std::chrono::milliseconds MAX_POLL_INTERVAL(100);
+
+struct options {
+  std::string host = "127.0.0.1";
+  int port = 40001;
+  std::size_t connections = 100;
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  double duration = 10;
+  double rate = 0;
+  std::size_t depth = 1;
+  bool compact = false;
+  std::uint64_t existing = 0;
+  unsigned weights[OP_COUNT] = {1, 4, 45, 50};
+};
+
+struct request {
+  op_type op;
+  clock::time_point start;
+};
+
+struct connection {
+  std::unique_ptr<tcp_client_socket> sock;
+  bool alive = true;
+  std::uint64_t client_id = 0;
+  proto_encoding encoding = proto_encoding::fixed;
+  std::deque<request> in_flight;
+  std::deque<request> queued;  // Scheduled, but waits for in_flight to shrink.
+  MessageBatch<> out;
+  std::vector<char> in = std::vector<char>(READ_BUFFER_SIZE);
+  std::size_t in_begin = 0, in_end = 0;
+};
+
+struct op_stats {
+  histogram latency;  // Nanoseconds.
+  std::uint64_t errors = 0;
+};
+
+class worker {
+public:
+  worker(const options &opts, std::size_t connections, std::uint64_t seed)
+      : opts_(opts), connections_(connections), rng_(seed), completed_(0) {}
+
+  // Connects, agrees on the encoding and registers an account for every connection, returns the account ids.
+  std::vector<std::uint64_t> connect_all();
+  void run(const std::vector<std::uint64_t> &accounts, clock::time_point start, clock::time_point stop);
+
+  const op_stats& stats(op_type op) const { return stats_[op]; }
+  std::uint64_t completed() const { return completed_.load(std::memory_order_relaxed); }
+
+private:
+  op_type pick_op();
+  void issue(connection &conn, op_type op, clock::time_point start);
+  void send_queued(connection &conn);
+  void receive(connection &conn, clock::time_point now);
+  void on_response(connection &conn, const AbstractMessage &msg, clock::time_point now);
+  void drop(connection &conn);
+
+  const options &opts_;
+  std::vector<connection> connections_;
+  const std::vector<std::uint64_t> *accounts_ = nullptr;
+  std::mt19937_64 rng_;
+  op_stats stats_[OP_COUNT];
+  std::atomic<std::uint64_t> completed_;
+};
+
+std::vector<std::uint64_t> worker::connect_all() {
+  std::vector<std::uint64_t> ids;
+  for (auto &conn : connections_) {
+    conn.sock.reset(new tcp_client_socket(opts_.host.c_str(), opts_.port));
+    conn.sock->connect();
+    if (opts_.compact) {
+      HelloMessage hello;
+      hello.version = PROTO_VERSION;
+      hello.capabilities = PROTO_CAP_COMPACT;
+      proto_send(*conn.sock, hello);
+      std::unique_ptr<AbstractMessage> resp = proto_recv(*conn.sock);
+      const HelloResponse *accepted = proto_get_if<HelloResponse>(*resp);
+      if (!accepted) {
+        throw protocol_error("Unexpected response to HelloMessage");
+      }
+      conn.encoding = proto_agreed_encoding(accepted->capabilities);
+    }
+    if (opts_.existing > 0) {
+      LoginMessage login;
+      login.client_id = std::uniform_int_distribution<std::uint64_t>(0, opts_.existing - 1)(rng_);
+      proto_send(*conn.sock, login, conn.encoding);
+      std::unique_ptr<AbstractMessage> resp = proto_recv(*conn.sock, conn.encoding);
+      if (resp->id() != OperationSucceeded::ID) {
+        throw protocol_error("Unexpected response to LoginMessage");
+      }
+      conn.client_id = login.client_id;
+    } else {
+      proto_send(*conn.sock, RegistrationMessage(), conn.encoding);
+      std::unique_ptr<AbstractMessage> resp = proto_recv(*conn.sock, conn.encoding);
+      const RegistrationResponse *reg = proto_get_if<RegistrationResponse>(*resp);
+      if (!reg) {
+        throw protocol_error("Unexpected response to RegistrationMessage");
+      }
+      conn.client_id = reg->client_id;
+    }
+    ids.push_back(conn.client_id);
+  }
+  return ids;
+}
+
+op_type worker::pick_op() {
+  unsigned total = 0;
+  for (unsigned w : opts_.weights) {
+    total += w;
+  }
+  unsigned x = std::uniform_int_distribution<unsigned>(0, total - 1)(rng_);
+  int op = 0;
+  while (x >= opts_.weights[op]) {
+    x -= opts_.weights[op++];
+  }
+  return static_cast<op_type>(op);
+}
+
+void worker::issue(connection &conn, op_type op, clock::time_point start) {
+  conn.queued.push_back({op, start});
+  send_queued(conn);
+}
+
+// Encodes queued requests into the connection's batch, it is sent once per loop iteration.
+void worker::send_queued(connection &conn) {
+  while (!conn.queued.empty() && conn.in_flight.size() < MAX_IN_FLIGHT) {
+    const request &req = conn.queued.front();
+    bool added = false;
+    switch (req.op) {
+    case OP_REGISTER:
+      added = conn.out.add(RegistrationMessage(), conn.encoding);
+      break;
+    case OP_LOGIN: {
+      LoginMessage msg;
+      msg.client_id = conn.client_id;
+      added = conn.out.add(msg, conn.encoding);
+      break;
+    }
+    case OP_BALANCE:
+      added = conn.out.add(BalanceInquiryRequest(), conn.encoding);
+      break;
+    case OP_TRANSFER: {
+      TransferRequest msg;
+      msg.transfer_to = (*accounts_)[std::uniform_int_distribution<std::size_t>(0, accounts_->size() - 1)(rng_)];
+      msg.amount = 1;
+      added = conn.out.add(msg, conn.encoding);
+      break;
+    }
+    default:
+      break;
+    }
+    if (!added) {
+      break;
+    }
+    conn.in_flight.push_back(req);
+    conn.queued.pop_front();
+  }
+}
+
+void worker::drop(connection &conn) {
+  conn.alive = false;
+  for (const auto &req : conn.in_flight) {
+    stats_[req.op].errors++;
+  }
+  for (const auto &req : conn.queued) {
+    stats_[req.op].errors++;
+  }
+  conn.in_flight.clear();
+  conn.queued.clear();
+  conn.out.clear();
+  conn.sock.reset();
+}
+
+void worker::on_response(connection &conn, const AbstractMessage &msg, clock::time_point now) {
+  if (conn.in_flight.empty()) {
+    throw protocol_error("Unexpected response");
+  }
+  request req = conn.in_flight.front();
+  conn.in_flight.pop_front();
+
+  bool ok = false;
+  switch (req.op) {
+  case OP_REGISTER:
+    if (const RegistrationResponse *reg = proto_get_if<RegistrationResponse>(msg)) {
+      conn.client_id = reg->client_id;  // The server has logged the connection in as the new client.
+      ok = true;
+    }
+    break;
+  case OP_LOGIN:
+  case OP_TRANSFER:
+    ok = msg.id() == OperationSucceeded::ID;
+    break;
+  case OP_BALANCE:
+    ok = msg.id() == BalanceInquiryResponse::ID;
+    break;
+  default:
+    break;
+  }
+  if (ok) {
+    stats_[req.op].latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - req.start).count());
+    completed_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    stats_[req.op].errors++;
+  }
+
+  if (opts_.rate == 0) {
+    issue(conn, pick_op(), now);
+  } else {
+    send_queued(conn);
+  }
+}
+
+void worker::receive(connection &conn, clock::time_point now) {
+  if (conn.in_begin > 0) {
+    std::copy(conn.in.begin() + conn.in_begin, conn.in.begin() + conn.in_end, conn.in.begin());
+    conn.in_end -= conn.in_begin;
+    conn.in_begin = 0;
+  }
+  conn.in_end += conn.sock->recv_some(conn.in.data() + conn.in_end, conn.in.size() - conn.in_end);
+
+  AnyMessage msg;
+  for (;;) {
+    std::size_t consumed = proto_decode(conn.in.data() + conn.in_begin, conn.in_end - conn.in_begin, msg, conn.encoding);
+    if (consumed == 0) {
+      break;
+    }
+    conn.in_begin += consumed;
+    on_response(conn, msg.get(), now);
+  }
+}
+
+void worker::run(const std::vector<std::uint64_t> &accounts, clock::time_point start, clock::time_point stop) {
+  accounts_ = &accounts;
+  std::vector<pollfd> fds(connections_.size());
+  std::vector<connection*> polled(connections_.size());
+
+  // Every worker takes an equal share of the target rate.
+  clock::duration interval(0);
+  if (opts_.rate > 0) {
+    interval = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(opts_.threads / opts_.rate));
+  }
+  clock::time_point next = start;
+  std::size_t next_conn = 0;
+  if (opts_.rate == 0) {
+    for (auto &conn : connections_) {
+      for (std::size_t i = 0; i < opts_.depth; i++) {
+        issue(conn, pick_op(), start);
+      }
+    }
+  }
+
+  for (;;) {
+    clock::time_point now = clock::now();
+    if (now >= stop) {
+      break;
+    }
+    if (opts_.rate > 0) {
+      for (; next <= now; next += interval) {
+        for (std::size_t tries = 0; tries < connections_.size(); tries++) {
+          connection &conn = connections_[next_conn++ % connections_.size()];
+          if (conn.alive) {
+            issue(conn, pick_op(), next);
+            break;
+          }
+        }
+      }
+    }
+
+    std::size_t nfds = 0;
+    for (auto &conn : connections_) {
+      if (!conn.alive) {
+        continue;
+      }
+      try {
+        if (!conn.out.empty()) {
+          conn.out.send(*conn.sock);
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Connection dropped: " << e.what() << std::endl;
+        drop(conn);
+        continue;
+      }
+      fds[nfds].fd = conn.sock->native_handle();
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+      polled[nfds++] = &conn;
+    }
+    if (nfds == 0) {
+      break;
+    }
+
+    clock::time_point wake = std::min(stop, now + MAX_POLL_INTERVAL);
+    if (opts_.rate > 0) {
+      wake = std::min(wake, next);
+    }
+    int timeout_ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count());
+    if (poll(fds.data(), nfds, timeout_ms) < 0) {
+      continue;
+    }
+    now = clock::now();
+    for (std::size_t i = 0; i < nfds; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      try {
+        receive(*polled[i], now);
+      } catch (const std::exception &e) {
+        std::cerr << "Connection dropped: " << e.what() << std::endl;
+        drop(*polled[i]);
+      }
+    }
+  }
+  // Requests still in flight are neither completed nor failed, they are not reported.
+}
+
+void usage() {
+  std::cout << "Usage: loadgen [host] [port] [options]\n"
+            << "Options:\n"
+            << "  --connections=<n> - number of connections (default: 100)\n"
+            << "  --threads=<n> - number of worker threads (default: number of cores)\n"
+            << "  --duration=<s> - how long to generate load (default: 10)\n"
+            << "  --rate=<n> - requests per second in total, sent on schedule (default: closed loop)\n"
+            << "  --depth=<n> - requests in flight per connection in closed loop (default: 1)\n"
+            << "  --mix=register:<w>,login:<w>,balance:<w>,transfer:<w> - relative weights of request types\n"
+            << "      (default: register:1,login:4,balance:45,transfer:50)\n"
+            << "  --compact - ask the server for the compact encoding of messages\n"
+            << "  --existing=<n> - log connections in as clients 0..n-1 instead of registering new ones,\n"
+            << "      e.g. to load a read replica with --mix=login:<w>,balance:<w>\n"
+            << "Thousands of connections may need a higher limit of open files (ulimit -n)." << std::endl;
+}
+
+bool parse_mix(const std::string &mix, unsigned weights[OP_COUNT]) {
+  std::fill(weights, weights + OP_COUNT, 0);
+  std::stringstream ss(mix);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    std::size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      return false;
+    }
+    std::string name = item.substr(0, colon);
+    int op = std::find(OP_NAMES, OP_NAMES + OP_COUNT, name) - OP_NAMES;
+    if (op == OP_COUNT) {
+      return false;
+    }
+    weights[op] = atoi(item.c_str() + colon + 1);
+  }
+  unsigned total = 0;
+  for (int op = 0; op < OP_COUNT; op++) {
+    total += weights[op];
+  }
+  return total > 0;
+}
+
+double to_us(std::uint64_t ns) {
+  return ns / 1000.0;
+}
+
+void report_line(const std::string &name, const op_stats &s, double seconds) {
+  const histogram &h = s.latency;
+  std::cout << name << "\t" << h.count() << "\t" << s.errors << "\t"
+            << std::fixed << std::setprecision(0) << h.count() / seconds << "\t"
+            << std::setprecision(1) << h.mean() / 1000 << "\t"
+            << to_us(h.percentile(50)) << "\t" << to_us(h.percentile(90)) << "\t"
+            << to_us(h.percentile(99)) << "\t" << to_us(h.percentile(99.9)) << "\t"
+            << to_us(h.max()) << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  options opts;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 14, "--connections=") == 0) {
+      opts.connections = atol(arg.c_str() + 14);
+    } else if (arg.compare(0, 10, "--threads=") == 0) {
+      opts.threads = atol(arg.c_str() + 10);
+    } else if (arg.compare(0, 11, "--duration=") == 0) {
+      opts.duration = atof(arg.c_str() + 11);
+    } else if (arg.compare(0, 7, "--rate=") == 0) {
+      opts.rate = atof(arg.c_str() + 7);
+    } else if (arg.compare(0, 8, "--depth=") == 0) {
+      opts.depth = atol(arg.c_str() + 8);
+    } else if (arg.compare(0, 6, "--mix=") == 0) {
+      if (!parse_mix(arg.substr(6), opts.weights)) {
+        usage();
+        return 1;
+      }
+    } else if (arg == "--compact") {
+      opts.compact = true;
+    } else if (arg.compare(0, 11, "--existing=") == 0) {
+      opts.existing = atoll(arg.c_str() + 11);
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+      return 1;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() > 0) {
+    opts.host = positional[0];
+  }
+  if (positional.size() > 1) {
+    opts.port = atoi(positional[1].c_str());
+  }
+  opts.threads = std::min(opts.threads, opts.connections);
+  if (opts.connections == 0 || opts.threads == 0 || opts.duration <= 0 || opts.rate < 0 ||
+      opts.depth == 0 || opts.depth > MAX_IN_FLIGHT) {
+    usage();
+    return 1;
+  }
+
+  try {
+    std::cout << "Connecting " << opts.connections << " client(s) to " << opts.host << ":" << opts.port
+              << " from " << opts.threads << " thread(s)..." << std::endl;
+    std::vector<std::unique_ptr<worker>> workers;
+    for (std::size_t i = 0; i < opts.threads; i++) {
+      std::size_t share = opts.connections / opts.threads + (i < opts.connections % opts.threads ? 1 : 0);
+      workers.emplace_back(new worker(opts, share, i + 1));
+    }
+
+    std::vector<std::vector<std::uint64_t>> ids(opts.threads);
+    std::vector<std::exception_ptr> errors(opts.threads);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < opts.threads; i++) {
+      threads.emplace_back([&, i] {
+        try {
+          ids[i] = workers[i]->connect_all();
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    threads.clear();
+    for (const auto &e : errors) {
+      if (e) {
+        std::rethrow_exception(e);
+      }
+    }
+    std::vector<std::uint64_t> accounts;
+    for (const auto &v : ids) {
+      accounts.insert(accounts.end(), v.begin(), v.end());
+    }
+
+    std::cout << "Running for " << opts.duration << "s "
+              << (opts.rate > 0 ? "at " + std::to_string(static_cast<long long>(opts.rate)) + " requests/s"
+                                : "in closed loop with " + std::to_string(opts.depth) + " request(s) in flight per connection")
+              << "..." << std::endl;
+    clock::time_point start = clock::now();
+    clock::time_point stop = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(opts.duration));
+    for (std::size_t i = 0; i < opts.threads; i++) {
+      threads.emplace_back([&, i] {
+        try {
+          workers[i]->run(accounts, start, stop);
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      });
+    }
+
+    std::cout << "second\tcompleted/s" << std::endl;
+    std::uint64_t last = 0;
+    for (int second = 1; clock::now() + std::chrono::seconds(1) <= stop + std::chrono::milliseconds(100); second++) {
+      std::this_thread::sleep_until(start + std::chrono::seconds(second));
+      std::uint64_t completed = 0;
+      for (const auto &w : workers) {
+        completed += w->completed();
+      }
+      std::cout << second << "\t" << completed - last << std::endl;
+      last = completed;
+    }
+    for (auto &t : threads) {
+      t.join();
+    }
+    for (const auto &e : errors) {
+      if (e) {
+        std::rethrow_exception(e);
+      }
+    }
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << "type\tcount\terrors\tper_second\tmean_us\tp50_us\tp90_us\tp99_us\tp99.9_us\tmax_us" << std::endl;
+    op_stats total;
+    for (int op = 0; op < OP_COUNT; op++) {
+      op_stats merged;
+      for (const auto &w : workers) {
+        merged.latency.merge(w->stats(static_cast<op_type>(op)).latency);
+        merged.errors += w->stats(static_cast<op_type>(op)).errors;
+      }
+      if (opts.weights[op] > 0) {
+        report_line(OP_NAMES[op], merged, seconds);
+      }
+      total.latency.merge(merged.latency);
+      total.errors += merged.errors;
+    }
+    report_line("total", total, seconds);
+  } catch (const std::exception &e) {
+    std::cout << "Exception caught: " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,220 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "log.h"
+
+namespace log_detail {
+std::atomic<int> verbosity(static_cast<int>(log_level::info));
+}
+
+namespace {
+
+const std::size_t RECORD_TEXT_SIZE = 248;
+const std::size_t RING_RECORDS = 1024;
+const std::chrono::milliseconds WRITE_INTERVAL(10);
+
+struct record {
+  log_level level;
+  std::uint32_t length;
+  char text[RECORD_TEXT_SIZE];
+};
+
+// Single-producer single-consumer ring of records of one thread.
+struct thread_ring {
+  thread_ring() : head(0), tail(0), dropped(0), orphaned(false) {}
+
+  std::atomic<std::uint64_t> head;  // Written by the producer only.
+  char padding1[64];
+  std::atomic<std::uint64_t> tail;  // Written by the consumer only.
+  char padding2[64];
+  std::atomic<std::uint64_t> dropped;
+  std::atomic<bool> orphaned;  // The producer thread has exited.
+  record records[RING_RECORDS];
+};
+
+const char* level_prefix(log_level level) {
+  switch (level) {
+  case log_level::error: return "[E] ";
+  case log_level::warning: return "[W] ";
+  case log_level::info: return "[I] ";
+  case log_level::debug: return "[D] ";
+  default: return "[?] ";
+  }
+}
+
+class logger {
+public:
+  logger() : output_(stdout), flush_requested_(0), flushed_(0) {
+    std::thread(&logger::run, this).detach();
+  }
+
+  std::shared_ptr<thread_ring> new_ring() {
+    std::shared_ptr<thread_ring> ring(new thread_ring);
+    std::lock_guard<std::mutex> lock(rings_mutex_);
+    rings_.push_back(ring);
+    return ring;
+  }
+
+  void set_output(FILE *output) {
+    flush();
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    output_ = output;
+  }
+
+  void flush() {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    std::uint64_t ticket = ++flush_requested_;
+    wake_.notify_all();
+    flushed_cv_.wait(lock, [&] { return flushed_ >= ticket; });
+  }
+
+private:
+  // The logger is never destroyed, so that threads may log during exit.
+  void run() {
+    std::string buf;
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    for (;;) {
+      wake_.wait_for(lock, WRITE_INTERVAL, [&] { return flush_requested_ > flushed_; });
+      std::uint64_t target = flush_requested_;
+      FILE *output = output_;
+      lock.unlock();
+
+      buf.clear();
+      collect(buf);
+      if (!buf.empty()) {
+        fwrite(buf.data(), 1, buf.size(), output);
+        fflush(output);
+      }
+
+      lock.lock();
+      flushed_ = target;
+      flushed_cv_.notify_all();
+    }
+  }
+
+  void collect(std::string &buf) {
+    std::vector<std::shared_ptr<thread_ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(rings_mutex_);
+      rings = rings_;
+    }
+    for (const auto &ring : rings) {
+      bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+      std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+      std::uint64_t head = ring->head.load(std::memory_order_acquire);
+      for (; tail < head; tail++) {
+        const record &r = ring->records[tail % RING_RECORDS];
+        buf += level_prefix(r.level);
+        buf.append(r.text, r.length);
+        buf += '\n';
+      }
+      ring->tail.store(tail, std::memory_order_release);
+
+      std::uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+      if (dropped > 0) {
+        char msg[64];
+        snprintf(msg, sizeof msg, "%s%llu log record(s) dropped\n",
+                 level_prefix(log_level::warning), static_cast<unsigned long long>(dropped));
+        buf += msg;
+      }
+      if (orphaned) {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.erase(std::find(rings_.begin(), rings_.end(), ring));
+      }
+    }
+  }
+
+  std::mutex rings_mutex_;
+  std::vector<std::shared_ptr<thread_ring>> rings_;
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::condition_variable flushed_cv_;
+  FILE *output_;
+  std::uint64_t flush_requested_;
+  std::uint64_t flushed_;
+};
+
+logger& instance() {
+  static logger *l = [] {
+    logger *result = new logger;
+    atexit(log_flush);
+    return result;
+  }();
+  return *l;
+}
+
+struct ring_holder {
+  ~ring_holder() {
+    if (ring) {
+      ring->orphaned.store(true, std::memory_order_release);
+    }
+  }
+  std::shared_ptr<thread_ring> ring;
+};
+
+thread_local ring_holder local_ring;
+
+}  // namespace
+
+void log_set_level(log_level level) {
+  log_detail::verbosity.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool log_parse_level(const char *name, log_level &level) {
+  static const struct {
+    const char *name;
+    log_level level;
+  } levels[] = {
+    {"off", log_level::off},
+    {"error", log_level::error},
+    {"warning", log_level::warning},
+    {"info", log_level::info},
+    {"debug", log_level::debug},
+  };
+  for (const auto &l : levels) {
+    if (strcmp(name, l.name) == 0) {
+      level = l.level;
+      return true;
+    }
+  }
+  return false;
+}
+
+void log_set_output(FILE *output) {
+  instance().set_output(output);
+}
+
+void log_flush() {
+  instance().flush();
+}
+
+void log_write(log_level level, const char *format, ...) {
+  if (!local_ring.ring) {
+    local_ring.ring = instance().new_ring();
+  }
+  thread_ring &ring = *local_ring.ring;
+  std::uint64_t head = ring.head.load(std::memory_order_relaxed);
+  if (head - ring.tail.load(std::memory_order_acquire) >= RING_RECORDS) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  record &r = ring.records[head % RING_RECORDS];
+  r.level = level;
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(r.text, sizeof r.text, format, args);
+  va_end(args);
+  r.length = std::max(0, std::min(length, static_cast<int>(sizeof r.text) - 1));
+  ring.head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "metrics.h"
+
+namespace {
+
+const int COUNTERS = static_cast<int>(metric_counter::COUNT);
+const std::size_t MESSAGE_IDS = METRICS_MAX_MESSAGE_ID + 1;
+
+/*
+ * The same buckets as in histogram(METRICS_PRECISION_BITS): values below
+ * EXACT are kept exactly, every further power of two is split into HALF
+ * buckets. Thread blocks keep raw bucket counts, which are turned into
+ * histograms only when collected.
+ */
+const std::uint64_t EXACT = 1ull << METRICS_PRECISION_BITS;
+const std::uint64_t HALF = EXACT / 2;
+
+int highest_bit(std::uint64_t value) {
+  int bit = 0;
+  while (value >>= 1) {
+    bit++;
+  }
+  return bit;
+}
+
+std::size_t bucket_of(std::uint64_t value) {
+  value = std::min(value, histogram::MAX_VALUE);
+  if (value < EXACT) {
+    return value;
+  }
+  int shift = highest_bit(value) - (METRICS_PRECISION_BITS - 1);
+  return EXACT + (shift - 1) * HALF + ((value >> shift) - HALF);
+}
+
+// The largest value in the bucket, so that percentiles are never underestimated.
+std::uint64_t bucket_max(std::size_t index) {
+  if (index < EXACT) {
+    return index;
+  }
+  std::size_t shift = (index - EXACT) / HALF + 1;
+  std::uint64_t base = (index - EXACT) % HALF + HALF;
+  return ((base + 1) << shift) - 1;
+}
+
+// Enough to hold bucket_of(histogram::MAX_VALUE).
+static_assert(histogram::MAX_VALUE < (1ull << 40), "Too few metrics buckets");
+const std::size_t BUCKETS = EXACT + (40 - METRICS_PRECISION_BITS) * HALF;
+
+typedef std::atomic<std::uint64_t> cell;
+
+// Zero-initialized when created with new thread_block().
+struct thread_block {
+  cell counters[COUNTERS];
+  cell request_errors[MESSAGE_IDS];
+  cell request_buckets[MESSAGE_IDS][BUCKETS];
+  cell lock_wait_buckets[BUCKETS];
+};
+
+// Cells of a live block are written by its thread only, so a plain load and store is enough.
+void bump(cell &c, std::uint64_t value) {
+  c.store(c.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+class registry {
+public:
+  registry() : retired_(new thread_block()) {}
+
+  void add(thread_block *block) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_.push_back(block);
+  }
+
+  // Folds the block of an exiting thread into the totals, the block may be freed afterwards.
+  void retire(thread_block *block) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_.erase(std::find(blocks_.begin(), blocks_.end(), block));
+    for (int i = 0; i < COUNTERS; i++) {
+      bump(retired_->counters[i], block->counters[i].load(std::memory_order_relaxed));
+    }
+    for (std::size_t id = 0; id < MESSAGE_IDS; id++) {
+      bump(retired_->request_errors[id], block->request_errors[id].load(std::memory_order_relaxed));
+      for (std::size_t b = 0; b < BUCKETS; b++) {
+        bump(retired_->request_buckets[id][b], block->request_buckets[id][b].load(std::memory_order_relaxed));
+      }
+    }
+    for (std::size_t b = 0; b < BUCKETS; b++) {
+      bump(retired_->lock_wait_buckets[b], block->lock_wait_buckets[b].load(std::memory_order_relaxed));
+    }
+  }
+
+  void collect(metrics_snapshot &snapshot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<const thread_block*> all(blocks_.begin(), blocks_.end());
+    all.push_back(retired_.get());
+
+    for (int i = 0; i < COUNTERS; i++) {
+      snapshot.counters[i] = sum(all, [i](const thread_block &b) -> const cell& { return b.counters[i]; });
+    }
+    for (std::size_t id = 0; id < MESSAGE_IDS; id++) {
+      metrics_snapshot::request_stats &stats = snapshot.requests[id];
+      stats.errors = sum(all, [id](const thread_block &b) -> const cell& { return b.request_errors[id]; });
+      for (std::size_t bucket = 0; bucket < BUCKETS; bucket++) {
+        stats.service_ns.record(bucket_max(bucket), sum(all, [id, bucket](const thread_block &b) -> const cell& {
+          return b.request_buckets[id][bucket];
+        }));
+      }
+    }
+    for (std::size_t bucket = 0; bucket < BUCKETS; bucket++) {
+      snapshot.lock_wait_ns.record(bucket_max(bucket), sum(all, [bucket](const thread_block &b) -> const cell& {
+        return b.lock_wait_buckets[bucket];
+      }));
+    }
+  }
+
+private:
+  template<typename F>
+  static std::uint64_t sum(const std::vector<const thread_block*> &blocks, F field) {
+    std::uint64_t result = 0;
+    for (const thread_block *block : blocks) {
+      result += field(*block).load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  std::mutex mutex_;
+  std::vector<thread_block*> blocks_;
+  std::unique_ptr<thread_block> retired_;
+};
+
+// Never destroyed, so that threads may record metrics during exit.
+registry& instance() {
+  static registry *r = new registry;
+  return *r;
+}
+
+struct block_holder {
+  ~block_holder() {
+    if (block) {
+      instance().retire(block.get());
+    }
+  }
+  std::unique_ptr<thread_block> block;
+};
+
+thread_local block_holder local_block;
+
+thread_block& local() {
+  if (!local_block.block) {
+    local_block.block.reset(new thread_block());
+    instance().add(local_block.block.get());
+  }
+  return *local_block.block;
+}
+
+}  // namespace
+
+void metrics_add(metric_counter counter, std::uint64_t value) {
+  bump(local().counters[static_cast<int>(counter)], value);
+}
+
+void metrics_record_request(std::uint8_t message_id, std::uint64_t service_ns, bool failed) {
+  std::size_t id = std::min<std::size_t>(message_id, METRICS_MAX_MESSAGE_ID);
+  thread_block &block = local();
+  bump(block.request_buckets[id][bucket_of(service_ns)], 1);
+  if (failed) {
+    bump(block.request_errors[id], 1);
+  }
+}
+
+void metrics_record_lock_wait(std::uint64_t wait_ns) {
+  thread_block &block = local();
+  bump(block.counters[static_cast<int>(metric_counter::lock_waits)], 1);
+  bump(block.lock_wait_buckets[bucket_of(wait_ns)], 1);
+}
+
+metrics_snapshot metrics_collect() {
+  metrics_snapshot snapshot;
+  instance().collect(snapshot);
+  return snapshot;
+}
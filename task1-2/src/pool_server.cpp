@@ -0,0 +1,268 @@
+#include "pool_server.h"
+#include "log.h"
+#include "output_buffer_socket.h"
+
+#ifdef __linux__
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "thread_pool.h"
+
+namespace {
+
+const int MAX_EVENTS = 256;
+const std::size_t READ_CHUNK = 64 * 1024;
+
+void ensure_errno(bool condition, const char *what) {
+  if (!condition) {
+    throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+  }
+}
+
+// Touched only by the task which currently serves it, see flush().
+struct connection {
+  connection(std::unique_ptr<tcp_connection_socket> s)
+      : sock(std::move(s)), out_pos(0), out_sock(&out), throttled(false), closing(false) {}
+
+  std::unique_ptr<tcp_connection_socket> sock;
+  std::string in;
+  std::string out;
+  std::size_t out_pos;
+  output_buffer_socket out_sock;
+  std::unique_ptr<MessageVisitor> handler;
+  bool throttled;  // Requests are left in `in` because of pending output.
+  bool closing;    // A request has failed, closed once the output before it is flushed.
+};
+
+}  // namespace
+
+class pool_server::impl {
+public:
+  impl(std::size_t workers, epoll_server::handler_factory factory, epoll_server::flush_hook before_flush)
+      : factory_(factory), before_flush_(before_flush), pool_(workers), stopping_(false), shut_down_(false) {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    ensure_errno(epoll_fd_ != -1, "epoll_create1");
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ensure_errno(wake_fd_ != -1, "eventfd");
+    epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    ensure_errno(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == 0, "epoll_ctl");
+    poller_ = std::thread(&impl::poll, this);
+  }
+
+  ~impl() {
+    shutdown();
+    close(wake_fd_);
+    close(epoll_fd_);
+  }
+
+  void add_client(std::unique_ptr<tcp_connection_socket> client) {
+    std::unique_ptr<connection> conn(new connection(std::move(client)));
+    conn->handler = factory_(&conn->out_sock);
+    conn->sock->set_nonblocking(true);
+    connection *c = conn.get();
+
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (stopping_) {
+      return;  // The connection is closed.
+    }
+    connections_[c] = std::move(conn);
+    epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, c->sock->native_handle(), &ev) != 0) {
+      connections_.erase(c);
+      ensure_errno(false, "epoll_ctl");
+    }
+  }
+
+  void shutdown() {
+    std::lock_guard<std::mutex> shutdown_lock(shutdown_mutex_);
+    if (shut_down_) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      stopping_ = true;
+    }
+    std::uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof one);
+    assert(written == sizeof one);
+    (void)written;
+    poller_.join();
+    pool_.shutdown();
+
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connections_.clear();
+    shut_down_ = true;
+  }
+
+private:
+  void poll() {
+    epoll_event events[MAX_EVENTS];
+    while (!stopping_) {
+      int n = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        LOG(log_level::error, "epoll_wait failed: %s", strerror(errno));
+        return;
+      }
+      for (int i = 0; i < n; i++) {
+        connection *c = static_cast<connection*>(events[i].data.ptr);
+        if (c == nullptr) {
+          continue;  // Woken up by shutdown().
+        }
+        std::uint32_t flags = events[i].events;
+        pool_.submit([this, c, flags] { serve(*c, flags); });
+      }
+    }
+  }
+
+  void serve(connection &c, std::uint32_t events) {
+    try {
+      if (events & EPOLLOUT) {
+        send_pending(c);
+      }
+      if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        std::size_t old_size = c.in.size();
+        c.in.resize(old_size + READ_CHUNK);
+        c.in.resize(old_size + c.sock->recv_some(&c.in[old_size], READ_CHUNK));
+      }
+      if (handle_requests(c) && before_flush_) {
+        before_flush_();
+      }
+      flush(c);
+    } catch (const std::exception &e) {
+      LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+      close_connection(&c);
+    }
+  }
+
+  /*
+   * Handles complete requests from the read buffer until the output is over
+   * epoll_server::MAX_PENDING_OUTPUT. Returns whether any requests were handled.
+   * If a request fails, the responses to the ones before it are still flushed.
+   */
+  bool handle_requests(connection &c) {
+    std::size_t pos = 0;
+    AnyMessage msg;
+    c.throttled = false;
+    try {
+      while (std::size_t size = proto_decode(c.in.data() + pos, c.in.size() - pos, msg, c.handler->encoding())) {
+        msg.visit(*c.handler);
+        pos += size;
+        if (c.out.size() - c.out_pos >= epoll_server::MAX_PENDING_OUTPUT) {
+          c.throttled = true;
+          break;
+        }
+      }
+    } catch (const std::exception &e) {
+      LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+      c.closing = true;
+    }
+    c.in.erase(0, pos);
+    return pos > 0;
+  }
+
+  // Sends as much output as the socket takes.
+  void send_pending(connection &c) {
+    if (c.out_pos < c.out.size()) {
+      c.out_pos += c.sock->send_some(c.out.data() + c.out_pos, c.out.size() - c.out_pos);
+    }
+    if (c.out_pos == c.out.size()) {
+      c.out.clear();
+      c.out_pos = 0;
+    }
+  }
+
+  /*
+   * Sends what it can and arms the connection for the next round. Like in
+   * epoll_server, reading stops while the output is over the limit, and a
+   * throttled connection waits for EPOLLOUT to handle its buffered requests.
+   */
+  void flush(connection &c) {
+    send_pending(c);
+    if (c.closing) {
+      close_connection(&c);  // What the socket has not taken is dropped.
+      return;
+    }
+    std::size_t pending = c.out.size() - c.out_pos;
+    epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLONESHOT;
+    if (pending < epoll_server::MAX_PENDING_OUTPUT) {
+      ev.events |= EPOLLIN;
+    }
+    if (pending > 0 || c.throttled) {
+      ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = &c;
+    ensure_errno(epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.sock->native_handle(), &ev) == 0, "epoll_ctl");
+  }
+
+  void close_connection(connection *c) {
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->sock->native_handle(), nullptr);
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connections_.erase(c);
+  }
+
+  epoll_server::handler_factory factory_;
+  epoll_server::flush_hook before_flush_;
+  thread_pool pool_;
+  int epoll_fd_;
+  int wake_fd_;
+  std::thread poller_;
+
+  std::mutex connections_mutex_;
+  std::map<connection*, std::unique_ptr<connection>> connections_;
+  std::atomic<bool> stopping_;  // Changed under connections_mutex_.
+
+  std::mutex shutdown_mutex_;
+  bool shut_down_;
+};
+
+pool_server::pool_server(std::size_t workers, epoll_server::handler_factory factory, epoll_server::flush_hook before_flush)
+    : impl_(new impl(workers, factory, before_flush)) {}
+
+pool_server::~pool_server() {}
+
+void pool_server::add_client(std::unique_ptr<tcp_connection_socket> client) {
+  impl_->add_client(std::move(client));
+}
+
+void pool_server::shutdown() {
+  impl_->shutdown();
+}
+
+#else  // __linux__
+
+#include <stdexcept>
+
+class pool_server::impl {};
+
+pool_server::pool_server(std::size_t, epoll_server::handler_factory, epoll_server::flush_hook) {
+  throw std::runtime_error("pool_server is available on Linux only");
+}
+
+pool_server::~pool_server() {}
+
+void pool_server::add_client(std::unique_ptr<tcp_connection_socket>) {}
+
+void pool_server::shutdown() {}
+
+#endif  // __linux__
@@ -1,114 +1,353 @@
 #include <assert.h>
+#include <string.h>
 #include <sstream>
 #include <string>
+#include <stdexcept>
 #include <vector>
-#include <type_traits>
 #include "protocol.h"
 
-using std::ostream;
-using std::istream;
 using std::stringstream;
 
-template<typename T>
-void write(ostream &os, const T& val_) {
-  typename std::make_unsigned<T>::type val = val_;
-  for (int i = static_cast<int>(sizeof(val)) - 1; i >= 0; i--) {
-    std::uint8_t byte = (val >> (8 * i)) & 0xFF;
-    assert(os.write(reinterpret_cast<char*>(&byte), 1));
+void proto_throw_unknown_id(std::uint8_t id) {
+  stringstream err_msg;
+  err_msg << "Unknown message id: " << static_cast<int>(id);
+  throw protocol_error(err_msg.str());
+}
+
+void proto_throw_malformed(const char *what) {
+  throw protocol_error(what);
+}
+
+void proto_throw_unexpected(std::uint8_t id) {
+  stringstream err_msg;
+  err_msg << "Unexpected message with id " << static_cast<int>(id);
+  throw protocol_error(err_msg.str());
+}
+
+constexpr std::size_t BatchTransferRequest::ITEM_SIZE;
+constexpr std::size_t BatchTransferRequest::MAX_COMPACT_ITEM_SIZE;
+constexpr std::size_t BatchTransferRequest::MAX_ITEMS;
+
+void BatchTransferRequest::encode(char *buf) const {
+  proto_store(buf, check_items_count(items.size()));
+  buf += HEADER_SIZE;
+  for (const auto &item : items) {
+    item_layout::encode(buf, item);
+    buf += ITEM_SIZE;
+  }
+}
+void BatchTransferRequest::decode(const char *buf) {
+  items.resize(items_count(buf));
+  buf += HEADER_SIZE;
+  for (auto &item : items) {
+    item_layout::decode(buf, item);
+    buf += ITEM_SIZE;
   }
 }
 
-template<typename T>
-T read(istream &is) {
-  typedef typename std::make_unsigned<T>::type UT;
-  UT result = 0;
-  for (int i = static_cast<int>(sizeof(result)) - 1; i >= 0; i--) {
-    std::uint8_t byte;
-    if (!is.read(reinterpret_cast<char*>(&byte), sizeof(byte))) {
-      throw protocol_error("Unexpected EOF");
+std::size_t BatchTransferRequest::compact_size() const {
+  std::size_t size = proto_varint_size(check_items_count(items.size()));
+  for (const auto &item : items) {
+    size += item_layout::compact_size(item);
+  }
+  return size;
+}
+void BatchTransferRequest::encode_compact(char *buf) const {
+  buf = proto_store_varint(buf, check_items_count(items.size()));
+  for (const auto &item : items) {
+    buf = item_layout::encode_compact(buf, item);
+  }
+}
+void BatchTransferRequest::decode_compact(const char *buf, std::size_t size) {
+  const char *end = buf + size;
+  items.resize(load_compact_items_count(buf, end));
+  for (auto &item : items) {
+    item_layout::decode_compact(buf, end, item);
+  }
+  proto_check_compact_end(buf, end);
+}
+
+constexpr std::size_t BatchTransferResponse::ITEM_SIZE;
+constexpr std::size_t BatchTransferResponse::MAX_COMPACT_ITEM_SIZE;
+constexpr std::size_t BatchTransferResponse::MAX_ITEMS;
+
+static BatchTransferResponse::Status check_status(std::uint8_t status) {
+  if (status > BatchTransferResponse::NOT_APPLIED) {
+    stringstream err_msg;
+    err_msg << "Unknown batch item status: " << static_cast<int>(status);
+    throw protocol_error(err_msg.str());
+  }
+  return static_cast<BatchTransferResponse::Status>(status);
+}
+
+void BatchTransferResponse::encode(char *buf) const {
+  proto_store(buf, check_items_count(statuses.size()));
+  buf += HEADER_SIZE;
+  for (auto status : statuses) {
+    *buf++ = static_cast<char>(status);
+  }
+}
+void BatchTransferResponse::decode(const char *buf) {
+  statuses.resize(items_count(buf));
+  buf += HEADER_SIZE;
+  for (auto &status : statuses) {
+    status = check_status(static_cast<std::uint8_t>(*buf++));
+  }
+}
+
+std::size_t BatchTransferResponse::compact_size() const {
+  return proto_varint_size(check_items_count(statuses.size())) + statuses.size();
+}
+void BatchTransferResponse::encode_compact(char *buf) const {
+  buf = proto_store_varint(buf, check_items_count(statuses.size()));
+  for (auto status : statuses) {
+    *buf++ = static_cast<char>(status);
+  }
+}
+void BatchTransferResponse::decode_compact(const char *buf, std::size_t size) {
+  const char *end = buf + size;
+  statuses.resize(load_compact_items_count(buf, end));
+  for (auto &status : statuses) {
+    status = check_status(static_cast<std::uint8_t>(*buf++));
+  }
+  proto_check_compact_end(buf, end);
+}
+
+constexpr std::size_t StatsResponse::ITEM_SIZE;
+constexpr std::size_t StatsResponse::MAX_COMPACT_ITEM_SIZE;
+constexpr std::size_t StatsResponse::MAX_TEXT_SIZE;
+constexpr std::size_t StatsResponse::MAX_ITEMS;
+
+void StatsResponse::encode(char *buf) const {
+  encode_head(buf);
+  memcpy(buf + HEADER_SIZE, text.data(), text.size());
+}
+void StatsResponse::encode_head(char *buf) const {
+  proto_store(buf, check_items_count(text.size()));
+}
+void StatsResponse::decode(const char *buf) {
+  text.assign(buf + HEADER_SIZE, items_count(buf));
+}
+
+std::size_t StatsResponse::compact_size() const {
+  return proto_varint_size(check_items_count(text.size())) + text.size();
+}
+void StatsResponse::encode_compact(char *buf) const {
+  buf = proto_store_varint(buf, check_items_count(text.size()));
+  memcpy(buf, text.data(), text.size());
+}
+void StatsResponse::decode_compact(const char *buf, std::size_t size) {
+  const char *end = buf + size;
+  std::uint32_t count = load_compact_items_count(buf, end);
+  text.assign(buf, count);
+  proto_check_compact_end(buf + count, end);
+}
+
+namespace {
+
+struct emplace_op {
+  template<typename T> static AbstractMessage& call(AnyMessage &msg) { return msg.emplace<T>(); }
+};
+
+struct make_message_op {
+  template<typename T> static std::unique_ptr<AbstractMessage> call() { return std::unique_ptr<AbstractMessage>(new T()); }
+};
+
+// Number of bytes at the beginning of a message (including the id byte) which determine its full size.
+struct size_prefix_op {
+  template<typename T> static std::size_t call() { return 1 + T::header_size(); }
+};
+
+struct message_size_op {
+  template<typename T> static std::size_t call(const char *data, std::size_t size) {
+    if (size < 1 + T::header_size()) {
+      return 0;
+    }
+    return 1 + T::payload_size(data + 1);
+  }
+};
+
+struct decode_op {
+  template<typename T> static std::size_t call(const char *data, std::size_t size, AnyMessage &msg) {
+    std::size_t msg_size = message_size_op::call<T>(data, size);
+    if (msg_size == 0 || size < msg_size) {
+      return 0;
     }
-    result |= static_cast<UT>(byte) << (8 * i);
-  }
-  return result;
-}
-
-void RegistrationMessage::serialize(ostream &) const {}
-void RegistrationMessage::deserialize(istream &) {}
-std::uint8_t RegistrationMessage::id() const { return 1; }
-std::size_t RegistrationMessage::serialized_size() const { return 0; }
-void RegistrationMessage::visit(MessageVisitor &v) const { v.accept(*this); }
-
-void LoginMessage::serialize(ostream &os) const { write(os, client_id); }
-void LoginMessage::deserialize(istream &is) { client_id = read<t_client_id>(is); }
-std::uint8_t LoginMessage::id() const { return 2; }
-std::size_t LoginMessage::serialized_size() const { return sizeof(t_client_id); }
-void LoginMessage::visit(MessageVisitor &v) const { v.accept(*this); }
-
-void RegistrationResponse::serialize(ostream &os) const { write(os, client_id); }
-void RegistrationResponse::deserialize(istream &is) { client_id = read<t_client_id>(is); }
-std::uint8_t RegistrationResponse::id() const { return 3; }
-std::size_t RegistrationResponse::serialized_size() const { return sizeof(t_client_id); }
-void RegistrationResponse::visit(MessageVisitor &v) const { v.accept(*this); }
-
-void BalanceInquiryRequest::serialize(ostream &) const {}
-void BalanceInquiryRequest::deserialize(istream &) {}
-std::uint8_t BalanceInquiryRequest::id() const { return 4; }
-std::size_t BalanceInquiryRequest::serialized_size() const { return 0; }
-void BalanceInquiryRequest::visit(MessageVisitor &v) const { v.accept(*this); }
-
-void BalanceInquiryResponse::serialize(ostream &os) const { write(os, balance); }
-void BalanceInquiryResponse::deserialize(istream &is) { balance = read<t_balance>(is); }
-std::uint8_t BalanceInquiryResponse::id() const { return 5; }
-std::size_t BalanceInquiryResponse::serialized_size() const { return sizeof(t_balance); }
-void BalanceInquiryResponse::visit(MessageVisitor &v) const { v.accept(*this); }
-
-void TransferRequest::serialize(ostream &os) const { write(os, transfer_to); write(os, amount); }
-void TransferRequest::deserialize(istream &is) { transfer_to = read<t_client_id>(is); amount = read<t_balance>(is); }
-std::uint8_t TransferRequest::id() const { return 6; }
-std::size_t TransferRequest::serialized_size() const { return sizeof(t_client_id) + sizeof(t_balance); }
-void TransferRequest::visit(MessageVisitor &v) const { v.accept(*this); }
-
-void OperationSucceeded::serialize(ostream &) const {}
-void OperationSucceeded::deserialize(istream &) {}
-std::uint8_t OperationSucceeded::id() const { return 7; }
-std::size_t OperationSucceeded::serialized_size() const { return 0; }
-void OperationSucceeded::visit(MessageVisitor &v) const { v.accept(*this); }
-
-#include <iostream>
-std::unique_ptr<AbstractMessage> proto_recv(stream_socket &sock) {
-  std::uint8_t id;
-  sock.recv(&id, 1);
-
-  std::unique_ptr<AbstractMessage> msg;
-  switch (id) {
-  case 1: msg.reset(new RegistrationMessage); break;
-  case 2: msg.reset(new LoginMessage); break;
-  case 3: msg.reset(new RegistrationResponse); break;
-  case 4: msg.reset(new BalanceInquiryRequest); break;
-  case 5: msg.reset(new BalanceInquiryResponse); break;
-  case 6: msg.reset(new TransferRequest); break;
-  case 7: msg.reset(new OperationSucceeded); break;
-  default:
+    msg.emplace<T>().decode(data + 1);
+    return msg_size;
+  }
+};
+
+/*
+ * Compact messages: the id byte, a varint with the payload size and the payload.
+ * Returns the size of the first two, or 0 if more than size bytes are needed to tell it.
+ */
+template<typename T>
+std::size_t compact_head_size(const char *data, std::size_t size, std::size_t &payload_size) {
+  const char *pos = data + 1;
+  std::uint64_t length;
+  if (!proto_try_load_varint(pos, data + size, length)) {
+    return 0;
+  }
+  if (length > T::max_compact_size()) {
     stringstream err_msg;
-    err_msg << "Unknown message id: " << static_cast<int>(id);
+    err_msg << "Too large compact message with id " << static_cast<int>(T::ID) << ": " << length;
     throw protocol_error(err_msg.str());
   }
-  std::vector<char> data(msg->serialized_size());
-  sock.recv(data.data(), data.size());
+  payload_size = static_cast<std::size_t>(length);
+  return pos - data;
+}
+
+struct compact_message_size_op {
+  template<typename T> static std::size_t call(const char *data, std::size_t size) {
+    std::size_t payload_size;
+    std::size_t head_size = compact_head_size<T>(data, size, payload_size);
+    return head_size == 0 ? 0 : head_size + payload_size;
+  }
+};
+
+struct compact_decode_op {
+  template<typename T> static std::size_t call(const char *data, std::size_t size, AnyMessage &msg) {
+    std::size_t payload_size;
+    std::size_t head_size = compact_head_size<T>(data, size, payload_size);
+    if (head_size == 0 || size - head_size < payload_size) {
+      return 0;
+    }
+    msg.emplace<T>().decode_compact(data + head_size, payload_size);
+    return head_size + payload_size;
+  }
+};
+
+// Creates a message of type T from the whole message of msg_size bytes at data.
+struct compact_make_message_op {
+  template<typename T> static std::unique_ptr<AbstractMessage> call(const char *data, std::size_t msg_size) {
+    std::size_t payload_size;
+    std::size_t head_size = compact_head_size<T>(data, msg_size, payload_size);
+    std::unique_ptr<AbstractMessage> msg(new T());
+    msg->decode_compact(data + head_size, payload_size);
+    return msg;
+  }
+};
+
+std::size_t size_prefix(std::uint8_t id) {
+  return ProtocolSchema::dispatch<size_prefix_op, std::size_t>(id);
+}
+
+std::uint8_t message_id(const char *data) {
+  return static_cast<std::uint8_t>(data[0]);
+}
+
+}  // namespace
 
-  stringstream data_stream;
-  data_stream.rdbuf()->pubsetbuf(&data[0], data.size());
-  msg->deserialize(data_stream);
-  assert(data_stream.rdbuf()->in_avail() == 0);
+AbstractMessage& AnyMessage::emplace(std::uint8_t id) {
+  return ProtocolSchema::dispatch<emplace_op, AbstractMessage&, AnyMessage&>(id, *this);
+}
+
+std::size_t proto_message_size(const void *buf, std::size_t size, proto_encoding encoding) {
+  const char *data = static_cast<const char*>(buf);
+  if (size == 0) {
+    return 0;
+  }
+  if (encoding == proto_encoding::compact) {
+    return ProtocolSchema::dispatch<compact_message_size_op, std::size_t, const char*, std::size_t>(message_id(data), data, size);
+  }
+  return ProtocolSchema::dispatch<message_size_op, std::size_t, const char*, std::size_t>(message_id(data), data, size);
+}
+
+std::size_t proto_decode(const void *buf, std::size_t size, AnyMessage &msg, proto_encoding encoding) {
+  msg.reset();
+  const char *data = static_cast<const char*>(buf);
+  if (size == 0) {
+    return 0;
+  }
+  if (encoding == proto_encoding::compact) {
+    return ProtocolSchema::dispatch<compact_decode_op, std::size_t, const char*, std::size_t, AnyMessage&>(message_id(data), data, size, msg);
+  }
+  return ProtocolSchema::dispatch<decode_op, std::size_t, const char*, std::size_t, AnyMessage&>(message_id(data), data, size, msg);
+}
+
+/*
+ * Receives a whole message into stack_buf (of MAX_MESSAGE_SIZE bytes)
+ * if it fits there, or into heap_buf otherwise.
+ * Returns a pointer to the message and stores its size into msg_size.
+ */
+static const char* recv_message(stream_socket &sock, proto_encoding encoding, char *stack_buf, std::vector<char> &heap_buf, std::size_t &msg_size) {
+  sock.recv(stack_buf, 1);
+  std::size_t prefix;
+  if (encoding == proto_encoding::compact) {
+    // The payload size is a varint, which ends with a byte without the high bit.
+    prefix = 1;
+    do {
+      if (prefix == MAX_MESSAGE_SIZE) {
+        throw protocol_error("Too long varint");
+      }
+      sock.recv(stack_buf + prefix, 1);
+    } while (stack_buf[prefix++] & 0x80);
+  } else {
+    prefix = size_prefix(message_id(stack_buf));
+    sock.recv(stack_buf + 1, prefix - 1);
+  }
+  msg_size = proto_message_size(stack_buf, prefix, encoding);
+  if (msg_size <= MAX_MESSAGE_SIZE) {
+    sock.recv(stack_buf + prefix, msg_size - prefix);
+    return stack_buf;
+  }
+  heap_buf.assign(stack_buf, stack_buf + prefix);
+  heap_buf.resize(msg_size);
+  sock.recv(heap_buf.data() + prefix, msg_size - prefix);
+  return heap_buf.data();
+}
+
+void proto_recv(stream_socket &sock, AnyMessage &msg, proto_encoding encoding) {
+  char stack_buf[MAX_MESSAGE_SIZE];
+  std::vector<char> heap_buf;
+  std::size_t msg_size;
+  const char *data = recv_message(sock, encoding, stack_buf, heap_buf, msg_size);
+  std::size_t decoded = proto_decode(data, msg_size, msg, encoding);
+  assert(decoded == msg_size);
+  (void)decoded;
+}
+
+std::unique_ptr<AbstractMessage> proto_recv(stream_socket &sock, proto_encoding encoding) {
+  char stack_buf[MAX_MESSAGE_SIZE];
+  std::vector<char> heap_buf;
+  std::size_t msg_size;
+  const char *data = recv_message(sock, encoding, stack_buf, heap_buf, msg_size);
+
+  if (encoding == proto_encoding::compact) {
+    return ProtocolSchema::dispatch<compact_make_message_op, std::unique_ptr<AbstractMessage>, const char*, std::size_t>(message_id(data), data, msg_size);
+  }
+  std::unique_ptr<AbstractMessage> msg = ProtocolSchema::dispatch<make_message_op, std::unique_ptr<AbstractMessage>>(message_id(data));
+  msg->decode(data + 1);
   return msg;
 }
 
-void proto_send(stream_socket &sock, const AbstractMessage &msg) {
-  stringstream data_stream;
-  write(data_stream, msg.id());
-  msg.serialize(data_stream);
+static void send_head_and_payload(stream_socket &sock, char *head, std::size_t head_size, const AbstractMessage &msg, const_buffer payload) {
+  head[0] = static_cast<char>(msg.id());
+  msg.encode_head(head + 1);
+  if (payload.size == 0) {
+    sock.send(head, head_size);
+  } else {
+    const_buffer bufs[] = {{head, head_size}, payload};
+    sock.sendv(bufs, 2);
+  }
+}
 
-  const auto &data = data_stream.str();
-  assert(data.size() == 1 + msg.serialized_size());
-  sock.send(data.data(), data.size());
+void proto_send_large(stream_socket &sock, const AbstractMessage &msg, proto_encoding encoding) {
+  if (encoding == proto_encoding::compact) {
+    // Compact messages are rarely large, so they are not split around payload().
+    std::vector<char> buf(proto_encoded_size(msg, encoding));
+    proto_encode(buf.data(), msg, encoding);
+    sock.send(buf.data(), buf.size());
+    return;
+  }
+  const_buffer payload = msg.payload();
+  std::size_t head_size = 1 + msg.serialized_size() - payload.size;
+  if (head_size <= MAX_MESSAGE_SIZE) {
+    char buf[MAX_MESSAGE_SIZE];
+    send_head_and_payload(sock, buf, head_size, msg, payload);
+  } else {
+    std::vector<char> buf(head_size);
+    send_head_and_payload(sock, buf.data(), head_size, msg, payload);
+  }
 }
@@ -0,0 +1,332 @@
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "buffered_socket.h"
+#include "journal_record.h"
+#include "log.h"
+#include "replication.h"
+
+namespace {
+
+enum frame_kind : std::uint8_t {
+  SNAPSHOT_PAGE = 1,
+  SNAPSHOT_END = 2,
+  RECORD = 3,
+  HEARTBEAT = 4,
+};
+
+const std::size_t MAGIC_SIZE = sizeof REPLICATION_MAGIC - 1;
+// Dropped replicas are noticed between pieces.
+const std::size_t SEND_PIECE = 256 * 1024;
+
+void append_position_frame(std::string &out, frame_kind kind, std::uint64_t position) {
+  char frame[9];
+  char *end = frame;
+  put_little_endian(end, kind, 1);
+  put_little_endian(end, position, 8);
+  out.append(frame, end - frame);
+}
+
+std::uint64_t recv_position(stream_socket &in) {
+  char buf[8];
+  in.recv(buf, sizeof buf);
+  const char *p = buf;
+  return get_little_endian(p, 8);
+}
+
+}  // namespace
+
+const std::chrono::milliseconds replication_primary::HEARTBEAT_INTERVAL(100);
+const std::chrono::milliseconds replication_primary::SEND_TIMEOUT(5000);
+
+replication_primary::replication_primary(account_store &store, account_journal *next)
+    : store_(store), next_(next), position_(0), stopping_(false) {
+}
+
+replication_primary::~replication_primary() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    for (auto &r : replicas_) {
+      r.dropped = true;
+      r.cv.notify_one();
+    }
+  }
+  for (auto &r : replicas_) {
+    r.thread.join();
+  }
+}
+
+void replication_primary::add_replica(std::unique_ptr<tcp_connection_socket> sock) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  reap();
+  if (stopping_) {
+    return;
+  }
+  replicas_.emplace_back();
+  replica &r = replicas_.back();
+  r.sock = std::move(sock);
+  r.thread = std::thread(&replication_primary::serve, this, std::ref(r));
+}
+
+void replication_primary::log_registration(t_client_id id) {
+  if (next_) {
+    next_->log_registration(id);
+  }
+  char record[JOURNAL_REGISTRATION_RECORD_SIZE];
+  publish(record, journal_encode_registration(record, id));
+}
+
+void replication_primary::log_transfer(t_client_id from, t_client_id to, t_balance amount) {
+  if (next_) {
+    next_->log_transfer(from, to, amount);
+  }
+  char record[JOURNAL_TRANSFER_RECORD_SIZE];
+  publish(record, journal_encode_transfer(record, from, to, amount));
+}
+
+void replication_primary::log_transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) {
+  if (next_) {
+    next_->log_transfer_batch(from, items);
+  }
+  std::vector<char> record(journal_batch_record_size(items.size()));
+  publish(record.data(), journal_encode_transfer_batch(record.data(), from, items));
+}
+
+std::size_t replication_primary::replicas() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::size_t count = 0;
+  for (const auto &r : replicas_) {
+    count += !r.finished;
+  }
+  return count;
+}
+
+std::uint64_t replication_primary::position() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return position_;
+}
+
+void replication_primary::publish(const char *record, std::size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  position_++;
+  for (auto &r : replicas_) {
+    if (!r.subscribed) {
+      continue;
+    }
+    if (r.pending.size() + 1 + size > MAX_BACKLOG) {
+      LOG(log_level::warning, "A replica is %zu byte(s) behind, disconnecting it", r.pending.size());
+      r.subscribed = false;
+      r.dropped = true;
+      r.pending.clear();
+      r.cv.notify_one();
+      continue;
+    }
+    bool notify = r.pending.empty();
+    r.pending.push_back(static_cast<char>(RECORD));
+    r.pending.append(record, size);
+    if (notify) {
+      r.cv.notify_one();
+    }
+  }
+}
+
+/*
+ * Sends the snapshot and then whatever is queued, appending a heartbeat
+ * at least every HEARTBEAT_INTERVAL, until the replica is dropped or fails.
+ */
+void replication_primary::serve(replica &r) {
+  try {
+    send_frames(r, REPLICATION_MAGIC, MAGIC_SIZE);
+    send_snapshot(r);
+    LOG(log_level::info, "A replica is following");
+
+    std::string batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto next_heartbeat = std::chrono::steady_clock::now();
+    for (;;) {
+      r.cv.wait_until(lock, next_heartbeat, [&r] { return r.dropped || !r.pending.empty(); });
+      if (r.dropped) {
+        break;
+      }
+      auto now = std::chrono::steady_clock::now();
+      if (now >= next_heartbeat) {
+        append_position_frame(r.pending, HEARTBEAT, position_);
+        next_heartbeat = now + HEARTBEAT_INTERVAL;
+      }
+      batch.swap(r.pending);
+      lock.unlock();
+      send_frames(r, batch.data(), batch.size());
+      batch.clear();
+      lock.lock();
+    }
+  } catch (const std::exception &e) {
+    LOG(log_level::warning, "Lost a replica: %s", e.what());
+  }
+  r.sock.reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  r.subscribed = false;
+  r.pending.clear();
+  r.finished = true;
+}
+
+// The snapshot is sent once it is taken, see account_store::write_snapshot.
+void replication_primary::send_snapshot(replica &r) {
+  std::uint64_t cut = 0;
+  std::string frames;
+  store_.write_snapshot([this, &r, &cut] {
+    // Records made after this moment are not in the snapshot, so they are queued.
+    std::lock_guard<std::mutex> lock(mutex_);
+    r.subscribed = !r.dropped;
+    cut = position_;
+  }, [&frames](const t_balance *balances, std::size_t count) {
+    std::size_t old_size = frames.size();
+    frames.resize(old_size + 5 + count * sizeof(t_balance));
+    char *out = &frames[old_size];
+    put_little_endian(out, SNAPSHOT_PAGE, 1);
+    put_little_endian(out, count, 4);
+    for (std::size_t i = 0; i < count; i++) {
+      put_little_endian(out, balances[i], 8);
+    }
+  });
+  append_position_frame(frames, SNAPSHOT_END, cut);
+  send_frames(r, frames.data(), frames.size());
+}
+
+void replication_primary::send_frames(replica &r, const char *data, std::size_t size) {
+  for (std::size_t pos = 0; pos < size; pos += SEND_PIECE) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (r.dropped) {
+        return;
+      }
+    }
+    r.sock->send(data + pos, std::min(SEND_PIECE, size - pos), std::chrono::steady_clock::now() + SEND_TIMEOUT);
+  }
+}
+
+void replication_primary::reap() {
+  for (auto it = replicas_.begin(); it != replicas_.end();) {
+    if (it->finished) {
+      it->thread.join();
+      it = replicas_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+replication_replica::replication_replica(account_store &store, std::unique_ptr<stream_client_socket> primary)
+    : store_(store), primary_(std::move(primary)), connected_(false), position_(0), last_heartbeat_(0) {
+  primary_->connect();
+  in_.reset(new buffered_socket(*primary_));
+  char magic[MAGIC_SIZE];
+  in_->recv(magic, sizeof magic);
+  if (memcmp(magic, REPLICATION_MAGIC, MAGIC_SIZE) != 0) {
+    throw std::runtime_error("The primary does not speak the replication protocol");
+  }
+  receive_snapshot();
+  connected_ = true;
+  thread_ = std::thread(&replication_replica::run, this);
+}
+
+replication_replica::~replication_replica() {
+  thread_.join();
+}
+
+std::chrono::milliseconds replication_replica::staleness() const {
+  std::chrono::steady_clock::duration since_epoch(last_heartbeat_.load());
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - std::chrono::steady_clock::time_point(since_epoch));
+}
+
+void replication_replica::receive_snapshot() {
+  std::vector<t_balance> balances;
+  std::vector<char> page;
+  for (;;) {
+    std::uint8_t kind;
+    in_->recv(&kind, 1);
+    if (kind == SNAPSHOT_END) {
+      position_ = recv_position(*in_);
+      break;
+    }
+    if (kind != SNAPSHOT_PAGE) {
+      throw std::runtime_error("Malformed replication snapshot");
+    }
+    char header[4];
+    in_->recv(header, sizeof header);
+    const char *p = header;
+    std::size_t count = get_little_endian(p, 4);
+    if (count > account_table::PAGE_SIZE) {
+      throw std::runtime_error("Malformed replication snapshot");
+    }
+    page.resize(count * sizeof(t_balance));
+    in_->recv(page.data(), page.size());
+    p = page.data();
+    for (std::size_t i = 0; i < count; i++) {
+      balances.push_back(get_little_endian(p, 8));
+    }
+  }
+
+  // Adopted balances should be cache-line aligned.
+  std::size_t bytes = balances.size() * sizeof(t_balance);
+  std::shared_ptr<char> owner(new char[bytes + CACHE_LINE_SIZE], std::default_delete<char[]>());
+  char *data = owner.get() + (CACHE_LINE_SIZE - reinterpret_cast<uintptr_t>(owner.get()) % CACHE_LINE_SIZE);
+  memcpy(data, balances.data(), bytes);
+  store_.adopt(reinterpret_cast<t_balance*>(data), balances.size(), owner);
+  heard_from_primary();
+  LOG(log_level::info, "Received a snapshot of %zu account(s) at position %llu", balances.size(),
+      static_cast<unsigned long long>(position_));
+}
+
+void replication_replica::run() {
+  try {
+    std::vector<char> payload;
+    for (;;) {
+      std::uint8_t kind;
+      in_->recv(&kind, 1);
+      if (kind == RECORD) {
+        char header[JOURNAL_RECORD_HEADER_SIZE];
+        in_->recv(header, sizeof header);
+        std::size_t size;
+        std::uint32_t checksum;
+        if (!journal_decode_header(header, size, checksum)) {
+          throw std::runtime_error("Malformed replication record");
+        }
+        payload.resize(size);
+        in_->recv(payload.data(), size);
+        if (journal_checksum(payload.data(), size) != checksum) {
+          throw std::runtime_error("Corrupted replication record");
+        }
+        journal_apply(store_, payload.data(), size);
+        position_++;
+      } else if (kind == HEARTBEAT) {
+        if (recv_position(*in_) != position_) {
+          throw std::runtime_error("The replica is out of sync with the primary");
+        }
+        heard_from_primary();
+      } else {
+        throw std::runtime_error("Malformed replication stream");
+      }
+    }
+  } catch (const socket_eof_error &) {
+    LOG(log_level::info, "The primary has closed the replication stream");
+  } catch (const std::exception &e) {
+    LOG(log_level::error, "Lost the primary: %s", e.what());
+  }
+  {
+    std::lock_guard<std::mutex> lock(lost_mutex_);
+    connected_ = false;
+  }
+  lost_.notify_all();
+}
+
+void replication_replica::wait_lost() {
+  std::unique_lock<std::mutex> lock(lost_mutex_);
+  lost_.wait(lock, [this] { return !connected_; });
+}
+
+void replication_replica::heard_from_primary() {
+  last_heartbeat_ = std::chrono::steady_clock::now().time_since_epoch().count();
+}
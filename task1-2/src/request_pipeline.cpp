@@ -0,0 +1,42 @@
+#include <stdexcept>
+#include "request_pipeline.h"
+
+request_pipeline::request_pipeline(buffered_socket &sock, std::size_t max_outstanding)
+    : sock_(sock), max_outstanding_(max_outstanding), encoding_(proto_encoding::fixed) {
+  if (max_outstanding == 0) {
+    throw std::invalid_argument("request_pipeline should allow at least one outstanding request");
+  }
+}
+
+void request_pipeline::send(const AbstractMessage &msg, response_handler on_response) {
+  while (handlers_.size() >= max_outstanding_) {
+    receive_one();
+  }
+  proto_send(sock_, msg, encoding_);
+  handlers_.push_back(on_response);
+}
+
+bool request_pipeline::receive_one() {
+  if (handlers_.empty()) {
+    return false;
+  }
+  sock_.flush();
+  proto_recv(sock_, response_, encoding_);
+  response_handler handler = std::move(handlers_.front());
+  handlers_.pop_front();
+  handler(response_.get());
+  return true;
+}
+
+void request_pipeline::set_encoding(proto_encoding encoding) {
+  if (!handlers_.empty()) {
+    throw std::logic_error("Encoding cannot change while requests are outstanding");
+  }
+  encoding_ = encoding;
+}
+
+void request_pipeline::drain() {
+  sock_.flush();
+  while (receive_one()) {
+  }
+}
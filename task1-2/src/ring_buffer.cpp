@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include "ring_buffer.h"
+
+namespace {
+
+const std::size_t MIN_ALLOCATION = 4096;
+
+}  // namespace
+
+ring_buffer::ring_buffer(std::size_t capacity) : ring_buffer(capacity, capacity) {}
+
+ring_buffer::ring_buffer(std::size_t capacity, std::size_t initial)
+    : data_(initial > 0 ? new char[initial] : nullptr), capacity_(capacity), allocated_(initial), head_(0), size_(0) {
+  if (capacity == 0 || initial > capacity) {
+    throw std::invalid_argument("ring_buffer capacity should be positive and at least the initial allocation");
+  }
+}
+
+void ring_buffer::reserve(std::size_t size) {
+  if (size <= allocated_ || allocated_ == capacity_) {
+    return;
+  }
+  std::size_t allocation = std::max(allocated_, MIN_ALLOCATION);
+  while (allocation < size) {
+    allocation *= 2;
+  }
+  allocation = std::min(allocation, capacity_);
+  std::unique_ptr<char[]> data(new char[allocation]);
+  peek(0, data.get(), size_);
+  data_.swap(data);
+  allocated_ = allocation;
+  head_ = 0;
+}
+
+std::size_t ring_buffer::write(const void *buf, std::size_t size) {
+  reserve(size_ + size);
+  const char *src = static_cast<const char*>(buf);
+  std::size_t written = 0;
+  while (written < size && !full()) {
+    auto region = write_region();
+    std::size_t n = std::min(region.second, size - written);
+    memcpy(region.first, src + written, n);
+    commit(n);
+    written += n;
+  }
+  return written;
+}
+
+std::size_t ring_buffer::read(void *buf, std::size_t size) {
+  std::size_t n = peek(0, buf, size);
+  consume(n);
+  return n;
+}
+
+std::size_t ring_buffer::peek(std::size_t offset, void *buf, std::size_t size) const {
+  if (offset >= size_) {
+    return 0;
+  }
+  size = std::min(size, size_ - offset);
+  std::size_t start = (head_ + offset) % allocated_;
+  std::size_t first = std::min(size, allocated_ - start);
+  memcpy(buf, data_.get() + start, first);
+  memcpy(static_cast<char*>(buf) + first, data_.get(), size - first);
+  return size;
+}
+
+std::pair<char*, std::size_t> ring_buffer::write_region() {
+  if (size_ == allocated_) {
+    reserve(size_ + 1);
+  }
+  std::size_t tail = (head_ + size_) % allocated_;
+  std::size_t n = tail >= head_ && size_ < allocated_ ? allocated_ - tail : head_ - tail;
+  return std::make_pair(data_.get() + tail, n);
+}
+
+void ring_buffer::commit(std::size_t n) {
+  assert(n <= allocated_ - size_);
+  size_ += n;
+}
+
+std::pair<const char*, std::size_t> ring_buffer::read_region() const {
+  return std::make_pair(data_.get() + head_, std::min(size_, allocated_ - head_));
+}
+
+void ring_buffer::consume(std::size_t n) {
+  assert(n <= size_);
+  size_ -= n;
+  // Emptying keeps regions as large as possible.
+  head_ = size_ == 0 ? 0 : (head_ + n) % allocated_;
+}
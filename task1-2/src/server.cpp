@@ -1,133 +1,385 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <stdexcept>
-#include <map>
+#include <string>
+#include <vector>
+#include "account_store.h"
+#include "client_handler.h"
+#include "epoll_server.h"
+#include "log.h"
+#include "pool_server.h"
 #include "protocol.h"
+#include "replication.h"
+#include "snapshot.h"
 #include "tcp_socket.h"
+#include "transfer_sequencer.h"
+#include "uring_server.h"
+#include "write_ahead_log.h"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifndef _WIN32
+#include <signal.h>
+#endif
 
-std::map<t_client_id, t_balance> balances;
-std::mutex balances_mutex;
-
-t_client_id register_new_client() {
-  std::lock_guard<std::mutex> lock(balances_mutex);
-  t_client_id id = balances.size();
-  assert(!balances.count(id));
-  balances[id] = 0;
-  return id;
+/*
+ * Serves a connection in threads mode. With a non-zero timeout, a client
+ * which sends nothing or takes no responses for that long is disconnected,
+ * so that it does not hold its thread forever.
+ */
+void serve_tcp_client(std::unique_ptr<tcp_connection_socket> client, std::chrono::milliseconds timeout) {
+  if (timeout.count() == 0) {
+    process_client(std::move(client));
+    return;
+  }
+  process_client(std::unique_ptr<stream_socket>(new deadline_socket(*client, timeout)));
 }
 
-t_balance get_amount(t_client_id id) {
-  std::lock_guard<std::mutex> lock(balances_mutex);
-  auto it = balances.find(id);
-  if (it == balances.end()) {
-    throw std::runtime_error("Requested balance for an unknown client");
+void take_snapshots(std::string path, std::chrono::seconds interval) {
+  for (;;) {
+    std::this_thread::sleep_for(interval);
+    try {
+      save_snapshot(accounts, path, wal.get());
+    } catch (const std::exception &e) {
+      LOG(log_level::error, "Unable to save a snapshot: %s", e.what());
+    }
   }
-  return it->second;
 }
 
-void transfer(t_client_id from, t_client_id to, t_balance amount) {
-  std::lock_guard<std::mutex> lock(balances_mutex);
-  auto it_from = balances.find(from);
-  auto it_to = balances.find(to);
-  if (it_from == balances.end() || it_to == balances.end()) {
-    throw std::runtime_error("Requested transfer for an unknown client");
-  }
-  it_from->second -= amount;
-  it_to->second += amount;
+/*
+ * A replica which has lost its primary can not catch up, as its store only
+ * takes a snapshot while empty. The server exits, so that a supervisor
+ * restarts it with a fresh snapshot instead of serving ever staler reads.
+ */
+void follow_primary() {
+  replica->wait_lost();
+  LOG(log_level::error, "Lost the primary, exiting");
+  exit(1);
 }
 
-class ClientHandler : public MessageVisitor {
-public:
-  ClientHandler(stream_socket *sock) : sock_(sock), client_id_(-1) {}
+// If accepting fails, the whole server exits.
+void accept_replicas(std::unique_ptr<tcp_server_socket> listener) {
+  try {
+    for (;;) {
+      std::unique_ptr<tcp_connection_socket> sock(listener->accept_one_client());
+      LOG(log_level::info, "New replica");
+      primary->add_replica(std::move(sock));
+    }
+  } catch (const std::exception &e) {
+    LOG(log_level::error, "Exception caught while accepting replicas: %s", e.what());
+    exit(1);
+  }
+}
 
-  void accept(const RegistrationMessage&) {
-    std::cout << "Received RegistrationMessage()" << std::endl;
-    client_id_ = register_new_client();
+typedef std::function<void(std::unique_ptr<tcp_connection_socket>)> client_consumer;
 
-    RegistrationResponse resp;
-    resp.client_id = client_id_;
-    proto_send(*sock_, resp);
+void accept_clients(tcp_server_socket &server, const client_consumer &serve) {
+  for (;;) {
+    std::unique_ptr<tcp_connection_socket> client(server.accept_one_client());
+    LOG(log_level::info, "New client");
+    serve(std::move(client));
   }
+}
 
-  void accept(const LoginMessage &m) {
-    std::cout << "Received LoginMessage(client_id=" << m.client_id << ")" << std::endl;
-    client_id_ = m.client_id;
-    get_amount(client_id_);  // Check that client exists.
-    proto_send(*sock_, OperationSucceeded());
+// Best effort: pinning is available on Linux only and may be forbidden.
+void pin_current_thread(std::size_t cpu) {
+  #ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % CPU_SETSIZE, &set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+  if (error != 0) {
+    LOG(log_level::warning, "Unable to pin a thread to CPU %zu: %s", cpu, strerror(error));
   }
+  #else
+  (void)cpu;
+  LOG(log_level::warning, "Pinning threads to CPUs is not supported on this platform");
+  #endif
+}
 
-  void accept(const RegistrationResponse&) {
-    throw std::runtime_error("Unexpected RegistrationResponse");
+/*
+ * Every listener is served by its own thread, the first one by the calling thread.
+ * Several listeners share the port with SO_REUSEPORT, so the kernel spreads
+ * connections between them and accepts do not contend for a single queue.
+ * Never returns normally; if an acceptor fails, the whole server exits.
+ */
+void run_acceptors(std::vector<std::unique_ptr<tcp_server_socket>> &listeners, bool pin, const client_consumer &serve) {
+  std::size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+  for (std::size_t i = 1; i < listeners.size(); i++) {
+    tcp_server_socket *listener = listeners[i].get();
+    std::thread([listener, i, cpus, pin, &serve] {
+      if (pin) {
+        pin_current_thread(i % cpus);
+      }
+      try {
+        accept_clients(*listener, serve);
+      } catch (const std::exception &e) {
+        LOG(log_level::error, "Exception caught in acceptor #%zu: %s", i, e.what());
+        exit(1);
+      }
+    }).detach();
   }
-
-  void accept(const BalanceInquiryRequest&) {
-    std::cout << "Received BalanceInquiryRequest()" << std::endl;
-
-    BalanceInquiryResponse resp;
-    resp.balance = get_amount(client_id_);
-    proto_send(*sock_, resp);
+  if (pin) {
+    pin_current_thread(0);
   }
+  accept_clients(*listeners[0], serve);
+}
 
-  void accept(const BalanceInquiryResponse&) {
-    throw std::runtime_error("Unexpected BalanceInquiryResponse");
-  }
+#ifndef _WIN32
+sigset_t shutdown_signals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  return signals;
+}
+#endif
 
-  void accept(const TransferRequest &m) {
-    std::cout << "Received TransferRequest("
-              << "to=" << m.transfer_to << ", "
-              << "amount=" << m.amount << ")" << std::endl;
-    transfer(client_id_, m.transfer_to, m.amount);
-    proto_send(*sock_, OperationSucceeded());
+/*
+ * Blocks SIGINT and SIGTERM in the calling thread and in threads it starts
+ * later, so they can be received by handle_shutdown_signals() only.
+ * Should be called before any other thread is started.
+ */
+void block_shutdown_signals() {
+  #ifndef _WIN32
+  sigset_t signals = shutdown_signals();
+  int error = pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  if (error != 0) {
+    throw std::runtime_error(std::string("pthread_sigmask: ") + strerror(error));
   }
+  #endif
+}
 
-  void accept(const OperationSucceeded&) {
-    throw std::runtime_error("Unexpected OperationSucceeded");
-  }
+/*
+ * Starts a thread which waits for SIGINT or SIGTERM, then lets the pool
+ * finish requests in flight and exits. Balances are not destroyed on exit
+ * as detached threads may still use them; everything already acknowledged
+ * is durable anyway.
+ */
+void handle_shutdown_signals(pool_server &server) {
+  #ifndef _WIN32
+  std::thread([&server] {
+    sigset_t signals = shutdown_signals();
+    int signal = 0;
+    sigwait(&signals, &signal);
+    LOG(log_level::info, "Got signal %d, shutting down...", signal);
+    server.shutdown();
+    LOG(log_level::info, "All requests are finished");
+    log_flush();
+    _Exit(0);
+  }).detach();
+  #else
+  (void)server;
+  #endif
+}
 
-private:
-  stream_socket *sock_;
-  std::uint64_t client_id_;
-};
+bool file_exists(const std::string &path) {
+  return std::ifstream(path.c_str()).good();
+}
 
-void process_client(std::unique_ptr<stream_socket> client) {
-  ClientHandler handler(client.get());
-  for (;;) {
-    try {
-      std::unique_ptr<AbstractMessage> msg_gen = proto_recv(*client);
-      msg_gen->visit(handler);
-    } catch (const std::exception &e) {
-      std::cout << "Exception caught while processing client: " << e.what() << std::endl;
-      break;
-    }
-  }
+void usage() {
+  std::cout << "Usage: server [host] [port] [options]\n"
+            << "Options:\n"
+            << "  --mode=threads - serve each client in its own thread (default)\n"
+            << "  --mode=epoll - serve clients from a fixed set of epoll event loops\n"
+            << "  --mode=uring - like epoll, but with io_uring event loops (Linux 6.0+, falls back to epoll)\n"
+            << "  --loops=<n> - number of event loops in epoll and uring modes (default: number of cores)\n"
+            << "  --mode=pool - execute requests on a fixed pool of work-stealing threads,\n"
+            << "                finish requests in flight on SIGINT/SIGTERM\n"
+            << "  --workers=<n> - number of threads in pool mode (default: number of cores)\n"
+            << "  --acceptors=<n> - accept connections from n threads with SO_REUSEPORT listeners (default: 1)\n"
+            << "  --pin-acceptors - pin acceptor threads to distinct CPUs (Linux only)\n"
+            << "  --sequencer - apply all transfers in order on a single thread instead of under contended locks\n"
+            << "  --client-timeout=<s> - in threads mode, disconnect clients idle for that long (default: 0, never)\n"
+            << "  --log-level=off|error|warning|info|debug - logging verbosity (default: info)\n"
+            << "  --wal=<path> - keep balances durable in a write-ahead log, replayed on start\n"
+            << "  --wal-interval=<us> - how long a group commit waits for more operations (default: 1000)\n"
+            << "  --wal-batch=<n> - commit a group early once it has that many operations (default: 1024)\n"
+            << "  --snapshot=<path> - load balances from a snapshot on start and save them periodically\n"
+            << "  --snapshot-interval=<s> - seconds between snapshots (default: 60)\n"
+            << "  --replication-port=<port> - stream all modifications to read replicas connecting to that port\n"
+            << "  --replica-of=<host>:<port> - serve reads only, following the primary's replication port;\n"
+            << "                               exits once the primary is lost, to be restarted\n"
+            << "  --max-staleness=<ms> - on a replica, refuse reads once the primary is silent for longer (default: 1000)" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
   std::string host = "127.0.0.1";
   int port = 40001;
+  std::string mode = "threads";
+  std::size_t loops = std::max(1u, std::thread::hardware_concurrency());
+  long workers = std::max(1u, std::thread::hardware_concurrency());
+  long acceptors = 1;
+  bool pin_acceptors = false;
+  bool use_sequencer = false;
+  std::string wal_path;
+  long wal_interval_us = 1000;
+  long wal_batch = write_ahead_log::DEFAULT_BATCH_SIZE;
+  std::string snapshot_path;
+  long snapshot_interval = 60;
+  double client_timeout = 0;
+  int replication_port = 0;
+  std::string replica_of;
 
-  if (argc > 1) {
-    host = argv[1];
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 7, "--mode=") == 0) {
+      mode = arg.substr(7);
+    } else if (arg.compare(0, 8, "--loops=") == 0) {
+      loops = atoi(arg.substr(8).c_str());
+    } else if (arg.compare(0, 10, "--workers=") == 0) {
+      workers = atol(arg.substr(10).c_str());
+    } else if (arg.compare(0, 12, "--acceptors=") == 0) {
+      acceptors = atol(arg.substr(12).c_str());
+    } else if (arg == "--pin-acceptors") {
+      pin_acceptors = true;
+    } else if (arg == "--sequencer") {
+      use_sequencer = true;
+    } else if (arg.compare(0, 17, "--client-timeout=") == 0) {
+      client_timeout = atof(arg.substr(17).c_str());
+    } else if (arg.compare(0, 12, "--log-level=") == 0) {
+      log_level level;
+      if (!log_parse_level(arg.c_str() + 12, level)) {
+        usage();
+        return 1;
+      }
+      log_set_level(level);
+    } else if (arg.compare(0, 6, "--wal=") == 0) {
+      wal_path = arg.substr(6);
+    } else if (arg.compare(0, 15, "--wal-interval=") == 0) {
+      wal_interval_us = atol(arg.substr(15).c_str());
+    } else if (arg.compare(0, 12, "--wal-batch=") == 0) {
+      wal_batch = atol(arg.substr(12).c_str());
+    } else if (arg.compare(0, 11, "--snapshot=") == 0) {
+      snapshot_path = arg.substr(11);
+    } else if (arg.compare(0, 20, "--snapshot-interval=") == 0) {
+      snapshot_interval = atol(arg.substr(20).c_str());
+    } else if (arg.compare(0, 19, "--replication-port=") == 0) {
+      replication_port = atoi(arg.substr(19).c_str());
+    } else if (arg.compare(0, 13, "--replica-of=") == 0) {
+      replica_of = arg.substr(13);
+    } else if (arg.compare(0, 16, "--max-staleness=") == 0) {
+      max_staleness = std::chrono::milliseconds(atol(arg.substr(16).c_str()));
+    } else if (arg.compare(0, 2, "--") == 0) {
+      usage();
+      return 1;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if (positional.size() > 0) {
+    host = positional[0];
   }
-  if (argc > 2) {
-    port = atoi(argv[2]);
+  if (positional.size() > 1) {
+    port = atoi(positional[1].c_str());
   }
+  if ((mode != "threads" && mode != "epoll" && mode != "uring" && mode != "pool") || workers <= 0 || acceptors <= 0 || wal_interval_us < 0 || wal_batch <= 0 ||
+      snapshot_interval <= 0 || client_timeout < 0 || replication_port < 0 || max_staleness.count() < 0) {
+    usage();
+    return 1;
+  }
+  // A replica gets all its balances from the primary.
+  std::size_t primary_colon = replica_of.rfind(':');
+  if (!replica_of.empty() && (primary_colon == std::string::npos || replication_port != 0 || !wal_path.empty() ||
+                              !snapshot_path.empty() || use_sequencer)) {
+    usage();
+    return 1;
+  }
+  // Outlives the socket, which keeps a pointer to it.
+  std::string primary_host = replica_of.substr(0, primary_colon);
+  tcp_port primary_port = replica_of.empty() ? 0 : atoi(replica_of.c_str() + primary_colon + 1);
 
   try {
-    std::cout << "Trying to listen on " << host << ":" << port << "..." << std::endl;
-    tcp_server_socket server(host.c_str(), port);
-    std::cout << "Listening..." << std::endl;
+    std::unique_ptr<pool_server> pool;
+    if (mode == "pool") {
+      // Before any thread is started, so that all of them inherit the signal mask.
+      block_shutdown_signals();
+      pool.reset(new pool_server(workers, [](stream_socket *sock) {
+        return make_client_handler(sock);
+      }, wait_durable));
+      handle_shutdown_signals(*pool);
+    }
+    std::uint64_t wal_position = 0;
+    if (!snapshot_path.empty() && file_exists(snapshot_path)) {
+      LOG(log_level::info, "Loading snapshot %s...", snapshot_path.c_str());
+      wal_position = load_snapshot(accounts, snapshot_path);
+    }
+    if (!wal_path.empty()) {
+      LOG(log_level::info, "Replaying write-ahead log %s...", wal_path.c_str());
+      wal.reset(new write_ahead_log(wal_path, std::chrono::microseconds(wal_interval_us), wal_batch));
+      wal->replay(accounts, wal_position);
+      accounts.set_journal(wal.get());
+    }
+    if (replication_port != 0) {
+      primary.reset(new replication_primary(accounts, wal.get()));
+      accounts.set_journal(primary.get());
+      LOG(log_level::info, "Accepting replicas on %s:%d...", host.c_str(), replication_port);
+      std::unique_ptr<tcp_server_socket> listener(new tcp_server_socket(host.c_str(), replication_port));
+      std::thread(accept_replicas, std::move(listener)).detach();
+    }
+    if (!replica_of.empty()) {
+      LOG(log_level::info, "Following the primary %s...", replica_of.c_str());
+      replica.reset(new replication_replica(accounts, std::unique_ptr<stream_client_socket>(
+          new tcp_client_socket(primary_host.c_str(), primary_port))));
+      std::thread(follow_primary).detach();
+    }
+    if (use_sequencer) {
+      sequencer.reset(new transfer_sequencer(accounts));
+    }
+    if (!snapshot_path.empty()) {
+      std::thread(take_snapshots, snapshot_path, std::chrono::seconds(snapshot_interval)).detach();
+    }
 
-    for (;;) {
-      std::unique_ptr<stream_socket> client(server.accept_one_client());
-      std::cout << "New client" << std::endl;
-      std::thread th(process_client, std::move(client));
-      th.detach();
+    LOG(log_level::info, "Trying to listen on %s:%d...", host.c_str(), port);
+    std::vector<std::unique_ptr<tcp_server_socket>> listeners;
+    for (long i = 0; i < acceptors; i++) {
+      listeners.emplace_back(new tcp_server_socket(host.c_str(), port, acceptors > 1));
+    }
+    if (mode == "uring" && !uring_server::supported()) {
+      LOG(log_level::warning, "io_uring is not available, falling back to epoll mode");
+      mode = "epoll";
     }
+    LOG(log_level::info, "Listening in %s mode with %ld acceptor(s)...", mode.c_str(), acceptors);
+
+    if (mode == "uring") {
+      uring_server reactor(loops, [](stream_socket *sock) {
+        return make_client_handler(sock);
+      }, wait_durable);
+      run_acceptors(listeners, pin_acceptors, [&reactor](std::unique_ptr<tcp_connection_socket> client) {
+        reactor.add_client(std::move(client));
+      });
+    }
+    if (mode == "epoll") {
+      epoll_server reactor(loops, [](stream_socket *sock) {
+        return make_client_handler(sock);
+      }, wait_durable);
+      run_acceptors(listeners, pin_acceptors, [&reactor](std::unique_ptr<tcp_connection_socket> client) {
+        reactor.add_client(std::move(client));
+      });
+    }
+    if (pool) {
+      run_acceptors(listeners, pin_acceptors, [&pool](std::unique_ptr<tcp_connection_socket> client) {
+        pool->add_client(std::move(client));
+      });
+    }
+
+    std::chrono::milliseconds timeout(static_cast<long long>(client_timeout * 1000));
+    run_acceptors(listeners, pin_acceptors, [timeout](std::unique_ptr<tcp_connection_socket> client) {
+      std::thread th(serve_tcp_client, std::move(client), timeout);
+      th.detach();
+    });
   } catch (const std::exception &e) {
-    std::cout << "Exception caught in the main loop: " << e.what() << std::endl;
+    LOG(log_level::error, "Exception caught in the main loop: %s", e.what());
     return 1;
   }
   return 0;
@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <memory>
+#include <stdexcept>
+#include "log.h"
+#include "snapshot.h"
+
+namespace {
+
+const char MAGIC[8] = {'A', 'U', 'S', 'N', 'A', 'P', 'S', 'H'};
+const std::size_t HEADER_SIZE = 64;
+static_assert(HEADER_SIZE % CACHE_LINE_SIZE == 0, "Balances should be cache-line aligned");
+
+void put(char *&out, std::uint64_t value, std::size_t bytes) {
+  for (std::size_t i = 0; i < bytes; i++) {
+    *out++ = static_cast<char>(value >> (8 * i));
+  }
+}
+
+std::uint64_t get(const char *&in, std::size_t bytes) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < bytes; i++) {
+    value |= static_cast<std::uint64_t>(static_cast<unsigned char>(*in++)) << (8 * i);
+  }
+  return value;
+}
+
+bool little_endian() {
+  const std::uint16_t one = 1;
+  return *reinterpret_cast<const unsigned char*>(&one) == 1;
+}
+
+// Converts between the host and the file byte order, in place.
+void swap_bytes(t_balance *balances, std::size_t count) {
+  for (std::size_t i = 0; i < count; i++) {
+    std::uint64_t value = balances[i];
+    std::uint64_t swapped = 0;
+    for (int b = 0; b < 8; b++) {
+      swapped = (swapped << 8) | ((value >> (8 * b)) & 0xFF);
+    }
+    balances[i] = swapped;
+  }
+}
+
+void throw_errno(const std::string &what) {
+  throw std::runtime_error(what + ": " + strerror(errno));
+}
+
+void write_header(FILE *file, std::uint64_t count, std::uint64_t wal_position) {
+  char header[HEADER_SIZE] = {};
+  char *out = header;
+  memcpy(out, MAGIC, sizeof MAGIC);
+  out += sizeof MAGIC;
+  put(out, SNAPSHOT_VERSION, 4);
+  put(out, HEADER_SIZE, 4);
+  put(out, count, 8);
+  put(out, wal_position, 8);
+  if (fseek(file, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof header, file) != sizeof header) {
+    throw_errno("Unable to write a snapshot");
+  }
+}
+
+// Returns the number of accounts and the log position.
+std::pair<std::uint64_t, std::uint64_t> read_header(const char *header, std::uint64_t file_size) {
+  const char *in = header;
+  if (file_size < HEADER_SIZE || memcmp(in, MAGIC, sizeof MAGIC) != 0) {
+    throw std::runtime_error("Not a snapshot file");
+  }
+  in += sizeof MAGIC;
+  std::uint32_t version = get(in, 4);
+  std::uint32_t header_size = get(in, 4);
+  if (version != SNAPSHOT_VERSION || header_size != HEADER_SIZE) {
+    throw std::runtime_error("Unsupported snapshot version " + std::to_string(version));
+  }
+  std::uint64_t count = get(in, 8);
+  std::uint64_t wal_position = get(in, 8);
+  if (count > (file_size - HEADER_SIZE) / sizeof(t_balance) ||
+      file_size != HEADER_SIZE + count * sizeof(t_balance)) {
+    throw std::runtime_error("Truncated snapshot file");
+  }
+  return std::make_pair(count, wal_position);
+}
+
+void sync_file(int fd) {
+#ifdef _WIN32
+  (void)fd;
+#else
+  if (fsync(fd) != 0) {
+    throw_errno("Unable to flush a snapshot");
+  }
+#endif
+}
+
+}  // namespace
+
+std::uint64_t save_snapshot(account_store &store, const std::string &path, write_ahead_log *wal) {
+  std::string temp_path = path + ".tmp";
+  std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(temp_path.c_str(), "wb"), fclose);
+  if (!file) {
+    throw_errno("Unable to create " + temp_path);
+  }
+  setvbuf(file.get(), nullptr, _IOFBF, 1 << 20);
+  // Space for the header, which is only known once the snapshot is complete.
+  write_header(file.get(), 0, 0);
+
+  std::uint64_t wal_position = 0;
+  bool swap = !little_endian();
+  t_balance swapped[account_table::PAGE_SIZE];
+  std::size_t count = store.write_snapshot(
+      [&] {
+        if (wal) {
+          wal_position = wal->appended();
+        }
+      },
+      [&](const t_balance *balances, std::size_t n) {
+        if (swap) {
+          memcpy(swapped, balances, n * sizeof(t_balance));
+          swap_bytes(swapped, n);
+          balances = swapped;
+        }
+        if (fwrite(balances, sizeof(t_balance), n, file.get()) != n) {
+          throw_errno("Unable to write " + temp_path);
+        }
+      });
+
+  write_header(file.get(), count, wal_position);
+  if (fflush(file.get()) != 0) {
+    throw_errno("Unable to write " + temp_path);
+  }
+  sync_file(fileno(file.get()));
+  file.reset();
+
+  // Otherwise the snapshot could refer to log records lost in a crash.
+  if (wal) {
+    wal->wait_durable(wal_position);
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    throw_errno("Unable to replace " + path);
+  }
+#ifndef _WIN32
+  std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/') + 1);
+  int dir_fd = open(dir.c_str(), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+#endif
+  LOG(log_level::info, "Saved a snapshot of %zu account(s)", count);
+  return wal_position;
+}
+
+std::uint64_t load_snapshot(account_store &store, const std::string &path) {
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw_errno("Unable to open " + path);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw_errno("Unable to stat " + path);
+  }
+  std::uint64_t file_size = st.st_size;
+  if (file_size < HEADER_SIZE) {
+    close(fd);
+    throw std::runtime_error("Not a snapshot file");
+  }
+  // Private writable mapping: pages are read lazily and copied on first write.
+  void *mapping = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw_errno("Unable to map " + path);
+  }
+  std::shared_ptr<void> owner(mapping, [file_size](void *p) { munmap(p, file_size); });
+  char *data = static_cast<char*>(mapping);
+#else
+  std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(path.c_str(), "rb"), fclose);
+  if (!file) {
+    throw_errno("Unable to open " + path);
+  }
+  fseek(file.get(), 0, SEEK_END);
+  std::uint64_t file_size = ftell(file.get());
+  fseek(file.get(), 0, SEEK_SET);
+  std::shared_ptr<char> owner(new char[file_size + CACHE_LINE_SIZE], std::default_delete<char[]>());
+  char *data = owner.get() + (CACHE_LINE_SIZE - reinterpret_cast<uintptr_t>(owner.get()) % CACHE_LINE_SIZE);
+  if (fread(data, 1, file_size, file.get()) != file_size) {
+    throw_errno("Unable to read " + path);
+  }
+#endif
+
+  auto header = read_header(data, file_size);
+  t_balance *balances = reinterpret_cast<t_balance*>(data + HEADER_SIZE);
+  if (!little_endian()) {
+    swap_bytes(balances, header.first);
+  }
+  store.adopt(balances, header.first, owner);
+  LOG(log_level::info, "Loaded a snapshot of %llu account(s)", static_cast<unsigned long long>(header.first));
+  return header.second;
+}
@@ -1,79 +1,28 @@
 #include <assert.h>
+#include <limits.h>
 #include <memory.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <sstream>
+#include "metrics.h"
+#include "socket_util.h"
 #include "tcp_socket.h"
 #ifdef _WIN32
 #include <w32api.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #endif
 
-#ifdef _WIN32
-// INVALID_SOCKET is already defined
-// SOCKET_ERROR is already defined
-#else
-static const int INVALID_SOCKET = -1;
-static const int SOCKET_ERROR = -1;
-#define closesocket close
-#endif
-
-#ifdef _WIN32
-class WSAStartupper {
-public:
-  WSAStartupper() {
-    WSADATA data;
-    assert(WSAStartup(MAKEWORD(2, 2), &data) == 0);
-  }
-  // We do not call WSACleanup() because of troubles with order of global ctors/dtors.
-private:
-  WSAStartupper(WSAStartupper &&) = delete;
-  WSAStartupper(const WSAStartupper&) = delete;
-  WSAStartupper& operator=(WSAStartupper) = delete;
-};
-#endif
-
-std::string get_socket_error(int code) {
-  #ifdef _WIN32
-  LPVOID msg_buf;
-  assert(FormatMessage(
-      FORMAT_MESSAGE_ALLOCATE_BUFFER |
-      FORMAT_MESSAGE_FROM_SYSTEM |
-      FORMAT_MESSAGE_IGNORE_INSERTS,
-      NULL,
-      code,
-      MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-      (LPTSTR)&msg_buf,
-      0, NULL) != 0);
-  std::string result((char*)msg_buf);
-  LocalFree(msg_buf);
-  return result;
-  #else
-  return strerror(code);
-  #endif
-}
-std::string get_socket_error() {
-  #ifdef _WIN32
-  return get_socket_error(WSAGetLastError());
-  #else
-  return get_socket_error(errno);
-  #endif
-}
-
-template<typename T>
-void ensure_or_throw_impl(bool condition, const char *errname, const char *funname, const char *file, int line, const char *cond) {
-  if (!condition) {
-    std::stringstream msg;
-    msg << errname << " in " << funname << "() at " << file << ":" << line << ": condition " << cond << " failed: " << get_socket_error();
-    throw T(msg.str());
-  }
-}
-#define ensure_or_throw(cond, error) ensure_or_throw_impl<error>(cond, #error, __FUNCTION__, __FILE__, __LINE__, #cond)
-
 tcp_connection_socket::tcp_connection_socket() : sock_(INVALID_SOCKET) {}
 
 tcp_connection_socket::tcp_connection_socket(SOCKET sock) : sock_(sock) {}
@@ -105,6 +54,7 @@ void tcp_connection_socket::send(const void *buf, size_t size) {
     ensure_or_throw(sent != SOCKET_ERROR, socket_io_error);
     i += sent;
   }
+  metrics_add(metric_counter::bytes_sent, size);
 }
 
 void tcp_connection_socket::recv(void *buf, size_t size) {
@@ -117,6 +67,283 @@ void tcp_connection_socket::recv(void *buf, size_t size) {
     }
     i += recved;
   }
+  metrics_add(metric_counter::bytes_received, size);
+}
+
+#ifndef _WIN32
+namespace {
+
+// Within IOV_MAX everywhere, so that sendmsg()/recvmsg() never reject a batch.
+const int IOV_BATCH = 64;
+
+/*
+ * Position in a sequence of buffers for vectored transfers which may stop
+ * in the middle: fills iovec batches with what is left, skipping empty buffers.
+ */
+template<typename Buffer>
+class iov_cursor {
+public:
+  iov_cursor(const Buffer *bufs, size_t count) : bufs_(bufs), count_(count), index_(0), offset_(0) {
+    skip_empty();
+  }
+
+  bool done() const { return index_ == count_; }
+
+  int fill(iovec *iov) const {
+    int n = 0;
+    for (size_t i = index_; i < count_ && n < IOV_BATCH; i++) {
+      size_t offset = i == index_ ? offset_ : 0;
+      if (bufs_[i].size > offset) {
+        iov[n].iov_base = const_cast<char*>(static_cast<const char*>(bufs_[i].data)) + offset;
+        iov[n].iov_len = bufs_[i].size - offset;
+        n++;
+      }
+    }
+    return n;
+  }
+
+  void advance(size_t n) {
+    while (n > 0) {
+      size_t left = bufs_[index_].size - offset_;
+      if (n < left) {
+        offset_ += n;
+        return;
+      }
+      n -= left;
+      index_++;
+      offset_ = 0;
+    }
+    skip_empty();
+  }
+
+private:
+  void skip_empty() {
+    while (index_ < count_ && bufs_[index_].size == offset_) {
+      index_++;
+      offset_ = 0;
+    }
+  }
+
+  const Buffer *bufs_;
+  size_t count_;
+  size_t index_;
+  size_t offset_;
+};
+
+}  // namespace
+#endif
+
+void tcp_connection_socket::sendv(const const_buffer *bufs, size_t count) {
+  #ifdef _WIN32
+  stream_socket::sendv(bufs, count);
+  #else
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  iov_cursor<const_buffer> cursor(bufs, count);
+  size_t total = 0;
+  while (!cursor.done()) {
+    iovec iov[IOV_BATCH];
+    msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cursor.fill(iov);
+    int flags = 0;
+    #ifdef __linux__
+    flags |= MSG_NOSIGNAL;
+    #endif
+    ssize_t sent = ::sendmsg(sock_, &msg, flags);
+    ensure_or_throw(sent != SOCKET_ERROR, socket_io_error);
+    cursor.advance(sent);
+    total += sent;
+  }
+  metrics_add(metric_counter::bytes_sent, total);
+  #endif
+}
+
+void tcp_connection_socket::recvv(const mutable_buffer *bufs, size_t count) {
+  #ifdef _WIN32
+  stream_socket::recvv(bufs, count);
+  #else
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  iov_cursor<mutable_buffer> cursor(bufs, count);
+  size_t total = 0;
+  while (!cursor.done()) {
+    iovec iov[IOV_BATCH];
+    msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cursor.fill(iov);
+    ssize_t recved = ::recvmsg(sock_, &msg, 0);
+    ensure_or_throw(recved != SOCKET_ERROR, socket_io_error);
+    if (recved == 0) {
+      throw socket_eof_error("Socket was gracefully closed");
+    }
+    cursor.advance(recved);
+    total += recved;
+  }
+  metrics_add(metric_counter::bytes_received, total);
+  #endif
+}
+
+static bool would_block() {
+  #ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+  #else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+  #endif
+}
+
+void tcp_connection_socket::set_nonblocking(bool nonblocking) {
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  #ifdef _WIN32
+  u_long mode = nonblocking ? 1 : 0;
+  ensure_or_throw(ioctlsocket(sock_, FIONBIO, &mode) == 0, socket_error);
+  #else
+  int flags = fcntl(sock_, F_GETFL, 0);
+  ensure_or_throw(flags != -1, socket_error);
+  flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  ensure_or_throw(fcntl(sock_, F_SETFL, flags) == 0, socket_error);
+  #endif
+}
+
+size_t tcp_connection_socket::send_some(const void *buf, size_t size) {
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  size_t i = 0;
+  while (i < size) {
+    int flags = 0;
+    #ifdef __linux__
+    flags |= MSG_NOSIGNAL;
+    #endif
+    int sent = ::send(sock_, static_cast<const char*>(buf) + i, size - i, flags);
+    if (sent == SOCKET_ERROR && would_block()) {
+      break;
+    }
+    ensure_or_throw(sent != SOCKET_ERROR, socket_io_error);
+    i += sent;
+  }
+  metrics_add(metric_counter::bytes_sent, i);
+  return i;
+}
+
+size_t tcp_connection_socket::recv_some(void *buf, size_t size) {
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  int recved = ::recv(sock_, static_cast<char*>(buf), size, 0);
+  if (recved == SOCKET_ERROR && would_block()) {
+    return 0;
+  }
+  ensure_or_throw(recved != SOCKET_ERROR, socket_io_error);
+  if (recved == 0 && size > 0) {
+    throw socket_eof_error("Socket was gracefully closed");
+  }
+  metrics_add(metric_counter::bytes_received, recved);
+  return recved;
+}
+
+namespace {
+
+#ifdef MSG_DONTWAIT
+const int DONTWAIT = MSG_DONTWAIT;
+const bool POLL_FIRST = false;
+#else
+// There is no per-call non-blocking flag on Windows, so readiness is awaited before every call instead.
+const int DONTWAIT = 0;
+const bool POLL_FIRST = true;
+#endif
+
+#ifdef __linux__
+const int NOSIGNAL = MSG_NOSIGNAL;
+#else
+const int NOSIGNAL = 0;
+#endif
+
+/*
+ * Waits until the socket is ready for `events` or has an error, which is
+ * then reported by the following call. Throws socket_timeout_error once the
+ * deadline passes; socket_deadline::max() waits forever.
+ */
+void wait_ready(SOCKET sock, short events, socket_deadline deadline) {
+  for (;;) {
+    int timeout_ms = -1;
+    if (deadline != socket_deadline::max()) {
+      auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now());
+      if (left.count() <= 0) {
+        throw socket_timeout_error("Socket operation timed out");
+      }
+      // Rounded up, so that poll() does not return just before the deadline and spin.
+      timeout_ms = static_cast<int>(std::min<long long>((left.count() + 999) / 1000, INT_MAX));
+    }
+    pollfd fd;
+    fd.fd = sock;
+    fd.events = events;
+    fd.revents = 0;
+    #ifdef _WIN32
+    int ready = WSAPoll(&fd, 1, timeout_ms);
+    #else
+    int ready = poll(&fd, 1, timeout_ms);
+    if (ready == -1 && errno == EINTR) {
+      continue;
+    }
+    #endif
+    ensure_or_throw(ready != SOCKET_ERROR, socket_io_error);
+    if (ready > 0) {
+      return;
+    }
+  }
+}
+
+bool connect_in_progress() {
+  #ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+  #else
+  return errno == EINPROGRESS;
+  #endif
+}
+
+}  // namespace
+
+void tcp_connection_socket::send(const void *buf, size_t size, socket_deadline deadline) {
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  for (size_t i = 0; i < size;) {
+    if (POLL_FIRST) {
+      wait_ready(sock_, POLLOUT, deadline);
+    }
+    int sent = ::send(sock_, static_cast<const char*>(buf) + i, size - i, NOSIGNAL | DONTWAIT);
+    if (sent == SOCKET_ERROR && would_block()) {
+      wait_ready(sock_, POLLOUT, deadline);
+      continue;
+    }
+    ensure_or_throw(sent != SOCKET_ERROR, socket_io_error);
+    i += sent;
+  }
+  metrics_add(metric_counter::bytes_sent, size);
+}
+
+void tcp_connection_socket::recv(void *buf, size_t size, socket_deadline deadline) {
+  for (size_t i = 0; i < size;) {
+    i += recv_some(static_cast<char*>(buf) + i, size - i, deadline);
+  }
+}
+
+size_t tcp_connection_socket::recv_some(void *buf, size_t size, socket_deadline deadline) {
+  ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
+  if (size == 0) {
+    return 0;
+  }
+  for (;;) {
+    if (POLL_FIRST) {
+      wait_ready(sock_, POLLIN, deadline);
+    }
+    int recved = ::recv(sock_, static_cast<char*>(buf), size, DONTWAIT);
+    if (recved == SOCKET_ERROR && would_block()) {
+      wait_ready(sock_, POLLIN, deadline);
+      continue;
+    }
+    ensure_or_throw(recved != SOCKET_ERROR, socket_io_error);
+    if (recved == 0) {
+      throw socket_eof_error("Socket was gracefully closed");
+    }
+    metrics_add(metric_counter::bytes_received, recved);
+    return recved;
+  }
 }
 
 class NameResolver {
@@ -160,6 +387,10 @@ private:
 };
 
 void tcp_client_socket::connect() {
+  connect(socket_deadline::max());
+}
+
+void tcp_client_socket::connect(socket_deadline deadline) {
   #ifdef _WIN32
   static WSAStartupper wsa_startupper_;
   #endif
@@ -167,16 +398,24 @@ void tcp_client_socket::connect() {
   NameResolver resolver(host_.c_str(), port_);
   SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
   ensure_or_throw(sock != INVALID_SOCKET, socket_error);
-  try {
-    ensure_or_throw(::connect(sock, resolver.ai_addr(), resolver.ai_addrlen()) == 0, socket_error);
-    sock_ = tcp_connection_socket(sock);
-  } catch (...) {
-    assert(closesocket(sock) == 0);
-    throw;
+  tcp_connection_socket connection(sock);  // Closes the socket if connecting fails.
+  // Connects in the background, so that the wait can be cut short.
+  connection.set_nonblocking(true);
+  if (::connect(sock, resolver.ai_addr(), resolver.ai_addrlen()) != 0) {
+    ensure_or_throw(connect_in_progress(), socket_error);
+    wait_ready(sock, POLLOUT, deadline);
+    int error = 0;
+    socklen_t error_len = sizeof error;
+    ensure_or_throw(getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &error_len) == 0, socket_error);
+    if (error != 0) {
+      throw socket_error("Unable to connect to '" + host_ + "': " + get_socket_error(error));
+    }
   }
+  connection.set_nonblocking(false);
+  sock_ = std::move(connection);
 }
 
-tcp_server_socket::tcp_server_socket(hostname host, tcp_port port) {
+tcp_server_socket::tcp_server_socket(hostname host, tcp_port port, bool reuse_port) {
   #ifdef _WIN32
   static WSAStartupper wsa_startupper_;
   #endif
@@ -187,8 +426,25 @@ tcp_server_socket::tcp_server_socket(hostname host, tcp_port port) {
   ensure_or_throw(setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&reuse_addr), sizeof reuse_addr) == 0, socket_error);
   ensure_or_throw(sock_ != INVALID_SOCKET, socket_error);
   try {
+    if (reuse_port) {
+      #ifdef SO_REUSEPORT
+      int one = 1;
+      ensure_or_throw(setsockopt(sock_, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char*>(&one), sizeof one) == 0, socket_error);
+      #else
+      throw socket_error("SO_REUSEPORT is not supported on this platform");
+      #endif
+    }
     ensure_or_throw(::bind(sock_, resolver.ai_addr(), resolver.ai_addrlen()) == 0, socket_error);
     ensure_or_throw(listen(sock_, SOMAXCONN) == 0, socket_error);
+    // Clients are awaited with poll(), so that accept() never blocks on a
+    // connection which was taken by another thread or dropped meanwhile.
+    #ifdef _WIN32
+    u_long nonblocking = 1;
+    ensure_or_throw(ioctlsocket(sock_, FIONBIO, &nonblocking) == 0, socket_error);
+    #else
+    int flags = fcntl(sock_, F_GETFL, 0);
+    ensure_or_throw(flags != -1 && fcntl(sock_, F_SETFL, flags | O_NONBLOCK) == 0, socket_error);
+    #endif
   } catch (...) {
     assert(closesocket(sock_) == 0);
     throw;
@@ -203,19 +459,26 @@ tcp_server_socket& tcp_server_socket::operator=(tcp_server_socket other) {
   return *this;
 }
 
-stream_socket* tcp_server_socket::accept_one_client() {
+tcp_connection_socket* tcp_server_socket::accept_one_client() {
+  return accept_one_client(socket_deadline::max());
+}
+
+tcp_connection_socket* tcp_server_socket::accept_one_client(socket_deadline deadline) {
   ensure_or_throw(sock_ != INVALID_SOCKET, socket_uninitialized);
   sockaddr addr;
   socklen_t addrlen = sizeof(addr);
   SOCKET client = INVALID_SOCKET;
-  for (int retry = 0; retry < 3; retry++) {
+  for (int retry = 0; retry < 3;) {
+    wait_ready(sock_, POLLIN, deadline);
     client = accept(sock_, &addr, &addrlen);
     if (client != INVALID_SOCKET) {
       break;
     }
+    if (would_block()) {
+      continue;  // Taken by another thread.
+    }
     #ifdef __linux__
-    if (errno == EAGAIN ||
-        errno == ENETDOWN ||
+    if (errno == ENETDOWN ||
         errno == EPROTO ||
         errno == ENOPROTOOPT ||
         errno == EHOSTDOWN ||
@@ -223,18 +486,25 @@ stream_socket* tcp_server_socket::accept_one_client() {
         errno == EHOSTUNREACH ||
         errno == EOPNOTSUPP ||
         errno == ENETUNREACH) {
+      retry++;
       continue;  // Retry
     }
     #endif
     break;
   }
   ensure_or_throw(client != INVALID_SOCKET, socket_error);
+  std::unique_ptr<tcp_connection_socket> connection;
   try {
-    return new tcp_connection_socket(client);
+    connection.reset(new tcp_connection_socket(client));
   } catch (...) {
     assert(closesocket(client) == 0);
     throw;
   }
+  #ifndef __linux__
+  // Elsewhere accepted sockets inherit the non-blocking mode of the listener.
+  connection->set_nonblocking(false);
+  #endif
+  return connection.release();
 }
 
 tcp_server_socket::~tcp_server_socket() {
@@ -5,9 +5,11 @@
 #include <cstring>
 #include <assert.h>
 #include <pthread.h>
+#include <chrono>
+#include <vector>
 
 #define TEST_TCP_STREAM_SOCKET
-//#define TEST_AU_STREAM_SOCKET
+#define TEST_AU_STREAM_SOCKET
 
 #include "stream_socket.h"
 #ifdef TEST_TCP_STREAM_SOCKET
@@ -21,10 +23,15 @@
 const char *TEST_ADDR = "localhost";
 #ifdef TEST_TCP_STREAM_SOCKET
 const tcp_port TCP_TEST_PORT = 40002;
+const tcp_port TCP_DEADLINE_TEST_PORT = 40004;
 #endif
 #ifdef TEST_AU_STREAM_SOCKET
 const au_stream_port AU_TEST_CLIENT_PORT = 40001;
 const au_stream_port AU_TEST_SERVER_PORT = 301;
+const au_stream_port AU_LOSSY_TEST_CLIENT_PORT = 40003;
+const au_stream_port AU_LOSSY_TEST_SERVER_PORT = 302;
+const au_stream_port AU_BACKLOG_TEST_CLIENT_PORT = 40100;  // Up to 40100 + ACCEPT_BACKLOG.
+const au_stream_port AU_BACKLOG_TEST_SERVER_PORT = 303;
 #endif
 
 static std::unique_ptr<stream_client_socket> client;
@@ -69,6 +76,19 @@ static void test_stream_sockets_datapipe()
             buf[buf_ix] = i;
         server_client->send(buf, sizeof(buf));
     }
+    pthread_join(th, NULL);
+}
+
+static void test_stream_sockets_vectored()
+{
+    // Buffers are split differently on both sides, empty ones are skipped
+    const const_buffer out[] = {{"Hello, ", 7}, {"", 0}, {"vectored world", 14}};
+    char head[3], tail[18];
+    const mutable_buffer in[] = {{head, sizeof(head)}, {tail, sizeof(tail)}};
+    client->sendv(out, 3);
+    server_client->recvv(in, 2);
+    assert(memcmp(head, "Hel", 3) == 0);
+    assert(memcmp(tail, "lo, vectored world", 18) == 0);
 }
 
 static void* test_stream_sockets_partial_data_sent_thread_func(void *)
@@ -102,16 +122,59 @@ static void test_stream_sockets_partial_data_sent()
         thrown = true;
     }
     assert(thrown);
+    pthread_join(th, NULL);
 }
 
 #ifdef TEST_TCP_STREAM_SOCKET
+static void test_tcp_deadlines()
+{
+    using std::chrono::milliseconds;
+    using std::chrono::steady_clock;
+
+    tcp_server_socket listener(TEST_ADDR, TCP_DEADLINE_TEST_PORT);
+    bool thrown = false;
+    try {
+        delete listener.accept_one_client(steady_clock::now() + milliseconds(20));
+    } catch (const socket_timeout_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    tcp_client_socket sock(TEST_ADDR, TCP_DEADLINE_TEST_PORT);
+    sock.connect(steady_clock::now() + milliseconds(1000));
+    std::unique_ptr<tcp_connection_socket> peer(listener.accept_one_client(steady_clock::now() + milliseconds(1000)));
+
+    // Nothing is sent, so the receive gives up, but not before the deadline
+    char c = 0;
+    thrown = false;
+    auto started = steady_clock::now();
+    try {
+        sock.connection().recv(&c, 1, started + milliseconds(50));
+    } catch (const socket_timeout_error &) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(steady_clock::now() - started >= milliseconds(50));
+
+    peer->send("x", 1, steady_clock::now() + milliseconds(1000));
+    deadline_socket timed(sock.connection(), milliseconds(1000));
+    timed.recv(&c, 1);
+    assert(c == 'x');
+    // Both ends are left in blocking mode
+    sock.send("y", 1);
+    peer->recv(&c, 1);
+    assert(c == 'y');
+}
+
 static void test_tcp_stream_sockets()
 {
     server.reset(new tcp_server_socket(TEST_ADDR, TCP_TEST_PORT));
     client.reset(new tcp_client_socket(TEST_ADDR, TCP_TEST_PORT));
 
     test_stream_sockets_datapipe();
+    test_stream_sockets_vectored();
     test_stream_sockets_partial_data_sent();
+    test_tcp_deadlines();
 }
 #endif
 
@@ -122,18 +185,73 @@ static void test_au_stream_sockets()
     client.reset(new au_stream_client_socket(TEST_ADDR, AU_TEST_CLIENT_PORT, AU_TEST_SERVER_PORT));
 
     test_stream_sockets_datapipe();
+    test_stream_sockets_vectored();
+    test_stream_sockets_partial_data_sent();
+
+    // Same over a link which loses, delays and reorders packets, like netnsct.sh does
+    au_stream_set_impairment({0.3, std::chrono::milliseconds(20), std::chrono::milliseconds(10)});
+    server.reset(new au_stream_server_socket(TEST_ADDR, AU_LOSSY_TEST_SERVER_PORT));
+    client.reset(new au_stream_client_socket(TEST_ADDR, AU_LOSSY_TEST_CLIENT_PORT, AU_LOSSY_TEST_SERVER_PORT));
+    au_stream_set_impairment({0, std::chrono::milliseconds(0), std::chrono::milliseconds(0)});
+
+    test_stream_sockets_datapipe();
+    test_stream_sockets_vectored();
     test_stream_sockets_partial_data_sent();
 }
+
+// Connections beyond the backlog are refused until the server accepts some.
+static void test_au_stream_backlog()
+{
+    au_stream_server_socket listener(TEST_ADDR, AU_BACKLOG_TEST_SERVER_PORT);
+    std::vector<std::unique_ptr<au_stream_client_socket>> clients;
+    for (size_t i = 0; i <= au_stream_server_socket::ACCEPT_BACKLOG; ++i) {
+        clients.emplace_back(new au_stream_client_socket(TEST_ADDR, AU_BACKLOG_TEST_CLIENT_PORT + i,
+                                                         AU_BACKLOG_TEST_SERVER_PORT));
+    }
+    for (size_t i = 0; i < au_stream_server_socket::ACCEPT_BACKLOG; ++i)
+        clients[i]->connect();
+
+    bool refused = false;
+    try {
+        clients.back()->connect();
+    } catch (const socket_error &) {
+        refused = true;
+    }
+    assert(refused);
+
+    std::unique_ptr<stream_socket> accepted(listener.accept_one_client());
+    clients.back()->connect();
+    clients.back()->send("x", 1);
+    std::unique_ptr<stream_socket> last;
+    for (size_t i = 0; i < au_stream_server_socket::ACCEPT_BACKLOG; ++i)
+        last.reset(listener.accept_one_client());
+    char c = 0;
+    last->recv(&c, 1);
+    assert(c == 'x');
+}
 #endif
 
 int main()
 {
     test_protocol();
+    test_account_store();
+    test_buffered_socket();
+    test_log();
+    test_write_ahead_log();
+    test_snapshot();
+    test_histogram();
+    test_metrics();
+    test_thread_pool();
+    test_transfer_sequencer();
+    test_replication();
+    test_client_handler();
+    test_servers();
     #ifdef TEST_TCP_STREAM_SOCKET
     test_tcp_stream_sockets();
     #endif
     #ifdef TEST_AU_STREAM_SOCKET
     test_au_stream_sockets();
+    test_au_stream_backlog();
     #endif
 
     return 0;
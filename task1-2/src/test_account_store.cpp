@@ -0,0 +1,149 @@
+#include "test.h"
+#include "account_store.h"
+#include <assert.h>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+static void test_account_table() {
+  account_table table;
+  assert(table.size() == 0);
+  const std::size_t n = 2 * account_table::CHUNK_SIZE + 1;
+  for (std::size_t i = 0; i < n; i++) {
+    assert(table.push_back() == i);
+  }
+  assert(table.size() == n);
+  t_balance &first = table[0];
+  for (std::size_t i = 0; i < n; i++) {
+    assert(table[i] == 0);
+    table[i] = i;
+  }
+  table.push_back();
+  assert(&first == &table[0]);  // Growing does not move balances.
+  assert(table[n - 1] == static_cast<t_balance>(n - 1));
+  assert(reinterpret_cast<std::uintptr_t>(&table[account_table::CHUNK_SIZE]) % CACHE_LINE_SIZE == 0);
+}
+
+static void test_account_store_basic() {
+  account_store store(4);
+  assert(store.register_new_client() == 0);
+  assert(store.register_new_client() == 1);
+  assert(store.size() == 2);
+  assert(store.get_amount(0) == 0);
+
+  store.transfer(0, 1, 17);
+  assert(store.get_amount(0) == -17);
+  assert(store.get_amount(1) == 17);
+
+  store.transfer(1, 1, 5);
+  assert(store.get_amount(1) == 17);
+
+  bool thrown = false;
+  try {
+    store.get_amount(2);
+  } catch (const unknown_client_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  thrown = false;
+  try {
+    store.transfer(0, 2, 1);
+  } catch (const unknown_client_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(store.get_amount(0) == -17);
+}
+
+static void test_account_store_batch() {
+  account_store store(4);
+  for (int i = 0; i < 20; i++) {
+    store.register_new_client();
+  }
+  std::vector<BatchTransferRequest::Item> items;
+  for (int i = 1; i < 20; i++) {
+    items.push_back({static_cast<t_client_id>(i), i});
+  }
+  store.transfer_batch(0, items);
+  assert(store.get_amount(0) == -190);
+  assert(store.get_amount(19) == 19);
+
+  items.push_back({20, 1});
+  bool thrown = false;
+  try {
+    store.transfer_batch(0, items);
+  } catch (const unknown_client_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+  assert(store.get_amount(0) == -190);  // Nothing is applied.
+  assert(store.get_amount(19) == 19);
+}
+
+static void test_account_store_concurrent() {
+  const int CLIENTS = 16;
+  const int THREADS = 8;
+  const int TRANSFERS = 20000;
+
+  account_store store(4);
+  for (int i = 0; i < CLIENTS; i++) {
+    store.register_new_client();
+  }
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&store, t] {
+      for (int i = 0; i < TRANSFERS; i++) {
+        // Opposite directions in different threads check that lock ordering avoids deadlocks.
+        t_client_id a = (i + t) % CLIENTS, b = (i * 7 + 3) % CLIENTS;
+        if (t % 2) {
+          store.transfer(a, b, 1);
+        } else {
+          store.transfer(b, a, 1);
+        }
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+
+  t_balance total = 0;
+  for (int i = 0; i < CLIENTS; i++) {
+    total += store.get_amount(i);
+  }
+  assert(total == 0);
+}
+
+static void test_account_store_lock_free_reads() {
+  account_store store(4);
+  store.register_new_client();
+  store.register_new_client();
+  // Both halves of the amount change at once, so a torn read would show up as another value.
+  const t_balance AMOUNT = (t_balance(1) << 32) + 1;
+  std::atomic<bool> done(false);
+
+  std::thread writer([&store, &done, AMOUNT] {
+    for (int i = 0; i < 20000; i++) {
+      store.transfer(0, 1, AMOUNT);
+      store.transfer(1, 0, AMOUNT);
+    }
+    done = true;
+  });
+  while (!done) {
+    t_balance amount = store.get_amount(0);
+    assert(amount == 0 || amount == -AMOUNT);
+  }
+  writer.join();
+  assert(store.get_amount(0) == 0);
+}
+
+void test_account_store() {
+  test_account_table();
+  test_account_store_basic();
+  test_account_store_batch();
+  test_account_store_concurrent();
+  test_account_store_lock_free_reads();
+}
@@ -0,0 +1,140 @@
+#include "test.h"
+#include "buffered_socket.h"
+#include "protocol.h"
+#include "ring_buffer.h"
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+namespace {
+
+// Counts calls to the underlying "syscalls".
+class counting_socket : public stream_socket {
+public:
+  void send(const void *buf, size_t size) override {
+    sends++;
+    data.append(static_cast<const char*>(buf), size);
+  }
+  void sendv(const const_buffer *bufs, size_t count) override {
+    sends++;
+    for (size_t i = 0; i < count; i++) {
+      data.append(static_cast<const char*>(bufs[i].data), bufs[i].size);
+    }
+  }
+  void recv(void *buf, size_t size) override {
+    recvs++;
+    assert(size <= data.size() - pos);
+    memcpy(buf, data.data() + pos, size);
+    pos += size;
+  }
+  size_t recv_some(void *buf, size_t size) override {
+    recvs++;
+    size = std::min(size, data.size() - pos);
+    assert(size > 0);
+    memcpy(buf, data.data() + pos, size);
+    pos += size;
+    return size;
+  }
+
+  std::string data;
+  std::size_t pos = 0;
+  int sends = 0, recvs = 0;
+};
+
+}  // namespace
+
+static void test_ring_buffer() {
+  ring_buffer buf(8);
+  assert(buf.write("abcdef", 6) == 6);
+  char out[8];
+  assert(buf.read(out, 4) == 4);
+  assert(memcmp(out, "abcd", 4) == 0);
+  assert(buf.write("ghijklmn", 8) == 6);  // Wraps around.
+  assert(buf.full());
+  assert(buf.read_region().second == 4);
+  assert(buf.peek(1, out, 8) == 7);
+  assert(memcmp(out, "fghijkl", 7) == 0);
+  assert(buf.read(out, 8) == 8);
+  assert(memcmp(out, "efghijkl", 8) == 0);
+  assert(buf.empty());
+  assert(buf.write_region().second == 8);
+}
+
+static void test_growing_ring_buffer() {
+  ring_buffer buf(1 << 16, 0);
+  assert(buf.allocated() == 0);
+  assert(buf.free_space() == 1 << 16);
+  char out[8];
+  assert(buf.read(out, 8) == 0);
+  assert(buf.write("abcdef", 6) == 6);
+  std::size_t first = buf.allocated();
+  assert(first > 0 && first < buf.capacity());
+  assert(buf.read(out, 4) == 4);
+  assert(memcmp(out, "abcd", 4) == 0);
+
+  // Data wrapped around the first allocation stays in order when it grows.
+  std::string data(first - 2, 'x');
+  assert(buf.write(data.data(), data.size()) == data.size());
+  assert(buf.allocated() == first);
+  assert(buf.write("0123", 4) == 4);
+  assert(buf.allocated() == 2 * first);
+  assert(buf.read(out, 3) == 3);
+  assert(memcmp(out, "efx", 3) == 0);
+  assert(buf.peek(buf.size() - 4, out, 4) == 4);
+  assert(memcmp(out, "0123", 4) == 0);
+
+  std::string big(1 << 17, 'y');
+  assert(buf.write(big.data(), big.size()) == buf.capacity() - (first + 1));
+  assert(buf.full());
+  assert(buf.allocated() == buf.capacity());
+}
+
+static void test_buffered_socket_batching() {
+  counting_socket inner;
+  {
+    buffered_socket sock(inner, 1024, 1024);
+    for (int i = 0; i < 10; i++) {
+      proto_send(sock, TransferRequest());
+    }
+    assert(inner.sends == 0);
+    sock.flush();
+    assert(inner.sends == 1);
+    assert(inner.data.size() == 10 * (1 + TransferRequest::fixed_size()));
+
+    AnyMessage msg;
+    for (int i = 0; i < 10; i++) {
+      proto_recv(sock, msg);
+      assert(msg.get_if<TransferRequest>());
+    }
+    assert(inner.recvs == 1);
+    assert(sock.buffered_input() == 0);
+  }
+
+  // Large transfers bypass the buffers and go out along with the buffered data.
+  counting_socket big_inner;
+  buffered_socket sock(big_inner, 16, 16);
+  std::string big(100, 'x');
+  sock.send("ab", 2);
+  sock.send(big.data(), big.size());
+  assert(big_inner.sends == 1);
+  assert(big_inner.data == "ab" + big);
+
+  // Small vectored sends are coalesced.
+  const_buffer parts[] = {{"cd", 2}, {"", 0}, {"ef", 2}};
+  sock.sendv(parts, 3);
+  assert(big_inner.sends == 1);
+  sock.flush();
+  assert(big_inner.sends == 2);
+  assert(big_inner.data == "ab" + big + "cdef");
+  char in[102];
+  sock.recv(in, 1);
+  sock.recv(in + 1, 101);
+  assert(std::string(in, 102) == "ab" + big);
+}
+
+void test_buffered_socket() {
+  test_ring_buffer();
+  test_growing_ring_buffer();
+  test_buffered_socket_batching();
+}
@@ -0,0 +1,146 @@
+#include "test.h"
+#include "client_handler.h"
+#include "journal_record.h"
+#include "tcp_socket.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+static const tcp_port CLIENT_HANDLER_TEST_PORT = 40006;
+
+// Sends the requests at once and returns the connection to read the responses from.
+static std::unique_ptr<tcp_client_socket> serve_pipelined(const std::string &requests) {
+  tcp_server_socket listener("127.0.0.1", CLIENT_HANDLER_TEST_PORT);
+  std::unique_ptr<tcp_client_socket> client(new tcp_client_socket("127.0.0.1", CLIENT_HANDLER_TEST_PORT));
+  client->connect();
+  std::thread([](std::unique_ptr<stream_socket> sock) {
+    process_client(std::move(sock));
+  }, std::unique_ptr<stream_socket>(listener.accept_one_client())).detach();
+  client->send(requests.data(), requests.size());
+  return client;
+}
+
+static void expect_closed(tcp_client_socket &client) {
+  bool thrown = false;
+  try {
+    proto_recv(client);
+  } catch (const socket_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// Responses to requests before a failed one are sent, as the requests are applied.
+static void test_client_handler_pipelined_failure() {
+  t_client_id from = accounts.register_new_client();
+  t_client_id to = accounts.register_new_client();
+  MessageBatch<> batch;
+  LoginMessage login;
+  login.client_id = from;
+  batch.add(login);
+  TransferRequest transfer;
+  transfer.transfer_to = to;
+  transfer.amount = 5;
+  batch.add(transfer);
+
+  // The handler throws for an unknown client.
+  TransferRequest unknown;
+  unknown.transfer_to = accounts.size() + 100;
+  unknown.amount = 1;
+  MessageBatch<> failing;
+  failing.add(unknown);
+  std::unique_ptr<tcp_client_socket> client = serve_pipelined(
+      std::string(batch.data(), batch.size()) + std::string(failing.data(), failing.size()));
+  assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+  assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+  expect_closed(*client);
+
+  // The next request has an unknown id, so its size cannot be told.
+  client = serve_pipelined(std::string(batch.data(), batch.size()) + "\xff");
+  assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+  assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+  expect_closed(*client);
+
+  assert(accounts.get_amount(from) == -10);
+  assert(accounts.get_amount(to) == 10);
+}
+
+// Only the first message may be a Hello, a later one closes the connection.
+static void test_client_handler_late_hello() {
+  HelloMessage hello;
+  hello.version = PROTO_VERSION;
+  hello.capabilities = 0;
+  LoginMessage login;
+  login.client_id = accounts.register_new_client();
+
+  MessageBatch<> greeted;
+  greeted.add(hello);
+  greeted.add(login);
+  greeted.add(hello);
+  std::unique_ptr<tcp_client_socket> client = serve_pipelined(std::string(greeted.data(), greeted.size()));
+  assert(proto_recv(*client)->id() == HelloResponse::ID);
+  assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+  expect_closed(*client);
+
+  MessageBatch<> late;
+  late.add(login);
+  late.add(hello);
+  client = serve_pipelined(std::string(late.data(), late.size()));
+  assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+  expect_closed(*client);
+}
+
+// A batch from a client which has not logged in fails like a single transfer does.
+static void test_client_handler_batch_without_login() {
+  t_client_id to = accounts.register_new_client();
+  BatchTransferRequest batch;
+  batch.items.push_back(BatchTransferRequest::Item{to, 5});
+  MessageBatch<> requests;
+  requests.add(batch);
+  std::unique_ptr<tcp_client_socket> client = serve_pipelined(std::string(requests.data(), requests.size()));
+  expect_closed(*client);
+  assert(accounts.get_amount(to) == 0);
+}
+
+// Responses which do not fit into the socket's buffer wait for the disk too.
+static void test_client_handler_durable_overflow() {
+  const int REGISTRATIONS = 10000;  // 90 KB of responses.
+  char path[] = "/tmp/test_handler_wal_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  // Nothing is synced by the log on its own before the responses would be sent.
+  wal.reset(new write_ahead_log(path, std::chrono::milliseconds(500), 1 << 20));
+  accounts.set_journal(wal.get());
+
+  tcp_server_socket listener("127.0.0.1", CLIENT_HANDLER_TEST_PORT);
+  std::unique_ptr<tcp_client_socket> client(new tcp_client_socket("127.0.0.1", CLIENT_HANDLER_TEST_PORT));
+  client->connect();
+  std::thread server([](std::unique_ptr<stream_socket> sock) {
+    process_client(std::move(sock));
+  }, std::unique_ptr<stream_socket>(listener.accept_one_client()));
+  std::uint64_t start = wal->appended();
+  std::string requests(REGISTRATIONS, static_cast<char>(RegistrationMessage::ID));
+  client->send(requests.data(), requests.size());
+  for (int i = 1; i <= REGISTRATIONS; i++) {
+    assert(proto_recv(*client)->id() == RegistrationResponse::ID);
+    assert(wal->durable() >= start + i * JOURNAL_REGISTRATION_RECORD_SIZE);
+  }
+  client.reset();  // The handler exits on end of stream.
+  server.join();
+
+  accounts.set_journal(nullptr);
+  wal.reset();
+  unlink(path);
+}
+
+void test_client_handler() {
+  test_client_handler_pipelined_failure();
+  test_client_handler_late_hello();
+  test_client_handler_batch_without_login();
+  test_client_handler_durable_overflow();
+}
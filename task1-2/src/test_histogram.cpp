@@ -0,0 +1,73 @@
+#include "test.h"
+#include "histogram.h"
+#include <assert.h>
+#include <cstdint>
+
+static void test_histogram_exact() {
+  histogram h;
+  assert(h.count() == 0 && h.percentile(50) == 0);
+  for (std::uint64_t i = 1; i <= 1000; i++) {
+    h.record(i);
+  }
+  assert(h.count() == 1000);
+  assert(h.min() == 1 && h.max() == 1000);
+  assert(h.mean() == 500.5);
+  assert(h.percentile(0) == 1);
+  assert(h.percentile(50) == 500);
+  assert(h.percentile(99.9) == 999);
+  assert(h.percentile(100) == 1000);
+}
+
+static void test_histogram_precision() {
+  histogram h;
+  const std::uint64_t values[] = {2048, 3000, 123456, 987654321, 1ull << 39};
+  for (std::uint64_t value : values) {
+    h.clear();
+    h.record(value - 1);
+    h.record(value);
+    h.record(value + 1);
+    std::uint64_t p = h.percentile(50);
+    assert(p >= value && p - value <= value / 1000);
+  }
+
+  h.clear();
+  h.record(histogram::MAX_VALUE + 12345);
+  assert(h.max() == histogram::MAX_VALUE);
+  assert(h.percentile(100) == histogram::MAX_VALUE);
+}
+
+static void test_histogram_merge() {
+  histogram a, b;
+  for (int i = 0; i < 90; i++) {
+    a.record(10);
+  }
+  for (int i = 0; i < 10; i++) {
+    b.record(1000000);
+  }
+  a.merge(b);
+  assert(a.count() == 100);
+  assert(a.min() == 10);
+  assert(a.percentile(90) == 10);
+  std::uint64_t p99 = a.percentile(99);
+  assert(p99 >= 1000000 && p99 <= 1001000);
+}
+
+static void test_histogram_low_precision() {
+  histogram h(4);
+  h.record(5, 3);
+  h.record(1000);
+  assert(h.count() == 4);
+  assert(h.percentile(75) == 5);
+  std::uint64_t p = h.percentile(100);
+  assert(p == 1000);  // Clamped to the maximum.
+  h.record(1001);
+  p = h.percentile(80);
+  assert(p >= 1000 && p <= 1000 + 1000 / 8);
+}
+
+void test_histogram() {
+  test_histogram_exact();
+  test_histogram_precision();
+  test_histogram_merge();
+  test_histogram_low_precision();
+}
@@ -0,0 +1,67 @@
+#include "test.h"
+#include "log.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+namespace {
+
+std::string read_all(FILE *f) {
+  std::string result;
+  rewind(f);
+  char buf[4096];
+  size_t got;
+  while ((got = fread(buf, 1, sizeof buf, f)) > 0) {
+    result.append(buf, got);
+  }
+  return result;
+}
+
+std::size_t count(const std::string &s, const std::string &what) {
+  std::size_t result = 0;
+  for (std::size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1)) {
+    result++;
+  }
+  return result;
+}
+
+void test_log_levels_and_threads() {
+  FILE *output = tmpfile();
+  assert(output);
+  log_set_output(output);
+  log_set_level(log_level::warning);
+
+  const int RECORDS_PER_THREAD = 100;  // Well below the ring capacity, nothing is dropped.
+  auto producer = [&](int thread_id) {
+    for (int i = 0; i < RECORDS_PER_THREAD; i++) {
+      LOG(log_level::warning, "thread %d record %d", thread_id, i);
+      LOG(log_level::info, "filtered out %d", i);
+    }
+  };
+  std::thread other(producer, 1);
+  producer(0);
+  other.join();
+
+  bool evaluated = false;
+  LOG(log_level::debug, "%d", (evaluated = true, 0));
+  assert(!evaluated);
+
+  log_flush();
+  std::string written = read_all(output);
+  assert(count(written, "[W] thread 0 record ") == RECORDS_PER_THREAD);
+  assert(count(written, "[W] thread 1 record ") == RECORDS_PER_THREAD);
+  assert(count(written, "filtered out") == 0);
+  // Records of a single thread keep their order.
+  assert(written.find("thread 1 record 9\n") < written.find("thread 1 record 10\n"));
+
+  log_set_output(stdout);
+  log_set_level(log_level::info);
+  fclose(output);
+}
+
+}  // namespace
+
+void test_log() {
+  test_log_levels_and_threads();
+}
@@ -0,0 +1,30 @@
+#include "test.h"
+#include "metrics.h"
+#include <assert.h>
+#include <thread>
+
+// Metrics are process-wide, so only the differences are checked.
+void test_metrics() {
+  const std::uint8_t ID = 12;  // Not used by any message.
+  metrics_snapshot before = metrics_collect();
+
+  // Blocks of exited threads are kept.
+  std::thread([&] {
+    for (int i = 0; i < 99; i++) {
+      metrics_record_request(ID, 1000, false);
+    }
+    metrics_record_request(ID, 1000000, true);
+    metrics_add(metric_counter::bytes_sent, 17);
+  }).join();
+  metrics_record_lock_wait(5);
+
+  metrics_snapshot after = metrics_collect();
+  const metrics_snapshot::request_stats &r = after.requests[ID];
+  assert(r.service_ns.count() - before.requests[ID].service_ns.count() == 100);
+  assert(r.errors - before.requests[ID].errors == 1);
+  assert(r.service_ns.percentile(50) >= 1000 && r.service_ns.percentile(50) <= 1000 + 1000 / 8);
+  assert(r.service_ns.max() >= 1000000 && r.service_ns.max() <= 1000000 + 1000000 / 8);
+  assert(after[metric_counter::bytes_sent] - before[metric_counter::bytes_sent] == 17);
+  assert(after[metric_counter::lock_waits] - before[metric_counter::lock_waits] == 1);
+  assert(after.lock_wait_ns.count() - before.lock_wait_ns.count() == 1);
+}
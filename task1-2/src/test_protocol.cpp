@@ -1,39 +1,25 @@
 #include "test.h"
 #include "stream_socket.h"
 #include "protocol.h"
+#include "stringstream_socket.h"
 #include <assert.h>
 #include <sstream>
 #include <set>
-
-class stringstream_socket : public stream_socket {
-public:
-  void send(const void *buf, size_t size) override {
-    assert(data_.write(reinterpret_cast<const char*>(buf), size));
-  }
-  void recv(void *buf, size_t size) override {
-    assert(data_.read(reinterpret_cast<char*>(buf), size));
-  }
-  const std::stringstream& data() const {
-    return data_;
-  }
-
-private:
-  std::stringstream data_;
-};
+#include <vector>
 
 std::set<std::uint8_t> ids;
 
 template<typename T> void fill_message(T&) {
 }
 
-template<typename T> void check_message(T&) {
+template<typename T> void check_message(const T&) {
 }
 
 template<> void fill_message<LoginMessage>(LoginMessage &msg) {
   msg.client_id = 239017;
 }
 
-template<> void check_message<LoginMessage>(LoginMessage &msg) {
+template<> void check_message<LoginMessage>(const LoginMessage &msg) {
   assert(msg.client_id == 239017);
 }
 
@@ -41,7 +27,7 @@ template<> void fill_message<RegistrationResponse>(RegistrationResponse &msg) {
   msg.client_id = 239017;
 }
 
-template<> void check_message<RegistrationResponse>(RegistrationResponse &msg) {
+template<> void check_message<RegistrationResponse>(const RegistrationResponse &msg) {
   assert(msg.client_id == 239017);
 }
 
@@ -49,7 +35,7 @@ template<> void fill_message<BalanceInquiryResponse>(BalanceInquiryResponse &msg
   msg.balance = -239017;
 }
 
-template<> void check_message<BalanceInquiryResponse>(BalanceInquiryResponse &msg) {
+template<> void check_message<BalanceInquiryResponse>(const BalanceInquiryResponse &msg) {
   assert(msg.balance == -239017);
 }
 
@@ -58,11 +44,71 @@ template<> void fill_message<TransferRequest>(TransferRequest &msg) {
   msg.amount = -17239;
 }
 
-template<> void check_message<TransferRequest>(TransferRequest &msg) {
+template<> void check_message<TransferRequest>(const TransferRequest &msg) {
   assert(msg.transfer_to == 239017);
   assert(msg.amount == -17239);
 }
 
+template<> void fill_message<BatchTransferRequest>(BatchTransferRequest &msg) {
+  msg.items.push_back({239017, -17239});
+  msg.items.push_back({1, 2});
+}
+
+template<> void check_message<BatchTransferRequest>(const BatchTransferRequest &msg) {
+  assert(msg.items.size() == 2);
+  assert(msg.items[0].transfer_to == 239017);
+  assert(msg.items[0].amount == -17239);
+  assert(msg.items[1].transfer_to == 1);
+  assert(msg.items[1].amount == 2);
+}
+
+template<> void fill_message<BatchTransferResponse>(BatchTransferResponse &msg) {
+  msg.statuses.push_back(BatchTransferResponse::NOT_APPLIED);
+  msg.statuses.push_back(BatchTransferResponse::UNKNOWN_CLIENT);
+  msg.statuses.push_back(BatchTransferResponse::OK);
+}
+
+template<> void check_message<BatchTransferResponse>(const BatchTransferResponse &msg) {
+  assert(msg.statuses.size() == 3);
+  assert(msg.statuses[0] == BatchTransferResponse::NOT_APPLIED);
+  assert(msg.statuses[1] == BatchTransferResponse::UNKNOWN_CLIENT);
+  assert(msg.statuses[2] == BatchTransferResponse::OK);
+}
+
+template<> void fill_message<StatsResponse>(StatsResponse &msg) {
+  msg.text = std::string("requests 10\n\0bytes 239\n", 23);
+}
+
+template<> void check_message<StatsResponse>(const StatsResponse &msg) {
+  assert(msg.text == std::string("requests 10\n\0bytes 239\n", 23));
+}
+
+template<> void fill_message<HelloMessage>(HelloMessage &msg) {
+  msg.version = PROTO_VERSION;
+  msg.capabilities = 0xFFFFFFFF;
+}
+
+template<> void check_message<HelloMessage>(const HelloMessage &msg) {
+  assert(msg.version == PROTO_VERSION);
+  assert(msg.capabilities == 0xFFFFFFFF);
+}
+
+template<typename T> std::size_t expected_size(const T&) {
+  return T::fixed_size();
+}
+
+template<> std::size_t expected_size<BatchTransferRequest>(const BatchTransferRequest &msg) {
+  return BatchTransferRequest::HEADER_SIZE + msg.items.size() * BatchTransferRequest::ITEM_SIZE;
+}
+
+template<> std::size_t expected_size<BatchTransferResponse>(const BatchTransferResponse &msg) {
+  return BatchTransferResponse::HEADER_SIZE + msg.statuses.size() * BatchTransferResponse::ITEM_SIZE;
+}
+
+template<> std::size_t expected_size<StatsResponse>(const StatsResponse &msg) {
+  return StatsResponse::HEADER_SIZE + msg.text.size();
+}
+
 template<typename T> void test_message() {
   std::stringstream sstr;
   stringstream_socket sock;
@@ -75,6 +121,13 @@ template<typename T> void test_message() {
 
     msg.serialize(sstr);
     assert(sstr.str().size() == msg.serialized_size());
+    assert(msg.serialized_size() == expected_size(msg));
+
+    std::vector<char> buf(1 + msg.serialized_size());
+    assert(proto_encode(buf.data(), msg) == buf.size());
+    assert(static_cast<std::uint8_t>(buf[0]) == T::ID);
+    assert(std::string(buf.data() + 1, buf.size() - 1) == sstr.str());
+    assert(proto_message_size(buf.data(), buf.size()) == buf.size());
 
     proto_send(sock, msg);
   }
@@ -85,12 +138,149 @@ template<typename T> void test_message() {
     assert(sstr.rdbuf()->in_avail() == 0);
     check_message(msg_out);
   }
+  {
+    const std::string data = sock.data().str();
+    AnyMessage msg_out;
+    assert(proto_decode(data.data(), data.size() - 1, msg_out) == 0);
+    assert(msg_out.empty());
+    assert(proto_decode(data.data(), data.size(), msg_out) == data.size());
+    assert(msg_out.get_if<T>() != nullptr);
+    check_message(*msg_out.get_if<T>());
+  }
   {
     auto msg_out_ptr = proto_recv(sock);
     assert(sock.data().rdbuf()->in_avail() == 0);
     T &msg_out = dynamic_cast<T&>(*msg_out_ptr);
     check_message(msg_out);
   }
+
+  const proto_encoding compact = proto_encoding::compact;
+  {
+    T msg;
+    fill_message(msg);
+    std::vector<char> buf(proto_encoded_size(msg, compact));
+    assert(proto_encode(buf.data(), msg, compact) == buf.size());
+    assert(buf.size() <= 1 + expected_size(msg) + 1);
+    assert(proto_message_size(buf.data(), buf.size(), compact) == buf.size());
+
+    AnyMessage msg_out;
+    assert(proto_decode(buf.data(), buf.size() - 1, msg_out, compact) == 0);
+    assert(proto_decode(buf.data(), buf.size(), msg_out, compact) == buf.size());
+    check_message(*msg_out.get_if<T>());
+
+    proto_send(sock, msg, compact);
+    proto_send(sock, msg, compact);
+    proto_recv(sock, msg_out, compact);
+    check_message(*msg_out.get_if<T>());
+    check_message(dynamic_cast<T&>(*proto_recv(sock, compact)));
+    assert(sock.data().rdbuf()->in_avail() == 0);
+  }
+}
+
+static void test_compact_encoding() {
+  char buf[MAX_MESSAGE_SIZE];
+  const proto_encoding compact = proto_encoding::compact;
+
+  BalanceInquiryResponse balance;
+  for (t_balance value : {t_balance(0), t_balance(-1), t_balance(63), t_balance(-64), t_balance(64), INT64_MIN, INT64_MAX}) {
+    balance.balance = value;
+    std::size_t size = proto_encode(buf, balance, compact);
+    assert(size == 2 + proto_varint_size(proto_to_varint(value)));
+    AnyMessage msg;
+    assert(proto_decode(buf, size, msg, compact) == size);
+    assert(msg.get_if<BalanceInquiryResponse>()->balance == value);
+  }
+  assert(proto_varint_size(proto_to_varint(t_balance(-64))) == 1);
+  assert(proto_varint_size(proto_to_varint(INT64_MIN)) == proto_max_varint_size(8));
+
+  AnyMessage msg;
+  // A payload with a varint which never ends.
+  const char endless[] = {LoginMessage::ID, 11, '\x80', '\x80', '\x80', '\x80', '\x80', '\x80', '\x80', '\x80', '\x80', '\x80', '\x01'};
+  bool thrown = false;
+  try {
+    proto_decode(endless, sizeof endless, msg, compact);
+  } catch (const protocol_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // An extra byte after the client id.
+  const char trailing[] = {LoginMessage::ID, 2, 1, 0};
+  thrown = false;
+  try {
+    proto_decode(trailing, sizeof trailing, msg, compact);
+  } catch (const protocol_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // More items than bytes in the payload.
+  const char short_batch[] = {BatchTransferResponse::ID, 2, 100, 0};
+  thrown = false;
+  try {
+    proto_decode(short_batch, sizeof short_batch, msg, compact);
+  } catch (const protocol_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+static void test_message_batch() {
+  MessageBatch<64> batch;
+  TransferRequest transfer;
+  fill_message(transfer);
+  assert(batch.add(transfer));
+  assert(batch.add(OperationSucceeded()));
+  assert(batch.add(transfer));
+  assert(batch.add(transfer));
+  assert(!batch.add(transfer));  // 4 * 17 bytes do not fit.
+  assert(batch.add(OperationSucceeded()));
+
+  stringstream_socket sock;
+  batch.send(sock);
+  assert(batch.empty());
+  const std::string data = sock.data().str();
+  assert(data.size() == 3 * 17 + 2);
+
+  AnyMessage msg;
+  std::size_t pos = 0, count = 0;
+  while (std::size_t size = proto_decode(data.data() + pos, data.size() - pos, msg)) {
+    if (count == 1 || count == 4) {
+      assert(msg.get_if<OperationSucceeded>());
+    } else {
+      check_message(*msg.get_if<TransferRequest>());
+    }
+    pos += size;
+    count++;
+  }
+  assert(pos == data.size());
+  assert(count == 5);
+}
+
+namespace {
+
+// Handles logins only, everything else goes to DefaultMessageVisitor.
+struct login_visitor : DefaultMessageVisitor {
+  t_client_id client_id = 0;
+  void accept(const LoginMessage &m) override { client_id = m.client_id; }
+};
+
+}  // namespace
+
+static void test_default_visitor() {
+  login_visitor v;
+  LoginMessage login;
+  login.client_id = 42;
+  login.visit(v);
+  assert(v.client_id == 42);
+
+  bool thrown = false;
+  try {
+    OperationSucceeded().visit(v);
+  } catch (const protocol_error &) {
+    thrown = true;
+  }
+  assert(thrown);
 }
 
 void test_protocol() {
@@ -102,4 +292,13 @@ void test_protocol() {
   test_message<BalanceInquiryResponse>();
   test_message<TransferRequest>();
   test_message<OperationSucceeded>();
+  test_message<BatchTransferRequest>();
+  test_message<BatchTransferResponse>();
+  test_message<StatsRequest>();
+  test_message<StatsResponse>();
+  test_message<HelloMessage>();
+  test_message<HelloResponse>();
+  test_message_batch();
+  test_compact_encoding();
+  test_default_visitor();
 }
@@ -0,0 +1,104 @@
+#include "test.h"
+#include "replication.h"
+#include "tcp_socket.h"
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static const tcp_port REPLICATION_TEST_PORT = 40005;
+
+template<typename Predicate>
+static bool wait_for(Predicate done) {
+  for (int i = 0; i < 1000 && !done(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return done();
+}
+
+// A replica which takes no data holds up neither snapshots nor the primary for long.
+static void test_stalled_replica() {
+  const int CLIENTS = 1 << 20;  // The snapshot does not fit into socket buffers.
+  account_store store(4);
+  for (int i = 0; i < CLIENTS; i++) {
+    store.register_new_client();
+  }
+  replication_primary primary(store, nullptr);
+  store.set_journal(&primary);
+  tcp_server_socket listener("127.0.0.1", REPLICATION_TEST_PORT);
+  tcp_client_socket stalled("127.0.0.1", REPLICATION_TEST_PORT);
+  stalled.connect();
+  primary.add_replica(std::unique_ptr<tcp_connection_socket>(listener.accept_one_client()));
+  assert(primary.replicas() == 1);
+
+  std::atomic<bool> taken(false);
+  std::thread snapshot([&store, &taken] {
+    store.write_snapshot([] {}, [](const t_balance *, std::size_t) {});
+    taken = true;
+  });
+  assert(wait_for([&] { return taken.load(); }));
+  snapshot.join();
+  store.transfer(0, 1, 1);
+  assert(wait_for([&] { return primary.replicas() == 0; }));
+  store.set_journal(nullptr);
+}
+
+void test_replication() {
+  const int CLIENTS = 10;
+  const int THREADS = 4;
+  const int TRANSFERS = 1000;
+  account_store store(4);
+  account_store follower(4);
+  std::unique_ptr<replication_replica> replica;
+  {
+    replication_primary primary(store, nullptr);
+    store.set_journal(&primary);
+    for (int i = 0; i < CLIENTS; i++) {
+      store.register_new_client();
+    }
+    store.transfer(0, 1, 100);
+
+    // The replica starts from a snapshot taken while transfers go on.
+    tcp_server_socket listener("127.0.0.1", REPLICATION_TEST_PORT);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+      threads.emplace_back([&store, t] {
+        for (int i = 0; i < TRANSFERS; i++) {
+          store.transfer((i + t) % CLIENTS, (i * 3 + 1) % CLIENTS, i);
+        }
+        std::vector<BatchTransferRequest::Item> items = {{2, 5}, {3, 7}};
+        store.transfer_batch(t, items);
+      });
+    }
+    std::thread acceptor([&primary, &listener] {
+      primary.add_replica(std::unique_ptr<tcp_connection_socket>(listener.accept_one_client()));
+    });
+    replica.reset(new replication_replica(follower, std::unique_ptr<stream_client_socket>(
+        new tcp_client_socket("127.0.0.1", REPLICATION_TEST_PORT))));
+    acceptor.join();
+    for (auto &th : threads) {
+      th.join();
+    }
+    t_client_id added = store.register_new_client();
+    store.transfer(added, 0, 42);
+    assert(primary.replicas() == 1);
+
+    assert(wait_for([&] { return replica->position() == primary.position(); }));
+    assert(follower.size() == store.size());
+    for (std::size_t id = 0; id < store.size(); id++) {
+      assert(follower.get_amount(id) == store.get_amount(id));
+    }
+    assert(replica->connected());
+    assert(wait_for([&] { return replica->staleness() < 2 * replication_primary::HEARTBEAT_INTERVAL; }));
+    store.set_journal(nullptr);
+  }
+  // The primary has closed the stream, the replica keeps its data.
+  replica->wait_lost();
+  assert(!replica->connected());
+  replica.reset();
+  assert(follower.get_amount(CLIENTS) == -42);
+
+  test_stalled_replica();
+}
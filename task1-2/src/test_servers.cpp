@@ -0,0 +1,219 @@
+#include "test.h"
+#include "client_handler.h"
+#include "epoll_server.h"
+#include "pool_server.h"
+#include "uring_server.h"
+#include "tcp_socket.h"
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const tcp_port SERVERS_TEST_PORT = 40007;
+
+// Answers balance inquiries with the number of requests handled so far on all connections.
+struct counting_handler : DefaultMessageVisitor {
+  counting_handler(stream_socket *sock, std::atomic<std::uint64_t> &handled) : sock_(sock), handled_(handled) {}
+
+  void accept(const BalanceInquiryRequest&) override {
+    BalanceInquiryResponse response;
+    response.balance = ++handled_;
+    proto_send(*sock_, response);
+  }
+
+private:
+  stream_socket *sock_;
+  std::atomic<std::uint64_t> &handled_;
+};
+
+// Connects a client and hands the other end to the server.
+template<typename Server>
+std::unique_ptr<tcp_client_socket> connect_to(Server &server, tcp_server_socket &listener) {
+  std::unique_ptr<tcp_client_socket> client(new tcp_client_socket("127.0.0.1", SERVERS_TEST_PORT));
+  client->connect();
+  server.add_client(std::unique_ptr<tcp_connection_socket>(listener.accept_one_client()));
+  return client;
+}
+
+/*
+ * Every client pipelines a login, transfers to the next client and a balance
+ * inquiry in a single write, then reads all responses.
+ */
+template<typename Server>
+void test_server_pipelined(Server &server) {
+  const int CLIENTS = 4;
+  const int TRANSFERS = 100;
+  tcp_server_socket listener("127.0.0.1", SERVERS_TEST_PORT);
+  t_client_id first = accounts.size();
+  for (int i = 0; i < CLIENTS; i++) {
+    accounts.register_new_client();
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < CLIENTS; i++) {
+    std::shared_ptr<tcp_client_socket> client(connect_to(server, listener));
+    threads.emplace_back([client, first, i] {
+      std::vector<char> requests;
+      auto add = [&requests](const AbstractMessage &msg) {
+        std::size_t size = proto_encoded_size(msg);
+        requests.resize(requests.size() + size);
+        proto_encode(requests.data() + requests.size() - size, msg);
+      };
+      LoginMessage login;
+      login.client_id = first + i;
+      add(login);
+      TransferRequest transfer;
+      transfer.transfer_to = first + (i + 1) % CLIENTS;
+      transfer.amount = i + 1;
+      for (int j = 0; j < TRANSFERS; j++) {
+        add(transfer);
+      }
+      add(BalanceInquiryRequest());
+      client->send(requests.data(), requests.size());
+      for (int j = 0; j < 1 + TRANSFERS; j++) {
+        assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+      }
+      assert(proto_recv(*client)->id() == BalanceInquiryResponse::ID);
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  // Client i gets i from the previous one and pays i + 1 to the next one, the first one gets CLIENTS.
+  assert(accounts.get_amount(first) == (CLIENTS - 1) * TRANSFERS);
+  for (int i = 1; i < CLIENTS; i++) {
+    assert(accounts.get_amount(first + i) == -TRANSFERS);
+  }
+}
+
+/*
+ * When a request fails, the responses to the requests before it in the
+ * same read are still sent before the connection is closed, as in threads mode.
+ */
+template<typename Server>
+void test_server_pipelined_failure(Server &server) {
+  tcp_server_socket listener("127.0.0.1", SERVERS_TEST_PORT);
+  t_client_id from = accounts.register_new_client();
+  t_client_id to = accounts.register_new_client();
+  MessageBatch<> batch;
+  LoginMessage login;
+  login.client_id = from;
+  batch.add(login);
+  TransferRequest transfer;
+  transfer.transfer_to = to;
+  transfer.amount = 5;
+  batch.add(transfer);
+
+  // The handler throws for an unknown client, the last request has an unknown id.
+  TransferRequest unknown;
+  unknown.transfer_to = accounts.size() + 100;
+  unknown.amount = 1;
+  MessageBatch<> failing;
+  failing.add(unknown);
+  std::string tails[] = {std::string(failing.data(), failing.size()), "\xff"};
+  for (const std::string &tail : tails) {
+    std::unique_ptr<tcp_client_socket> client = connect_to(server, listener);
+    std::string requests = std::string(batch.data(), batch.size()) + tail;
+    client->send(requests.data(), requests.size());
+    assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+    assert(proto_recv(*client)->id() == OperationSucceeded::ID);
+    bool closed = false;
+    try {
+      proto_recv(*client);
+    } catch (const socket_error &) {
+      closed = true;
+    }
+    assert(closed);
+  }
+  assert(accounts.get_amount(from) == -10);
+  assert(accounts.get_amount(to) == 10);
+}
+
+/*
+ * A client sends far more requests than fit into the output limit and
+ * socket buffers together and does not read responses: the server stops
+ * handling them until the client reads.
+ */
+template<typename Server>
+void test_server_backpressure(Server &server, std::atomic<std::uint64_t> &handled) {
+  const std::size_t REQUESTS = 4 << 20;
+  tcp_server_socket listener("127.0.0.1", SERVERS_TEST_PORT);
+  std::shared_ptr<tcp_client_socket> client(connect_to(server, listener));
+  std::thread sender([client] {
+    std::vector<char> requests(64 * 1024);
+    std::size_t request_size = proto_encode(requests.data(), BalanceInquiryRequest());
+    for (std::size_t i = request_size; i < requests.size(); i += request_size) {
+      proto_encode(requests.data() + i, BalanceInquiryRequest());
+    }
+    std::size_t per_send = requests.size() / request_size;
+    for (std::size_t sent = 0; sent < REQUESTS; sent += per_send) {
+      client->send(requests.data(), per_send * request_size);
+    }
+  });
+
+  std::uint64_t seen;
+  do {
+    seen = handled;
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  } while (handled != seen);
+  assert(seen < REQUESTS);
+
+  std::vector<char> responses(64 * 1024);
+  std::size_t response_size = 1 + BalanceInquiryResponse::fixed_size();
+  for (std::size_t left = REQUESTS; left > 0;) {
+    std::size_t count = std::min(left, responses.size() / response_size);
+    client->recv(responses.data(), count * response_size);
+    left -= count;
+  }
+  sender.join();
+  assert(handled == REQUESTS);
+}
+
+}  // namespace
+
+void test_servers() {
+  {
+    epoll_server server(2, make_client_handler);
+    test_server_pipelined(server);
+    test_server_pipelined_failure(server);
+  }
+  {
+    std::atomic<std::uint64_t> handled(0);
+    epoll_server server(1, [&handled](stream_socket *sock) {
+      return std::unique_ptr<MessageVisitor>(new counting_handler(sock, handled));
+    });
+    test_server_backpressure(server, handled);
+  }
+  {
+    pool_server server(2, make_client_handler);
+    test_server_pipelined(server);
+    test_server_pipelined_failure(server);
+  }
+  {
+    std::atomic<std::uint64_t> handled(0);
+    pool_server server(2, [&handled](stream_socket *sock) {
+      return std::unique_ptr<MessageVisitor>(new counting_handler(sock, handled));
+    });
+    test_server_backpressure(server, handled);
+  }
+  if (uring_server::supported()) {
+    {
+      uring_server server(2, make_client_handler);
+      test_server_pipelined(server);
+      test_server_pipelined_failure(server);
+    }
+    {
+      std::atomic<std::uint64_t> handled(0);
+      uring_server server(1, [&handled](stream_socket *sock) {
+        return std::unique_ptr<MessageVisitor>(new counting_handler(sock, handled));
+      });
+      test_server_backpressure(server, handled);
+    }
+  }
+}
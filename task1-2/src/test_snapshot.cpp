@@ -0,0 +1,91 @@
+#include "test.h"
+#include "account_store.h"
+#include "snapshot.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::string temp_path() {
+  char path[] = "/tmp/test_snapshot_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  return path;
+}
+
+static void test_snapshot_roundtrip() {
+  // Two full chunks are adopted in place, the partial one is copied.
+  const std::size_t CLIENTS = 2 * account_table::CHUNK_SIZE + 1000;
+  std::string path = temp_path();
+
+  account_store store(4);
+  for (std::size_t i = 0; i < CLIENTS; i++) {
+    store.register_new_client();
+  }
+  for (std::size_t i = 1; i < CLIENTS; i += 7) {
+    store.transfer(0, i, i);
+  }
+  assert(save_snapshot(store, path, nullptr) == 0);
+
+  account_store loaded(4);
+  assert(load_snapshot(loaded, path) == 0);
+  assert(loaded.size() == CLIENTS);
+  for (std::size_t i = 0; i < CLIENTS; i++) {
+    assert(loaded.get_amount(i) == store.get_amount(i));
+  }
+
+  // The loaded store keeps working, including the copied partial chunk.
+  assert(loaded.register_new_client() == CLIENTS);
+  loaded.transfer(1, CLIENTS, 10);
+  loaded.transfer(CLIENTS - 1, 0, 10);
+  assert(loaded.get_amount(1) == store.get_amount(1) - 10);
+  assert(loaded.get_amount(CLIENTS) == 10);
+  assert(loaded.get_amount(0) == store.get_amount(0) + 10);
+
+  unlink(path.c_str());
+}
+
+static void test_snapshot_is_consistent() {
+  const std::size_t CLIENTS = account_table::CHUNK_SIZE / 2;
+  const int THREADS = 4;
+  std::string path = temp_path();
+
+  account_store store(8);
+  for (std::size_t i = 0; i < CLIENTS; i++) {
+    store.register_new_client();
+  }
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADS; t++) {
+    threads.emplace_back([&store, &stop, t] {
+      for (std::uint64_t i = t; !stop; i++) {
+        store.transfer((i * 7919) % CLIENTS, (i * 104729 + t) % CLIENTS, i % 1000);
+      }
+    });
+  }
+  for (int round = 0; round < 5; round++) {
+    save_snapshot(store, path, nullptr);
+    account_store loaded;
+    load_snapshot(loaded, path);
+    // Transfers do not change the total, so a torn snapshot would have a non-zero one.
+    t_balance total = 0;
+    for (std::size_t i = 0; i < CLIENTS; i++) {
+      total += loaded.get_amount(i);
+    }
+    assert(total == 0);
+  }
+  stop = true;
+  for (auto &th : threads) {
+    th.join();
+  }
+  unlink(path.c_str());
+}
+
+void test_snapshot() {
+  test_snapshot_roundtrip();
+  test_snapshot_is_consistent();
+}
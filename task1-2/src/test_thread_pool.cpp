@@ -0,0 +1,32 @@
+#include "test.h"
+#include "thread_pool.h"
+#include <assert.h>
+#include <atomic>
+#include <stdexcept>
+
+void test_thread_pool() {
+  std::atomic<int> done(0);
+  thread_pool pool(4);
+  assert(pool.size() == 4);
+  for (int i = 0; i < 100; i++) {
+    pool.submit([&pool, &done] {
+      // Nested tasks land in the worker's own deque and are stolen by others.
+      for (int j = 0; j < 10; j++) {
+        pool.submit([&done] { done++; });
+      }
+      done++;
+    });
+  }
+  // Waits for nested tasks too.
+  pool.shutdown();
+  assert(done == 100 * 11);
+
+  bool thrown = false;
+  try {
+    pool.submit([] {});
+  } catch (const std::logic_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+  pool.shutdown();
+}
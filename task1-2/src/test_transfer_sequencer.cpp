@@ -0,0 +1,49 @@
+#include "test.h"
+#include "transfer_sequencer.h"
+#include <assert.h>
+#include <thread>
+#include <vector>
+
+void test_transfer_sequencer() {
+  const int THREADS = 4;
+  const int TRANSFERS = 1000;
+  account_store store;
+  for (int i = 0; i < THREADS; i++) {
+    store.register_new_client();
+  }
+
+  {
+    // A tiny ring, so that callers wait for free slots and slots are reused.
+    transfer_sequencer sequencer(store, 2);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+      threads.emplace_back([&sequencer, t] {
+        for (int i = 0; i < TRANSFERS; i++) {
+          sequencer.transfer(t, (t + 1) % THREADS, t + 1);
+        }
+        std::vector<BatchTransferRequest::Item> items = {{0, 1}, {1, 1}};
+        sequencer.transfer_batch(t, items);
+      });
+    }
+    for (auto &th : threads) {
+      th.join();
+    }
+    assert(sequencer.applied() == THREADS * (TRANSFERS + 1));
+
+    bool thrown = false;
+    try {
+      sequencer.transfer(0, THREADS, 1);
+    } catch (const unknown_client_error &) {
+      thrown = true;
+    }
+    assert(thrown);
+    assert(sequencer.applied() == THREADS * (TRANSFERS + 1) + 1);
+  }
+
+  // Client t pays (t + 1) * TRANSFERS to the next one and gets t * TRANSFERS from the previous one.
+  // Every batch pays 1 to clients 0 and 1.
+  assert(store.get_amount(0) == 4 * TRANSFERS - 1 * TRANSFERS - 2 + THREADS);
+  assert(store.get_amount(1) == 1 * TRANSFERS - 2 * TRANSFERS - 2 + THREADS);
+  assert(store.get_amount(2) == 2 * TRANSFERS - 3 * TRANSFERS - 2);
+  assert(store.get_amount(3) == 3 * TRANSFERS - 4 * TRANSFERS - 2);
+}
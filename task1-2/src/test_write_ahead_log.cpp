@@ -0,0 +1,90 @@
+#include "test.h"
+#include "account_store.h"
+#include "write_ahead_log.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::string temp_path() {
+  char path[] = "/tmp/test_wal_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  return path;
+}
+
+static void test_write_ahead_log_replay() {
+  const int CLIENTS = 10;
+  const int THREADS = 4;
+  const int TRANSFERS = 500;
+  std::string path = temp_path();
+
+  std::vector<t_balance> expected;
+  {
+    account_store store(4);
+    write_ahead_log wal(path, std::chrono::microseconds(200), 64);
+    wal.replay(store);
+    store.set_journal(&wal);
+    for (int i = 0; i < CLIENTS; i++) {
+      store.register_new_client();
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+      threads.emplace_back([&store, &wal, t] {
+        for (int i = 0; i < TRANSFERS; i++) {
+          store.transfer((i + t) % CLIENTS, (i * 3 + 1) % CLIENTS, i);
+          if (i % 50 == 0) {
+            wal.sync();
+          }
+        }
+      });
+    }
+    for (auto &th : threads) {
+      th.join();
+    }
+    store.transfer_batch(0, {{1, 5}, {2, 7}});
+    wal.sync();
+    assert(wal.durable() == wal.appended());
+    for (int i = 0; i < CLIENTS; i++) {
+      expected.push_back(store.get_amount(i));
+    }
+  }
+
+  // A torn record at the end is ignored and cut off.
+  FILE *f = fopen(path.c_str(), "ab");
+  assert(f);
+  const char torn[] = "\x19\x00\x00\x00garbage";
+  fwrite(torn, 1, sizeof torn - 1, f);
+  fclose(f);
+
+  account_store restored(4);
+  write_ahead_log wal(path, std::chrono::microseconds(0));
+  std::uint64_t torn_size = wal.appended();
+  wal.replay(restored);
+  assert(wal.appended() == torn_size - 11);
+  assert(restored.size() == CLIENTS);
+  for (int i = 0; i < CLIENTS; i++) {
+    assert(restored.get_amount(i) == expected[i]);
+  }
+
+  // Appends continue after the last complete record.
+  restored.set_journal(&wal);
+  restored.register_new_client();
+  wal.sync();
+  account_store again(4);
+  write_ahead_log reopened(path, std::chrono::microseconds(0));
+  reopened.replay(again);
+  assert(again.size() == CLIENTS + 1);
+  assert(again.get_amount(2) == expected[2]);
+
+  unlink(path.c_str());
+}
+
+void test_write_ahead_log() {
+  test_write_ahead_log_replay();
+}
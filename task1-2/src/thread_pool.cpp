@@ -0,0 +1,113 @@
+#include <stdexcept>
+#include "thread_pool.h"
+
+namespace {
+
+// Identifies the worker running on the current thread, if any.
+thread_local const thread_pool *current_pool = nullptr;
+thread_local std::size_t current_index = 0;
+
+}  // namespace
+
+thread_pool::thread_pool(std::size_t threads)
+    : next_(0), queued_(0), active_(0), sleepers_(0), stopping_(false) {
+  if (threads == 0) {
+    throw std::invalid_argument("thread_pool needs at least one thread");
+  }
+  for (std::size_t i = 0; i < threads; i++) {
+    workers_.emplace_back(new worker);
+  }
+  for (std::size_t i = 0; i < threads; i++) {
+    workers_[i]->thread = std::thread(&thread_pool::run, this, i);
+  }
+}
+
+thread_pool::~thread_pool() {
+  shutdown();
+}
+
+void thread_pool::submit(task t) {
+  bool on_worker = current_pool == this;
+  if (stopping_ && !on_worker) {
+    throw std::logic_error("thread_pool is shut down");
+  }
+  worker &w = *workers_[on_worker ? current_index : next_++ % workers_.size()];
+  queued_++;
+  {
+    std::lock_guard<std::mutex> lock(w.mutex);
+    w.tasks.push_back(std::move(t));
+  }
+  // Pairs with the check in run(): either the sleeper sees queued_, or we see sleepers_.
+  if (sleepers_ > 0) {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    idle_cv_.notify_one();
+  }
+}
+
+bool thread_pool::take(std::size_t index, task &t) {
+  {
+    worker &own = *workers_[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      t = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      active_++;
+      queued_--;
+      return true;
+    }
+  }
+  for (std::size_t i = 1; i < workers_.size(); i++) {
+    worker &victim = *workers_[(index + i) % workers_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      t = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      active_++;
+      queued_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void thread_pool::run(std::size_t index) {
+  current_pool = this;
+  current_index = index;
+  for (;;) {
+    task t;
+    if (take(index, t)) {
+      t();
+      t = task();
+      if (--active_ == 0 && stopping_) {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        idle_cv_.notify_all();
+      }
+      continue;
+    }
+
+    // Tasks may be in flight between queued_++ and the push, then we just look again.
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    sleepers_++;
+    while (queued_ == 0 && !(stopping_ && active_ == 0)) {
+      idle_cv_.wait(lock);
+    }
+    sleepers_--;
+    if (queued_ == 0 && stopping_ && active_ == 0) {
+      return;
+    }
+  }
+}
+
+void thread_pool::shutdown() {
+  std::lock_guard<std::mutex> shutdown_lock(shutdown_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    stopping_ = true;
+    idle_cv_.notify_all();
+  }
+  for (auto &w : workers_) {
+    if (w->thread.joinable()) {
+      w->thread.join();
+    }
+  }
+}
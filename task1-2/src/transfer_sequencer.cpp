@@ -0,0 +1,131 @@
+#include <stdexcept>
+#include "transfer_sequencer.h"
+
+namespace {
+
+// A transfer takes much less than a sleep and a wake-up, so waiters yield for a while first.
+const int YIELDS_BEFORE_SLEEP = 64;
+
+}  // namespace
+
+transfer_sequencer::transfer_sequencer(account_store &store, std::size_t capacity)
+    : store_(store), stopping_(false), sleeping_callers_(0), sequencer_sleeping_(false) {
+  if (capacity == 0) {
+    throw std::invalid_argument("transfer_sequencer needs at least one slot");
+  }
+  std::size_t size = 1;
+  while (size < capacity) {
+    size *= 2;
+  }
+  mask_ = size - 1;
+  slots_.reset(new slot[size]);
+  thread_ = std::thread(&transfer_sequencer::run, this);
+}
+
+transfer_sequencer::~transfer_sequencer() {
+  stopping_ = true;
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    published_cv_.notify_one();
+  }
+  thread_.join();
+}
+
+void transfer_sequencer::transfer(t_client_id from, t_client_id to, t_balance amount) {
+  publish(from, to, amount, nullptr);
+}
+
+void transfer_sequencer::transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) {
+  publish(from, 0, 0, &items);
+}
+
+void transfer_sequencer::publish(t_client_id from, t_client_id to, t_balance amount,
+                                 const std::vector<BatchTransferRequest::Item> *items) {
+  ticket result;
+  std::uint64_t sequence = next_.value.fetch_add(1, std::memory_order_relaxed);
+  // The slot is free once the operation which used it a lap ago is applied.
+  while (sequence - applied_.value.load(std::memory_order_acquire) > mask_) {
+    std::this_thread::yield();
+  }
+  slot &s = slots_[sequence & mask_];
+  s.from = from;
+  s.to = to;
+  s.amount = amount;
+  s.items = items;
+  s.result = &result;
+  // Pairs with the check in wait_published(): either the sequencer sees the slot, or we see it sleeping.
+  s.published.store(sequence + 1);
+  if (sequencer_sleeping_) {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    published_cv_.notify_one();
+  }
+
+  for (int i = 0; i < YIELDS_BEFORE_SLEEP && !result.done.load(std::memory_order_acquire); i++) {
+    std::this_thread::yield();
+  }
+  if (!result.done.load(std::memory_order_acquire)) {
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    sleeping_callers_++;
+    done_cv_.wait(lock, [&result] { return result.done.load(); });
+    sleeping_callers_--;
+  }
+  if (result.error) {
+    std::rethrow_exception(result.error);
+  }
+}
+
+/*
+ * Applies everything published so far in one run and wakes up sleeping
+ * callers once per run rather than once per operation.
+ */
+void transfer_sequencer::run() {
+  std::uint64_t sequence = 0;
+  for (;;) {
+    std::uint64_t start = sequence;
+    while (slots_[sequence & mask_].published.load(std::memory_order_acquire) == sequence + 1) {
+      apply(slots_[sequence & mask_]);
+      sequence++;
+      applied_.value.store(sequence, std::memory_order_release);
+    }
+    if (sequence != start) {
+      // Pairs with the check in publish(): either the caller sees its ticket done, or we see it sleeping.
+      if (sleeping_callers_ > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        done_cv_.notify_all();
+      }
+    } else if (!wait_published(sequence)) {
+      return;
+    }
+  }
+}
+
+void transfer_sequencer::apply(slot &s) {
+  ticket &result = *s.result;
+  try {
+    if (s.items) {
+      store_.transfer_batch(s.from, *s.items);
+    } else {
+      store_.transfer(s.from, s.to, s.amount);
+    }
+  } catch (...) {
+    result.error = std::current_exception();
+  }
+  // The caller may return right after this, so the ticket is not touched anymore.
+  result.done.store(true);
+}
+
+bool transfer_sequencer::wait_published(std::uint64_t sequence) {
+  const slot &s = slots_[sequence & mask_];
+  auto ready = [&] { return s.published.load() == sequence + 1 || stopping_; };
+  for (int i = 0; i < YIELDS_BEFORE_SLEEP; i++) {
+    if (ready()) {
+      return s.published.load(std::memory_order_acquire) == sequence + 1;
+    }
+    std::this_thread::yield();
+  }
+  std::unique_lock<std::mutex> lock(sleep_mutex_);
+  sequencer_sleeping_ = true;
+  published_cv_.wait(lock, ready);
+  sequencer_sleeping_ = false;
+  return s.published.load(std::memory_order_acquire) == sequence + 1;
+}
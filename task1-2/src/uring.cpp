@@ -0,0 +1,209 @@
+#ifdef __linux__
+
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+void ensure_errno(bool condition, const char *what) {
+  if (!condition) {
+    throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+  }
+}
+
+template<typename T>
+T* at_offset(void *base, std::uint32_t offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+bool probe() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    return false;
+  }
+  bool ok = false;
+  try {
+    uring ring(4);
+    uring_buffer_ring bufs(ring, 0, 1, 64);
+    io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bufs.group();
+    ensure_errno(write(fds[1], "x", 1) == 1, "write");
+
+    // The receive should deliver the byte and stay armed, then it is ended
+    // by shutdown() before the buffers go away.
+    bool first = true;
+    bool finished = false;
+    ring.submit_and_wait(1);
+    for (;;) {
+      ring.drain([&](const io_uring_cqe &cqe) {
+        if (first) {
+          ok = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) && (cqe.flags & IORING_CQE_F_BUFFER);
+          first = false;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+          finished = true;
+        }
+      });
+      if (finished) {
+        break;
+      }
+      shutdown(fds[0], SHUT_RDWR);
+      ring.submit_and_wait(1);
+    }
+  } catch (const std::exception &) {
+    ok = false;
+  }
+  close(fds[0]);
+  close(fds[1]);
+  return ok;
+}
+
+}  // namespace
+
+uring::uring(unsigned entries) : sq_queued_(0) {
+  io_uring_params params;
+  memset(&params, 0, sizeof params);
+  // Completions of a round of submissions must fit, multishot receives may post many.
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = 4 * entries;
+  fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  ensure_errno(fd_ >= 0, "io_uring_setup");
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd_);
+    throw std::runtime_error("io_uring is too old: no IORING_FEAT_SINGLE_MMAP");
+  }
+
+  ring_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (ring_ == MAP_FAILED) {
+    int error = errno;
+    close(fd_);
+    errno = error;
+    ensure_errno(false, "mmap");
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    int error = errno;
+    munmap(ring_, ring_size_);
+    close(fd_);
+    errno = error;
+    ensure_errno(false, "mmap");
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  sq_tail_ = at_offset<unsigned>(ring_, params.sq_off.tail);
+  sq_mask_ = at_offset<unsigned>(ring_, params.sq_off.ring_mask);
+  sq_array_ = at_offset<unsigned>(ring_, params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = at_offset<unsigned>(ring_, params.cq_off.head);
+  cq_tail_ = at_offset<unsigned>(ring_, params.cq_off.tail);
+  cq_mask_ = at_offset<unsigned>(ring_, params.cq_off.ring_mask);
+  cqes_ = at_offset<io_uring_cqe>(ring_, params.cq_off.cqes);
+  // Entries are always submitted in order, so the indirection array is identity.
+  for (unsigned i = 0; i < sq_entries_; i++) {
+    sq_array_[i] = i;
+  }
+}
+
+uring::~uring() {
+  munmap(sqes_, sqes_size_);
+  munmap(ring_, ring_size_);
+  close(fd_);
+}
+
+io_uring_sqe* uring::get_sqe() {
+  if (sq_queued_ == sq_entries_) {
+    submit_and_wait(0);
+  }
+  io_uring_sqe *sqe = &sqes_[(*sq_tail_ + sq_queued_) & *sq_mask_];
+  sq_queued_++;
+  memset(sqe, 0, sizeof *sqe);
+  return sqe;
+}
+
+void uring::submit_and_wait(unsigned wait_nr) {
+  __atomic_store_n(sq_tail_, *sq_tail_ + sq_queued_, __ATOMIC_RELEASE);
+  unsigned to_submit = sq_queued_;
+  sq_queued_ = 0;
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  for (;;) {
+    long submitted = syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr, flags, nullptr, 0);
+    if (submitted == -1 && errno == EINTR) {
+      continue;
+    }
+    ensure_errno(submitted != -1, "io_uring_enter");
+    to_submit -= submitted;
+    // A signal may cut the wait short, callers handle having no completions.
+    if (to_submit == 0) {
+      return;
+    }
+  }
+}
+
+bool uring::supported() {
+  static const bool result = probe();
+  return result;
+}
+
+uring_buffer_ring::uring_buffer_ring(uring &ring, std::uint16_t group, unsigned count, std::size_t buffer_size)
+    : ring_(ring), group_(group), count_(count), buffer_size_(buffer_size), tail_(0) {
+  if (count == 0 || count > 32768 || (count & (count - 1)) != 0) {
+    throw std::invalid_argument("uring_buffer_ring size should be a power of two up to 32768");
+  }
+  bufs_size_ = count * sizeof(io_uring_buf);
+  void *bufs = mmap(nullptr, bufs_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ensure_errno(bufs != MAP_FAILED, "mmap");
+  bufs_ = static_cast<io_uring_buf_ring*>(bufs);
+  data_ = new char[count * buffer_size];
+
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.ring_addr = reinterpret_cast<std::uint64_t>(bufs_);
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (syscall(__NR_io_uring_register, ring_.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    int error = errno;
+    delete[] data_;
+    munmap(bufs_, bufs_size_);
+    errno = error;
+    ensure_errno(false, "IORING_REGISTER_PBUF_RING");
+  }
+  for (unsigned i = 0; i < count; i++) {
+    recycle(i);
+  }
+}
+
+uring_buffer_ring::~uring_buffer_ring() {
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof reg);
+  reg.bgid = group_;
+  syscall(__NR_io_uring_register, ring_.fd(), IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  delete[] data_;
+  munmap(bufs_, bufs_size_);
+}
+
+void uring_buffer_ring::recycle(unsigned id) {
+  // Not bufs_->bufs: in C++ the kernel header places that array at a wrong offset.
+  io_uring_buf &buf = reinterpret_cast<io_uring_buf*>(bufs_)[tail_ & (count_ - 1)];
+  buf.addr = reinterpret_cast<std::uint64_t>(data_ + id * buffer_size_);
+  buf.len = buffer_size_;
+  buf.bid = id;
+  tail_++;
+  __atomic_store_n(&bufs_->tail, tail_, __ATOMIC_RELEASE);
+}
+
+#endif  // __linux__
@@ -0,0 +1,440 @@
+#include "uring_server.h"
+#include "log.h"
+#include "output_buffer_socket.h"
+
+#ifdef __linux__
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "uring.h"
+
+namespace {
+
+const unsigned RING_ENTRIES = 1024;
+const std::uint16_t BUFFER_GROUP = 0;
+const unsigned BUFFER_COUNT = 256;
+const std::size_t BUFFER_SIZE = 16 * 1024;
+// Longer outputs are sent as a chain of linked sends.
+const std::size_t SEND_CHUNK = 64 * 1024;
+
+// Completions are told apart by the low bits of user_data, the rest is the connection.
+const std::uint64_t OP_RECV = 0;
+const std::uint64_t OP_SEND = 1;
+const std::uint64_t OP_WAKE = 2;
+const std::uint64_t OP_CANCEL = 3;
+const std::uint64_t OP_MASK = 3;
+
+void ensure_errno(bool condition, const char *what) {
+  if (!condition) {
+    throw std::runtime_error(std::string(what) + ": " + strerror(errno));
+  }
+}
+
+struct connection {
+  connection(std::unique_ptr<tcp_connection_socket> s)
+      : sock(std::move(s)), out_sock(&out), in_flight(0), sends(0), sent(0), ready(false), closing(false),
+        receiving(false), throttled(false), draining(false) {}
+
+  std::unique_ptr<tcp_connection_socket> sock;
+  std::string in;
+  std::string out;      // Responses which are not being sent yet.
+  std::string sending;  // Responses being sent, kept intact until all their sends complete.
+  output_buffer_socket out_sock;
+  std::unique_ptr<MessageVisitor> handler;
+  unsigned in_flight;   // Submitted operations which have not completed for good.
+  unsigned sends;       // Sends of the current chain which have not completed.
+  std::size_t sent;     // Bytes of `sending` sent so far.
+  bool ready;           // Whether it should be flushed at the end of the round.
+  bool closing;         // Freed once in_flight drops to zero.
+  bool receiving;       // The multishot receive has not completed for good.
+  bool throttled;       // Requests are left in `in` because of pending output.
+  bool draining;        // A request has failed, closed once the output before it is sent.
+
+  std::size_t pending_output() const { return out.size() + sending.size() - sent; }
+};
+
+std::uint64_t tag(connection *c, std::uint64_t op) {
+  return reinterpret_cast<std::uint64_t>(c) | op;
+}
+
+}  // namespace
+
+class uring_server::event_loop {
+public:
+  explicit event_loop(const epoll_server::flush_hook &before_flush)
+      : before_flush_(before_flush), ring_(RING_ENTRIES), buffers_(ring_, BUFFER_GROUP, BUFFER_COUNT, BUFFER_SIZE),
+        wake_value_(0), wake_armed_(false), handled_(false), stopping_(false) {
+    wake_fd_ = eventfd(0, EFD_CLOEXEC);
+    ensure_errno(wake_fd_ != -1, "eventfd");
+    thread_ = std::thread(&event_loop::run, this);
+  }
+
+  ~event_loop() {
+    stopping_ = true;
+    wake();
+    thread_.join();
+    close(wake_fd_);
+  }
+
+  void add_client(std::unique_ptr<connection> conn) {
+    {
+      std::lock_guard<std::mutex> lock(incoming_mutex_);
+      incoming_.push_back(std::move(conn));
+    }
+    wake();
+  }
+
+private:
+  void wake() {
+    std::uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof one);
+    assert(written == sizeof one);
+    (void)written;
+  }
+
+  /*
+   * Every round submits everything queued by the previous one and handles
+   * the completions. On stop, connections are shut down and the loop goes on
+   * until all their operations complete, as the kernel may use their buffers till then.
+   */
+  void run() {
+    arm_wake();
+    bool closed_all = false;
+    while (!(closed_all && connections_.empty() && !wake_armed_)) {
+      ring_.submit_and_wait(1);
+      ring_.drain([this](const io_uring_cqe &cqe) { complete(cqe); });
+      if (stopping_ && !closed_all) {
+        for (auto &conn : connections_) {
+          close_connection(*conn.second);
+        }
+        closed_all = true;
+      }
+      flush_round();
+    }
+  }
+
+  void complete(const io_uring_cqe &cqe) {
+    std::uint64_t op = cqe.user_data & OP_MASK;
+    if (op == OP_WAKE) {
+      wake_armed_ = false;
+      accept_incoming();
+      if (!stopping_) {
+        arm_wake();
+      }
+      return;
+    }
+
+    connection &c = *reinterpret_cast<connection*>(cqe.user_data & ~OP_MASK);
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      c.in_flight--;
+    }
+    if (op == OP_CANCEL) {
+      return;  // The receive completes on its own.
+    }
+    try {
+      if (op == OP_RECV) {
+        received(c, cqe);
+      } else {
+        sent(c, cqe);
+      }
+    } catch (const std::exception &e) {
+      LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+      close_connection(c);
+    }
+  }
+
+  void received(connection &c, const io_uring_cqe &cqe) {
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      unsigned id = uring_buffer_ring::buffer_id(cqe);
+      if (cqe.res > 0 && !c.closing) {
+        c.in.append(buffers_.buffer(id), cqe.res);
+      }
+      buffers_.recycle(id);
+    }
+    if (c.closing) {
+      return;
+    }
+    if (cqe.res == 0) {
+      throw socket_eof_error("Socket was gracefully closed");
+    }
+    if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+      throw socket_io_error(std::string("recv: ") + strerror(-cqe.res));
+    }
+    if (cqe.res > 0) {
+      metrics_add(metric_counter::bytes_received, cqe.res);
+      if (!c.throttled) {
+        handle_requests(c);
+      }
+    }
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      c.receiving = false;
+      if (!c.throttled && !c.draining) {
+        arm_recv(c);  // Ran out of buffers or was stopped by the kernel.
+      }
+    }
+  }
+
+  /*
+   * Handles complete requests from the read buffer until the output is over
+   * epoll_server::MAX_PENDING_OUTPUT. Then the receive is cancelled, so that
+   * the client is not read until sent() finds the output drained.
+   * If a request fails, the client is not read anymore either, and the
+   * connection is closed once the responses to the requests before it are sent.
+   */
+  void handle_requests(connection &c) {
+    if (c.draining) {
+      return;
+    }
+    std::size_t pos = 0;
+    AnyMessage msg;
+    c.throttled = false;
+    try {
+      while (std::size_t size = proto_decode(c.in.data() + pos, c.in.size() - pos, msg, c.handler->encoding())) {
+        msg.visit(*c.handler);
+        pos += size;
+        if (c.pending_output() >= epoll_server::MAX_PENDING_OUTPUT) {
+          c.throttled = true;
+          break;
+        }
+      }
+    } catch (const std::exception &e) {
+      LOG(log_level::warning, "Exception caught while processing client: %s", e.what());
+      c.draining = true;
+      mark_ready(c);
+    }
+    c.in.erase(0, pos);
+    if (pos > 0) {
+      handled_ = true;
+      mark_ready(c);
+    }
+    if ((c.throttled || c.draining) && c.receiving) {
+      cancel_recv(c);
+    }
+  }
+
+  void sent(connection &c, const io_uring_cqe &cqe) {
+    c.sends--;
+    if (c.closing) {
+      return;
+    }
+    // Failed sends break the chain, the rest of it completes with -ECANCELED.
+    if (cqe.res < 0) {
+      throw socket_io_error(std::string("send: ") + strerror(-cqe.res));
+    }
+    metrics_add(metric_counter::bytes_sent, cqe.res);
+    c.sent += cqe.res;
+    if (c.sends == 0) {
+      if (c.sent != c.sending.size()) {
+        throw socket_io_error("send: connection was closed in the middle of a response");
+      }
+      c.sending.clear();
+      c.sent = 0;
+      if (c.draining && c.out.empty()) {
+        close_connection(c);
+        return;
+      }
+      if (c.throttled && c.pending_output() < epoll_server::MAX_PENDING_OUTPUT) {
+        handle_requests(c);
+        if (!c.throttled && !c.receiving) {
+          arm_recv(c);
+        }
+      }
+      if (!c.out.empty()) {
+        mark_ready(c);
+      }
+    }
+  }
+
+  void mark_ready(connection &c) {
+    if (!c.ready) {
+      c.ready = true;
+      ready_.push_back(&c);
+    }
+  }
+
+  void flush_round() {
+    if (handled_ && before_flush_) {
+      try {
+        before_flush_();
+      } catch (const std::exception &e) {
+        LOG(log_level::error, "Exception caught before sending responses: %s", e.what());
+        for (connection *c : ready_) {
+          close_connection(*c);
+        }
+      }
+    }
+    handled_ = false;
+    for (connection *c : ready_) {
+      c->ready = false;
+      if (!c->closing && c->sends == 0 && !c->out.empty()) {
+        start_send(*c);
+      }
+      if (c->draining && c->sends == 0) {
+        close_connection(*c);  // Nothing left to send.
+      }
+    }
+    ready_.clear();
+
+    auto finished = std::partition(closed_.begin(), closed_.end(), [](connection *c) { return c->in_flight > 0; });
+    for (auto it = finished; it != closed_.end(); ++it) {
+      connections_.erase(*it);
+    }
+    closed_.erase(finished, closed_.end());
+  }
+
+  void start_send(connection &c) {
+    c.sending.swap(c.out);
+    c.sent = 0;
+    std::size_t chunks = (c.sending.size() + SEND_CHUNK - 1) / SEND_CHUNK;
+    if (ring_.space() < chunks) {
+      ring_.submit_and_wait(0);  // A chain should not be split between submissions.
+    }
+    for (std::size_t pos = 0; pos < c.sending.size(); pos += SEND_CHUNK) {
+      std::size_t len = std::min(SEND_CHUNK, c.sending.size() - pos);
+      io_uring_sqe *sqe = ring_.get_sqe();
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = c.sock->native_handle();
+      sqe->addr = reinterpret_cast<std::uint64_t>(c.sending.data() + pos);
+      sqe->len = len;
+      sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      if (pos + len < c.sending.size()) {
+        sqe->flags = IOSQE_IO_LINK;
+      }
+      sqe->user_data = tag(&c, OP_SEND);
+      c.sends++;
+      c.in_flight++;
+    }
+  }
+
+  void arm_recv(connection &c) {
+    io_uring_sqe *sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c.sock->native_handle();
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers_.group();
+    sqe->user_data = tag(&c, OP_RECV);
+    c.in_flight++;
+    c.receiving = true;
+  }
+
+  // Received data which is already on its way is still appended to `in`.
+  void cancel_recv(connection &c) {
+    io_uring_sqe *sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tag(&c, OP_RECV);
+    sqe->user_data = tag(&c, OP_CANCEL);
+    c.in_flight++;
+  }
+
+  void arm_wake() {
+    io_uring_sqe *sqe = ring_.get_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd_;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&wake_value_);
+    sqe->len = sizeof wake_value_;
+    sqe->user_data = tag(nullptr, OP_WAKE);
+    wake_armed_ = true;
+  }
+
+  void accept_incoming() {
+    std::vector<std::unique_ptr<connection>> incoming;
+    {
+      std::lock_guard<std::mutex> lock(incoming_mutex_);
+      incoming.swap(incoming_);
+    }
+    if (stopping_) {
+      return;  // The connections are closed.
+    }
+    for (auto &conn : incoming) {
+      connection *c = conn.get();
+      connections_[c] = std::move(conn);
+      arm_recv(*c);
+    }
+  }
+
+  // Shutting the socket down makes all its pending operations complete.
+  void close_connection(connection &c) {
+    if (c.closing) {
+      return;
+    }
+    c.closing = true;
+    shutdown(c.sock->native_handle(), SHUT_RDWR);
+    closed_.push_back(&c);
+  }
+
+  epoll_server::flush_hook before_flush_;
+  uring ring_;
+  uring_buffer_ring buffers_;
+  int wake_fd_;
+  std::uint64_t wake_value_;
+  bool wake_armed_;
+
+  std::map<connection*, std::unique_ptr<connection>> connections_;
+  std::vector<connection*> ready_;
+  std::vector<connection*> closed_;
+  bool handled_;  // Whether any requests were handled in this round.
+
+  std::mutex incoming_mutex_;
+  std::vector<std::unique_ptr<connection>> incoming_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+};
+
+uring_server::uring_server(std::size_t threads, epoll_server::handler_factory factory, epoll_server::flush_hook before_flush)
+    : factory_(factory), next_loop_(0) {
+  if (threads == 0) {
+    throw std::invalid_argument("uring_server needs at least one event loop");
+  }
+  if (!supported()) {
+    throw std::runtime_error("io_uring with multishot receive is not available");
+  }
+  for (std::size_t i = 0; i < threads; i++) {
+    loops_.emplace_back(new event_loop(before_flush));
+  }
+}
+
+uring_server::~uring_server() {}
+
+void uring_server::add_client(std::unique_ptr<tcp_connection_socket> client) {
+  std::unique_ptr<connection> conn(new connection(std::move(client)));
+  conn->handler = factory_(&conn->out_sock);
+  loops_[next_loop_++ % loops_.size()]->add_client(std::move(conn));
+}
+
+bool uring_server::supported() {
+  return uring::supported();
+}
+
+#else  // __linux__
+
+#include <stdexcept>
+
+class uring_server::event_loop {};
+
+uring_server::uring_server(std::size_t, epoll_server::handler_factory, epoll_server::flush_hook) : next_loop_(0) {
+  throw std::runtime_error("uring_server is available on Linux only");
+}
+
+uring_server::~uring_server() {}
+
+void uring_server::add_client(std::unique_ptr<tcp_connection_socket>) {}
+
+bool uring_server::supported() {
+  return false;
+}
+
+#endif  // __linux__
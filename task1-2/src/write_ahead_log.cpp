@@ -0,0 +1,214 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <memory>
+#include <stdexcept>
+#include "journal_record.h"
+#include "log.h"
+#include "write_ahead_log.h"
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+namespace {
+
+void throw_errno(const std::string &what) {
+  throw std::runtime_error(what + ": " + strerror(errno));
+}
+
+void write_all(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_errno("Unable to write the write-ahead log");
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+void sync_file(int fd) {
+#if defined(_WIN32)
+  int result = _commit(fd);
+#elif defined(__linux__)
+  int result = fdatasync(fd);
+#else
+  int result = fsync(fd);
+#endif
+  if (result != 0) {
+    throw_errno("Unable to flush the write-ahead log");
+  }
+}
+
+}  // namespace
+
+write_ahead_log::write_ahead_log(const std::string &path, std::chrono::microseconds batch_interval,
+                                 std::size_t batch_size)
+    : path_(path), batch_interval_(batch_interval), batch_size_(batch_size),
+      pending_records_(0), stopping_(false) {
+  if (batch_size == 0) {
+    throw std::invalid_argument("write_ahead_log batch size should be positive");
+  }
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_BINARY, 0644);
+  if (fd_ < 0) {
+    throw_errno("Unable to open the write-ahead log " + path);
+  }
+  struct stat st;
+  if (fstat(fd_, &st) != 0) {
+    close(fd_);
+    throw_errno("Unable to stat the write-ahead log " + path);
+  }
+  appended_ = durable_ = st.st_size;
+  writer_ = std::thread(&write_ahead_log::run, this);
+}
+
+write_ahead_log::~write_ahead_log() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  writer_.join();
+  close(fd_);
+}
+
+void write_ahead_log::replay(account_store &store, std::uint64_t from) {
+  std::unique_ptr<FILE, int(*)(FILE*)> file(fopen(path_.c_str(), "rb"), fclose);
+  if (!file) {
+    throw_errno("Unable to open the write-ahead log " + path_);
+  }
+  if (fseeko(file.get(), from, SEEK_SET) != 0) {
+    throw_errno("Unable to seek in the write-ahead log " + path_);
+  }
+
+  std::uint64_t position = from;
+  std::size_t records = 0;
+  std::vector<char> payload;
+  for (;;) {
+    char header[JOURNAL_RECORD_HEADER_SIZE];
+    if (fread(header, 1, sizeof header, file.get()) != sizeof header) {
+      break;
+    }
+    std::size_t size;
+    std::uint32_t expected_checksum;
+    if (!journal_decode_header(header, size, expected_checksum)) {
+      break;
+    }
+    payload.resize(size);
+    if (fread(payload.data(), 1, size, file.get()) != size ||
+        journal_checksum(payload.data(), size) != expected_checksum) {
+      break;
+    }
+    journal_apply(store, payload.data(), size);
+    position += JOURNAL_RECORD_HEADER_SIZE + size;
+    records++;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (position < appended_) {
+    LOG(log_level::warning, "Dropping %llu byte(s) of an incomplete write-ahead log record",
+        static_cast<unsigned long long>(appended_ - position));
+    if (ftruncate(fd_, position) != 0) {
+      throw_errno("Unable to truncate the write-ahead log " + path_);
+    }
+    sync_file(fd_);
+    appended_ = durable_ = position;
+  }
+  LOG(log_level::info, "Replayed %zu write-ahead log record(s)", records);
+}
+
+void write_ahead_log::append(const char *record, std::size_t size) {
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    notify = pending_.empty();
+    pending_.append(record, size);
+    appended_ += size;
+    if (++pending_records_ >= batch_size_) {
+      notify = true;
+    }
+  }
+  if (notify) {
+    work_cv_.notify_one();
+  }
+}
+
+void write_ahead_log::log_registration(t_client_id id) {
+  char record[JOURNAL_REGISTRATION_RECORD_SIZE];
+  append(record, journal_encode_registration(record, id));
+}
+
+void write_ahead_log::log_transfer(t_client_id from, t_client_id to, t_balance amount) {
+  char record[JOURNAL_TRANSFER_RECORD_SIZE];
+  append(record, journal_encode_transfer(record, from, to, amount));
+}
+
+void write_ahead_log::log_transfer_batch(t_client_id from, const std::vector<BatchTransferRequest::Item> &items) {
+  std::vector<char> record(journal_batch_record_size(items.size()));
+  append(record.data(), journal_encode_transfer_batch(record.data(), from, items));
+}
+
+std::uint64_t write_ahead_log::appended() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return appended_;
+}
+
+std::uint64_t write_ahead_log::durable() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return durable_;
+}
+
+void write_ahead_log::wait_durable(std::uint64_t position) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  durable_cv_.wait(lock, [&] { return durable_ >= position || !error_.empty(); });
+  if (durable_ < position) {
+    throw std::runtime_error(error_);
+  }
+}
+
+void write_ahead_log::run() {
+  std::string batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    work_cv_.wait(lock, [&] { return stopping_ || !pending_.empty(); });
+    if (pending_.empty()) {
+      break;
+    }
+    // Gives other clients a chance to join the batch.
+    work_cv_.wait_for(lock, batch_interval_, [&] { return stopping_ || pending_records_ >= batch_size_; });
+
+    batch.swap(pending_);
+    pending_records_ = 0;
+    std::uint64_t end = appended_;
+    lock.unlock();
+    try {
+      write_all(fd_, batch.data(), batch.size());
+      sync_file(fd_);
+    } catch (const std::exception &e) {
+      LOG(log_level::error, "%s", e.what());
+      lock.lock();
+      error_ = e.what();
+      durable_cv_.notify_all();
+      break;
+    }
+    batch.clear();
+    lock.lock();
+    durable_ = end;
+    durable_cv_.notify_all();
+  }
+}